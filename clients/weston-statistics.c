@@ -0,0 +1,335 @@
+/*
+ * Copyright © 2016 The Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include <wayland-client.h>
+#include "weston-statistics-client-protocol.h"
+#include "shared/config-parser.h"
+#include "shared/helpers.h"
+#include "shared/xalloc.h"
+
+/* Prints the repaint statistics weston keeps per output, as rates
+ * over each sampling interval. */
+
+#define HISTOGRAM_SIZE 8
+
+struct sample {
+	uint64_t repaints;
+	uint64_t missed_vblanks;
+	uint64_t damage_pixels;
+	uint64_t views;
+	uint64_t upload_bytes;
+	uint64_t repaint_cpu_usec;
+	uint32_t histogram[HISTOGRAM_SIZE];
+};
+
+struct stats_output {
+	struct stats_app *app;
+	uint32_t global_name;
+	struct wl_output *output;
+	struct weston_output_statistics *stats;
+	char *make, *model;
+	struct sample current, previous;
+	int samples;
+	struct wl_list link;
+};
+
+struct stats_app {
+	struct wl_display *display;
+	struct wl_registry *registry;
+	struct weston_statistics *statistics;
+	struct wl_list output_list;
+};
+
+static uint64_t
+u64_from_u32s(uint32_t hi, uint32_t lo)
+{
+	return ((uint64_t) hi << 32) + lo;
+}
+
+static void
+output_handle_geometry(void *data, struct wl_output *wl_output,
+		       int x, int y, int physical_width, int physical_height,
+		       int subpixel, const char *make, const char *model,
+		       int transform)
+{
+	struct stats_output *output = data;
+
+	free(output->make);
+	free(output->model);
+	output->make = xstrdup(make);
+	output->model = xstrdup(model);
+}
+
+static void
+output_handle_mode(void *data, struct wl_output *wl_output, uint32_t flags,
+		   int width, int height, int refresh)
+{
+}
+
+static const struct wl_output_listener output_listener = {
+	output_handle_geometry,
+	output_handle_mode
+};
+
+static void
+stats_handle_counters(void *data,
+		      struct weston_output_statistics *stats,
+		      uint32_t repaints_hi, uint32_t repaints_lo,
+		      uint32_t missed_vblanks_hi, uint32_t missed_vblanks_lo,
+		      uint32_t damage_pixels_hi, uint32_t damage_pixels_lo,
+		      uint32_t views_hi, uint32_t views_lo,
+		      uint32_t upload_bytes_hi, uint32_t upload_bytes_lo,
+		      uint32_t repaint_cpu_usec_hi,
+		      uint32_t repaint_cpu_usec_lo)
+{
+	struct stats_output *output = data;
+	struct sample *s = &output->current;
+
+	s->repaints = u64_from_u32s(repaints_hi, repaints_lo);
+	s->missed_vblanks = u64_from_u32s(missed_vblanks_hi,
+					  missed_vblanks_lo);
+	s->damage_pixels = u64_from_u32s(damage_pixels_hi, damage_pixels_lo);
+	s->views = u64_from_u32s(views_hi, views_lo);
+	s->upload_bytes = u64_from_u32s(upload_bytes_hi, upload_bytes_lo);
+	s->repaint_cpu_usec = u64_from_u32s(repaint_cpu_usec_hi,
+					    repaint_cpu_usec_lo);
+}
+
+static void
+stats_handle_repaint_histogram(void *data,
+			       struct weston_output_statistics *stats,
+			       struct wl_array *buckets)
+{
+	struct stats_output *output = data;
+	size_t size = MIN(buckets->size, sizeof output->current.histogram);
+
+	memset(output->current.histogram, 0,
+	       sizeof output->current.histogram);
+	memcpy(output->current.histogram, buckets->data, size);
+}
+
+static void
+stats_handle_done(void *data, struct weston_output_statistics *stats)
+{
+	struct stats_output *output = data;
+
+	output->samples++;
+}
+
+static const struct weston_output_statistics_listener stats_listener = {
+	stats_handle_counters,
+	stats_handle_repaint_histogram,
+	stats_handle_done
+};
+
+static void
+output_create_stats(struct stats_output *output)
+{
+	struct stats_app *app = output->app;
+
+	if (output->stats || !app->statistics)
+		return;
+
+	output->stats =
+		weston_statistics_get_output_statistics(app->statistics,
+							output->output);
+	weston_output_statistics_add_listener(output->stats,
+					      &stats_listener, output);
+}
+
+static void
+output_destroy(struct stats_output *output)
+{
+	if (output->stats)
+		weston_output_statistics_destroy(output->stats);
+	wl_output_destroy(output->output);
+	wl_list_remove(&output->link);
+	free(output->make);
+	free(output->model);
+	free(output);
+}
+
+static void
+handle_global(void *data, struct wl_registry *registry,
+	      uint32_t name, const char *interface, uint32_t version)
+{
+	struct stats_app *app = data;
+	struct stats_output *output;
+
+	if (strcmp(interface, "wl_output") == 0) {
+		output = xzalloc(sizeof *output);
+		output->app = app;
+		output->global_name = name;
+		output->output = wl_registry_bind(registry, name,
+						  &wl_output_interface, 1);
+		wl_output_add_listener(output->output,
+				       &output_listener, output);
+		wl_list_insert(app->output_list.prev, &output->link);
+		output_create_stats(output);
+	} else if (strcmp(interface, "weston_statistics") == 0) {
+		app->statistics =
+			wl_registry_bind(registry, name,
+					 &weston_statistics_interface, 1);
+		wl_list_for_each(output, &app->output_list, link)
+			output_create_stats(output);
+	}
+}
+
+static void
+handle_global_remove(void *data, struct wl_registry *registry,
+		     uint32_t name)
+{
+	struct stats_app *app = data;
+	struct stats_output *output, *tmp;
+
+	wl_list_for_each_safe(output, tmp, &app->output_list, link) {
+		if (output->global_name == name) {
+			output_destroy(output);
+			break;
+		}
+	}
+}
+
+static const struct wl_registry_listener registry_listener = {
+	handle_global,
+	handle_global_remove
+};
+
+static void
+print_output(struct stats_output *output, double seconds)
+{
+	const struct sample *c = &output->current, *p = &output->previous;
+	uint64_t repaints = c->repaints - p->repaints;
+	double per_frame = repaints ? 1.0 / repaints : 0.0;
+	int i;
+
+	printf("%s %s: %6.1f fps, %3" PRIu64 " missed vblanks, "
+	       "%8.0f px damage/frame, %4.1f views/frame, "
+	       "%8.1f KiB/s upload, %6.3f ms cpu/repaint  [",
+	       output->make ? output->make : "?",
+	       output->model ? output->model : "?",
+	       repaints / seconds, c->missed_vblanks - p->missed_vblanks,
+	       (c->damage_pixels - p->damage_pixels) * per_frame,
+	       (c->views - p->views) * per_frame,
+	       (c->upload_bytes - p->upload_bytes) / 1024.0 / seconds,
+	       (c->repaint_cpu_usec - p->repaint_cpu_usec) * per_frame / 1000.0);
+
+	for (i = 0; i < HISTOGRAM_SIZE; i++)
+		printf("%s%u", i ? " " : "",
+		       c->histogram[i] - p->histogram[i]);
+	printf("]\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct stats_app app;
+	struct stats_output *output, *tmp;
+	struct timespec delay;
+	int interval = 1000, count = 0, help = 0, n;
+
+	const struct weston_option options[] = {
+		{ WESTON_OPTION_INTEGER, "interval", 'i', &interval },
+		{ WESTON_OPTION_INTEGER, "count", 'c', &count },
+		{ WESTON_OPTION_BOOLEAN, "help", 'h', &help },
+	};
+
+	parse_options(options, ARRAY_LENGTH(options), &argc, argv);
+	if (help || argc > 1 || interval <= 0) {
+		fprintf(stderr, "usage: %s [options]\n\n"
+			"  -i, --interval=MS\tsampling interval, default 1000\n"
+			"  -c, --count=N\t\tstop after N samples\n"
+			"  -h, --help\t\tthis help text\n\n"
+			"Histogram buckets are repaints below 0.25, 0.5, 1, 2,"
+			" 4, 8, 16 and\nabove 16 ms of CPU time.\n", argv[0]);
+		return help ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	memset(&app, 0, sizeof app);
+	wl_list_init(&app.output_list);
+
+	app.display = wl_display_connect(NULL);
+	if (!app.display) {
+		fprintf(stderr, "failed to create display: %m\n");
+		return EXIT_FAILURE;
+	}
+
+	app.registry = wl_display_get_registry(app.display);
+	wl_registry_add_listener(app.registry, &registry_listener, &app);
+	wl_display_roundtrip(app.display);
+
+	if (!app.statistics) {
+		fprintf(stderr, "display doesn't support weston_statistics\n");
+		return EXIT_FAILURE;
+	}
+
+	for (n = 0; ; n++) {
+		wl_list_for_each(output, &app.output_list, link) {
+			output->previous = output->current;
+			if (output->stats)
+				weston_output_statistics_sample(output->stats);
+		}
+
+		if (wl_display_roundtrip(app.display) < 0) {
+			fprintf(stderr, "lost connection: %m\n");
+			return EXIT_FAILURE;
+		}
+
+		/* The first sample only sets the baseline */
+		wl_list_for_each(output, &app.output_list, link)
+			if (output->samples > 1)
+				print_output(output, interval / 1000.0);
+
+		if (n > 0 && !wl_list_empty(&app.output_list))
+			printf("\n");
+		fflush(stdout);
+
+		if (count != 0 && n == count)
+			break;
+
+		delay.tv_sec = interval / 1000;
+		delay.tv_nsec = (interval % 1000) * 1000000L;
+		while (nanosleep(&delay, &delay) < 0 && errno == EINTR)
+			;
+	}
+
+	wl_list_for_each_safe(output, tmp, &app.output_list, link)
+		output_destroy(output);
+	weston_statistics_destroy(app.statistics);
+	wl_registry_destroy(app.registry);
+	wl_display_disconnect(app.display);
+
+	return EXIT_SUCCESS;
+}
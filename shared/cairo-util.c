@@ -451,16 +451,19 @@ theme_destroy(struct theme *t)
 	free(t);
 }
 
+/* The drop shadow around a frame that is not maximized: drawn from
+ * FRAME_SHADOW_OFFSET, FRAME_SHADOW_GROW larger than the frame, with
+ * FRAME_SHADOW_MARGIN sized corners. */
+#define FRAME_SHADOW_OFFSET	2
+#define FRAME_SHADOW_GROW	8
+#define FRAME_SHADOW_MARGIN	64
+
 void
-theme_render_frame(struct theme *t,
-		   cairo_t *cr, int width, int height,
-		   const char *title, struct wl_list *buttons,
-		   uint32_t flags)
+theme_render_frame_background(struct theme *t, cairo_t *cr,
+			      int width, int height, uint32_t flags)
 {
-	cairo_text_extents_t extents;
-	cairo_font_extents_t font_extents;
 	cairo_surface_t *source;
-	int x, y, margin, top_margin;
+	int margin, top_margin;
 
 	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
 	cairo_set_source_rgba(cr, 0, 0, 0, 0);
@@ -470,8 +473,10 @@ theme_render_frame(struct theme *t,
 		margin = 0;
 	else {
 		render_shadow(cr, t->shadow,
-			      2, 2, width + 8, height + 8,
-			      64, 64);
+			      FRAME_SHADOW_OFFSET, FRAME_SHADOW_OFFSET,
+			      width + FRAME_SHADOW_GROW,
+			      height + FRAME_SHADOW_GROW,
+			      FRAME_SHADOW_MARGIN, FRAME_SHADOW_MARGIN);
 		margin = t->margin;
 	}
 
@@ -480,48 +485,106 @@ theme_render_frame(struct theme *t,
 	else
 		source = t->inactive_frame;
 
-	if (title || !wl_list_empty(buttons))
-		top_margin = t->titlebar_height;
-	else
+	if (flags & THEME_FRAME_NO_TITLE)
 		top_margin = t->width;
+	else
+		top_margin = t->titlebar_height;
 
 	tile_source(cr, source,
 		    margin, margin,
 		    width - margin * 2, height - margin * 2,
 		    t->width, top_margin);
+}
 
-	if (title || !wl_list_empty(buttons)) {
-		cairo_rectangle (cr, margin + t->width, margin,
-				 width - (margin + t->width) * 2,
-				 t->titlebar_height - t->width);
-		cairo_clip(cr);
-
-		cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
-		cairo_select_font_face(cr, "sans",
-				       CAIRO_FONT_SLANT_NORMAL,
-				       CAIRO_FONT_WEIGHT_BOLD);
-		cairo_set_font_size(cr, 14);
-		cairo_text_extents(cr, title, &extents);
-		cairo_font_extents (cr, &font_extents);
-		x = (width - extents.width) / 2;
-		y = margin +
-			(t->titlebar_height -
-			 font_extents.ascent - font_extents.descent) / 2 +
-			font_extents.ascent;
-
-		if (flags & THEME_FRAME_ACTIVE) {
-			cairo_move_to(cr, x + 1, y  + 1);
-			cairo_set_source_rgb(cr, 1, 1, 1);
-			cairo_show_text(cr, title);
-			cairo_move_to(cr, x, y);
-			cairo_set_source_rgb(cr, 0, 0, 0);
-			cairo_show_text(cr, title);
-		} else {
-			cairo_move_to(cr, x, y);
-			cairo_set_source_rgb(cr, 0.4, 0.4, 0.4);
-			cairo_show_text(cr, title);
-		}
+void
+theme_frame_background_borders(struct theme *t, uint32_t flags,
+			       int *left, int *right, int *top, int *bottom)
+{
+	int margin, top_margin, shadow_near = 0, shadow_far = 0;
+
+	if (flags & THEME_FRAME_MAXIMIZED) {
+		margin = 0;
+	} else {
+		margin = t->margin;
+		/* Where the shadow corners end, from either edge */
+		shadow_near = FRAME_SHADOW_OFFSET + FRAME_SHADOW_MARGIN;
+		shadow_far = FRAME_SHADOW_MARGIN - FRAME_SHADOW_OFFSET -
+			     FRAME_SHADOW_GROW;
 	}
+
+	if (flags & THEME_FRAME_NO_TITLE)
+		top_margin = t->width;
+	else
+		top_margin = t->titlebar_height;
+
+	*left = MAX(shadow_near, margin + t->width);
+	*right = MAX(shadow_far, margin + t->width);
+	*top = MAX(shadow_near, margin + top_margin);
+	*bottom = MAX(shadow_far, margin + t->width);
+}
+
+void
+theme_render_frame_title(struct theme *t, cairo_t *cr,
+			 int width, int height, const char *title,
+			 uint32_t flags)
+{
+	cairo_text_extents_t extents;
+	cairo_font_extents_t font_extents;
+	int x, y, margin;
+
+	if (flags & THEME_FRAME_NO_TITLE)
+		return;
+
+	if (flags & THEME_FRAME_MAXIMIZED)
+		margin = 0;
+	else
+		margin = t->margin;
+
+	cairo_rectangle (cr, margin + t->width, margin,
+			 width - (margin + t->width) * 2,
+			 t->titlebar_height - t->width);
+	cairo_clip(cr);
+
+	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+	cairo_select_font_face(cr, "sans",
+			       CAIRO_FONT_SLANT_NORMAL,
+			       CAIRO_FONT_WEIGHT_BOLD);
+	cairo_set_font_size(cr, 14);
+	cairo_text_extents(cr, title, &extents);
+	cairo_font_extents (cr, &font_extents);
+	x = (width - extents.width) / 2;
+	y = margin +
+		(t->titlebar_height -
+		 font_extents.ascent - font_extents.descent) / 2 +
+		font_extents.ascent;
+
+	if (flags & THEME_FRAME_ACTIVE) {
+		cairo_move_to(cr, x + 1, y  + 1);
+		cairo_set_source_rgb(cr, 1, 1, 1);
+		cairo_show_text(cr, title);
+		cairo_move_to(cr, x, y);
+		cairo_set_source_rgb(cr, 0, 0, 0);
+		cairo_show_text(cr, title);
+	} else {
+		cairo_move_to(cr, x, y);
+		cairo_set_source_rgb(cr, 0.4, 0.4, 0.4);
+		cairo_show_text(cr, title);
+	}
+}
+
+void
+theme_render_frame(struct theme *t,
+		   cairo_t *cr, int width, int height,
+		   const char *title, struct wl_list *buttons,
+		   uint32_t flags)
+{
+	if (!title && wl_list_empty(buttons))
+		flags |= THEME_FRAME_NO_TITLE;
+	else
+		flags &= ~THEME_FRAME_NO_TITLE;
+
+	theme_render_frame_background(t, cr, width, height, flags);
+	theme_render_frame_title(t, cr, width, height, title, flags);
 }
 
 enum theme_location
@@ -77,6 +77,24 @@ theme_render_frame(struct theme *t,
 		   const char *title, struct wl_list *buttons,
 		   uint32_t flags);
 
+/* theme_render_frame() in two steps: the background only depends on
+ * the size and flags, so it can be rendered once and reused. */
+void
+theme_render_frame_background(struct theme *t, cairo_t *cr,
+			      int width, int height, uint32_t flags);
+void
+theme_render_frame_title(struct theme *t, cairo_t *cr,
+			 int width, int height, const char *title,
+			 uint32_t flags);
+
+/* The corners of the background, as wide and high as these borders,
+ * are the same for every frame size.  Between them each edge repeats
+ * a single row or column, so a background of left + 1 + right by
+ * top + 1 + bottom pixels can be stretched to any larger size. */
+void
+theme_frame_background_borders(struct theme *t, uint32_t flags,
+			       int *left, int *right, int *top, int *bottom);
+
 enum theme_location {
 	THEME_LOCATION_INTERIOR = 0,
 	THEME_LOCATION_RESIZING_TOP = 1,
@@ -230,4 +248,23 @@ frame_double_touch_up(struct frame *frame, void *data, int32_t id);
 void
 frame_repaint(struct frame *frame, cairo_t *cr);
 
+/* The THEME_FRAME_* flags the frame is rendered with.  Together with
+ * the frame size they determine what frame_repaint_background() draws. */
+uint32_t
+frame_theme_flags(struct frame *frame);
+
+/* The area frame_repaint_foreground() draws into. */
+void
+frame_titlebar_rect(struct frame *frame, int32_t *x, int32_t *y,
+		    int32_t *width, int32_t *height);
+
+/* frame_repaint() split in two, for callers that cache the background.
+ * frame_repaint_foreground() draws the title and buttons over it, and
+ * clears FRAME_STATUS_REPAINT. */
+void
+frame_repaint_background(struct frame *frame, cairo_t *cr);
+
+void
+frame_repaint_foreground(struct frame *frame, cairo_t *cr);
+
 #endif
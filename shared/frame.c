@@ -379,6 +379,10 @@ frame_set_title(struct frame *frame, const char *title)
 {
 	char *dup = NULL;
 
+	if (title == frame->title ||
+	    (title && frame->title && strcmp(title, frame->title) == 0))
+		return 0;
+
 	if (title) {
 		dup = strdup(title);
 		if (!dup)
@@ -397,6 +401,9 @@ frame_set_title(struct frame *frame, const char *title)
 void
 frame_set_flag(struct frame *frame, enum frame_flag flag)
 {
+	if ((frame->flags & flag) == flag)
+		return;
+
 	if (flag & FRAME_FLAG_MAXIMIZED && !(frame->flags & FRAME_FLAG_MAXIMIZED))
 		frame->geometry_dirty = 1;
 
@@ -407,6 +414,9 @@ frame_set_flag(struct frame *frame, enum frame_flag flag)
 void
 frame_unset_flag(struct frame *frame, enum frame_flag flag)
 {
+	if (!(frame->flags & flag))
+		return;
+
 	if (flag & FRAME_FLAG_MAXIMIZED && frame->flags & FRAME_FLAG_MAXIMIZED)
 		frame->geometry_dirty = 1;
 
@@ -417,6 +427,9 @@ frame_unset_flag(struct frame *frame, enum frame_flag flag)
 void
 frame_resize(struct frame *frame, int32_t width, int32_t height)
 {
+	if (frame->width == width && frame->height == height)
+		return;
+
 	frame->width = width;
 	frame->height = height;
 
@@ -921,23 +934,60 @@ frame_double_touch_up(struct frame *frame, void *data, int32_t id)
 	}
 }
 
-void
-frame_repaint(struct frame *frame, cairo_t *cr)
+uint32_t
+frame_theme_flags(struct frame *frame)
 {
-	struct frame_button *button;
 	uint32_t flags = 0;
 
-	frame_refresh_geometry(frame);
-
 	if (frame->flags & FRAME_FLAG_MAXIMIZED)
 		flags |= THEME_FRAME_MAXIMIZED;
 
 	if (frame->flags & FRAME_FLAG_ACTIVE)
 		flags |= THEME_FRAME_ACTIVE;
 
+	if (!frame->title && wl_list_empty(&frame->buttons))
+		flags |= THEME_FRAME_NO_TITLE;
+
+	return flags;
+}
+
+void
+frame_titlebar_rect(struct frame *frame, int32_t *x, int32_t *y,
+		    int32_t *width, int32_t *height)
+{
+	frame_refresh_geometry(frame);
+
+	if (x)
+		*x = frame->shadow_margin;
+	if (y)
+		*y = frame->shadow_margin;
+	if (width)
+		*width = frame->width - frame->shadow_margin * 2;
+	if (height)
+		*height = frame->interior.y - frame->shadow_margin;
+}
+
+void
+frame_repaint_background(struct frame *frame, cairo_t *cr)
+{
+	cairo_save(cr);
+	theme_render_frame_background(frame->theme, cr,
+				      frame->width, frame->height,
+				      frame_theme_flags(frame));
+	cairo_restore(cr);
+}
+
+void
+frame_repaint_foreground(struct frame *frame, cairo_t *cr)
+{
+	struct frame_button *button;
+
+	frame_refresh_geometry(frame);
+
 	cairo_save(cr);
-	theme_render_frame(frame->theme, cr, frame->width, frame->height,
-			   frame->title, &frame->buttons, flags);
+	theme_render_frame_title(frame->theme, cr,
+				 frame->width, frame->height,
+				 frame->title, frame_theme_flags(frame));
 	cairo_restore(cr);
 
 	wl_list_for_each(button, &frame->buttons, link)
@@ -945,3 +995,11 @@ frame_repaint(struct frame *frame, cairo_t *cr)
 
 	frame_status_clear(frame, FRAME_STATUS_REPAINT);
 }
+
+void
+frame_repaint(struct frame *frame, cairo_t *cr)
+{
+	frame_refresh_geometry(frame);
+	frame_repaint_background(frame, cr);
+	frame_repaint_foreground(frame, cr);
+}
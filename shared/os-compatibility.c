@@ -27,6 +27,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -135,6 +136,7 @@ create_tmpfile_cloexec(char *tmpname)
  *
  * The file should not have a permanent backing store like a disk,
  * but may have if XDG_RUNTIME_DIR is not properly implemented in OS.
+ * A memfd is used where available, which never has one.
  *
  * The file name is deleted from the file system.
  *
@@ -157,6 +159,12 @@ os_create_anonymous_file(off_t size)
 	int fd;
 	int ret;
 
+#ifdef HAVE_MEMFD_CREATE
+	fd = memfd_create("weston-shared", MFD_CLOEXEC);
+	if (fd >= 0)
+		goto allocate;
+#endif
+
 	path = getenv("XDG_RUNTIME_DIR");
 	if (!path) {
 		errno = ENOENT;
@@ -177,6 +185,13 @@ os_create_anonymous_file(off_t size)
 	if (fd < 0)
 		return -1;
 
+#ifdef HAVE_MEMFD_CREATE
+allocate:
+#endif
+	/* Files that grow as they are written start out empty */
+	if (size == 0)
+		return fd;
+
 #ifdef HAVE_POSIX_FALLOCATE
 	ret = posix_fallocate(fd, 0, size);
 	if (ret != 0) {
@@ -39,12 +39,105 @@ struct weston_binding {
 	void *handler;
 	void *data;
 	struct wl_list link;
+	/* Not in any table for modifier bindings */
+	struct weston_binding_table *table;
+	struct wl_list hash_link;
 };
 
+/*
+ * Every binding but modifier bindings is also kept in a hash table keyed
+ * by its key, button or axis and its modifier, so dispatch only looks at
+ * bindings that can match.  A bucket keeps bindings in the order they
+ * were added, and so does splitting it on growth, so handlers for the
+ * same key still run in that order.
+ */
+
+#define BINDING_TABLE_MIN_SIZE 64
+
+static uint32_t
+binding_hash(uint32_t code, uint32_t modifier)
+{
+	uint32_t h = code * 0x9e3779b1 ^ modifier * 0x85ebca6b;
+
+	return h ^ (h >> 16);
+}
+
+static struct wl_list *
+binding_table_bucket(struct weston_binding_table *table,
+		     uint32_t code, uint32_t modifier)
+{
+	if (table->size == 0)
+		return NULL;
+
+	return &table->buckets[binding_hash(code, modifier) &
+			       (table->size - 1)];
+}
+
+static void
+binding_table_resize(struct weston_binding_table *table, uint32_t size)
+{
+	struct weston_binding *b, *tmp;
+	struct wl_list *buckets;
+	uint32_t i, code;
+
+	buckets = malloc(size * sizeof *buckets);
+	if (!buckets)
+		return;
+
+	for (i = 0; i < size; i++)
+		wl_list_init(&buckets[i]);
+
+	for (i = 0; i < table->size; i++) {
+		wl_list_for_each_safe(b, tmp, &table->buckets[i], hash_link) {
+			code = b->key | b->button | b->axis;
+			wl_list_insert(buckets[binding_hash(code, b->modifier) &
+					       (size - 1)].prev,
+				       &b->hash_link);
+		}
+	}
+
+	free(table->buckets);
+	table->buckets = buckets;
+	table->size = size;
+}
+
+static int
+binding_table_insert(struct weston_binding_table *table,
+		     struct weston_binding *binding)
+{
+	uint32_t code = binding->key | binding->button | binding->axis;
+
+	if (table->size == 0)
+		binding_table_resize(table, BINDING_TABLE_MIN_SIZE);
+	else if (table->count >= table->size && !table->dispatching)
+		binding_table_resize(table, table->size * 2);
+
+	if (table->size == 0)
+		return -1;
+
+	wl_list_insert(binding_table_bucket(table, code,
+					    binding->modifier)->prev,
+		       &binding->hash_link);
+	binding->table = table;
+	table->count++;
+
+	return 0;
+}
+
+void
+weston_binding_table_release(struct weston_binding_table *table)
+{
+	free(table->buckets);
+	table->buckets = NULL;
+	table->size = 0;
+	table->count = 0;
+}
+
 static struct weston_binding *
 weston_compositor_add_binding(struct weston_compositor *compositor,
 			      uint32_t key, uint32_t button, uint32_t axis,
-			      uint32_t modifier, void *handler, void *data)
+			      uint32_t modifier, void *handler, void *data,
+			      struct weston_binding_table *table)
 {
 	struct weston_binding *binding;
 
@@ -58,6 +151,13 @@ weston_compositor_add_binding(struct weston_compositor *compositor,
 	binding->modifier = modifier;
 	binding->handler = handler;
 	binding->data = data;
+	binding->table = NULL;
+	wl_list_init(&binding->hash_link);
+
+	if (table && binding_table_insert(table, binding) < 0) {
+		free(binding);
+		return NULL;
+	}
 
 	return binding;
 }
@@ -71,7 +171,8 @@ weston_compositor_add_key_binding(struct weston_compositor *compositor,
 	struct weston_binding *binding;
 
 	binding = weston_compositor_add_binding(compositor, key, 0, 0,
-						modifier, handler, data);
+						modifier, handler, data,
+						&compositor->key_binding_table);
 	if (binding == NULL)
 		return NULL;
 
@@ -89,10 +190,14 @@ weston_compositor_add_modifier_binding(struct weston_compositor *compositor,
 	struct weston_binding *binding;
 
 	binding = weston_compositor_add_binding(compositor, 0, 0, 0,
-						modifier, handler, data);
+						modifier, handler, data, NULL);
 	if (binding == NULL)
 		return NULL;
 
+	/* Primed by the modifier press, see
+	 * weston_compositor_run_modifier_binding() */
+	binding->key = compositor->binding_press_count - 1;
+
 	wl_list_insert(compositor->modifier_binding_list.prev, &binding->link);
 
 	return binding;
@@ -107,7 +212,8 @@ weston_compositor_add_button_binding(struct weston_compositor *compositor,
 	struct weston_binding *binding;
 
 	binding = weston_compositor_add_binding(compositor, 0, button, 0,
-						modifier, handler, data);
+						modifier, handler, data,
+						&compositor->button_binding_table);
 	if (binding == NULL)
 		return NULL;
 
@@ -125,7 +231,8 @@ weston_compositor_add_touch_binding(struct weston_compositor *compositor,
 	struct weston_binding *binding;
 
 	binding = weston_compositor_add_binding(compositor, 0, 0, 0,
-						modifier, handler, data);
+						modifier, handler, data,
+						&compositor->touch_binding_table);
 	if (binding == NULL)
 		return NULL;
 
@@ -143,7 +250,8 @@ weston_compositor_add_axis_binding(struct weston_compositor *compositor,
 	struct weston_binding *binding;
 
 	binding = weston_compositor_add_binding(compositor, 0, 0, axis,
-						modifier, handler, data);
+						modifier, handler, data,
+						&compositor->axis_binding_table);
 	if (binding == NULL)
 		return NULL;
 
@@ -161,7 +269,10 @@ weston_compositor_add_debug_binding(struct weston_compositor *compositor,
 	struct weston_binding *binding;
 
 	binding = weston_compositor_add_binding(compositor, key, 0, 0, 0,
-						handler, data);
+						handler, data,
+						&compositor->debug_binding_table);
+	if (binding == NULL)
+		return NULL;
 
 	wl_list_insert(compositor->debug_binding_list.prev, &binding->link);
 
@@ -172,6 +283,9 @@ WL_EXPORT void
 weston_binding_destroy(struct weston_binding *binding)
 {
 	wl_list_remove(&binding->link);
+	wl_list_remove(&binding->hash_link);
+	if (binding->table)
+		binding->table->count--;
 	free(binding);
 }
 
@@ -284,18 +398,25 @@ weston_compositor_run_key_binding(struct weston_compositor *compositor,
 				  uint32_t time, uint32_t key,
 				  enum wl_keyboard_key_state state)
 {
+	struct weston_binding_table *table = &compositor->key_binding_table;
 	struct weston_binding *b, *tmp;
 	struct weston_surface *focus;
 	struct weston_seat *seat = keyboard->seat;
+	struct wl_list *bucket;
 
 	if (state == WL_KEYBOARD_KEY_STATE_RELEASED)
 		return;
 
 	/* Invalidate all active modifier bindings. */
-	wl_list_for_each(b, &compositor->modifier_binding_list, link)
-		b->key = key;
+	compositor->binding_press_count++;
 
-	wl_list_for_each_safe(b, tmp, &compositor->key_binding_list, link) {
+	bucket = binding_table_bucket(table, key, seat->modifier_state);
+	if (!bucket)
+		return;
+
+	table->dispatching++;
+	wl_list_for_each_safe(b, tmp, bucket, hash_link) {
+		table->probes++;
 		if (b->key == key && b->modifier == seat->modifier_state) {
 			weston_key_binding_handler_t handler = b->handler;
 			focus = keyboard->focus;
@@ -312,6 +433,7 @@ weston_compositor_run_key_binding(struct weston_compositor *compositor,
 						     focus);
 		}
 	}
+	table->dispatching--;
 }
 
 void
@@ -333,11 +455,11 @@ weston_compositor_run_modifier_binding(struct weston_compositor *compositor,
 
 		/* Prime the modifier binding. */
 		if (state == WL_KEYBOARD_KEY_STATE_PRESSED) {
-			b->key = 0;
+			b->key = compositor->binding_press_count;
 			continue;
 		}
 		/* Ignore the binding if a key was pressed in between. */
-		else if (b->key != 0) {
+		else if (b->key != compositor->binding_press_count) {
 			return;
 		}
 
@@ -351,22 +473,30 @@ weston_compositor_run_button_binding(struct weston_compositor *compositor,
 				     uint32_t time, uint32_t button,
 				     enum wl_pointer_button_state state)
 {
+	struct weston_binding_table *table = &compositor->button_binding_table;
+	uint32_t modifier = pointer->seat->modifier_state;
 	struct weston_binding *b, *tmp;
+	struct wl_list *bucket;
 
 	if (state == WL_POINTER_BUTTON_STATE_RELEASED)
 		return;
 
 	/* Invalidate all active modifier bindings. */
-	wl_list_for_each(b, &compositor->modifier_binding_list, link)
-		b->key = button;
+	compositor->binding_press_count++;
 
-	wl_list_for_each_safe(b, tmp, &compositor->button_binding_list, link) {
-		if (b->button == button &&
-		    b->modifier == pointer->seat->modifier_state) {
+	bucket = binding_table_bucket(table, button, modifier);
+	if (!bucket)
+		return;
+
+	table->dispatching++;
+	wl_list_for_each_safe(b, tmp, bucket, hash_link) {
+		table->probes++;
+		if (b->button == button && b->modifier == modifier) {
 			weston_button_binding_handler_t handler = b->handler;
 			handler(pointer, time, button, b->data);
 		}
 	}
+	table->dispatching--;
 }
 
 void
@@ -374,17 +504,27 @@ weston_compositor_run_touch_binding(struct weston_compositor *compositor,
 				    struct weston_touch *touch, uint32_t time,
 				    int touch_type)
 {
+	struct weston_binding_table *table = &compositor->touch_binding_table;
+	uint32_t modifier = touch->seat->modifier_state;
 	struct weston_binding *b, *tmp;
+	struct wl_list *bucket;
 
 	if (touch->num_tp != 1 || touch_type != WL_TOUCH_DOWN)
 		return;
 
-	wl_list_for_each_safe(b, tmp, &compositor->touch_binding_list, link) {
-		if (b->modifier == touch->seat->modifier_state) {
+	bucket = binding_table_bucket(table, 0, modifier);
+	if (!bucket)
+		return;
+
+	table->dispatching++;
+	wl_list_for_each_safe(b, tmp, bucket, hash_link) {
+		table->probes++;
+		if (b->modifier == modifier) {
 			weston_touch_binding_handler_t handler = b->handler;
 			handler(touch, time, b->data);
 		}
 	}
+	table->dispatching--;
 }
 
 int
@@ -393,15 +533,21 @@ weston_compositor_run_axis_binding(struct weston_compositor *compositor,
 				   uint32_t time,
 				   struct weston_pointer_axis_event *event)
 {
-	struct weston_binding *b, *tmp;
+	uint32_t modifier = pointer->seat->modifier_state;
+	struct weston_binding *b;
+	struct wl_list *bucket;
 
 	/* Invalidate all active modifier bindings. */
-	wl_list_for_each(b, &compositor->modifier_binding_list, link)
-		b->key = event->axis;
+	compositor->binding_press_count++;
+
+	bucket = binding_table_bucket(&compositor->axis_binding_table,
+				      event->axis, modifier);
+	if (!bucket)
+		return 0;
 
-	wl_list_for_each_safe(b, tmp, &compositor->axis_binding_list, link) {
-		if (b->axis == event->axis &&
-		    b->modifier == pointer->seat->modifier_state) {
+	wl_list_for_each(b, bucket, hash_link) {
+		compositor->axis_binding_table.probes++;
+		if (b->axis == event->axis && b->modifier == modifier) {
 			weston_axis_binding_handler_t handler = b->handler;
 			handler(pointer, time, event, b->data);
 			return 1;
@@ -417,11 +563,19 @@ weston_compositor_run_debug_binding(struct weston_compositor *compositor,
 				    uint32_t time, uint32_t key,
 				    enum wl_keyboard_key_state state)
 {
+	struct weston_binding_table *table = &compositor->debug_binding_table;
 	weston_key_binding_handler_t handler;
 	struct weston_binding *binding, *tmp;
+	struct wl_list *bucket;
 	int count = 0;
 
-	wl_list_for_each_safe(binding, tmp, &compositor->debug_binding_list, link) {
+	bucket = binding_table_bucket(table, key, 0);
+	if (!bucket)
+		return 0;
+
+	table->dispatching++;
+	wl_list_for_each_safe(binding, tmp, bucket, hash_link) {
+		table->probes++;
 		if (key != binding->key)
 			continue;
 
@@ -429,6 +583,7 @@ weston_compositor_run_debug_binding(struct weston_compositor *compositor,
 		handler = binding->handler;
 		handler(keyboard, time, key, binding->data);
 	}
+	table->dispatching--;
 
 	return count;
 }
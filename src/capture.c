@@ -0,0 +1,403 @@
+/*
+ * Copyright © 2016 The Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "compositor.h"
+#include "shared/helpers.h"
+
+static int
+capture_buffer_reserve(struct weston_capture_buffer *buffer,
+		       int nboxes, size_t data_size)
+{
+	pixman_box32_t *boxes;
+	uint32_t **pixels;
+	uint32_t *data;
+
+	if (buffer->boxes_size < nboxes) {
+		boxes = realloc(buffer->boxes, nboxes * sizeof *boxes);
+		if (boxes == NULL)
+			return -1;
+		buffer->boxes = boxes;
+
+		pixels = realloc(buffer->pixels, nboxes * sizeof *pixels);
+		if (pixels == NULL)
+			return -1;
+		buffer->pixels = pixels;
+
+		buffer->boxes_size = nboxes;
+	}
+
+	if (buffer->data_size < data_size) {
+		data = realloc(buffer->data, data_size);
+		if (data == NULL)
+			return -1;
+		buffer->data = data;
+		buffer->data_size = data_size;
+	}
+
+	return 0;
+}
+
+/* Find a buffer no sink holds on to any more.  If they all are, e.g.
+ * while the recorder's encoder catches up, hand the oldest one over to
+ * its holders and start a new one. */
+static struct weston_capture_buffer *
+capture_get_buffer(struct weston_output_capture *capture)
+{
+	struct weston_capture_buffer *buffer;
+	int i;
+
+	for (i = 0; i < WESTON_CAPTURE_BUFFERS; i++) {
+		buffer = capture->buffers[i];
+		if (buffer == NULL ||
+		    __atomic_load_n(&buffer->refcount, __ATOMIC_ACQUIRE) == 1)
+			break;
+	}
+
+	if (i == WESTON_CAPTURE_BUFFERS) {
+		weston_capture_buffer_unref(capture->buffers[0]);
+		memmove(&capture->buffers[0], &capture->buffers[1],
+			(WESTON_CAPTURE_BUFFERS - 1) * sizeof buffer);
+		i = WESTON_CAPTURE_BUFFERS - 1;
+		capture->buffers[i] = NULL;
+	}
+
+	if (capture->buffers[i] == NULL) {
+		buffer = zalloc(sizeof *buffer);
+		if (buffer == NULL)
+			return NULL;
+		buffer->refcount = 1;
+		capture->buffers[i] = buffer;
+	}
+
+	return capture->buffers[i];
+}
+
+/* Read back region, in framebuffer coordinates, into a capture buffer
+ * and describe it in frame. */
+static void
+capture_read_region(struct weston_output *output,
+		    pixman_region32_t *region,
+		    struct weston_capture_frame *frame)
+{
+	struct weston_output_capture *capture = &output->capture;
+	struct weston_compositor *compositor = output->compositor;
+	struct weston_capture_buffer *buffer;
+	int bpp = PIXMAN_FORMAT_BPP(frame->format) / 8;
+	int i, n, width, height;
+	pixman_box32_t *r, *box;
+	size_t size = 0;
+	uint8_t *p;
+
+	frame->buffer = NULL;
+	frame->nboxes = 0;
+	frame->boxes = NULL;
+	frame->pixels = NULL;
+
+	r = pixman_region32_rectangles(region, &n);
+	if (n == 0)
+		return;
+
+	for (i = 0; i < n; i++)
+		size += (size_t) (r[i].x2 - r[i].x1) * (r[i].y2 - r[i].y1);
+
+	buffer = capture_get_buffer(capture);
+	if (buffer == NULL ||
+	    capture_buffer_reserve(buffer, n, size * bpp) < 0) {
+		weston_log("%s: out of memory\n", __func__);
+		return;
+	}
+
+	p = (uint8_t *) buffer->data;
+	for (i = 0; i < n; i++) {
+		width = r[i].x2 - r[i].x1;
+		height = r[i].y2 - r[i].y1;
+
+		box = &buffer->boxes[i];
+		box->x1 = r[i].x1;
+		box->x2 = r[i].x2;
+		if (frame->y_flip) {
+			box->y1 = output->current_mode->height - r[i].y2;
+			box->y2 = output->current_mode->height - r[i].y1;
+		} else {
+			box->y1 = r[i].y1;
+			box->y2 = r[i].y2;
+		}
+
+		compositor->renderer->read_pixels(output, frame->format, p,
+						  box->x1, box->y1,
+						  width, height);
+		buffer->pixels[i] = (uint32_t *) p;
+		p += (size_t) width * height * bpp;
+	}
+	buffer->nboxes = n;
+
+	frame->buffer = buffer;
+	frame->nboxes = n;
+	frame->boxes = buffer->boxes;
+	frame->pixels = (const uint32_t * const *) buffer->pixels;
+}
+
+static int
+capture_has_format(struct weston_output_capture *capture,
+		   pixman_format_code_t format)
+{
+	pixman_format_code_t *f;
+
+	wl_array_for_each(f, &capture->formats)
+		if (*f == format)
+			return 1;
+
+	return 0;
+}
+
+static void
+capture_frame_notify(struct wl_listener *listener, void *data)
+{
+	struct weston_output *output = data;
+	struct weston_output_capture *capture = &output->capture;
+	struct weston_capture_sink *sink, *tmp;
+	struct weston_capture_frame frame;
+	pixman_format_code_t *format, *f;
+	pixman_region32_t damage, region;
+
+	pixman_region32_init(&damage);
+	pixman_region32_intersect(&damage, &output->region,
+				  &output->previous_damage);
+	pixman_region32_translate(&damage, -output->x, -output->y);
+	weston_transformed_region(output->width, output->height,
+				  output->transform, output->current_scale,
+				  &damage, &damage);
+
+	capture->formats.size = 0;
+	wl_list_for_each(sink, &capture->sink_list, link) {
+		if (sink->prepare)
+			sink->prepare(sink);
+
+		if (capture_has_format(capture, sink->format))
+			continue;
+
+		f = wl_array_add(&capture->formats, sizeof *f);
+		if (f == NULL) {
+			weston_log("%s: out of memory, not capturing "
+				   "format 0x%08x\n", __func__, sink->format);
+			continue;
+		}
+		*f = sink->format;
+	}
+
+	frame.output = output;
+	frame.y_flip = !!(output->compositor->capabilities &
+			  WESTON_CAP_CAPTURE_YFLIP);
+	frame.damage = &damage;
+
+	pixman_region32_init(&region);
+	wl_array_for_each(format, &capture->formats) {
+		pixman_region32_clear(&region);
+		wl_list_for_each(sink, &capture->sink_list, link) {
+			if (sink->format != *format)
+				continue;
+			if (sink->flags & WESTON_CAPTURE_SINK_DAMAGE)
+				pixman_region32_union(&region, &region,
+						      &damage);
+			pixman_region32_union(&region, &region,
+					      &sink->region);
+		}
+		pixman_region32_intersect_rect(&region, &region, 0, 0,
+					       output->current_mode->width,
+					       output->current_mode->height);
+
+		frame.format = *format;
+		capture_read_region(output, &region, &frame);
+
+		wl_list_for_each_safe(sink, tmp, &capture->sink_list, link)
+			if (sink->format == *format)
+				sink->frame(sink, &frame);
+	}
+	pixman_region32_fini(&region);
+
+	pixman_region32_fini(&damage);
+}
+
+WL_EXPORT void
+weston_output_init_capture(struct weston_output *output)
+{
+	memset(&output->capture, 0, sizeof output->capture);
+	wl_list_init(&output->capture.sink_list);
+	wl_array_init(&output->capture.formats);
+	wl_list_init(&output->capture.frame_listener.link);
+	output->capture.frame_listener.notify = capture_frame_notify;
+}
+
+WL_EXPORT void
+weston_output_release_capture(struct weston_output *output)
+{
+	struct weston_output_capture *capture = &output->capture;
+	struct weston_capture_sink *sink, *tmp;
+	int i;
+
+	wl_list_for_each_safe(sink, tmp, &capture->sink_list, link) {
+		wl_list_remove(&sink->link);
+		wl_list_init(&sink->link);
+		sink->output = NULL;
+	}
+
+	wl_list_remove(&capture->frame_listener.link);
+	wl_list_init(&capture->frame_listener.link);
+
+	wl_array_release(&capture->formats);
+	for (i = 0; i < WESTON_CAPTURE_BUFFERS; i++) {
+		if (capture->buffers[i])
+			weston_capture_buffer_unref(capture->buffers[i]);
+		capture->buffers[i] = NULL;
+	}
+}
+
+/** Initialize a capture sink for pixels of the given format.
+ *
+ * The caller sets prepare and frame before adding it to an output.
+ */
+WL_EXPORT void
+weston_capture_sink_init(struct weston_capture_sink *sink,
+			 pixman_format_code_t format, uint32_t flags)
+{
+	memset(sink, 0, sizeof *sink);
+	sink->format = format;
+	sink->flags = flags;
+	pixman_region32_init(&sink->region);
+	wl_list_init(&sink->link);
+}
+
+WL_EXPORT void
+weston_output_add_capture_sink(struct weston_output *output,
+			       struct weston_capture_sink *sink)
+{
+	struct weston_output_capture *capture = &output->capture;
+
+	if (wl_list_empty(&capture->sink_list))
+		wl_signal_add(&output->frame_signal,
+			      &capture->frame_listener);
+
+	sink->output = output;
+	wl_list_insert(capture->sink_list.prev, &sink->link);
+}
+
+/** Remove a sink from its output and release its region.
+ *
+ * Safe to call on a sink whose output has been destroyed.
+ */
+WL_EXPORT void
+weston_capture_sink_remove(struct weston_capture_sink *sink)
+{
+	struct weston_output *output = sink->output;
+
+	wl_list_remove(&sink->link);
+	wl_list_init(&sink->link);
+	pixman_region32_fini(&sink->region);
+	pixman_region32_init(&sink->region);
+	sink->output = NULL;
+
+	if (output && wl_list_empty(&output->capture.sink_list)) {
+		wl_list_remove(&output->capture.frame_listener.link);
+		wl_list_init(&output->capture.frame_listener.link);
+	}
+}
+
+/** Copy a rectangle of a captured 32 bpp frame into an image.
+ *
+ * x, y, width and height are in top-down framebuffer coordinates and
+ * the pixels land at the same coordinates in dst, a top-down image of
+ * dst_stride pixels per row; the y-flip of the readback is undone on
+ * the way.  Pixels outside the captured boxes are left untouched, so
+ * sinks should only ask for what they requested in prepare() or for
+ * the frame damage.
+ */
+WL_EXPORT void
+weston_capture_frame_copy_rect(const struct weston_capture_frame *frame,
+			       uint32_t *dst, int dst_stride,
+			       int x, int y, int width, int height)
+{
+	int32_t fb_height = frame->output->current_mode->height;
+	const pixman_box32_t *b;
+	int i, x1, y1, x2, y2, by1, by2, box_width;
+
+	for (i = 0; i < frame->nboxes; i++) {
+		b = &frame->boxes[i];
+		if (frame->y_flip) {
+			by1 = fb_height - b->y2;
+			by2 = fb_height - b->y1;
+		} else {
+			by1 = b->y1;
+			by2 = b->y2;
+		}
+
+		x1 = MAX(x, b->x1);
+		y1 = MAX(y, by1);
+		x2 = MIN(x + width, b->x2);
+		y2 = MIN(y + height, by2);
+		if (x1 >= x2 || y1 >= y2)
+			continue;
+
+		/* With y_flip the box's last row is its top one, so walk
+		 * it backwards with a negative stride. */
+		box_width = b->x2 - b->x1;
+		if (frame->y_flip)
+			pixman_blt((uint32_t *) frame->pixels[i], dst,
+				   -box_width, dst_stride, 32, 32,
+				   x1 - b->x1, y1 - by2 + 1,
+				   x1, y1, x2 - x1, y2 - y1);
+		else
+			pixman_blt((uint32_t *) frame->pixels[i], dst,
+				   box_width, dst_stride, 32, 32,
+				   x1 - b->x1, y1 - by1,
+				   x1, y1, x2 - x1, y2 - y1);
+	}
+}
+
+/** Keep a frame's pixels past frame(), see struct weston_capture_buffer */
+WL_EXPORT struct weston_capture_buffer *
+weston_capture_buffer_ref(struct weston_capture_buffer *buffer)
+{
+	__atomic_fetch_add(&buffer->refcount, 1, __ATOMIC_RELAXED);
+
+	return buffer;
+}
+
+/** Drop a reference; may be called from any thread. */
+WL_EXPORT void
+weston_capture_buffer_unref(struct weston_capture_buffer *buffer)
+{
+	if (__atomic_fetch_sub(&buffer->refcount, 1, __ATOMIC_ACQ_REL) != 1)
+		return;
+
+	free(buffer->data);
+	free(buffer->boxes);
+	free(buffer->pixels);
+	free(buffer);
+}
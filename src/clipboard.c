@@ -27,17 +27,31 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <linux/input.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <sys/uio.h>
+#include <sys/sendfile.h>
 
 #include "compositor.h"
 #include "shared/helpers.h"
+#include "shared/os-compatibility.h"
+
+/*
+ * The selection is cached in an anonymous file, memfd where available.
+ * Data is spliced from the source pipe into it and sent from it to
+ * requesters with sendfile(), so the contents never pass through
+ * buffers in the compositor, however large they are.
+ */
+
+/* Upper bound for one splice() or sendfile() call */
+#define CLIPBOARD_CHUNK_SIZE (1 << 20)
 
 struct clipboard_source {
 	struct weston_data_source base;
-	struct wl_array contents;
+	int contents_fd;
+	off_t size;
+	struct wl_list client_list;	/* struct clipboard_client::link */
 	struct clipboard *clipboard;
 	struct wl_event_source *event_source;
 	uint32_t serial;
@@ -52,6 +66,13 @@ struct clipboard {
 	struct clipboard_source *source;
 };
 
+struct clipboard_client {
+	struct wl_event_source *event_source;
+	off_t offset;
+	struct clipboard_source *source;
+	struct wl_list link;
+};
+
 static void clipboard_client_create(struct clipboard_source *source, int fd);
 
 static void
@@ -72,35 +93,64 @@ clipboard_source_unref(struct clipboard_source *source)
 	s = source->base.mime_types.data;
 	free(*s);
 	wl_array_release(&source->base.mime_types);
-	wl_array_release(&source->contents);
+	close(source->contents_fd);
 	free(source);
 }
 
+/* Read through a buffer, for kernels that cannot splice to the cache */
+static ssize_t
+clipboard_source_copy(struct clipboard_source *source, int fd)
+{
+	char buffer[4096];
+	ssize_t len;
+
+	len = read(fd, buffer, sizeof buffer);
+	if (len <= 0)
+		return len;
+
+	if (pwrite(source->contents_fd, buffer, len, source->size) != len)
+		return -1;
+
+	return len;
+}
+
+static void
+clipboard_source_finish(struct clipboard_source *source)
+{
+	wl_event_source_remove(source->event_source);
+	close(source->fd);
+	source->event_source = NULL;
+}
+
 static int
 clipboard_source_data(int fd, uint32_t mask, void *data)
 {
 	struct clipboard_source *source = data;
 	struct clipboard *clipboard = source->clipboard;
-	char *p;
-	int len, size;
+	struct clipboard_client *client;
+	loff_t offset = source->size;
+	ssize_t len;
 
-	if (source->contents.alloc - source->contents.size < 1024) {
-		wl_array_add(&source->contents, 1024);
-		source->contents.size -= 1024;
-	}
+	len = splice(fd, NULL, source->contents_fd, &offset,
+		     CLIPBOARD_CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (len < 0 && errno == EAGAIN)
+		return 1;
+	if (len < 0 && errno == EINVAL)
+		len = clipboard_source_copy(source, fd);
 
-	p = source->contents.data + source->contents.size;
-	size = source->contents.alloc - source->contents.size;
-	len = read(fd, p, size);
-	if (len == 0) {
-		wl_event_source_remove(source->event_source);
-		close(fd);
-		source->event_source = NULL;
-	} else if (len < 0) {
+	if (len > 0)
+		source->size += len;
+	else
+		clipboard_source_finish(source);
+
+	/* Wake up requesters waiting for more data */
+	wl_list_for_each(client, &source->client_list, link)
+		wl_event_source_fd_update(client->event_source,
+					  WL_EVENT_WRITABLE);
+
+	if (len < 0) {
 		clipboard_source_unref(source);
 		clipboard->source = NULL;
-	} else {
-		source->contents.size += len;
 	}
 
 	return 1;
@@ -145,7 +195,11 @@ clipboard_source_create(struct clipboard *clipboard,
 	if (source == NULL)
 		return NULL;
 
-	wl_array_init(&source->contents);
+	source->contents_fd = os_create_anonymous_file(0);
+	if (source->contents_fd < 0)
+		goto err_file;
+
+	wl_list_init(&source->client_list);
 	wl_array_init(&source->base.mime_types);
 	source->base.resource = NULL;
 	source->base.accept = clipboard_source_accept;
@@ -176,37 +230,50 @@ clipboard_source_create(struct clipboard *clipboard,
  err_strdup:
 	wl_array_release(&source->base.mime_types);
  err_add:
+	close(source->contents_fd);
+ err_file:
 	free(source);
 
 	return NULL;
 }
 
-struct clipboard_client {
-	struct wl_event_source *event_source;
-	size_t offset;
-	struct clipboard_source *source;
-};
+static void
+clipboard_client_destroy(struct clipboard_client *client, int fd)
+{
+	close(fd);
+	wl_event_source_remove(client->event_source);
+	wl_list_remove(&client->link);
+	clipboard_source_unref(client->source);
+	free(client);
+}
 
 static int
 clipboard_client_data(int fd, uint32_t mask, void *data)
 {
 	struct clipboard_client *client = data;
-	char *p;
-	size_t size;
-	int len;
+	struct clipboard_source *source = client->source;
+	ssize_t len = 0;
+
+	if (client->offset < source->size) {
+		len = sendfile(fd, source->contents_fd, &client->offset,
+			       MIN(source->size - client->offset,
+				   CLIPBOARD_CHUNK_SIZE));
+		if (len < 0 && errno == EAGAIN)
+			return 1;
+		if (len <= 0) {
+			clipboard_client_destroy(client, fd);
+			return 1;
+		}
+	}
 
-	size = client->source->contents.size;
-	p = client->source->contents.data;
-	len = write(fd, p + client->offset, size - client->offset);
-	if (len > 0)
-		client->offset += len;
+	if (client->offset < source->size)
+		return 1;
 
-	if (client->offset == size || len <= 0) {
-		close(fd);
-		wl_event_source_remove(client->event_source);
-		clipboard_source_unref(client->source);
-		free(client);
-	}
+	/* Everything sent so far, wait for the source if it is not done */
+	if (source->event_source)
+		wl_event_source_fd_update(client->event_source, 0);
+	else
+		clipboard_client_destroy(client, fd);
 
 	return 1;
 }
@@ -218,16 +285,31 @@ clipboard_client_create(struct clipboard_source *source, int fd)
 	struct clipboard_client *client;
 	struct wl_event_loop *loop =
 		wl_display_get_event_loop(seat->compositor->wl_display);
+	int flags;
 
 	client = zalloc(sizeof *client);
-	if (client == NULL)
+	if (client == NULL) {
+		close(fd);
 		return;
+	}
+
+	/* A short write is better than blocking the compositor */
+	flags = fcntl(fd, F_GETFL);
+	if (flags != -1)
+		fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 
 	client->source = source;
-	source->refcount++;
 	client->event_source =
 		wl_event_loop_add_fd(loop, fd, WL_EVENT_WRITABLE,
 				     clipboard_client_data, client);
+	if (client->event_source == NULL) {
+		close(fd);
+		free(client);
+		return;
+	}
+
+	source->refcount++;
+	wl_list_insert(&source->client_list, &client->link);
 }
 
 static void
@@ -82,6 +82,7 @@
 #define MAX_FREERDP_FDS 32
 #define DEFAULT_AXIS_STEP_DISTANCE 10
 #define RDP_MODE_FREQ 60 * 1000
+#define RDP_TILE_SIZE 64
 
 
 struct rdp_output;
@@ -106,11 +107,28 @@ enum peer_item_flags {
 	RDP_PEER_OUTPUT_ENABLED = (1 << 1),
 };
 
+/* Content hashes of the RDP_TILE_SIZE x RDP_TILE_SIZE tiles of a frame */
+struct rdp_tile_cache {
+	int width, height; /* in tiles */
+	uint64_t *hash;
+};
+
 struct rdp_peers_item {
 	int flags;
 	freerdp_peer *peer;
 	struct weston_seat seat;
 
+	/* what was last sent to this peer */
+	struct rdp_tile_cache tiles;
+	uint64_t tiles_sent;
+	uint64_t tiles_skipped;
+
+	/* frame acknowledge flow control */
+	pixman_region32_t pending_damage;
+	uint32_t frame_id; /* last frame sent */
+	uint32_t acked_frame_id;
+	uint32_t max_frames_in_flight; /* 0 if the peer does not acknowledge */
+
 	struct wl_list link;
 };
 
@@ -119,6 +137,11 @@ struct rdp_output {
 	struct wl_event_source *finish_frame_timer;
 	pixman_image_t *shadow_surface;
 
+	/* what the shadow surface currently holds, not kept up to date
+	 * while there are no peers */
+	struct rdp_tile_cache tiles;
+	bool tiles_stale;
+
 	struct wl_list peers;
 };
 
@@ -263,10 +286,6 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 	if (!nrects)
 		return;
 
-	marker->frameId++;
-	marker->frameAction = SURFACECMD_FRAMEACTION_BEGIN;
-	update->SurfaceFrameMarker(peer->context, marker);
-
 	memset(cmd, 0, sizeof(*cmd));
 	cmd->bpp = 32;
 	cmd->codecID = 0;
@@ -302,9 +321,182 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 			   top += cmd->height;
 		}
 	}
+}
 
-	marker->frameAction = SURFACECMD_FRAMEACTION_END;
-	update->SurfaceFrameMarker(peer->context, marker);
+static int
+rdp_tile_cache_resize(struct rdp_tile_cache *cache, int width, int height)
+{
+	int tw = (width + RDP_TILE_SIZE - 1) / RDP_TILE_SIZE;
+	int th = (height + RDP_TILE_SIZE - 1) / RDP_TILE_SIZE;
+	uint64_t *hash;
+
+	if (cache->hash && cache->width == tw && cache->height == th)
+		return 0;
+
+	hash = calloc(tw * th, sizeof *hash);
+	if (!hash)
+		return -1;
+
+	free(cache->hash);
+	cache->hash = hash;
+	cache->width = tw;
+	cache->height = th;
+	return 0;
+}
+
+static void
+rdp_tile_cache_release(struct rdp_tile_cache *cache)
+{
+	free(cache->hash);
+	cache->hash = NULL;
+	cache->width = cache->height = 0;
+}
+
+static void
+rdp_tile_box(int tx, int ty, pixman_image_t *image, pixman_box32_t *box)
+{
+	box->x1 = tx * RDP_TILE_SIZE;
+	box->y1 = ty * RDP_TILE_SIZE;
+	box->x2 = MIN(box->x1 + RDP_TILE_SIZE, pixman_image_get_width(image));
+	box->y2 = MIN(box->y1 + RDP_TILE_SIZE, pixman_image_get_height(image));
+}
+
+/* 64-bit FNV-1a, one pixel at a time */
+static uint64_t
+rdp_tile_hash(pixman_image_t *image, const pixman_box32_t *box)
+{
+	int stride = pixman_image_get_stride(image) / sizeof(uint32_t);
+	const uint32_t *row = pixman_image_get_data(image) +
+			box->y1 * stride + box->x1;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	int x, y;
+
+	for (y = box->y1; y < box->y2; y++, row += stride) {
+		for (x = 0; x < box->x2 - box->x1; x++) {
+			h ^= row[x];
+			h *= 0x100000001b3ULL;
+		}
+	}
+
+	return h;
+}
+
+/* Recompute the output tile hashes for every tile touched by region. */
+static void
+rdp_output_hash_tiles(struct rdp_output *output, pixman_region32_t *region)
+{
+	struct rdp_tile_cache *cache = &output->tiles;
+	pixman_box32_t *extents = pixman_region32_extents(region);
+	pixman_box32_t box;
+	int tx, ty;
+
+	for (ty = extents->y1 / RDP_TILE_SIZE;
+	     ty < cache->height && ty * RDP_TILE_SIZE < extents->y2; ty++) {
+		for (tx = extents->x1 / RDP_TILE_SIZE;
+		     tx < cache->width && tx * RDP_TILE_SIZE < extents->x2; tx++) {
+			rdp_tile_box(tx, ty, output->shadow_surface, &box);
+			if (pixman_region32_contains_rectangle(region, &box) ==
+			    PIXMAN_REGION_OUT)
+				continue;
+
+			cache->hash[ty * cache->width + tx] =
+				rdp_tile_hash(output->shadow_surface, &box);
+		}
+	}
+}
+
+static void
+rdp_output_hash_all_tiles(struct rdp_output *output)
+{
+	pixman_region32_t all;
+
+	pixman_region32_init_rect(&all, 0, 0,
+				  pixman_image_get_width(output->shadow_surface),
+				  pixman_image_get_height(output->shadow_surface));
+	rdp_output_hash_tiles(output, &all);
+	pixman_region32_fini(&all);
+
+	output->tiles_stale = false;
+}
+
+static void
+rdp_output_update_tiles(struct rdp_output *output, pixman_region32_t *damage)
+{
+	if (output->tiles_stale)
+		rdp_output_hash_all_tiles(output);
+	else
+		rdp_output_hash_tiles(output, damage);
+}
+
+/* The peer has just been sent the whole shadow surface. */
+static void
+rdp_peer_sync_tiles(struct rdp_peers_item *item, struct rdp_output *output)
+{
+	struct rdp_tile_cache *cache = &output->tiles;
+
+	if (output->tiles_stale)
+		rdp_output_hash_all_tiles(output);
+
+	if (rdp_tile_cache_resize(&item->tiles,
+				  pixman_image_get_width(output->shadow_surface),
+				  pixman_image_get_height(output->shadow_surface)) < 0)
+		return;
+
+	memcpy(item->tiles.hash, cache->hash,
+	       cache->width * cache->height * sizeof *cache->hash);
+}
+
+/* Compute in out the part of damage which the peer does not have yet,
+ * dropping tiles whose content did not change since they were last sent.
+ * The output tile hashes must be up to date for damage.
+ */
+static void
+rdp_peer_filter_damage(struct rdp_peers_item *item, struct rdp_output *output,
+		       pixman_region32_t *damage, pixman_region32_t *out)
+{
+	struct rdp_tile_cache *cache = &output->tiles;
+	pixman_box32_t *extents = pixman_region32_extents(damage);
+	pixman_box32_t box;
+	uint64_t *sent;
+	int tx, ty, i;
+
+	if (!item->tiles.hash || item->tiles.width != cache->width ||
+	    item->tiles.height != cache->height) {
+		/* no usable history: send everything, and remember it */
+		pixman_region32_fini(out);
+		pixman_region32_init_rect(out, 0, 0,
+					  pixman_image_get_width(output->shadow_surface),
+					  pixman_image_get_height(output->shadow_surface));
+		rdp_peer_sync_tiles(item, output);
+		return;
+	}
+
+	pixman_region32_clear(out);
+	for (ty = extents->y1 / RDP_TILE_SIZE;
+	     ty < cache->height && ty * RDP_TILE_SIZE < extents->y2; ty++) {
+		for (tx = extents->x1 / RDP_TILE_SIZE;
+		     tx < cache->width && tx * RDP_TILE_SIZE < extents->x2; tx++) {
+			rdp_tile_box(tx, ty, output->shadow_surface, &box);
+			if (pixman_region32_contains_rectangle(damage, &box) ==
+			    PIXMAN_REGION_OUT)
+				continue;
+
+			i = ty * cache->width + tx;
+			sent = &item->tiles.hash[i];
+			if (*sent == cache->hash[i]) {
+				item->tiles_skipped++;
+				continue;
+			}
+
+			*sent = cache->hash[i];
+			item->tiles_sent++;
+			pixman_region32_union_rect(out, out, box.x1, box.y1,
+						   box.x2 - box.x1,
+						   box.y2 - box.y1);
+		}
+	}
+
+	pixman_region32_intersect(out, out, damage);
 }
 
 static void
@@ -313,6 +505,12 @@ rdp_peer_refresh_region(pixman_region32_t *region, freerdp_peer *peer)
 	RdpPeerContext *context = (RdpPeerContext *)peer->context;
 	struct rdp_output *output = context->rdpBackend->output;
 	rdpSettings *settings = peer->settings;
+	rdpUpdate *update = peer->update;
+	SURFACE_FRAME_MARKER *marker = &update->surface_frame_marker;
+
+	marker->frameId = ++context->item.frame_id;
+	marker->frameAction = SURFACECMD_FRAMEACTION_BEGIN;
+	update->SurfaceFrameMarker(peer->context, marker);
 
 	if (settings->RemoteFxCodec)
 		rdp_peer_refresh_rfx(region, output->shadow_surface, peer);
@@ -320,6 +518,52 @@ rdp_peer_refresh_region(pixman_region32_t *region, freerdp_peer *peer)
 		rdp_peer_refresh_nsc(region, output->shadow_surface, peer);
 	else
 		rdp_peer_refresh_raw(region, output->shadow_surface, peer);
+
+	marker->frameAction = SURFACECMD_FRAMEACTION_END;
+	update->SurfaceFrameMarker(peer->context, marker);
+}
+
+static bool
+rdp_peer_can_send(struct rdp_peers_item *item)
+{
+	if (!(item->flags & RDP_PEER_ACTIVATED) ||
+	    !(item->flags & RDP_PEER_OUTPUT_ENABLED))
+		return false;
+
+	if (!item->max_frames_in_flight)
+		return true;
+
+	return item->frame_id - item->acked_frame_id <
+		item->max_frames_in_flight;
+}
+
+/* Send the damage accumulated for this peer, unless it still has too many
+ * frames to acknowledge. The shadow surface always holds the newest frame,
+ * so a peer which fell behind skips straight to it.
+ */
+static void
+rdp_peer_flush_damage(struct rdp_peers_item *item)
+{
+	if (!pixman_region32_not_empty(&item->pending_damage) ||
+	    !rdp_peer_can_send(item))
+		return;
+
+	rdp_peer_refresh_region(&item->pending_damage, item->peer);
+	pixman_region32_clear(&item->pending_damage);
+}
+
+static void
+rdp_peer_refresh_full(freerdp_peer *peer)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	struct rdp_output *output = context->rdpBackend->output;
+
+	/* goes through the frame accounting like any other update */
+	pixman_region32_union_rect(&context->item.pending_damage,
+				   &context->item.pending_damage, 0, 0,
+				   output->base.width, output->base.height);
+	rdp_peer_sync_tiles(&context->item, output);
+	rdp_peer_flush_damage(&context->item);
 }
 
 static void
@@ -337,18 +581,33 @@ rdp_output_repaint(struct weston_output *output_base, pixman_region32_t *damage)
 	struct rdp_output *output = container_of(output_base, struct rdp_output, base);
 	struct weston_compositor *ec = output->base.compositor;
 	struct rdp_peers_item *outputPeer;
+	pixman_region32_t peer_damage;
 
 	pixman_renderer_output_set_buffer(output_base, output->shadow_surface);
 	ec->renderer->repaint_output(&output->base, damage);
 
-	if (pixman_region32_not_empty(damage)) {
+	if (wl_list_empty(&output->peers)) {
+		/* nobody to compare against, hash everything once a
+		 * peer shows up */
+		output->tiles_stale = true;
+	} else if (pixman_region32_not_empty(damage)) {
+		rdp_output_update_tiles(output, damage);
+
+		pixman_region32_init(&peer_damage);
 		wl_list_for_each(outputPeer, &output->peers, link) {
-			if ((outputPeer->flags & RDP_PEER_ACTIVATED) &&
-					(outputPeer->flags & RDP_PEER_OUTPUT_ENABLED))
-			{
-				rdp_peer_refresh_region(damage, outputPeer->peer);
-			}
+			if (!(outputPeer->flags & RDP_PEER_ACTIVATED))
+				continue;
+
+			/* peers which are behind or suppressed accumulate
+			 * damage until they can take the next frame */
+			rdp_peer_filter_damage(outputPeer, output, damage,
+					       &peer_damage);
+			pixman_region32_union(&outputPeer->pending_damage,
+					      &outputPeer->pending_damage,
+					      &peer_damage);
+			rdp_peer_flush_damage(outputPeer);
 		}
+		pixman_region32_fini(&peer_damage);
 	}
 
 	pixman_region32_subtract(&ec->primary_plane.damage,
@@ -364,6 +623,7 @@ rdp_output_destroy(struct weston_output *output_base)
 	struct rdp_output *output = (struct rdp_output *)output_base;
 
 	wl_event_source_remove(output->finish_frame_timer);
+	rdp_tile_cache_release(&output->tiles);
 	free(output);
 }
 
@@ -413,6 +673,7 @@ rdp_switch_mode(struct weston_output *output, struct weston_mode *target_mode)
 	struct rdp_peers_item *rdpPeer;
 	rdpSettings *settings;
 	pixman_image_t *new_shadow_buffer;
+	struct rdp_tile_cache new_tiles = { 0 };
 	struct weston_mode *local_mode;
 
 	local_mode = ensure_matching_mode(output, target_mode);
@@ -424,6 +685,21 @@ rdp_switch_mode(struct weston_output *output, struct weston_mode *target_mode)
 	if (local_mode == output->current_mode)
 		return 0;
 
+	/* Allocate everything first, so a failure leaves the old mode */
+	new_shadow_buffer = pixman_image_create_bits(PIXMAN_x8r8g8b8, target_mode->width,
+			target_mode->height, 0, target_mode->width * 4);
+	if (!new_shadow_buffer) {
+		weston_log("failed to allocate RDP shadow surface\n");
+		return -ENOMEM;
+	}
+
+	if (rdp_tile_cache_resize(&new_tiles, target_mode->width,
+				  target_mode->height) < 0) {
+		weston_log("failed to allocate RDP tile cache\n");
+		pixman_image_unref(new_shadow_buffer);
+		return -ENOMEM;
+	}
+
 	output->current_mode->flags &= ~WL_OUTPUT_MODE_CURRENT;
 
 	output->current_mode = local_mode;
@@ -432,13 +708,15 @@ rdp_switch_mode(struct weston_output *output, struct weston_mode *target_mode)
 	pixman_renderer_output_destroy(output);
 	pixman_renderer_output_create(output);
 
-	new_shadow_buffer = pixman_image_create_bits(PIXMAN_x8r8g8b8, target_mode->width,
-			target_mode->height, 0, target_mode->width * 4);
 	pixman_image_composite32(PIXMAN_OP_SRC, rdpOutput->shadow_surface, 0, new_shadow_buffer,
 			0, 0, 0, 0, 0, 0, target_mode->width, target_mode->height);
 	pixman_image_unref(rdpOutput->shadow_surface);
 	rdpOutput->shadow_surface = new_shadow_buffer;
 
+	rdp_tile_cache_release(&rdpOutput->tiles);
+	rdpOutput->tiles = new_tiles;
+	rdp_output_hash_all_tiles(rdpOutput);
+
 	wl_list_for_each(rdpPeer, &rdpOutput->peers, link) {
 		settings = rdpPeer->peer->settings;
 		if (settings->DesktopWidth == (UINT32)target_mode->width &&
@@ -496,8 +774,12 @@ rdp_backend_create_output(struct rdp_backend *b, int width, int height)
 		goto out_output;
 	}
 
-	if (pixman_renderer_output_create(&output->base) < 0)
+	if (rdp_tile_cache_resize(&output->tiles, width, height) < 0)
 		goto out_shadow_surface;
+	rdp_output_hash_all_tiles(output);
+
+	if (pixman_renderer_output_create(&output->base) < 0)
+		goto out_tiles;
 
 	loop = wl_display_get_event_loop(b->compositor->wl_display);
 	output->finish_frame_timer = wl_event_loop_add_timer(loop, finish_frame_handler, output);
@@ -514,6 +796,8 @@ rdp_backend_create_output(struct rdp_backend *b, int width, int height)
 	weston_compositor_add_output(b->compositor, &output->base);
 	return 0;
 
+out_tiles:
+	rdp_tile_cache_release(&output->tiles);
 out_shadow_surface:
 	pixman_image_unref(output->shadow_surface);
 out_output:
@@ -617,6 +901,8 @@ rdp_peer_context_new(freerdp_peer* client, RdpPeerContext* context)
 	if (!context->encode_stream)
 		goto out_error_stream;
 
+	pixman_region32_init(&context->item.pending_damage);
+
 	FREERDP_CB_RETURN(TRUE);
 
 out_error_nsc:
@@ -645,6 +931,14 @@ rdp_peer_context_free(freerdp_peer* client, RdpPeerContext* context)
 		weston_seat_release(&context->item.seat);
 	}
 
+	if (context->item.tiles_sent || context->item.tiles_skipped)
+		weston_log("RDP peer %p: %llu tiles sent, %llu unchanged tiles skipped\n",
+			   client,
+			   (unsigned long long)context->item.tiles_sent,
+			   (unsigned long long)context->item.tiles_skipped);
+	rdp_tile_cache_release(&context->item.tiles);
+	pixman_region32_fini(&context->item.pending_damage);
+
 	Stream_Free(context->encode_stream, TRUE);
 	nsc_context_free(context->nsc_context);
 	rfx_context_free(context->rfx_context);
@@ -823,8 +1117,6 @@ xf_peer_activate(freerdp_peer* client)
 	struct xkb_keymap *keymap;
 	struct weston_output *weston_output;
 	int i;
-	pixman_box32_t box;
-	pixman_region32_t damage;
 	char seat_name[50];
 
 
@@ -917,21 +1209,25 @@ xf_peer_activate(freerdp_peer* client)
 
 	peersItem->flags |= RDP_PEER_ACTIVATED;
 
+	/* number of unacknowledged frames the peer accepts, 0 if the peer
+	 * did not advertise the frame acknowledge capability; FrameAcknowledge
+	 * keeps its non-zero default when the capability set is missing */
+	if (settings->ReceivedCapabilities[CAPSET_TYPE_FRAME_ACKNOWLEDGE])
+		peersItem->max_frames_in_flight = settings->FrameAcknowledge;
+	else
+		peersItem->max_frames_in_flight = 0;
+	peersItem->acked_frame_id = peersItem->frame_id;
+	if (peersItem->max_frames_in_flight)
+		weston_log("%s: peer acknowledges frames, %u in flight at most\n",
+			   __FUNCTION__, peersItem->max_frames_in_flight);
+
 	/* disable pointer on the client side */
 	pointer = client->update->pointer;
 	pointer->pointer_system.type = SYSPTR_NULL;
 	pointer->PointerSystem(client->context, &pointer->pointer_system);
 
 	/* sends a full refresh */
-	box.x1 = 0;
-	box.y1 = 0;
-	box.x2 = output->base.width;
-	box.y2 = output->base.height;
-	pixman_region32_init_with_extents(&damage, &box);
-
-	rdp_peer_refresh_region(&damage, client);
-
-	pixman_region32_fini(&damage);
+	rdp_peer_refresh_full(client);
 
 	return TRUE;
 }
@@ -1022,21 +1318,10 @@ static FREERDP_CB_RET_TYPE
 xf_input_synchronize_event(rdpInput *input, UINT32 flags)
 {
 	freerdp_peer *client = input->context->peer;
-	RdpPeerContext *peerCtx = (RdpPeerContext *)input->context;
-	struct rdp_output *output = peerCtx->rdpBackend->output;
-	pixman_box32_t box;
-	pixman_region32_t damage;
 
 	/* sends a full refresh */
-	box.x1 = 0;
-	box.y1 = 0;
-	box.x2 = output->base.width;
-	box.y2 = output->base.height;
-	pixman_region32_init_with_extents(&damage, &box);
+	rdp_peer_refresh_full(client);
 
-	rdp_peer_refresh_region(&damage, client);
-
-	pixman_region32_fini(&damage);
 	FREERDP_CB_RETURN(TRUE);
 }
 
@@ -1093,10 +1378,23 @@ xf_suppress_output(rdpContext *context, BYTE allow, RECTANGLE_16 *area)
 {
 	RdpPeerContext *peerContext = (RdpPeerContext *)context;
 
-	if (allow)
+	if (allow) {
 		peerContext->item.flags |= RDP_PEER_OUTPUT_ENABLED;
-	else
+		rdp_peer_flush_damage(&peerContext->item);
+	} else {
 		peerContext->item.flags &= (~RDP_PEER_OUTPUT_ENABLED);
+	}
+
+	FREERDP_CB_RETURN(TRUE);
+}
+
+static FREERDP_CB_RET_TYPE
+xf_surface_frame_acknowledge(rdpContext *context, UINT32 frameId)
+{
+	RdpPeerContext *peerContext = (RdpPeerContext *)context;
+
+	peerContext->item.acked_frame_id = frameId;
+	rdp_peer_flush_damage(&peerContext->item);
 
 	FREERDP_CB_RETURN(TRUE);
 }
@@ -1151,6 +1449,7 @@ rdp_peer_init(freerdp_peer *client, struct rdp_backend *b)
 	client->Activate = xf_peer_activate;
 
 	client->update->SuppressOutput = xf_suppress_output;
+	client->update->SurfaceFrameAcknowledge = xf_surface_frame_acknowledge;
 
 	input = client->input;
 	input->SynchronizeEvent = xf_input_synchronize_event;
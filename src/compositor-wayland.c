@@ -30,6 +30,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <math.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
@@ -48,11 +50,18 @@
 #include "shared/os-compatibility.h"
 #include "shared/cairo-util.h"
 #include "fullscreen-shell-unstable-v1-client-protocol.h"
+#include "linux-dmabuf-unstable-v1-client-protocol.h"
 #include "presentation-time-server-protocol.h"
 #include "linux-dmabuf.h"
 
 #define WINDOW_TITLE "Weston Compositor"
 
+/* Smallest size class of the SHM buffer pool */
+#define WAYLAND_SHM_MIN_SLOT (64 * 1024)
+
+/* Most views forwarded to the parent compositor per output */
+#define WAYLAND_MAX_PLANES 4
+
 struct wayland_backend {
 	struct weston_backend base;
 	struct weston_compositor *compositor;
@@ -64,6 +73,8 @@ struct wayland_backend {
 		struct wl_shell *shell;
 		struct zwp_fullscreen_shell_v1 *fshell;
 		struct wl_shm *shm;
+		struct wl_subcompositor *subcompositor;
+		struct zwp_linux_dmabuf_v1 *dmabuf;
 
 		struct wl_list output_list;
 
@@ -73,6 +84,7 @@ struct wayland_backend {
 
 	int use_pixman;
 	int sprawl_across_outputs;
+	int passthrough;
 
 	struct theme *theme;
 	cairo_device_t *frame_device;
@@ -114,8 +126,17 @@ struct wayland_output {
 	struct {
 		struct wl_list buffers;
 		struct wl_list free_buffers;
+		struct wayland_shm_pool *pool;
+
+		/* decoration rendered at the current frame size, copied
+		 * into every new buffer instead of redrawing the frame */
+		cairo_surface_t *border;
 	} shm;
 
+	/* views forwarded to the parent as subsurfaces, in stacking
+	 * order from the top */
+	struct wl_list planes;
+
 	struct weston_mode mode;
 	uint32_t scale;
 };
@@ -143,11 +164,37 @@ struct wayland_parent_output {
 	struct weston_mode *current_mode;
 };
 
+/*
+ * All SHM buffers of an output are carved from a single anonymous file.
+ * The file is split in page aligned slots whose size is rounded up to a
+ * size class, and slots of released buffers are reused for later
+ * buffers, also across resizes. Adjacent free slots are merged, and free
+ * space at the end of the file is given back.
+ */
+struct wayland_shm_pool {
+	int fd;
+	struct wl_shm_pool *pool;
+	size_t size; /* of the file */
+	size_t pool_size; /* of the wl_shm_pool, which cannot shrink */
+	struct wl_list free_slots; /* sorted by offset */
+};
+
+struct wayland_shm_slot {
+	struct wayland_shm_pool *pool;
+	struct wl_list link;
+
+	off_t offset;
+	size_t size;
+	void *data; /* NULL while the slot is free */
+	int used;
+};
+
 struct wayland_shm_buffer {
 	struct wayland_output *output;
 	struct wl_list link;
 	struct wl_list free_link;
 
+	struct wayland_shm_slot *slot;
 	struct wl_buffer *buffer;
 	void *data;
 	size_t size;
@@ -158,6 +205,56 @@ struct wayland_shm_buffer {
 	cairo_surface_t *c_surface;
 };
 
+/* Copy of a client SHM buffer shown in a plane */
+struct wayland_plane_buffer {
+	struct wayland_plane *plane;
+	struct wl_list link;
+
+	struct wayland_shm_slot *slot;
+	struct wl_buffer *buffer;
+	int32_t width, height, stride;
+	uint32_t format;
+	int busy;
+
+	/* not copied into this buffer yet, in buffer coordinates */
+	pixman_region32_t damage;
+};
+
+/*
+ * In passthrough mode, a view which the parent compositor can show as is
+ * goes to a plane instead of being composited into the output buffer.
+ * Each plane is a subsurface of the output surface in the parent.
+ */
+struct wayland_plane {
+	struct weston_plane base;
+	struct wayland_output *output;
+	struct wl_list link;
+
+	struct wl_surface *surface;
+	struct wl_subsurface *subsurface;
+	int mapped;
+
+	/* assigned for the current repaint */
+	struct weston_view *view;
+	struct weston_buffer_reference buffer_ref;
+	struct wayland_plane_buffer *shm_attach;
+	pixman_region32_t shm_damage; /* of shm_attach */
+
+	struct wl_list shm_buffers;
+	struct wayland_plane_buffer *shm_current; /* shown by the parent */
+};
+
+/* Parent compositor wl_buffer of a client dmabuf, kept for the lifetime
+ * of the client buffer */
+struct wayland_dmabuf_import {
+	struct wl_listener destroy_listener;
+	struct zwp_linux_buffer_params_v1 *params;
+	struct wl_buffer *buffer; /* NULL until created, or if it failed */
+
+	/* held while the parent uses the buffer */
+	struct weston_buffer_reference ref;
+};
+
 struct wayland_input {
 	struct weston_seat base;
 	struct wayland_backend *backend;
@@ -192,6 +289,250 @@ struct wayland_input {
 
 struct gl_renderer_interface *gl_renderer;
 
+static size_t
+wayland_shm_slot_size_class(size_t size)
+{
+	size_t p = WAYLAND_SHM_MIN_SLOT;
+	size_t page_size = sysconf(_SC_PAGESIZE);
+
+	if (size <= p)
+		return (p + page_size - 1) & ~(page_size - 1);
+
+	/* Round up to a quarter of the power of two below, so that
+	 * interactive resizes keep hitting the same slots while wasting
+	 * at most 25% of a slot. Slots stay page aligned, as they are
+	 * mapped on their own. */
+	while (p * 2 <= size)
+		p *= 2;
+	p /= 4;
+	if (p < page_size)
+		p = page_size;
+
+	return (size + p - 1) & ~(p - 1);
+}
+
+static struct wayland_shm_slot *
+wayland_shm_slot_create(struct wayland_shm_pool *pool,
+			off_t offset, size_t size, int used)
+{
+	struct wayland_shm_slot *slot;
+
+	slot = zalloc(sizeof *slot);
+	if (!slot)
+		return NULL;
+
+	slot->pool = pool;
+	slot->offset = offset;
+	slot->size = size;
+	slot->used = used;
+	wl_list_init(&slot->link);
+
+	return slot;
+}
+
+static struct wayland_shm_pool *
+wayland_shm_pool_create(struct wl_shm *shm, size_t size)
+{
+	struct wayland_shm_pool *pool;
+	struct wayland_shm_slot *slot;
+
+	pool = zalloc(sizeof *pool);
+	if (!pool)
+		return NULL;
+
+	pool->fd = os_create_anonymous_file(size);
+	if (pool->fd < 0) {
+		weston_log("could not create an anonymous file buffer: %m\n");
+		free(pool);
+		return NULL;
+	}
+
+	pool->size = size;
+	pool->pool_size = size;
+	wl_list_init(&pool->free_slots);
+
+	slot = wayland_shm_slot_create(pool, 0, size, 0);
+	if (!slot)
+		goto err_fd;
+	wl_list_insert(&pool->free_slots, &slot->link);
+
+	pool->pool = wl_shm_create_pool(shm, pool->fd, size);
+	if (!pool->pool) {
+		weston_log("could not create a wl_shm_pool\n");
+		free(slot);
+		goto err_fd;
+	}
+
+	return pool;
+
+err_fd:
+	close(pool->fd);
+	free(pool);
+	return NULL;
+}
+
+static void
+wayland_shm_pool_destroy(struct wayland_shm_pool *pool)
+{
+	struct wayland_shm_slot *slot, *next;
+
+	wl_list_for_each_safe(slot, next, &pool->free_slots, link)
+		free(slot);
+
+	wl_shm_pool_destroy(pool->pool);
+	close(pool->fd);
+	free(pool);
+}
+
+static int
+wayland_shm_pool_grow(struct wayland_shm_pool *pool, size_t size)
+{
+	int ret;
+
+#ifdef HAVE_POSIX_FALLOCATE
+	ret = posix_fallocate(pool->fd, pool->size, size);
+	if (ret != 0) {
+		errno = ret;
+		return -1;
+	}
+#else
+	ret = ftruncate(pool->fd, pool->size + size);
+	if (ret < 0)
+		return -1;
+#endif
+
+	pool->size += size;
+	if (pool->size > pool->pool_size) {
+		pool->pool_size = pool->size;
+		wl_shm_pool_resize(pool->pool, pool->pool_size);
+	}
+
+	return 0;
+}
+
+/* Give back the free space at the end of the file. The parent keeps the
+ * wl_shm_pool at its largest size, but no buffer lives past the end of
+ * the file, so it never touches the missing pages. */
+static void
+wayland_shm_pool_trim(struct wayland_shm_pool *pool)
+{
+	struct wayland_shm_slot *last;
+
+	if (wl_list_empty(&pool->free_slots))
+		return;
+
+	last = container_of(pool->free_slots.prev,
+			    struct wayland_shm_slot, link);
+	if (last->offset + last->size != pool->size ||
+	    ftruncate(pool->fd, last->offset) < 0)
+		return;
+
+	pool->size = last->offset;
+	wl_list_remove(&last->link);
+	free(last);
+}
+
+/* Return the slot to the free list, merging it with its free neighbours */
+static void
+wayland_shm_slot_release(struct wayland_shm_slot *slot)
+{
+	struct wayland_shm_pool *pool = slot->pool;
+	struct wayland_shm_slot *prev = NULL, *next;
+	struct wl_list *pos = &pool->free_slots;
+
+	if (slot->data) {
+		munmap(slot->data, slot->size);
+		slot->data = NULL;
+		slot->used = 1;
+	}
+
+	wl_list_for_each(next, &pool->free_slots, link) {
+		if (next->offset > slot->offset)
+			break;
+		prev = next;
+		pos = &next->link;
+	}
+	wl_list_insert(pos, &slot->link);
+
+	if (slot->link.next != &pool->free_slots) {
+		next = container_of(slot->link.next,
+				    struct wayland_shm_slot, link);
+		if (slot->offset + (off_t) slot->size == next->offset) {
+			slot->size += next->size;
+			slot->used |= next->used;
+			wl_list_remove(&next->link);
+			free(next);
+		}
+	}
+
+	if (prev && prev->offset + (off_t) prev->size == slot->offset) {
+		prev->size += slot->size;
+		prev->used |= slot->used;
+		wl_list_remove(&slot->link);
+		free(slot);
+	}
+
+	wayland_shm_pool_trim(pool);
+}
+
+/* Find the smallest free slot which holds size bytes, or carve a new one
+ * at the end of the pool. A slot much larger than needed is split. */
+static struct wayland_shm_slot *
+wayland_shm_pool_get_slot(struct wayland_shm_pool *pool, size_t size)
+{
+	struct wayland_shm_slot *slot, *best = NULL, *rest;
+	size_t slot_size = wayland_shm_slot_size_class(size);
+	off_t offset;
+
+	wl_list_for_each(slot, &pool->free_slots, link) {
+		if (slot->size >= slot_size &&
+		    (!best || slot->size < best->size))
+			best = slot;
+	}
+
+	if (best && best->size > slot_size * 2) {
+		rest = wayland_shm_slot_create(pool,
+					       best->offset + slot_size,
+					       best->size - slot_size,
+					       best->used);
+		if (!rest)
+			return NULL;
+		wl_list_insert(&best->link, &rest->link);
+		best->size = slot_size;
+	}
+
+	if (best) {
+		wl_list_remove(&best->link);
+		wl_list_init(&best->link);
+		slot = best;
+	} else {
+		offset = pool->size;
+		if (wayland_shm_pool_grow(pool, slot_size) < 0) {
+			weston_log("could not grow the shm pool by %zu bytes: %m\n",
+				   slot_size);
+			return NULL;
+		}
+
+		slot = wayland_shm_slot_create(pool, offset, slot_size, 0);
+		if (!slot) {
+			wayland_shm_pool_trim(pool);
+			return NULL;
+		}
+	}
+
+	slot->data = mmap(NULL, slot->size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED, pool->fd, slot->offset);
+	if (slot->data == MAP_FAILED) {
+		weston_log("could not mmap %zu memory for data: %m\n",
+			   slot->size);
+		slot->data = NULL;
+		wayland_shm_slot_release(slot);
+		return NULL;
+	}
+
+	return slot;
+}
+
 static void
 wayland_shm_buffer_destroy(struct wayland_shm_buffer *buffer)
 {
@@ -199,7 +540,7 @@ wayland_shm_buffer_destroy(struct wayland_shm_buffer *buffer)
 	pixman_image_unref(buffer->pm_image);
 
 	wl_buffer_destroy(buffer->buffer);
-	munmap(buffer->data, buffer->size);
+	wayland_shm_slot_release(buffer->slot);
 
 	pixman_region32_fini(&buffer->damage);
 
@@ -229,13 +570,10 @@ wayland_output_get_shm_buffer(struct wayland_output *output)
 {
 	struct wayland_backend *b =
 		(struct wayland_backend *) output->base.compositor->backend;
-	struct wl_shm *shm = b->parent.shm;
 	struct wayland_shm_buffer *sb;
-
-	struct wl_shm_pool *pool;
+	struct wayland_shm_slot *slot;
 	int width, height, stride;
 	int32_t fx, fy;
-	int fd;
 	unsigned char *data;
 
 	if (!wl_list_empty(&output->shm.free_buffers)) {
@@ -257,28 +595,28 @@ wayland_output_get_shm_buffer(struct wayland_output *output)
 
 	stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, width);
 
-	fd = os_create_anonymous_file(height * stride);
-	if (fd < 0) {
-		weston_log("could not create an anonymous file buffer: %m\n");
-		return NULL;
+	if (!output->shm.pool) {
+		output->shm.pool =
+			wayland_shm_pool_create(b->parent.shm,
+						wayland_shm_slot_size_class(height * stride));
+		if (!output->shm.pool)
+			return NULL;
 	}
 
-	data = mmap(NULL, height * stride, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (data == MAP_FAILED) {
-		weston_log("could not mmap %d memory for data: %m\n", height * stride);
-		close(fd);
+	slot = wayland_shm_pool_get_slot(output->shm.pool, height * stride);
+	if (!slot)
 		return NULL;
-	}
+	data = slot->data;
 
 	sb = zalloc(sizeof *sb);
 	if (sb == NULL) {
 		weston_log("could not zalloc %zu memory for sb: %m\n", sizeof *sb);
-		close(fd);
-		free(data);
+		wayland_shm_slot_release(slot);
 		return NULL;
 	}
 
 	sb->output = output;
+	sb->slot = slot;
 	wl_list_init(&sb->free_link);
 	wl_list_insert(&output->shm.buffers, &sb->link);
 
@@ -289,17 +627,16 @@ wayland_output_get_shm_buffer(struct wayland_output *output)
 	sb->data = data;
 	sb->size = height * stride;
 
-	pool = wl_shm_create_pool(shm, fd, sb->size);
-
-	sb->buffer = wl_shm_pool_create_buffer(pool, 0,
+	sb->buffer = wl_shm_pool_create_buffer(output->shm.pool->pool,
+					       slot->offset,
 					       width, height,
 					       stride,
 					       WL_SHM_FORMAT_ARGB8888);
 	wl_buffer_add_listener(sb->buffer, &buffer_listener, sb);
-	wl_shm_pool_destroy(pool);
-	close(fd);
 
-	memset(data, 0, sb->size);
+	/* Fresh pool memory is already zeroed */
+	if (slot->used)
+		memset(data, 0, sb->size);
 
 	sb->c_surface =
 		cairo_image_surface_create_for_data(data, CAIRO_FORMAT_ARGB32,
@@ -360,6 +697,642 @@ draw_initial_frame(struct wayland_output *output)
 			  output->base.current_mode->height);
 }
 
+static void
+wayland_dmabuf_import_destroy_handler(struct wl_listener *listener, void *data)
+{
+	struct wayland_dmabuf_import *import =
+		container_of(listener, struct wayland_dmabuf_import,
+			     destroy_listener);
+
+	if (import->params)
+		zwp_linux_buffer_params_v1_destroy(import->params);
+	if (import->buffer)
+		wl_buffer_destroy(import->buffer);
+	weston_buffer_reference(&import->ref, NULL);
+	free(import);
+}
+
+static void
+wayland_dmabuf_import_release(void *data, struct wl_buffer *buffer)
+{
+	struct wayland_dmabuf_import *import = data;
+
+	/* The parent is done with it, let the client have it back */
+	weston_buffer_reference(&import->ref, NULL);
+}
+
+static const struct wl_buffer_listener dmabuf_import_buffer_listener = {
+	wayland_dmabuf_import_release
+};
+
+static void
+wayland_dmabuf_import_created(void *data,
+			      struct zwp_linux_buffer_params_v1 *params,
+			      struct wl_buffer *buffer)
+{
+	struct wayland_dmabuf_import *import = data;
+
+	import->buffer = buffer;
+	wl_buffer_add_listener(import->buffer,
+			       &dmabuf_import_buffer_listener, import);
+
+	zwp_linux_buffer_params_v1_destroy(import->params);
+	import->params = NULL;
+}
+
+static void
+wayland_dmabuf_import_failed(void *data,
+			     struct zwp_linux_buffer_params_v1 *params)
+{
+	struct wayland_dmabuf_import *import = data;
+
+	/* Leave the buffer NULL, the view keeps being composited */
+	zwp_linux_buffer_params_v1_destroy(import->params);
+	import->params = NULL;
+}
+
+static const struct zwp_linux_buffer_params_v1_listener dmabuf_params_listener = {
+	wayland_dmabuf_import_created,
+	wayland_dmabuf_import_failed
+};
+
+/* Look up the parent compositor's wl_buffer for a client dmabuf. The
+ * first lookup asks the parent to import the dmabuf and returns an import
+ * without a buffer, the view gets composited until the parent answers. */
+static struct wayland_dmabuf_import *
+wayland_dmabuf_import_get(struct wayland_backend *b,
+			  struct linux_dmabuf_buffer *dmabuf)
+{
+	struct dmabuf_attributes *attributes = &dmabuf->attributes;
+	struct wayland_dmabuf_import *import;
+	struct wl_listener *listener;
+	int i;
+
+	listener = wl_resource_get_destroy_listener(dmabuf->buffer_resource,
+						    wayland_dmabuf_import_destroy_handler);
+	if (listener)
+		return container_of(listener, struct wayland_dmabuf_import,
+				    destroy_listener);
+
+	import = zalloc(sizeof *import);
+	if (!import)
+		return NULL;
+
+	import->params = zwp_linux_dmabuf_v1_create_params(b->parent.dmabuf);
+	for (i = 0; i < attributes->n_planes; i++)
+		zwp_linux_buffer_params_v1_add(import->params,
+					       attributes->fd[i], i,
+					       attributes->offset[i],
+					       attributes->stride[i],
+					       attributes->modifier[i] >> 32,
+					       attributes->modifier[i] & 0xffffffff);
+	zwp_linux_buffer_params_v1_add_listener(import->params,
+						&dmabuf_params_listener,
+						import);
+	zwp_linux_buffer_params_v1_create(import->params,
+					  attributes->width,
+					  attributes->height,
+					  attributes->format,
+					  attributes->flags);
+
+	import->destroy_listener.notify = wayland_dmabuf_import_destroy_handler;
+	wl_resource_add_destroy_listener(dmabuf->buffer_resource,
+					 &import->destroy_listener);
+
+	return import;
+}
+
+static void
+wayland_plane_buffer_destroy(struct wayland_plane_buffer *pb)
+{
+	if (pb->plane->shm_current == pb)
+		pb->plane->shm_current = NULL;
+	if (pb->plane->shm_attach == pb)
+		pb->plane->shm_attach = NULL;
+
+	wl_buffer_destroy(pb->buffer);
+	wayland_shm_slot_release(pb->slot);
+	pixman_region32_fini(&pb->damage);
+	wl_list_remove(&pb->link);
+	free(pb);
+}
+
+static void
+wayland_plane_buffer_release(void *data, struct wl_buffer *buffer)
+{
+	struct wayland_plane_buffer *pb = data;
+
+	pb->busy = 0;
+}
+
+static const struct wl_buffer_listener plane_buffer_listener = {
+	wayland_plane_buffer_release
+};
+
+/* Get an idle SHM buffer of the given size and format for the plane */
+static struct wayland_plane_buffer *
+wayland_plane_get_shm_buffer(struct wayland_plane *plane,
+			     int32_t width, int32_t height,
+			     int32_t stride, uint32_t format)
+{
+	struct wayland_output *output = plane->output;
+	struct wayland_backend *b =
+		(struct wayland_backend *) output->base.compositor->backend;
+	struct wayland_plane_buffer *pb, *next;
+
+	wl_list_for_each_safe(pb, next, &plane->shm_buffers, link) {
+		if (pb->busy)
+			continue;
+		if (pb->width == width && pb->height == height &&
+		    pb->stride == stride && pb->format == format)
+			return pb;
+
+		/* stale size, give the memory back to the pool */
+		wayland_plane_buffer_destroy(pb);
+	}
+
+	if (!output->shm.pool) {
+		output->shm.pool =
+			wayland_shm_pool_create(b->parent.shm,
+						wayland_shm_slot_size_class(height * stride));
+		if (!output->shm.pool)
+			return NULL;
+	}
+
+	pb = zalloc(sizeof *pb);
+	if (!pb)
+		return NULL;
+
+	pb->slot = wayland_shm_pool_get_slot(output->shm.pool, height * stride);
+	if (!pb->slot) {
+		free(pb);
+		return NULL;
+	}
+
+	pb->plane = plane;
+	pb->width = width;
+	pb->height = height;
+	pb->stride = stride;
+	pb->format = format;
+	pixman_region32_init_rect(&pb->damage, 0, 0, width, height);
+	pb->buffer = wl_shm_pool_create_buffer(output->shm.pool->pool,
+					       pb->slot->offset,
+					       width, height, stride, format);
+	wl_buffer_add_listener(pb->buffer, &plane_buffer_listener, pb);
+	wl_list_insert(&plane->shm_buffers, &pb->link);
+
+	return pb;
+}
+
+static void
+wayland_plane_create_parent_surface(struct wayland_plane *plane)
+{
+	struct wayland_output *output = plane->output;
+	struct wayland_backend *b =
+		(struct wayland_backend *) output->base.compositor->backend;
+	struct wl_region *region;
+
+	plane->surface = wl_compositor_create_surface(b->parent.compositor);
+	plane->subsurface =
+		wl_subcompositor_get_subsurface(b->parent.subcompositor,
+						plane->surface,
+						output->parent.surface);
+
+	/* Input always goes to the output surface */
+	region = wl_compositor_create_region(b->parent.compositor);
+	wl_surface_set_input_region(plane->surface, region);
+	wl_region_destroy(region);
+
+	/* wayland_output_update_planes() attaches shm_current again */
+	plane->mapped = 0;
+}
+
+static void
+wayland_plane_destroy_parent_surface(struct wayland_plane *plane)
+{
+	wl_subsurface_destroy(plane->subsurface);
+	wl_surface_destroy(plane->surface);
+}
+
+static struct wayland_plane *
+wayland_plane_create(struct wayland_output *output)
+{
+	struct weston_compositor *ec = output->base.compositor;
+	struct wayland_plane *plane;
+
+	plane = zalloc(sizeof *plane);
+	if (!plane)
+		return NULL;
+
+	plane->output = output;
+	wl_list_init(&plane->shm_buffers);
+	pixman_region32_init(&plane->shm_damage);
+	wayland_plane_create_parent_surface(plane);
+
+	weston_plane_init(&plane->base, ec, 0, 0);
+	weston_compositor_stack_plane(ec, &plane->base, &ec->primary_plane);
+	wl_list_insert(output->planes.prev, &plane->link);
+
+	return plane;
+}
+
+static void
+wayland_plane_destroy(struct wayland_plane *plane)
+{
+	struct weston_compositor *ec = plane->output->base.compositor;
+	struct wayland_plane_buffer *pb, *next;
+	struct weston_view *ev;
+
+	wl_list_for_each(ev, &ec->view_list, link)
+		if (ev->plane == &plane->base)
+			weston_view_move_to_plane(ev, &ec->primary_plane);
+
+	wl_list_for_each_safe(pb, next, &plane->shm_buffers, link)
+		wayland_plane_buffer_destroy(pb);
+
+	weston_buffer_reference(&plane->buffer_ref, NULL);
+	pixman_region32_fini(&plane->shm_damage);
+	wayland_plane_destroy_parent_surface(plane);
+	weston_plane_release(&plane->base);
+	wl_list_remove(&plane->link);
+	free(plane);
+}
+
+static bool
+wayland_output_view_is_passthrough_candidate(struct wayland_output *output,
+					     struct weston_view *ev)
+{
+	struct wayland_backend *b =
+		(struct wayland_backend *) output->base.compositor->backend;
+	struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
+	struct weston_buffer_viewport *viewport = &ev->surface->buffer_viewport;
+	struct linux_dmabuf_buffer *dmabuf;
+	struct wayland_dmabuf_import *import;
+	struct wl_shm_buffer *shm;
+	struct wayland_plane *plane;
+
+	/* The parent composites the buffer as is: no transformation,
+	 * cropping, scaling or translucency */
+	if (ev->output_mask != (1u << output->base.id) ||
+	    ev->transform.enabled || ev->alpha != 1.0f ||
+	    output->base.transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+	    viewport->buffer.transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+	    viewport->buffer.scale != output->base.current_scale ||
+	    viewport->buffer.src_width != wl_fixed_from_int(-1) ||
+	    viewport->surface.width != -1)
+		return false;
+
+	if (pixman_region32_contains_rectangle(&output->base.region,
+					       &ev->transform.boundingbox.extents) !=
+	    PIXMAN_REGION_IN)
+		return false;
+
+	/* The core drops its reference to SHM buffers after a repaint.
+	 * A view which did not commit since can keep its plane, which
+	 * still holds a copy of the buffer. */
+	if (!buffer) {
+		wl_list_for_each(plane, &output->planes, link)
+			if (ev->plane == &plane->base)
+				return plane->shm_current != NULL;
+		return false;
+	}
+
+	shm = wl_shm_buffer_get(buffer->resource);
+	if (shm) {
+		switch (wl_shm_buffer_get_format(shm)) {
+		case WL_SHM_FORMAT_ARGB8888:
+		case WL_SHM_FORMAT_XRGB8888:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	dmabuf = linux_dmabuf_buffer_get(buffer->resource);
+	if (dmabuf && b->parent.dmabuf) {
+		import = wayland_dmabuf_import_get(b, dmabuf);
+		return import && import->buffer;
+	}
+
+	return false;
+}
+
+/* What changed in the view since it was last copied to the plane: the
+ * surface damage of this repaint, and the damage accumulated on the plane
+ * by earlier ones, in buffer coordinates. */
+static void
+wayland_plane_get_view_damage(struct wayland_plane *plane,
+			      struct weston_view *ev, pixman_region32_t *damage)
+{
+	int32_t scale = ev->surface->buffer_viewport.buffer.scale;
+	pixman_box32_t *rects;
+	int32_t vx, vy;
+	float x, y;
+	int i, n;
+
+	weston_view_to_global_float(ev, 0, 0, &x, &y);
+	vx = floorf(x);
+	vy = floorf(y);
+
+	rects = pixman_region32_rectangles(&plane->base.damage, &n);
+	for (i = 0; i < n; i++)
+		pixman_region32_union_rect(damage, damage,
+					   (rects[i].x1 - vx) * scale,
+					   (rects[i].y1 - vy) * scale,
+					   (rects[i].x2 - rects[i].x1) * scale,
+					   (rects[i].y2 - rects[i].y1) * scale);
+
+	rects = pixman_region32_rectangles(&ev->surface->damage, &n);
+	for (i = 0; i < n; i++)
+		pixman_region32_union_rect(damage, damage,
+					   rects[i].x1 * scale,
+					   rects[i].y1 * scale,
+					   (rects[i].x2 - rects[i].x1) * scale,
+					   (rects[i].y2 - rects[i].y1) * scale);
+}
+
+static void
+wayland_plane_buffer_copy(struct wayland_plane_buffer *pb,
+			  struct wl_shm_buffer *shm)
+{
+	uint8_t *src = wl_shm_buffer_get_data(shm);
+	uint8_t *dst = pb->slot->data;
+	pixman_box32_t *rects;
+	int32_t y;
+	int i, n;
+
+	rects = pixman_region32_rectangles(&pb->damage, &n);
+
+	wl_shm_buffer_begin_access(shm);
+	for (i = 0; i < n; i++) {
+		for (y = rects[i].y1; y < rects[i].y2; y++)
+			memcpy(dst + y * pb->stride + rects[i].x1 * 4,
+			       src + y * pb->stride + rects[i].x1 * 4,
+			       (rects[i].x2 - rects[i].x1) * 4);
+	}
+	wl_shm_buffer_end_access(shm);
+
+	pixman_region32_clear(&pb->damage);
+}
+
+/* Copy what changed in the SHM buffer of the view into a buffer the
+ * parent can show. Returns false if the view cannot go to the plane. */
+static bool
+wayland_plane_prepare_shm(struct wayland_plane *plane, struct weston_view *ev)
+{
+	struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
+	struct wayland_plane_buffer *pb, *current = plane->shm_current;
+	struct wl_shm_buffer *shm;
+	pixman_region32_t damage;
+	int32_t width, height, stride;
+	bool on_plane;
+
+	on_plane = ev->plane == &plane->base && current;
+
+	if (!buffer) {
+		/* nothing to copy from, the plane must be up to date */
+		return on_plane &&
+			!pixman_region32_not_empty(&plane->base.damage);
+	}
+
+	shm = wl_shm_buffer_get(buffer->resource);
+	width = wl_shm_buffer_get_width(shm);
+	height = wl_shm_buffer_get_height(shm);
+	stride = wl_shm_buffer_get_stride(shm);
+
+	if (on_plane && (current->width != width ||
+			 current->height != height ||
+			 current->stride != stride ||
+			 current->format != wl_shm_buffer_get_format(shm)))
+		on_plane = false;
+
+	pixman_region32_init(&damage);
+	if (on_plane)
+		wayland_plane_get_view_damage(plane, ev, &damage);
+	else
+		pixman_region32_union_rect(&damage, &damage,
+					   0, 0, width, height);
+	pixman_region32_intersect_rect(&damage, &damage, 0, 0, width, height);
+
+	if (on_plane && !pixman_region32_not_empty(&damage)) {
+		pixman_region32_fini(&damage);
+		return true;
+	}
+
+	pb = wayland_plane_get_shm_buffer(plane, width, height, stride,
+					  wl_shm_buffer_get_format(shm));
+	if (!pb) {
+		pixman_region32_fini(&damage);
+		return false;
+	}
+
+	/* every other buffer misses this update as well */
+	wl_list_for_each(current, &plane->shm_buffers, link)
+		pixman_region32_union(&current->damage, &current->damage,
+				      &damage);
+
+	wayland_plane_buffer_copy(pb, shm);
+
+	plane->shm_attach = pb;
+	pixman_region32_copy(&plane->shm_damage, &damage);
+	pixman_region32_fini(&damage);
+
+	return true;
+}
+
+static bool
+wayland_plane_assign_view(struct wayland_plane *plane, struct weston_view *ev)
+{
+	struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
+
+	/* SHM buffers get copied, dmabufs are handed over */
+	if (!buffer || wl_shm_buffer_get(buffer->resource)) {
+		if (!wayland_plane_prepare_shm(plane, ev))
+			return false;
+		ev->psf_flags = 0;
+	} else {
+		weston_buffer_reference(&plane->buffer_ref, buffer);
+		ev->psf_flags = WP_PRESENTATION_FEEDBACK_KIND_ZERO_COPY;
+	}
+
+	plane->view = ev;
+	return true;
+}
+
+static void
+wayland_output_assign_planes(struct weston_output *output_base)
+{
+	struct wayland_output *output = (struct wayland_output *) output_base;
+	struct weston_compositor *ec = output->base.compositor;
+	struct wayland_backend *b = (struct wayland_backend *) ec->backend;
+	struct weston_plane *primary = &ec->primary_plane;
+	struct wayland_plane *plane;
+	struct weston_buffer *buffer;
+	struct weston_view *ev;
+	struct wl_list *next_plane;
+	pixman_region32_t overlap, surface_overlap;
+	int nplanes = 0;
+
+	wl_list_for_each(plane, &output->planes, link) {
+		plane->view = NULL;
+		plane->shm_attach = NULL;
+	}
+
+	pixman_region32_init(&overlap);
+	next_plane = output->planes.next;
+
+	/* Views are walked top to bottom. A view can only be forwarded if
+	 * nothing composited locally is stacked above it. */
+	wl_list_for_each(ev, &ec->view_list, link) {
+		if (!(ev->output_mask & (1u << output->base.id)))
+			continue;
+
+		/* Keep dmabufs around, they may move to a plane. SHM
+		 * buffers are copied while assigning planes, so they can
+		 * be released early; the pixman renderer keeps its own
+		 * reference anyway. */
+		buffer = ev->surface->buffer_ref.buffer;
+		if (b->use_pixman ||
+		    (buffer && !wl_shm_buffer_get(buffer->resource)))
+			ev->surface->keep_buffer = true;
+		else
+			ev->surface->keep_buffer = false;
+
+		pixman_region32_init(&surface_overlap);
+		pixman_region32_intersect(&surface_overlap, &overlap,
+					  &ev->transform.boundingbox);
+
+		plane = NULL;
+		if (!pixman_region32_not_empty(&surface_overlap) &&
+		    nplanes < WAYLAND_MAX_PLANES &&
+		    wayland_output_view_is_passthrough_candidate(output, ev)) {
+			if (next_plane != &output->planes)
+				plane = container_of(next_plane,
+						     struct wayland_plane, link);
+			else
+				plane = wayland_plane_create(output);
+		}
+
+		if (plane && !wayland_plane_assign_view(plane, ev))
+			plane = NULL;
+
+		if (plane) {
+			next_plane = plane->link.next;
+			nplanes++;
+
+			weston_view_move_to_plane(ev, &plane->base);
+		} else {
+			weston_view_move_to_plane(ev, primary);
+			pixman_region32_union(&overlap, &overlap,
+					      &ev->transform.boundingbox);
+			ev->psf_flags = 0;
+		}
+
+		pixman_region32_fini(&surface_overlap);
+	}
+
+	pixman_region32_fini(&overlap);
+}
+
+static void
+wayland_plane_attach_shm(struct wayland_plane *plane)
+{
+	struct wayland_plane_buffer *pb = plane->shm_attach;
+	pixman_box32_t *rects;
+	int i, n;
+
+	pb->busy = 1;
+	wl_surface_attach(plane->surface, pb->buffer, 0, 0);
+
+	rects = pixman_region32_rectangles(&plane->shm_damage, &n);
+	for (i = 0; i < n; i++)
+		wl_surface_damage(plane->surface, rects[i].x1, rects[i].y1,
+				  rects[i].x2 - rects[i].x1,
+				  rects[i].y2 - rects[i].y1);
+
+	plane->shm_current = pb;
+	plane->shm_attach = NULL;
+}
+
+static void
+wayland_plane_attach_dmabuf(struct wayland_plane *plane,
+			    struct linux_dmabuf_buffer *dmabuf)
+{
+	struct wayland_backend *b =
+		(struct wayland_backend *) plane->output->base.compositor->backend;
+	struct wayland_dmabuf_import *import;
+
+	import = wayland_dmabuf_import_get(b, dmabuf);
+
+	/* The client buffer stays busy until the parent releases it */
+	weston_buffer_reference(&import->ref, plane->buffer_ref.buffer);
+	plane->shm_current = NULL;
+	wl_surface_attach(plane->surface, import->buffer, 0, 0);
+	wl_surface_damage(plane->surface, 0, 0,
+			  dmabuf->attributes.width, dmabuf->attributes.height);
+}
+
+/* Forward the buffers of the views assigned to planes as subsurfaces of
+ * the output surface. The subsurfaces are synchronized, so this must
+ * happen before the output surface itself gets committed. */
+static void
+wayland_output_update_planes(struct wayland_output *output)
+{
+	struct wayland_plane *plane;
+	struct wl_surface *below = output->parent.surface;
+	struct wl_resource *resource;
+	int32_t ix = 0, iy = 0;
+	float x, y;
+
+	if (output->frame)
+		frame_interior(output->frame, &ix, &iy, NULL, NULL);
+
+	/* Planes were assigned top to bottom, stack them bottom to top */
+	wl_list_for_each_reverse(plane, &output->planes, link) {
+		if (!plane->view) {
+			if (plane->mapped) {
+				wl_surface_attach(plane->surface, NULL, 0, 0);
+				wl_surface_commit(plane->surface);
+				plane->mapped = 0;
+				plane->shm_current = NULL;
+			}
+			continue;
+		}
+
+		/* an SHM view which did not change keeps its buffer,
+		 * unless the surface showing it was recreated */
+		if (plane->shm_attach) {
+			wayland_plane_attach_shm(plane);
+		} else if (plane->shm_current && !plane->mapped) {
+			plane->shm_attach = plane->shm_current;
+			pixman_region32_fini(&plane->shm_damage);
+			pixman_region32_init_rect(&plane->shm_damage, 0, 0,
+						  plane->shm_current->width,
+						  plane->shm_current->height);
+			wayland_plane_attach_shm(plane);
+		} else if (plane->buffer_ref.buffer) {
+			resource = plane->buffer_ref.buffer->resource;
+			wayland_plane_attach_dmabuf(plane,
+						    linux_dmabuf_buffer_get(resource));
+		}
+
+		weston_view_to_global_float(plane->view, 0, 0, &x, &y);
+		wl_subsurface_set_position(plane->subsurface,
+					   ix + (x - output->base.x) *
+						output->base.current_scale,
+					   iy + (y - output->base.y) *
+						output->base.current_scale);
+		wl_subsurface_place_above(plane->subsurface, below);
+		below = plane->surface;
+
+		wl_surface_commit(plane->surface);
+		plane->mapped = 1;
+
+		weston_buffer_reference(&plane->buffer_ref, NULL);
+		pixman_region32_clear(&plane->base.damage);
+	}
+}
+
 static void
 wayland_output_update_gl_border(struct wayland_output *output)
 {
@@ -466,6 +1439,7 @@ wayland_output_repaint_gl(struct weston_output *output_base,
 	callback = wl_surface_frame(output->parent.surface);
 	wl_callback_add_listener(callback, &frame_listener, output);
 
+	wayland_output_update_planes(output);
 	wayland_output_update_gl_border(output);
 
 	ec->renderer->repaint_output(&output->base, damage);
@@ -475,15 +1449,45 @@ wayland_output_repaint_gl(struct weston_output *output_base,
 	return 0;
 }
 
+static void
+wayland_output_invalidate_shm_border(struct wayland_output *output)
+{
+	cairo_surface_destroy(output->shm.border);
+	output->shm.border = NULL;
+}
+
+static cairo_surface_t *
+wayland_output_get_shm_border(struct wayland_output *output)
+{
+	cairo_t *cr;
+
+	if (output->shm.border)
+		return output->shm.border;
+
+	output->shm.border =
+		cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+					   frame_width(output->frame),
+					   frame_height(output->frame));
+
+	cr = cairo_create(output->shm.border);
+	frame_repaint(output->frame, cr);
+	cairo_destroy(cr);
+
+	return output->shm.border;
+}
+
 static void
 wayland_output_update_shm_border(struct wayland_shm_buffer *buffer)
 {
 	int32_t ix, iy, iwidth, iheight, fwidth, fheight;
+	cairo_surface_t *border;
 	cairo_t *cr;
 
 	if (!buffer->output->frame || !buffer->frame_damaged)
 		return;
 
+	border = wayland_output_get_shm_border(buffer->output);
+
 	cr = cairo_create(buffer->c_surface);
 
 	frame_interior(buffer->output->frame, &ix, &iy, &iwidth, &iheight);
@@ -505,10 +1509,7 @@ wayland_output_update_shm_border(struct wayland_shm_buffer *buffer)
 	cairo_close_path(cr);
 	cairo_clip(cr);
 
-	/* Draw using a pattern so that the final result gets clipped */
-	cairo_push_group(cr);
-	frame_repaint(buffer->output->frame, cr);
-	cairo_pop_group_to_source(cr);
+	cairo_set_source_surface(cr, border, 0, 0);
 	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
 	cairo_paint(cr);
 
@@ -573,9 +1574,11 @@ wayland_output_repaint_pixman(struct weston_output *output_base,
 	struct wayland_shm_buffer *sb;
 
 	if (output->frame) {
-		if (frame_status(output->frame) & FRAME_STATUS_REPAINT)
+		if (frame_status(output->frame) & FRAME_STATUS_REPAINT) {
+			wayland_output_invalidate_shm_border(output);
 			wl_list_for_each(sb, &output->shm.buffers, link)
 				sb->frame_damaged = 1;
+		}
 	}
 
 	wl_list_for_each(sb, &output->shm.buffers, link)
@@ -583,6 +1586,7 @@ wayland_output_repaint_pixman(struct weston_output *output_base,
 
 	sb = wayland_output_get_shm_buffer(output);
 
+	wayland_output_update_planes(output);
 	wayland_output_update_shm_border(sb);
 	pixman_renderer_output_set_buffer(output_base, sb->pm_image);
 	b->compositor->renderer->repaint_output(output_base, &sb->damage);
@@ -609,6 +1613,8 @@ wayland_output_destroy(struct weston_output *output_base)
 	struct wayland_output *output = (struct wayland_output *) output_base;
 	struct wayland_backend *b =
 		(struct wayland_backend *) output->base.compositor->backend;
+	struct wayland_shm_buffer *buffer, *next;
+	struct wayland_plane *plane, *pnext;
 
 	if (b->use_pixman) {
 		pixman_renderer_output_destroy(output_base);
@@ -616,6 +1622,15 @@ wayland_output_destroy(struct weston_output *output_base)
 		gl_renderer->output_destroy(output_base);
 	}
 
+	wl_list_for_each_safe(plane, pnext, &output->planes, link)
+		wayland_plane_destroy(plane);
+
+	wl_list_for_each_safe(buffer, next, &output->shm.buffers, link)
+		wayland_shm_buffer_destroy(buffer);
+	if (output->shm.pool)
+		wayland_shm_pool_destroy(output->shm.pool);
+	wayland_output_invalidate_shm_border(output);
+
 	wl_egl_window_destroy(output->gl.egl_window);
 	wl_surface_destroy(output->parent.surface);
 	if (output->parent.shell_surface)
@@ -748,7 +1763,10 @@ wayland_output_resize_surface(struct wayland_output *output)
 		output->gl.border.bottom = NULL;
 	}
 
-	/* Throw away any remaining SHM buffers */
+	wayland_output_invalidate_shm_border(output);
+
+	/* Throw away any remaining SHM buffers, their memory goes back
+	 * to the pool for the buffers of the new size */
 	wl_list_for_each_safe(buffer, next, &output->shm.free_buffers, free_link)
 		wayland_shm_buffer_destroy(buffer);
 	/* These will get thrown away when they get released */
@@ -902,6 +1920,7 @@ wayland_output_switch_mode(struct weston_output *output_base,
 	struct wl_surface *old_surface;
 	struct weston_mode *old_mode;
 	struct zwp_fullscreen_shell_mode_feedback_v1 *mode_feedback;
+	struct wayland_plane *plane;
 	enum mode_status mode_status;
 	int ret = 0;
 
@@ -934,6 +1953,12 @@ wayland_output_switch_mode(struct weston_output *output_base,
 		wl_compositor_create_surface(b->parent.compositor);
 	wl_surface_set_user_data(output->parent.surface, output);
 
+	/* Planes are subsurfaces of the old surface */
+	wl_list_for_each(plane, &output->planes, link) {
+		wayland_plane_destroy_parent_surface(plane);
+		wayland_plane_create_parent_surface(plane);
+	}
+
 	/* Blow the old buffers because we changed size/surfaces */
 	wayland_output_resize_surface(output);
 
@@ -958,8 +1983,12 @@ wayland_output_switch_mode(struct weston_output *output_base,
 
 	if (mode_status == MODE_STATUS_FAIL) {
 		output->base.current_mode = old_mode;
+		wl_list_for_each(plane, &output->planes, link)
+			wayland_plane_destroy_parent_surface(plane);
 		wl_surface_destroy(output->parent.surface);
 		output->parent.surface = old_surface;
+		wl_list_for_each(plane, &output->planes, link)
+			wayland_plane_create_parent_surface(plane);
 		wayland_output_resize_surface(output);
 
 		return -1;
@@ -1051,6 +2080,7 @@ wayland_output_create(struct wayland_backend *b, int x, int y,
 
 	wl_list_init(&output->shm.buffers);
 	wl_list_init(&output->shm.free_buffers);
+	wl_list_init(&output->planes);
 
 	weston_output_init(&output->base, b->compositor, x, y, width, height,
 			   transform, scale);
@@ -1067,7 +2097,10 @@ wayland_output_create(struct wayland_backend *b, int x, int y,
 
 	output->base.start_repaint_loop = wayland_output_start_repaint_loop;
 	output->base.destroy = wayland_output_destroy;
-	output->base.assign_planes = NULL;
+	if (b->passthrough)
+		output->base.assign_planes = wayland_output_assign_planes;
+	else
+		output->base.assign_planes = NULL;
 	output->base.set_backlight = NULL;
 	output->base.set_dpms = NULL;
 	output->base.switch_mode = wayland_output_switch_mode;
@@ -2052,6 +3085,14 @@ registry_handle_global(void *data, struct wl_registry *registry, uint32_t name,
 	} else if (strcmp(interface, "wl_shm") == 0) {
 		b->parent.shm =
 			wl_registry_bind(registry, name, &wl_shm_interface, 1);
+	} else if (strcmp(interface, "wl_subcompositor") == 0) {
+		b->parent.subcompositor =
+			wl_registry_bind(registry, name,
+					 &wl_subcompositor_interface, 1);
+	} else if (strcmp(interface, "zwp_linux_dmabuf_v1") == 0) {
+		b->parent.dmabuf =
+			wl_registry_bind(registry, name,
+					 &zwp_linux_dmabuf_v1_interface, 1);
 	}
 }
 
@@ -2110,6 +3151,10 @@ wayland_destroy(struct weston_compositor *ec)
 
 	if (b->parent.shm)
 		wl_shm_destroy(b->parent.shm);
+	if (b->parent.subcompositor)
+		wl_subcompositor_destroy(b->parent.subcompositor);
+	if (b->parent.dmabuf)
+		zwp_linux_dmabuf_v1_destroy(b->parent.dmabuf);
 
 	free(b);
 }
@@ -2200,6 +3245,14 @@ wayland_backend_create(struct weston_compositor *compositor,
 
 	b->use_pixman = new_config->use_pixman;
 
+	if (new_config->passthrough) {
+		if (b->parent.subcompositor)
+			b->passthrough = 1;
+		else
+			weston_log("parent compositor has no wl_subcompositor, "
+				   "passthrough disabled\n");
+	}
+
 	if (!b->use_pixman) {
 		gl_renderer = weston_load_module("gl-renderer.so",
 						 "gl_renderer_interface");
@@ -52,6 +52,7 @@ struct weston_wayland_backend_config {
 	int cursor_size;
 	int num_outputs;
 	struct weston_wayland_backend_output_config *outputs;
+	int passthrough;
 };
 
 #ifdef  __cplusplus
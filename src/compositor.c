@@ -1977,6 +1977,7 @@ weston_surface_destroy(struct weston_surface *surface)
 		wl_resource_destroy(cb->resource);
 
 	weston_presentation_feedback_discard_list(&surface->feedback_list);
+	weston_surface_latency_release(surface);
 
 	free(surface);
 }
@@ -2355,12 +2356,18 @@ weston_output_repaint(struct weston_output *output)
 	struct weston_frame_callback *cb, *cnext;
 	struct wl_list frame_callback_list;
 	pixman_region32_t output_damage;
+	uint32_t views = 0;
 	int r;
 
 	if (output->destroying)
 		return 0;
 
 	TL_POINT("core_repaint_begin", TLP_OUTPUT(output), TLP_END);
+	weston_output_stats_repaint_begin(output);
+
+	/* Deliver held back pointer motion, so the cursor and the focus
+	 * match what this frame shows. */
+	weston_compositor_flush_pointer_motion(ec);
 
 	/* Rebuild the surface list and update surface transforms up front. */
 	weston_compositor_build_view_list(ec);
@@ -2376,6 +2383,10 @@ weston_output_repaint(struct weston_output *output)
 
 	wl_list_init(&frame_callback_list);
 	wl_list_for_each(ev, &ec->view_list, link) {
+		if (ev->plane == &ec->primary_plane &&
+		    (ev->output_mask & (1u << output->id)))
+			views++;
+
 		/* Note: This operation is safe to do multiple times on the
 		 * same surface.
 		 */
@@ -2385,6 +2396,7 @@ weston_output_repaint(struct weston_output *output)
 			wl_list_init(&ev->surface->frame_callback_list);
 
 			weston_output_take_feedback_list(output, ev->surface);
+			weston_output_latency_take(output, ev->surface);
 		}
 	}
 
@@ -2401,6 +2413,7 @@ weston_output_repaint(struct weston_output *output)
 
 	r = output->repaint(output, &output_damage);
 
+	weston_output_stats_repaint_end(output, &output_damage, views);
 	pixman_region32_fini(&output_damage);
 
 	output->repaint_needed = 0;
@@ -2459,12 +2472,14 @@ weston_output_finish_frame(struct weston_output *output,
 
 	TL_POINT("core_repaint_finished", TLP_OUTPUT(output),
 		 TLP_VBLANK(stamp), TLP_END);
+	weston_output_stats_frame(output, stamp, presented_flags);
 
 	refresh_nsec = millihz_to_nsec(output->current_mode->refresh);
 	weston_presentation_feedback_present_list(&output->feedback_list,
 						  output, refresh_nsec, stamp,
 						  output->msc,
 						  presented_flags);
+	weston_output_latency_present(output, stamp, presented_flags);
 
 	output->frame_time = stamp->tv_sec * 1000 + stamp->tv_nsec / 1000000;
 
@@ -2502,6 +2517,7 @@ idle_repaint(void *data)
 {
 	struct weston_output *output = data;
 
+	weston_output_stats_restart(output);
 	output->start_repaint_loop(output);
 }
 
@@ -2944,6 +2960,8 @@ surface_commit(struct wl_client *client, struct wl_resource *resource)
 	struct weston_surface *surface = wl_resource_get_user_data(resource);
 	struct weston_subsurface *sub = weston_surface_to_subsurface(surface);
 
+	weston_surface_latency_commit(surface);
+
 	if (sub) {
 		weston_subsurface_commit(sub);
 		return;
@@ -4115,6 +4133,8 @@ weston_output_destroy(struct weston_output *output)
 	wl_signal_emit(&output->compositor->output_destroyed_signal, output);
 	wl_signal_emit(&output->destroy_signal, output);
 
+	weston_output_release_capture(output);
+	weston_output_release_stats(output);
 	free(output->name);
 	pixman_region32_fini(&output->region);
 	pixman_region32_fini(&output->previous_damage);
@@ -4298,6 +4318,8 @@ weston_output_init(struct weston_output *output, struct weston_compositor *c,
 
 	wl_signal_init(&output->frame_signal);
 	wl_signal_init(&output->destroy_signal);
+	weston_output_init_capture(output);
+	weston_output_init_stats(output);
 	wl_list_init(&output->animation_list);
 	wl_list_init(&output->resource_list);
 	wl_list_init(&output->feedback_list);
@@ -4762,6 +4784,9 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 	weston_compositor_add_debug_binding(ec, KEY_T,
 					    timeline_key_binding_handler, ec);
 
+	if (weston_compositor_init_statistics(ec) < 0)
+		goto fail;
+
 	return ec;
 
 fail:
@@ -4790,6 +4815,12 @@ weston_compositor_shutdown(struct weston_compositor *ec)
 	weston_binding_list_destroy_all(&ec->axis_binding_list);
 	weston_binding_list_destroy_all(&ec->debug_binding_list);
 
+	weston_binding_table_release(&ec->key_binding_table);
+	weston_binding_table_release(&ec->button_binding_table);
+	weston_binding_table_release(&ec->touch_binding_table);
+	weston_binding_table_release(&ec->axis_binding_table);
+	weston_binding_table_release(&ec->debug_binding_table);
+
 	weston_plane_release(&ec->primary_plane);
 }
 
@@ -158,6 +158,72 @@ struct weston_output_zoom {
 	struct wl_listener motion_listener;
 };
 
+/** Pixels of one readback, one packed block per box.
+ *
+ * Shared read-only by the sinks of a frame; a sink that needs the
+ * pixels after frame() returns takes a reference instead of copying
+ * them, and may drop it from any thread.
+ */
+struct weston_capture_buffer {
+	int refcount;
+	int nboxes;
+	pixman_box32_t *boxes;
+	uint32_t **pixels;
+	int boxes_size;
+	uint32_t *data;
+	size_t data_size;
+};
+
+/* Readback buffers an output keeps around for reuse */
+#define WESTON_CAPTURE_BUFFERS 4
+
+struct weston_output_capture {
+	struct wl_list sink_list;
+	struct wl_listener frame_listener;
+
+	/* Formats read back this frame, scratch for frame_listener */
+	struct wl_array formats;
+	struct weston_capture_buffer *buffers[WESTON_CAPTURE_BUFFERS];
+};
+
+#define WESTON_STATS_HISTOGRAM_SIZE 8
+
+/* Always-on repaint counters, see statistics.c */
+struct weston_output_stats {
+	uint64_t repaints;
+	uint64_t missed_vblanks;
+	uint64_t damage_pixels;
+	uint64_t views;
+	uint64_t upload_bytes;
+	uint64_t repaint_cpu_nsec;
+	uint32_t repaint_histogram[WESTON_STATS_HISTOGRAM_SIZE];
+
+	struct wl_list resource_list;
+	struct timespec repaint_start;
+	uint64_t upload_start;
+	struct timespec last_vblank;
+	/* struct weston_input_stamp of the frame being presented */
+	struct wl_array input_stamps;
+};
+
+#define WESTON_LATENCY_HISTOGRAM_SIZE 16
+
+/* Input to presentation latency, see statistics.c */
+struct weston_latency_stats {
+	uint64_t samples;
+	uint64_t total_usec;
+	uint32_t max_usec;
+	/* 8 ms buckets, the last one also counts everything slower */
+	uint32_t histogram[WESTON_LATENCY_HISTOGRAM_SIZE];
+};
+
+/* An input event whose effect has not been presented yet */
+struct weston_input_stamp {
+	struct weston_seat *seat;	/* NULL if unused */
+	struct weston_surface *surface;
+	uint32_t msec;
+};
+
 /* bit compatible with drm definitions. */
 enum dpms_enum {
 	WESTON_DPMS_ON,
@@ -197,6 +263,8 @@ struct weston_output {
 	int dirty;
 	struct wl_signal frame_signal;
 	struct wl_signal destroy_signal;
+	struct weston_output_capture capture;
+	struct weston_output_stats stats;
 	int move_x, move_y;
 	uint32_t frame_time; /* presentation timestamp in milliseconds */
 	uint64_t msc;        /* media stream counter */
@@ -239,6 +307,54 @@ struct weston_output {
 	struct weston_timeline_object timeline;
 };
 
+/** A frame read back for the capture sinks of one output.
+ *
+ * The pixels are laid out exactly as renderer->read_pixels() returns
+ * them: boxes are in the coordinates passed to read_pixels(), so they
+ * are y-flipped framebuffer coordinates when y_flip is set, and each
+ * box's rows are tightly packed.
+ */
+struct weston_capture_frame {
+	struct weston_output *output;
+	pixman_format_code_t format;
+	int y_flip;
+
+	/** Damage of this frame in framebuffer coordinates */
+	pixman_region32_t *damage;
+
+	/** What was read back, NULL if nothing was */
+	struct weston_capture_buffer *buffer;
+	int nboxes;
+	const pixman_box32_t *boxes;
+	const uint32_t * const *pixels;
+};
+
+enum weston_capture_sink_flags {
+	/** Read back the damage of every frame */
+	WESTON_CAPTURE_SINK_DAMAGE = 1 << 0,
+};
+
+/** A consumer of the pixels an output renders.
+ *
+ * Every frame the output's sinks are asked, through prepare(), which
+ * part of the framebuffer they need in addition to the frame damage
+ * (region, in framebuffer coordinates).  The union for all sinks of
+ * the same format is read back once and handed to frame(), which is
+ * called for every repaint even if nothing was read back.  A sink may
+ * remove itself from frame(), but not any other sink.
+ */
+struct weston_capture_sink {
+	struct weston_output *output;
+	struct wl_list link;
+	pixman_format_code_t format;
+	uint32_t flags;
+	pixman_region32_t region;
+
+	void (*prepare)(struct weston_capture_sink *sink);
+	void (*frame)(struct weston_capture_sink *sink,
+		      struct weston_capture_frame *frame);
+};
+
 enum weston_pointer_motion_mask {
 	WESTON_POINTER_MOTION_ABS = 1 << 0,
 	WESTON_POINTER_MOTION_REL = 1 << 1,
@@ -381,9 +497,23 @@ struct weston_pointer {
 	uint32_t button_count;
 
 	struct wl_listener output_destroy_listener;
+
+	/* Motion held back until the next repaint, see
+	 * weston_compositor.coalesce_pointer_motion */
+	bool motion_pending;
+	bool frame_pending;
+	uint32_t pending_time;
+	struct weston_pointer_motion_event pending_motion;
 };
 
 
+#define WESTON_TOUCH_BATCH_SLOTS 16
+
+struct weston_touch_batch_motion {
+	int touch_id;
+	wl_fixed_t x, y;
+};
+
 struct weston_touch {
 	struct weston_seat *seat;
 
@@ -403,6 +533,16 @@ struct weston_touch {
 	wl_fixed_t grab_x, grab_y;
 	uint32_t grab_serial;
 	uint32_t grab_time;
+
+	/* Motion held back until the end of the event dispatch, the last
+	 * position per touch point wins, see notify_touch_frame() */
+	struct weston_touch_batch_motion batch[WESTON_TOUCH_BATCH_SLOTS];
+	int batch_count;
+	uint32_t batch_time;
+	bool batch_frame;
+	struct wl_event_source *batch_idle;
+	uint64_t motion_collapsed;
+	uint64_t frames_collapsed;
 };
 
 void
@@ -589,6 +729,11 @@ struct weston_seat {
 
 	struct input_method *input_method;
 	char *seat_name;
+
+	/* Event times passed to notify_*() are CLOCK_MONOTONIC msec,
+	 * as with libinput, and can be used to measure latency. */
+	bool monotonic_event_time;
+	struct weston_latency_stats latency;
 };
 
 enum {
@@ -720,6 +865,15 @@ struct weston_backend {
 	void (*restore)(struct weston_compositor *compositor);
 };
 
+/* Hash of struct weston_binding::hash_link, see bindings.c */
+struct weston_binding_table {
+	struct wl_list *buckets;
+	uint32_t size;		/* power of two, 0 until first used */
+	uint32_t count;
+	int dispatching;	/* no rehashing while running handlers */
+	uint32_t probes;	/* bindings looked at by dispatch, for tests */
+};
+
 struct weston_compositor {
 	struct wl_signal destroy_signal;
 
@@ -762,6 +916,14 @@ struct weston_compositor {
 	struct wl_list touch_binding_list;
 	struct wl_list axis_binding_list;
 	struct wl_list debug_binding_list;
+	/* The same bindings indexed by key, button or axis and modifier */
+	struct weston_binding_table key_binding_table;
+	struct weston_binding_table button_binding_table;
+	struct weston_binding_table touch_binding_table;
+	struct weston_binding_table axis_binding_table;
+	struct weston_binding_table debug_binding_table;
+	/* Key, button and axis presses, primes modifier bindings */
+	uint32_t binding_press_count;
 
 	uint32_t state;
 	struct wl_event_source *idle_source;
@@ -775,6 +937,10 @@ struct weston_compositor {
 	uint32_t capabilities; /* combination of enum weston_capability */
 
 	struct weston_renderer *renderer;
+	/* Client buffer bytes uploaded by the renderer, for statistics */
+	uint64_t upload_bytes;
+	/* struct weston_client_latency::link */
+	struct wl_list client_latency_list;
 
 	pixman_format_code_t read_format;
 
@@ -796,6 +962,9 @@ struct weston_compositor {
 
 	bool vt_switching;
 
+	/* Deliver pointer motion once per repaint instead of per event */
+	bool coalesce_pointer_motion;
+
 	clockid_t presentation_clock;
 	int32_t repaint_msec;
 
@@ -1035,6 +1204,11 @@ struct weston_surface {
 	struct wl_list frame_callback_list;
 	struct wl_list feedback_list;
 
+	/* Oldest input delivered since the last commit, and oldest
+	 * committed but not yet presented */
+	struct weston_input_stamp input_pending;
+	struct weston_input_stamp input_committed;
+
 	struct weston_buffer_reference buffer_ref;
 	struct weston_buffer_viewport buffer_viewport;
 	int32_t width_from_buffer; /* before applying viewport */
@@ -1184,6 +1358,8 @@ notify_axis_source(struct weston_seat *seat, uint32_t source);
 
 void
 notify_pointer_frame(struct weston_seat *seat);
+void
+weston_compositor_flush_pointer_motion(struct weston_compositor *compositor);
 
 void
 notify_key(struct weston_seat *seat, uint32_t time, uint32_t key,
@@ -1331,6 +1507,8 @@ weston_install_debug_key_binding(struct weston_compositor *compositor,
 
 void
 weston_binding_list_destroy_all(struct wl_list *list);
+void
+weston_binding_table_release(struct weston_binding_table *table);
 
 void
 weston_compositor_run_key_binding(struct weston_compositor *compositor,
@@ -1514,6 +1692,54 @@ weston_output_transform_coordinate(struct weston_output *output,
 				   double device_x, double device_y,
 				   double *x, double *y);
 
+void
+weston_output_init_capture(struct weston_output *output);
+void
+weston_output_release_capture(struct weston_output *output);
+void
+weston_capture_sink_init(struct weston_capture_sink *sink,
+			 pixman_format_code_t format, uint32_t flags);
+void
+weston_output_add_capture_sink(struct weston_output *output,
+			       struct weston_capture_sink *sink);
+void
+weston_capture_sink_remove(struct weston_capture_sink *sink);
+void
+weston_capture_frame_copy_rect(const struct weston_capture_frame *frame,
+			       uint32_t *dst, int dst_stride,
+			       int x, int y, int width, int height);
+struct weston_capture_buffer *
+weston_capture_buffer_ref(struct weston_capture_buffer *buffer);
+void
+weston_capture_buffer_unref(struct weston_capture_buffer *buffer);
+
+int
+weston_compositor_init_statistics(struct weston_compositor *compositor);
+void
+weston_output_init_stats(struct weston_output *output);
+void
+weston_output_release_stats(struct weston_output *output);
+void
+weston_output_stats_repaint_begin(struct weston_output *output);
+void
+weston_output_stats_repaint_end(struct weston_output *output,
+				pixman_region32_t *damage, uint32_t views);
+void
+weston_output_stats_restart(struct weston_output *output);
+void
+weston_output_stats_frame(struct weston_output *output,
+			  const struct timespec *stamp, uint32_t flags);
+void
+weston_surface_latency_commit(struct weston_surface *surface);
+void
+weston_surface_latency_release(struct weston_surface *surface);
+void
+weston_output_latency_take(struct weston_output *output,
+			   struct weston_surface *surface);
+void
+weston_output_latency_present(struct weston_output *output,
+			      const struct timespec *stamp, uint32_t flags);
+
 void
 weston_seat_init(struct weston_seat *seat, struct weston_compositor *ec,
 		 const char *seat_name);
@@ -1550,6 +1776,10 @@ weston_log_file_open(const char *filename);
 void
 weston_log_file_close(void);
 int
+weston_log_start_async(void);
+void
+weston_log_flush_sync(void);
+int
 weston_vlog(const char *fmt, va_list ap);
 int
 weston_vlog_continue(const char *fmt, va_list ap);
@@ -1583,7 +1813,8 @@ screenshooter_create(struct weston_compositor *ec);
 enum weston_screenshooter_outcome {
 	WESTON_SCREENSHOOTER_SUCCESS,
 	WESTON_SCREENSHOOTER_NO_MEMORY,
-	WESTON_SCREENSHOOTER_BAD_BUFFER
+	WESTON_SCREENSHOOTER_BAD_BUFFER,
+	WESTON_SCREENSHOOTER_FAILED
 };
 
 typedef void (*weston_screenshooter_done_func_t)(void *data,
@@ -1591,6 +1822,13 @@ typedef void (*weston_screenshooter_done_func_t)(void *data,
 int
 weston_screenshooter_shoot(struct weston_output *output, struct weston_buffer *buffer,
 			   weston_screenshooter_done_func_t done, void *data);
+int
+weston_screenshooter_shoot_region(struct weston_output *output,
+				  struct weston_buffer *buffer,
+				  int32_t x, int32_t y,
+				  int32_t width, int32_t height,
+				  weston_screenshooter_done_func_t done,
+				  void *data);
 
 struct clipboard *
 clipboard_create(struct weston_seat *seat);
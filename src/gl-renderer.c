@@ -1232,6 +1232,7 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 	struct weston_buffer *buffer = gs->buffer_ref.buffer;
 	struct weston_view *view;
 	bool texture_used;
+	int32_t stride;
 
 #ifdef GL_EXT_unpack_subimage
 	pixman_box32_t *rectangles;
@@ -1266,6 +1267,8 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 
 	glBindTexture(GL_TEXTURE_2D, gs->textures[0]);
 
+	stride = wl_shm_buffer_get_stride(buffer->shm_buffer);
+
 	if (!gr->has_unpack_subimage) {
 		wl_shm_buffer_begin_access(buffer->shm_buffer);
 		glTexImage2D(GL_TEXTURE_2D, 0, gs->gl_format,
@@ -1273,6 +1276,8 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 			     gs->gl_format, gs->gl_pixel_type,
 			     wl_shm_buffer_get_data(buffer->shm_buffer));
 		wl_shm_buffer_end_access(buffer->shm_buffer);
+		surface->compositor->upload_bytes +=
+			(uint64_t) stride * buffer->height;
 
 		goto done;
 	}
@@ -1289,6 +1294,8 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 			     gs->pitch, buffer->height, 0,
 			     gs->gl_format, gs->gl_pixel_type, data);
 		wl_shm_buffer_end_access(buffer->shm_buffer);
+		surface->compositor->upload_bytes +=
+			(uint64_t) stride * buffer->height;
 		goto done;
 	}
 
@@ -1304,6 +1311,8 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 		glTexSubImage2D(GL_TEXTURE_2D, 0, r.x1, r.y1,
 				r.x2 - r.x1, r.y2 - r.y1,
 				gs->gl_format, gs->gl_pixel_type, data);
+		surface->compositor->upload_bytes += (uint64_t)
+			(r.x2 - r.x1) * (r.y2 - r.y1) * (stride / gs->pitch);
 	}
 	wl_shm_buffer_end_access(buffer->shm_buffer);
 #endif
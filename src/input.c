@@ -38,6 +38,9 @@
 #include "shared/os-compatibility.h"
 #include "compositor.h"
 
+static void
+weston_pointer_flush_motion(struct weston_pointer *pointer);
+
 static void
 empty_region(pixman_region32_t *region)
 {
@@ -830,6 +833,8 @@ weston_touch_destroy(struct weston_touch *touch)
 {
 	/* XXX: What about touch->resource_list? */
 
+	if (touch->batch_idle)
+		wl_event_source_remove(touch->batch_idle);
 	wl_list_remove(&touch->focus_view_listener.link);
 	wl_list_remove(&touch->focus_resource_listener.link);
 	free(touch);
@@ -1044,6 +1049,9 @@ WL_EXPORT void
 weston_pointer_start_grab(struct weston_pointer *pointer,
 			  struct weston_pointer_grab *grab)
 {
+	/* Held back motion belongs to the default grab */
+	weston_pointer_flush_motion(pointer);
+
 	pointer->grab = grab;
 	grab->pointer = pointer;
 	pointer->grab->interface->focus(pointer->grab);
@@ -1229,6 +1237,113 @@ weston_pointer_handle_output_destroy(struct wl_listener *listener, void *data)
 	weston_pointer_move_to(pointer, fx, fy);
 }
 
+/** Remember the time of an event sent to surface
+ *
+ * Starts an input to presentation latency measurement, see
+ * weston_output_latency_present().  Only the oldest event since the
+ * last commit of the surface counts.
+ */
+static void
+weston_seat_stamp_input(struct weston_seat *seat,
+			struct weston_surface *surface, uint32_t time)
+{
+	if (!seat->monotonic_event_time || !surface ||
+	    surface->input_pending.seat)
+		return;
+
+	surface->input_pending.seat = seat;
+	surface->input_pending.msec = time;
+}
+
+static void
+weston_pointer_stamp_input(struct weston_pointer *pointer, uint32_t time)
+{
+	if (pointer->focus)
+		weston_seat_stamp_input(pointer->seat,
+					pointer->focus->surface, time);
+}
+
+/** Deliver motion held back by weston_pointer_coalesce_motion()
+ *
+ * Sends one motion to the grab for everything accumulated since the
+ * last flush, followed by the pointer frame it swallowed.
+ */
+static void
+weston_pointer_flush_motion(struct weston_pointer *pointer)
+{
+	struct weston_pointer_motion_event event;
+
+	if (!pointer->motion_pending)
+		return;
+
+	event = pointer->pending_motion;
+	pointer->motion_pending = false;
+	pointer->grab->interface->motion(pointer->grab,
+					 pointer->pending_time, &event);
+
+	if (pointer->frame_pending) {
+		pointer->frame_pending = false;
+		pointer->grab->interface->frame(pointer->grab);
+	}
+}
+
+/* Returns true if the motion was held back for the next repaint.
+ *
+ * Only motion for the default grab with a visible cursor is held
+ * back.  Everything else, moves, resizes, drags, popups and clients
+ * that hide the cursor to take raw motion, gets every event. */
+static bool
+weston_pointer_coalesce_motion(struct weston_pointer *pointer,
+			       uint32_t time,
+			       struct weston_pointer_motion_event *event)
+{
+	struct weston_pointer_motion_event *pending = &pointer->pending_motion;
+
+	if (!pointer->seat->compositor->coalesce_pointer_motion ||
+	    pointer->grab != &pointer->default_grab ||
+	    !pointer->sprite) {
+		weston_pointer_flush_motion(pointer);
+		return false;
+	}
+
+	if (!pointer->motion_pending) {
+		*pending = *event;
+		pointer->motion_pending = true;
+	} else if (event->mask & WESTON_POINTER_MOTION_ABS) {
+		*pending = *event;
+	} else if (pending->mask & WESTON_POINTER_MOTION_ABS) {
+		pending->x += event->dx;
+		pending->y += event->dy;
+	} else {
+		pending->dx += event->dx;
+		pending->dy += event->dy;
+	}
+	pointer->pending_time = time;
+
+	/* The repaint that moves the cursor flushes the motion */
+	weston_view_schedule_repaint(pointer->sprite);
+
+	return true;
+}
+
+/** Deliver held back pointer motion of all seats
+ *
+ * Called before every output repaint, so the cursor and the pointer
+ * focus are up to date in the frame.
+ */
+WL_EXPORT void
+weston_compositor_flush_pointer_motion(struct weston_compositor *compositor)
+{
+	struct weston_seat *seat;
+
+	if (!compositor->coalesce_pointer_motion)
+		return;
+
+	wl_list_for_each(seat, &compositor->seat_list, link)
+		if (seat->pointer_state)
+			weston_pointer_flush_motion(seat->pointer_state);
+}
+
 WL_EXPORT void
 notify_motion(struct weston_seat *seat,
 	      uint32_t time,
@@ -1238,6 +1353,11 @@ notify_motion(struct weston_seat *seat,
 	struct weston_pointer *pointer = weston_seat_get_pointer(seat);
 
 	weston_compositor_wake(ec);
+	weston_pointer_stamp_input(pointer, time);
+
+	if (weston_pointer_coalesce_motion(pointer, time, event))
+		return;
+
 	pointer->grab->interface->motion(pointer->grab, time, event);
 }
 
@@ -1293,6 +1413,11 @@ notify_motion_absolute(struct weston_seat *seat,
 		.y = y,
 	};
 
+	weston_pointer_stamp_input(pointer, time);
+
+	if (weston_pointer_coalesce_motion(pointer, time, &event))
+		return;
+
 	pointer->grab->interface->motion(pointer->grab, time, &event);
 }
 
@@ -1318,6 +1443,8 @@ notify_button(struct weston_seat *seat, uint32_t time, int32_t button,
 	struct weston_compositor *compositor = seat->compositor;
 	struct weston_pointer *pointer = weston_seat_get_pointer(seat);
 
+	weston_pointer_flush_motion(pointer);
+
 	if (state == WL_POINTER_BUTTON_STATE_PRESSED) {
 		weston_compositor_idle_inhibit(compositor);
 		if (pointer->button_count == 0) {
@@ -1336,6 +1463,7 @@ notify_button(struct weston_seat *seat, uint32_t time, int32_t button,
 					     state);
 
 	pointer->grab->interface->button(pointer->grab, time, button, state);
+	weston_pointer_stamp_input(pointer, time);
 
 	if (pointer->button_count == 1)
 		pointer->grab_serial =
@@ -1350,6 +1478,7 @@ notify_axis(struct weston_seat *seat, uint32_t time,
 	struct weston_pointer *pointer = weston_seat_get_pointer(seat);
 
 	weston_compositor_wake(compositor);
+	weston_pointer_flush_motion(pointer);
 
 	if (weston_compositor_run_axis_binding(compositor, pointer,
 					       time, event))
@@ -1365,6 +1494,7 @@ notify_axis_source(struct weston_seat *seat, uint32_t source)
 	struct weston_pointer *pointer = weston_seat_get_pointer(seat);
 
 	weston_compositor_wake(compositor);
+	weston_pointer_flush_motion(pointer);
 
 	pointer->grab->interface->axis_source(pointer->grab, source);
 }
@@ -1377,6 +1507,14 @@ notify_pointer_frame(struct weston_seat *seat)
 
 	weston_compositor_wake(compositor);
 
+	/* Sent after the held back motion it ends.  This does not
+	 * flush the motion: libinput sends a frame after every event,
+	 * which would leave nothing to coalesce. */
+	if (pointer->motion_pending) {
+		pointer->frame_pending = true;
+		return;
+	}
+
 	pointer->grab->interface->frame(pointer->grab);
 }
 
@@ -1664,6 +1802,7 @@ notify_key(struct weston_seat *seat, uint32_t time, uint32_t key,
 	}
 
 	grab->interface->key(grab, time, key, state);
+	weston_seat_stamp_input(seat, keyboard->focus, time);
 
 	if (keyboard->pending_keymap &&
 	    keyboard->keys.size == 0)
@@ -1819,6 +1958,66 @@ weston_touch_set_focus(struct weston_touch *touch, struct weston_view *view)
  * for sending along such order.
  *
  */
+/* Send batched motion, without the frame that ends it */
+static void
+weston_touch_flush_motion(struct weston_touch *touch)
+{
+	struct weston_touch_batch_motion *m;
+	int i, count = touch->batch_count;
+
+	touch->batch_count = 0;
+	for (i = 0; i < count; i++) {
+		m = &touch->batch[i];
+		touch->grab->interface->motion(touch->grab, touch->batch_time,
+					       m->touch_id, m->x, m->y);
+	}
+}
+
+static void
+weston_touch_flush_batch(void *data)
+{
+	struct weston_touch *touch = data;
+
+	touch->batch_idle = NULL;
+	weston_touch_flush_motion(touch);
+
+	if (touch->batch_frame) {
+		touch->batch_frame = false;
+		touch->grab->interface->frame(touch->grab);
+	}
+}
+
+/* Returns false if there is no room left in the batch. */
+static bool
+weston_touch_batch_motion(struct weston_touch *touch, uint32_t time,
+			  int touch_id, wl_fixed_t x, wl_fixed_t y)
+{
+	struct weston_touch_batch_motion *m;
+	int i;
+
+	for (i = 0; i < touch->batch_count; i++) {
+		m = &touch->batch[i];
+		if (m->touch_id == touch_id) {
+			m->x = x;
+			m->y = y;
+			touch->batch_time = time;
+			touch->motion_collapsed++;
+			return true;
+		}
+	}
+
+	if (touch->batch_count == WESTON_TOUCH_BATCH_SLOTS)
+		return false;
+
+	m = &touch->batch[touch->batch_count++];
+	m->touch_id = touch_id;
+	m->x = x;
+	m->y = y;
+	touch->batch_time = time;
+
+	return true;
+}
+
 WL_EXPORT void
 notify_touch(struct weston_seat *seat, uint32_t time, int touch_id,
              double double_x, double double_y, int touch_type)
@@ -1837,6 +2036,10 @@ notify_touch(struct weston_seat *seat, uint32_t time, int touch_id,
 		touch->grab_y = y;
 	}
 
+	/* Keep the order of motion against down and up */
+	if (touch_type != WL_TOUCH_MOTION)
+		weston_touch_flush_motion(touch);
+
 	switch (touch_type) {
 	case WL_TOUCH_DOWN:
 		weston_compositor_idle_inhibit(ec);
@@ -1862,6 +2065,9 @@ notify_touch(struct weston_seat *seat, uint32_t time, int touch_id,
 						    time, touch_type);
 
 		grab->interface->down(grab, time, touch_id, x, y);
+		if (touch->focus)
+			weston_seat_stamp_input(seat, touch->focus->surface,
+						time);
 		if (touch->num_tp == 1) {
 			touch->grab_serial =
 				wl_display_get_serial(ec->wl_display);
@@ -1877,7 +2083,13 @@ notify_touch(struct weston_seat *seat, uint32_t time, int touch_id,
 		if (!ev)
 			break;
 
-		grab->interface->motion(grab, time, touch_id, x, y);
+		if (!weston_touch_batch_motion(touch, time, touch_id, x, y)) {
+			weston_touch_flush_motion(touch);
+			grab->interface->motion(grab, time, touch_id, x, y);
+		}
+		if (touch->focus)
+			weston_seat_stamp_input(seat, touch->focus->surface,
+						time);
 		break;
 	case WL_TOUCH_UP:
 		if (touch->num_tp == 0) {
@@ -1892,6 +2104,9 @@ notify_touch(struct weston_seat *seat, uint32_t time, int touch_id,
 		touch->num_tp--;
 
 		grab->interface->up(grab, time, touch_id);
+		if (touch->focus)
+			weston_seat_stamp_input(seat, touch->focus->surface,
+						time);
 		if (touch->num_tp == 0)
 			weston_touch_set_focus(touch, NULL);
 		break;
@@ -1903,7 +2118,32 @@ notify_touch_frame(struct weston_seat *seat)
 {
 	struct weston_touch *touch = weston_seat_get_touch(seat);
 	struct weston_touch_grab *grab = touch->grab;
+	struct wl_event_loop *loop;
+
+	/* Frames with motion are sent once the compositor is done
+	 * dispatching, right before clients get flushed.  Frames that
+	 * arrive before that, e.g. a backlog after a stall, are merged
+	 * into one. */
+	if (touch->batch_count > 0) {
+		if (touch->batch_frame)
+			touch->frames_collapsed++;
+		touch->batch_frame = true;
+
+		if (!touch->batch_idle) {
+			loop = wl_display_get_event_loop(
+					seat->compositor->wl_display);
+			touch->batch_idle =
+				wl_event_loop_add_idle(loop,
+						       weston_touch_flush_batch,
+						       touch);
+		}
+		if (touch->batch_idle)
+			return;
 
+		weston_touch_flush_motion(touch);
+	}
+
+	touch->batch_frame = false;
 	grab->interface->frame(grab);
 }
 
@@ -1913,6 +2153,9 @@ notify_touch_cancel(struct weston_seat *seat)
 	struct weston_touch *touch = weston_seat_get_touch(seat);
 	struct weston_touch_grab *grab = touch->grab;
 
+	touch->batch_count = 0;
+	touch->batch_frame = false;
+
 	grab->interface->cancel(grab);
 }
 
@@ -28,6 +28,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <libinput.h>
@@ -38,9 +39,30 @@
 #include "libinput-seat.h"
 #include "libinput-device.h"
 #include "shared/helpers.h"
+#include "shared/timespec-util.h"
+
+/* Probe devices anyway if no frame is shown within this time */
+#define PROBE_TIMEOUT_MSEC 1000
+
+struct frame_wait {
+	struct udev_input *input;
+	struct wl_listener frame_listener;
+	struct wl_list link;
+};
 
 static void
 process_events(struct udev_input *input);
+
+static double
+elapsed_msec(const struct timespec *begin)
+{
+	struct timespec now, d;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespec_sub(&d, &now, begin);
+
+	return timespec_to_nsec(&d) / 1e6;
+}
 static struct udev_seat *
 udev_seat_create(struct udev_input *input, const char *seat_name);
 static void
@@ -67,8 +89,10 @@ device_added(struct udev_input *input, struct libinput_device *libinput_device)
 	struct weston_seat *seat;
 	struct udev_seat *udev_seat;
 	struct weston_pointer *pointer;
+	struct timespec begin;
 
 	c = input->compositor;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
 
 	udev_seat = get_udev_seat(input, libinput_device);
 	if (!udev_seat)
@@ -103,6 +127,10 @@ device_added(struct udev_input *input, struct libinput_device *libinput_device)
 
 	if (!input->suspended)
 		weston_seat_repick(seat);
+
+	weston_log("input device '%s' set up in %.1f ms\n",
+		   libinput_device_get_name(libinput_device),
+		   elapsed_msec(&begin));
 }
 
 static void
@@ -124,9 +152,31 @@ udev_seat_remove_devices(struct udev_seat *seat)
 	}
 }
 
+static void
+udev_input_cancel_probe(struct udev_input *input)
+{
+	struct frame_wait *wait, *tmp;
+
+	wl_list_for_each_safe(wait, tmp, &input->frame_waits, link) {
+		wl_list_remove(&wait->frame_listener.link);
+		wl_list_remove(&wait->link);
+		free(wait);
+	}
+
+	if (input->probe_idle)
+		wl_event_source_remove(input->probe_idle);
+	input->probe_idle = NULL;
+
+	if (input->probe_timer)
+		wl_event_source_remove(input->probe_timer);
+	input->probe_timer = NULL;
+}
+
 void
 udev_input_disable(struct udev_input *input)
 {
+	udev_input_cancel_probe(input);
+
 	if (input->suspended)
 		return;
 
@@ -202,8 +252,15 @@ open_restricted(const char *path, int flags, void *user_data)
 {
 	struct udev_input *input = user_data;
 	struct weston_launcher *launcher = input->compositor->launcher;
+	struct timespec begin;
+	int fd;
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	fd = weston_launcher_open(launcher, path, flags);
+	weston_log("input: opened %s in %.1f ms\n", path,
+		   elapsed_msec(&begin));
 
-	return weston_launcher_open(launcher, path, flags);
+	return fd;
 }
 
 static void
@@ -220,42 +277,39 @@ const struct libinput_interface libinput_interface = {
 	close_restricted,
 };
 
-int
-udev_input_enable(struct udev_input *input)
+/* Set up the devices libinput found or reopened, which it can only hand
+ * over on this thread.  Each device is still timed in device_added(). */
+static void
+udev_input_probe(struct udev_input *input)
 {
-	struct wl_event_loop *loop;
 	struct weston_compositor *c = input->compositor;
-	int fd;
 	struct udev_seat *seat;
+	struct timespec begin;
 	int devices_found = 0;
 
-	loop = wl_display_get_event_loop(c->wl_display);
-	fd = libinput_get_fd(input->libinput);
-	input->libinput_source =
-		wl_event_loop_add_fd(loop, fd, WL_EVENT_READABLE,
-				     libinput_source_dispatch, input);
-	if (!input->libinput_source) {
-		return -1;
-	}
+	udev_input_cancel_probe(input);
+	clock_gettime(CLOCK_MONOTONIC, &begin);
 
 	if (input->suspended) {
 		if (libinput_resume(input->libinput) != 0) {
-			wl_event_source_remove(input->libinput_source);
-			input->libinput_source = NULL;
-			return -1;
+			weston_log("libinput: failed to resume\n");
+			return;
 		}
 		input->suspended = 0;
-		process_events(input);
 	}
+	process_events(input);
+	wl_event_source_fd_update(input->libinput_source, WL_EVENT_READABLE);
 
-	wl_list_for_each(seat, &input->compositor->seat_list, base.link) {
+	wl_list_for_each(seat, &c->seat_list, base.link) {
 		evdev_notify_keyboard_focus(&seat->base, &seat->devices_list);
 
 		if (!wl_list_empty(&seat->devices_list))
 			devices_found = 1;
 	}
 
-	if (devices_found == 0) {
+	weston_log("input devices probed in %.1f ms\n", elapsed_msec(&begin));
+
+	if (devices_found == 0)
 		weston_log(
 			"warning: no input devices on entering Weston. "
 			"Possible causes:\n"
@@ -263,9 +317,110 @@ udev_input_enable(struct udev_input *input)
 			"\t- seats misconfigured "
 			"(Weston backend option 'seat', "
 			"udev device property ID_SEAT)\n");
-		return -1;
+}
+
+static void
+probe_now_handler(void *data)
+{
+	struct udev_input *input = data;
+
+	input->probe_idle = NULL;
+	udev_input_probe(input);
+}
+
+/* Called from the renderer, so probe only once the frame is done */
+static void
+frame_wait_notify(struct wl_listener *listener, void *data)
+{
+	struct frame_wait *wait =
+		container_of(listener, struct frame_wait, frame_listener);
+	struct udev_input *input = wait->input;
+	struct wl_event_loop *loop;
+
+	udev_input_cancel_probe(input);
+
+	loop = wl_display_get_event_loop(input->compositor->wl_display);
+	input->probe_idle = wl_event_loop_add_idle(loop, probe_now_handler,
+						   input);
+}
+
+static int
+probe_timer_handler(void *data)
+{
+	struct udev_input *input = data;
+
+	udev_input_probe(input);
+
+	return 0;
+}
+
+/* Runs once startup or session activation is done and the outputs have
+ * something to repaint. */
+static void
+probe_idle_handler(void *data)
+{
+	struct udev_input *input = data;
+	struct weston_compositor *c = input->compositor;
+	struct wl_event_loop *loop;
+	struct weston_output *output;
+	struct frame_wait *wait;
+
+	input->probe_idle = NULL;
+
+	wl_list_for_each(output, &c->output_list, link) {
+		wait = zalloc(sizeof *wait);
+		if (!wait)
+			break;
+
+		wait->input = input;
+		wait->frame_listener.notify = frame_wait_notify;
+		wl_signal_add(&output->frame_signal, &wait->frame_listener);
+		wl_list_insert(&input->frame_waits, &wait->link);
+	}
+
+	loop = wl_display_get_event_loop(c->wl_display);
+	if (!wl_list_empty(&input->frame_waits))
+		input->probe_timer =
+			wl_event_loop_add_timer(loop, probe_timer_handler,
+						input);
+	if (input->probe_timer)
+		wl_event_source_timer_update(input->probe_timer,
+					     PROBE_TIMEOUT_MSEC);
+	else
+		udev_input_probe(input);
+}
+
+/** Start input, without holding back the next frame
+ *
+ * Setting up every device can take a while with many of them.  Instead
+ * of handling the devices libinput reports right away, it waits for the
+ * first frame after startup or session activation, so the screen is up
+ * while devices are still being probed.  Until then the libinput fd is
+ * not polled.
+ */
+int
+udev_input_enable(struct udev_input *input)
+{
+	struct wl_event_loop *loop;
+	struct weston_compositor *c = input->compositor;
+	int fd;
+
+	loop = wl_display_get_event_loop(c->wl_display);
+	if (!input->libinput_source) {
+		fd = libinput_get_fd(input->libinput);
+		input->libinput_source =
+			wl_event_loop_add_fd(loop, fd, 0,
+					     libinput_source_dispatch, input);
+		if (!input->libinput_source)
+			return -1;
 	}
 
+	udev_input_cancel_probe(input);
+	input->probe_idle = wl_event_loop_add_idle(loop, probe_idle_handler,
+						   input);
+	if (!input->probe_idle)
+		udev_input_probe(input);
+
 	return 0;
 }
 
@@ -311,13 +466,18 @@ udev_input_init(struct udev_input *input, struct weston_compositor *c,
 	libinput_log_set_priority(input->libinput, priority);
 
 	if (libinput_udev_assign_seat(input->libinput, seat_id) != 0) {
+		weston_log("libinput: failed to assign seat %s\n", seat_id);
 		libinput_unref(input->libinput);
 		return -1;
 	}
 
-	process_events(input);
+	wl_list_init(&input->frame_waits);
+	if (udev_input_enable(input) < 0) {
+		libinput_unref(input->libinput);
+		return -1;
+	}
 
-	return udev_input_enable(input);
+	return 0;
 }
 
 void
@@ -325,6 +485,7 @@ udev_input_destroy(struct udev_input *input)
 {
 	struct udev_seat *seat, *next;
 
+	udev_input_cancel_probe(input);
 	wl_event_source_remove(input->libinput_source);
 	wl_list_for_each_safe(seat, next, &input->compositor->seat_list, base.link)
 		udev_seat_destroy(seat);
@@ -372,6 +533,8 @@ udev_seat_create(struct udev_input *input, const char *seat_name)
 
 	weston_seat_init(&seat->base, c, seat_name);
 	seat->base.led_update = udev_seat_led_update;
+	/* libinput timestamps come from the kernel on CLOCK_MONOTONIC */
+	seat->base.monotonic_event_time = true;
 
 	seat->output_create_listener.notify = notify_output_create;
 	wl_signal_add(&c->output_created_signal,
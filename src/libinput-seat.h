@@ -44,6 +44,12 @@ struct udev_input {
 	struct wl_event_source *libinput_source;
 	struct weston_compositor *compositor;
 	int suspended;
+
+	/* Devices are set up once the first frame is out, see
+	 * udev_input_enable() */
+	struct wl_event_source *probe_idle;
+	struct wl_event_source *probe_timer;
+	struct wl_list frame_waits;
 };
 
 int
@@ -27,10 +27,15 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <errno.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/time.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
 
 #include <wayland-util.h>
 
@@ -38,37 +43,373 @@
 
 #include "os-compatibility.h"
 
+/* Asynchronous mode: messages are formatted by the caller into a
+ * bounded ring of slots and written out by a background thread.  The
+ * ring is a multi-producer, single-consumer queue where every slot
+ * carries a sequence number (Vyukov style), so producers never block
+ * and never take a lock.  A message longer than one slot takes
+ * several consecutive ones.  When the ring is full the message is
+ * dropped and counted.
+ *
+ * Producers announce themselves in the writers count before they
+ * touch the ring, so weston_log_flush_sync() can tell when the last
+ * one is done with it.  The ring is never freed while that count is
+ * not zero. */
+#define LOG_RING_SLOTS		4096
+#define LOG_SLOT_PAYLOAD	248
+#define LOG_MESSAGE_MAX		4096
+
+struct log_slot {
+	uint32_t seq;
+	uint32_t len;
+	char data[LOG_SLOT_PAYLOAD];
+};
+
+struct log_ring {
+	struct log_slot *slots;
+	uint32_t enqueue_pos;
+	uint32_t dequeue_pos;
+	uint32_t dropped;
+	uint32_t writers;
+	int done;
+	sem_t ready;
+	pthread_t thread;
+};
+
 static FILE *weston_logfile = NULL;
+static struct log_ring *log_ring;
 
 static int cached_tm_mday = -1;
+/* Per thread, as the log writer makes logging from threads common */
+static __thread time_t cached_sec = -1;
+static __thread char cached_time[32];
 
-static int weston_log_timestamp(void)
+static int
+weston_log_format_timestamp(char *buf, size_t size)
 {
 	struct timeval tv;
-	struct tm *brokendown_time;
+	struct tm tm, *brokendown_time;
 	char string[128];
+	int l = 0;
 
 	gettimeofday(&tv, NULL);
 
-	brokendown_time = localtime(&tv.tv_sec);
-	if (brokendown_time == NULL)
-		return fprintf(weston_logfile, "[(NULL)localtime] ");
+	/* localtime() and strftime() only once per second */
+	if (tv.tv_sec != cached_sec) {
+		brokendown_time = localtime_r(&tv.tv_sec, &tm);
+		if (brokendown_time == NULL)
+			return snprintf(buf, size, "[(NULL)localtime] ");
+
+		if (brokendown_time->tm_mday != cached_tm_mday) {
+			strftime(string, sizeof string, "%Y-%m-%d %Z",
+				 brokendown_time);
+			l = snprintf(buf, size, "Date: %s\n", string);
+			if (l < 0 || (size_t) l >= size)
+				return l;
+
+			cached_tm_mday = brokendown_time->tm_mday;
+		}
+
+		strftime(cached_time, sizeof cached_time, "%H:%M:%S",
+			 brokendown_time);
+		cached_sec = tv.tv_sec;
+	}
+
+	return l + snprintf(buf + l, size - l, "[%s.%03li] ",
+			    cached_time, tv.tv_usec / 1000);
+}
+
+static int weston_log_timestamp(void)
+{
+	char string[256];
+
+	if (weston_log_format_timestamp(string, sizeof string) < 0)
+		return 0;
+
+	return fprintf(weston_logfile, "%s", string);
+}
+
+static void
+log_ring_write_dropped(struct log_ring *ring, uint32_t *reported)
+{
+	uint32_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+
+	if (dropped != *reported) {
+		fprintf(weston_logfile, "[log: %u messages dropped]\n",
+			dropped - *reported);
+		*reported = dropped;
+	}
+}
+
+/* Write out whatever is queued.  Only the writer thread, or
+ * weston_log_flush_sync() once the thread is gone, may call this. */
+static void
+log_ring_drain(struct log_ring *ring, uint32_t *reported)
+{
+	struct log_slot *slot;
+	uint32_t pos = ring->dequeue_pos;
+
+	while (1) {
+		slot = &ring->slots[pos % LOG_RING_SLOTS];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+			break;
+
+		fwrite(slot->data, 1, slot->len, weston_logfile);
+		__atomic_store_n(&slot->seq, pos + LOG_RING_SLOTS,
+				 __ATOMIC_RELEASE);
+		pos++;
+	}
+
+	ring->dequeue_pos = pos;
+	log_ring_write_dropped(ring, reported);
+	fflush(weston_logfile);
+}
+
+static void *
+log_ring_thread(void *data)
+{
+	struct log_ring *ring = data;
+	uint32_t reported = 0;
+
+	while (1) {
+		while (sem_wait(&ring->ready) < 0)
+			;
+
+		log_ring_drain(ring, &reported);
+
+		if (__atomic_load_n(&ring->done, __ATOMIC_ACQUIRE)) {
+			log_ring_drain(ring, &reported);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static int
+log_ring_push(struct log_ring *ring, const char *msg, size_t len)
+{
+	struct log_slot *slot;
+	uint32_t pos, n, i;
+	size_t chunk;
+
+	n = (len + LOG_SLOT_PAYLOAD - 1) / LOG_SLOT_PAYLOAD;
+	if (n == 0)
+		return 0;
+
+	/* The consumer frees slots in order, so if the last slot we
+	 * want is free for this lap all the ones before it are too. */
+	pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+	do {
+		slot = &ring->slots[(pos + n - 1) % LOG_RING_SLOTS];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) !=
+		    pos + n - 1) {
+			__atomic_fetch_add(&ring->dropped, 1,
+					   __ATOMIC_RELAXED);
+			return -1;
+		}
+	} while (!__atomic_compare_exchange_n(&ring->enqueue_pos, &pos,
+					      pos + n, 1, __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+
+	for (i = 0; i < n; i++) {
+		slot = &ring->slots[(pos + i) % LOG_RING_SLOTS];
+		chunk = len < LOG_SLOT_PAYLOAD ? len : LOG_SLOT_PAYLOAD;
+		memcpy(slot->data, msg, chunk);
+		slot->len = chunk;
+		msg += chunk;
+		len -= chunk;
+		__atomic_store_n(&slot->seq, pos + i + 1, __ATOMIC_RELEASE);
+	}
+
+	sem_post(&ring->ready);
+
+	return 0;
+}
+
+/* Returns the ring to queue a message in, or NULL to write the
+ * message synchronously.  A ring returned here must be handed back
+ * with log_ring_put(). */
+static struct log_ring *
+log_ring_get(void)
+{
+	struct log_ring *ring;
+
+	ring = __atomic_load_n(&log_ring, __ATOMIC_ACQUIRE);
+	if (!ring)
+		return NULL;
+
+	__atomic_fetch_add(&ring->writers, 1, __ATOMIC_SEQ_CST);
+
+	/* Lost a race with weston_log_flush_sync() */
+	if (__atomic_load_n(&log_ring, __ATOMIC_SEQ_CST) != ring) {
+		__atomic_fetch_sub(&ring->writers, 1, __ATOMIC_RELEASE);
+		return NULL;
+	}
+
+	return ring;
+}
+
+static void
+log_ring_put(struct log_ring *ring)
+{
+	__atomic_fetch_sub(&ring->writers, 1, __ATOMIC_RELEASE);
+}
+
+static int
+weston_log_async(struct log_ring *ring, const char *fmt, va_list ap,
+		 int timestamp)
+{
+	char buf[LOG_MESSAGE_MAX];
+	int l = 0, r;
+
+	if (timestamp) {
+		l = weston_log_format_timestamp(buf, sizeof buf);
+		if (l < 0)
+			l = 0;
+	}
+
+	r = vsnprintf(buf + l, sizeof buf - l, fmt, ap);
+	if (r < 0)
+		return r;
+
+	l += r;
+	if ((size_t) l >= sizeof buf) {
+		/* Keep the truncated message on its own line */
+		l = sizeof buf - 1;
+		buf[l - 1] = '\n';
+	}
+
+	log_ring_push(ring, buf, l);
+
+	return l;
+}
+
+/** Write the log from a background thread
+ *
+ * From here on weston_log() and friends only format the message and
+ * queue it.  weston_log_file_close() and weston_log_flush_sync()
+ * write out everything still queued.
+ */
+int
+weston_log_start_async(void)
+{
+	struct log_ring *ring;
+	uint32_t i;
+
+	if (__atomic_load_n(&log_ring, __ATOMIC_ACQUIRE))
+		return 0;
+
+	ring = zalloc(sizeof *ring);
+	if (!ring)
+		return -1;
+
+	ring->slots = calloc(LOG_RING_SLOTS, sizeof *ring->slots);
+	if (!ring->slots)
+		goto err_ring;
+
+	for (i = 0; i < LOG_RING_SLOTS; i++)
+		ring->slots[i].seq = i;
+
+	if (sem_init(&ring->ready, 0, 0) < 0)
+		goto err_slots;
+
+	/* The writer flushes whenever the queue runs empty */
+	fflush(weston_logfile);
+	if (weston_logfile != stderr)
+		setvbuf(weston_logfile, NULL, _IOFBF, 0);
 
-	if (brokendown_time->tm_mday != cached_tm_mday) {
-		strftime(string, sizeof string, "%Y-%m-%d %Z", brokendown_time);
-		fprintf(weston_logfile, "Date: %s\n", string);
+	if (pthread_create(&ring->thread, NULL, log_ring_thread, ring) != 0)
+		goto err_sem;
 
-		cached_tm_mday = brokendown_time->tm_mday;
+	__atomic_store_n(&log_ring, ring, __ATOMIC_RELEASE);
+
+	return 0;
+
+err_sem:
+	sem_destroy(&ring->ready);
+err_slots:
+	free(ring->slots);
+err_ring:
+	free(ring);
+	return -1;
+}
+
+/** Go back to writing the log synchronously
+ *
+ * Stops the writer thread after it wrote out everything queued.  Also
+ * used from the crash handler, so it does not wait for more than a
+ * second; a slow writer is left to finish on its own.  A ring that
+ * producers or the writer may still hold is leaked rather than freed.
+ */
+void
+weston_log_flush_sync(void)
+{
+	struct log_ring *ring;
+	struct timespec timeout, now;
+	uint32_t reported;
+	int ret;
+
+	ring = __atomic_exchange_n(&log_ring, NULL, __ATOMIC_SEQ_CST);
+	if (!ring)
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &timeout);
+	timeout.tv_sec += 1;
+
+	/* New messages go out synchronously now, wait for the ones
+	 * being queued.  When we crashed in the middle of queueing one
+	 * it never finishes. */
+	while (__atomic_load_n(&ring->writers, __ATOMIC_ACQUIRE) != 0) {
+		clock_gettime(CLOCK_REALTIME, &now);
+		if (now.tv_sec > timeout.tv_sec ||
+		    (now.tv_sec == timeout.tv_sec &&
+		     now.tv_nsec >= timeout.tv_nsec))
+			break;
+		sched_yield();
 	}
 
-	strftime(string, sizeof string, "%H:%M:%S", brokendown_time);
+	__atomic_store_n(&ring->done, 1, __ATOMIC_RELEASE);
+	sem_post(&ring->ready);
 
-	return fprintf(weston_logfile, "[%s.%03li] ", string, tv.tv_usec/1000);
+	ret = pthread_timedjoin_np(ring->thread, NULL, &timeout);
+	if (ret == EDEADLK) {
+		/* We crashed in the writer thread itself */
+		reported = ring->dropped;
+		log_ring_drain(ring, &reported);
+		return;
+	} else if (ret != 0) {
+		return;
+	}
+
+	if (__atomic_load_n(&ring->writers, __ATOMIC_ACQUIRE) != 0) {
+		/* The thread is gone, write out what is queued so far */
+		reported = ring->dropped;
+		log_ring_drain(ring, &reported);
+		return;
+	}
+
+	sem_destroy(&ring->ready);
+	free(ring->slots);
+	free(ring);
+
+	if (weston_logfile != stderr)
+		setvbuf(weston_logfile, NULL, _IOLBF, 256);
 }
 
 static void
 custom_handler(const char *fmt, va_list arg)
 {
+	struct log_ring *ring = log_ring_get();
+	char buf[LOG_MESSAGE_MAX];
+
+	if (ring) {
+		snprintf(buf, sizeof buf, "libwayland: %s", fmt);
+		weston_log_async(ring, buf, arg, 1);
+		log_ring_put(ring);
+		return;
+	}
+
 	weston_log_timestamp();
 	fprintf(weston_logfile, "libwayland: ");
 	vfprintf(weston_logfile, fmt, arg);
@@ -94,6 +435,8 @@ weston_log_file_open(const char *filename)
 void
 weston_log_file_close()
 {
+	weston_log_flush_sync();
+
 	if ((weston_logfile != stderr) && (weston_logfile != NULL))
 		fclose(weston_logfile);
 	weston_logfile = stderr;
@@ -102,8 +445,15 @@ weston_log_file_close()
 WL_EXPORT int
 weston_vlog(const char *fmt, va_list ap)
 {
+	struct log_ring *ring = log_ring_get();
 	int l;
 
+	if (ring) {
+		l = weston_log_async(ring, fmt, ap, 1);
+		log_ring_put(ring);
+		return l;
+	}
+
 	l = weston_log_timestamp();
 	l += vfprintf(weston_logfile, fmt, ap);
 
@@ -126,6 +476,15 @@ weston_log(const char *fmt, ...)
 WL_EXPORT int
 weston_vlog_continue(const char *fmt, va_list argp)
 {
+	struct log_ring *ring = log_ring_get();
+	int l;
+
+	if (ring) {
+		l = weston_log_async(ring, fmt, argp, 0);
+		log_ring_put(ring);
+		return l;
+	}
+
 	return vfprintf(weston_logfile, fmt, argp);
 }
 
@@ -266,6 +266,7 @@ usage(int error_code)
 		"  -i, --idle-time=SECS\tIdle time in seconds\n"
 		"  --modules\t\tLoad the comma-separated list of modules\n"
 		"  --log=FILE\t\tLog to the given file\n"
+		"  --log-async\t\tWrite the log from a background thread\n"
 		"  -c, --config=FILE\tConfig file to load, defaults to weston.ini\n"
 		"  --no-config\t\tDo not read weston.ini\n"
 		"  -h, --help\t\tThis help message\n\n");
@@ -336,6 +337,7 @@ usage(int error_code)
 		"  --use-pixman\t\tUse the pixman (CPU) renderer\n"
 		"  --output-count=COUNT\tCreate multiple outputs\n"
 		"  --sprawl\t\tCreate one fullscreen output for every parent output\n"
+		"  --passthrough\t\tHand suitable client buffers to the parent compositor\n"
 		"  --display=DISPLAY\tWayland display to connect to\n\n");
 #endif
 
@@ -375,6 +377,7 @@ on_caught_signal(int s, siginfo_t *siginfo, void *context)
 	 * will allow weston to switch back to gdb on crash and then
 	 * gdb will catch the crash with SIGTRAP.*/
 
+	weston_log_flush_sync();
 	weston_log("caught signal: %d\n", s);
 
 	print_backtrace();
@@ -512,6 +515,7 @@ weston_compositor_init_config(struct weston_compositor *ec,
 	struct weston_config_section *s;
 	int repaint_msec;
 	int vt_switching;
+	int coalesce;
 
 	s = weston_config_get_section(config, "keyboard", NULL, NULL);
 	weston_config_section_get_string(s, "keymap_rules",
@@ -549,6 +553,10 @@ weston_compositor_init_config(struct weston_compositor *ec,
 	weston_log("Output repaint window is %d ms maximum.\n",
 		   ec->repaint_msec);
 
+	weston_config_section_get_bool(s, "coalesce-pointer-motion",
+				       &coalesce, false);
+	ec->coalesce_pointer_motion = coalesce;
+
 	return 0;
 }
 
@@ -1140,6 +1148,7 @@ load_wayland_backend_config(struct weston_compositor *compositor, int *argc,
 		{ WESTON_OPTION_INTEGER, "output-count", 0, &count },
 		{ WESTON_OPTION_BOOLEAN, "fullscreen", 0, &config->fullscreen },
 		{ WESTON_OPTION_BOOLEAN, "sprawl", 0, &config->sprawl },
+		{ WESTON_OPTION_BOOLEAN, "passthrough", 0, &config->passthrough },
 	};
 
 	width = 0;
@@ -1150,6 +1159,7 @@ load_wayland_backend_config(struct weston_compositor *compositor, int *argc,
 	count = 1;
 	config->fullscreen = 0;
 	config->sprawl = 0;
+	config->passthrough = 0;
 	parse_options(wayland_options,
 		      ARRAY_LENGTH(wayland_options), argc, argv);
 
@@ -1293,6 +1303,7 @@ int main(int argc, char *argv[])
 	char *socket_name = NULL;
 	int32_t version = 0;
 	int32_t noconfig = 0;
+	int32_t log_async = 0;
 	int32_t numlock_on;
 	char *config_file = NULL;
 	struct weston_config *config = NULL;
@@ -1308,6 +1319,7 @@ int main(int argc, char *argv[])
 		{ WESTON_OPTION_INTEGER, "idle-time", 'i', &idle_time },
 		{ WESTON_OPTION_STRING, "modules", 0, &option_modules },
 		{ WESTON_OPTION_STRING, "log", 0, &log },
+		{ WESTON_OPTION_BOOLEAN, "log-async", 0, &log_async },
 		{ WESTON_OPTION_BOOLEAN, "help", 'h', &help },
 		{ WESTON_OPTION_BOOLEAN, "version", 0, &version },
 		{ WESTON_OPTION_BOOLEAN, "no-config", 0, &noconfig },
@@ -1325,6 +1337,9 @@ int main(int argc, char *argv[])
 	}
 
 	weston_log_file_open(log);
+	if (log_async && weston_log_start_async() < 0)
+		fprintf(stderr, "failed to start the log writer thread, "
+			"logging synchronously\n");
 
 	weston_log("%s\n"
 		   STAMP_SPACE "%s\n"
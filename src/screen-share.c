@@ -34,16 +34,21 @@
 #include <sys/mman.h>
 #include <signal.h>
 #include <linux/input.h>
-#include <errno.h>
 #include <ctype.h>
+#include <time.h>
 
 #include <wayland-client.h>
 
 #include "compositor.h"
 #include "shared/helpers.h"
 #include "shared/os-compatibility.h"
+#include "shared/timespec-util.h"
 #include "fullscreen-shell-unstable-v1-client-protocol.h"
 
+/* Buffers shared with the parent, one being shown, one queued and one
+ * being filled */
+#define SS_MAX_BUFFERS 3
+
 struct shared_output {
 	struct weston_output *output;
 	struct wl_listener output_destroyed;
@@ -63,19 +68,28 @@ struct shared_output {
 	} parent;
 
 	struct wl_event_source *event_source;
-	struct wl_listener frame_listener;
+	struct weston_capture_sink capture_sink;
 
 	struct {
 		int32_t width, height;
 
 		struct wl_list buffers;
 		struct wl_list free_buffers;
+		int count;
+		int exhausted;
 	} shm;
 
-	int cache_dirty;
+	/* Filled buffer waiting for the parent frame callback */
+	struct ss_shm_buffer *ready;
+	/* Damage not yet sent to the parent, in output coordinates */
+	pixman_region32_t pending_damage;
+
+	/* Only used for transformed or scaled outputs, where the pixels
+	 * read back cannot be copied as is into the shared buffers */
 	pixman_image_t *cache_image;
-	uint32_t *tmp_data;
-	size_t tmp_data_size;
+
+	uint32_t frame_count;
+	struct timespec start_time;
 };
 
 struct ss_seat {
@@ -394,11 +408,20 @@ static void
 buffer_release(void *data, struct wl_buffer *buffer)
 {
 	struct ss_shm_buffer *sb = data;
+	struct shared_output *so = sb->output;
 
-	if (sb->output) {
-		wl_list_insert(&sb->output->shm.free_buffers, &sb->free_link);
-	} else {
+	if (!so) {
 		ss_shm_buffer_destroy(sb);
+		return;
+	}
+
+	wl_list_insert(&so->shm.free_buffers, &sb->free_link);
+
+	/* We skipped frames for want of a buffer, the pixels can only be
+	 * read back while the output repaints */
+	if (so->shm.exhausted) {
+		so->shm.exhausted = 0;
+		weston_output_schedule_repaint(so->output);
 	}
 }
 
@@ -428,14 +451,29 @@ shared_output_get_shm_buffer(struct shared_output *so)
 		wl_list_for_each_safe(sb, bnext, &so->shm.free_buffers, free_link)
 			ss_shm_buffer_destroy(sb);
 
+		/* The queued buffer was never attached, nothing would
+		 * release it */
+		if (so->ready) {
+			ss_shm_buffer_destroy(so->ready);
+			so->ready = NULL;
+		}
+
 		/* Orphan in-use buffers so they get destroyed */
 		wl_list_for_each(sb, &so->shm.buffers, link)
 			sb->output = NULL;
 
 		so->shm.width = width;
 		so->shm.height = height;
+		so->shm.count = 0;
+
+		pixman_region32_fini(&so->pending_damage);
+		pixman_region32_init_rect(&so->pending_damage,
+					  0, 0, width, height);
 	}
 
+	if (so->ready)
+		return so->ready;
+
 	if (!wl_list_empty(&so->shm.free_buffers)) {
 		sb = container_of(so->shm.free_buffers.next,
 				  struct ss_shm_buffer, free_link);
@@ -445,6 +483,11 @@ shared_output_get_shm_buffer(struct shared_output *so)
 		return sb;
 	}
 
+	if (so->shm.count >= SS_MAX_BUFFERS) {
+		so->shm.exhausted = 1;
+		return NULL;
+	}
+
 	fd = os_create_anonymous_file(height * stride);
 	if (fd < 0) {
 		weston_log("os_create_anonymous_file: %m\n");
@@ -461,6 +504,7 @@ shared_output_get_shm_buffer(struct shared_output *so)
 	if (!sb)
 		goto out_unmap;
 
+	so->shm.count++;
 	sb->output = so;
 	wl_list_init(&sb->free_link);
 	wl_list_insert(&so->shm.buffers, &sb->link);
@@ -552,44 +596,8 @@ output_compute_transform(struct weston_output *output,
 static void
 shared_output_destroy(struct shared_output *so);
 
-static int
-shared_output_ensure_tmp_data(struct shared_output *so,
-			      pixman_region32_t *region)
-{
-	pixman_box32_t *ext;
-	size_t size;
-
-	if (!pixman_region32_not_empty(region))
-		return 0;
-
-	ext = pixman_region32_extents(region);
-
-	/* Damage is in output coordinates.
-	 *
-	 * We are multiplying by 4 because the temporary data needs to be able
-	 * to store an 32 bit-per-pixel buffer.
-	 */
-	size = 4 * (ext->x2 - ext->x1) * (ext->y2 - ext->y1)
-		 * so->output->current_scale * so->output->current_scale;
-
-	if (so->tmp_data != NULL && size <= so->tmp_data_size)
-		return 0;
-
-	free(so->tmp_data);
-	so->tmp_data = malloc(size);
-	if (so->tmp_data == NULL) {
-		so->tmp_data_size = 0;
-		errno = ENOMEM;
-		return -1;
-	}
-
-	so->tmp_data_size = size;
-
-	return 0;
-}
-
 static void
-shared_output_update(struct shared_output *so);
+shared_output_commit(struct shared_output *so);
 
 static void
 shared_output_frame_callback(void *data, struct wl_callback *cb, uint32_t time)
@@ -602,30 +610,50 @@ shared_output_frame_callback(void *data, struct wl_callback *cb, uint32_t time)
 	wl_callback_destroy(cb);
 	so->parent.frame_cb = NULL;
 
-	shared_output_update(so);
+	shared_output_commit(so);
 }
 
 static const struct wl_callback_listener shared_output_frame_listener = {
 	shared_output_frame_callback
 };
 
+/* Hand the filled buffer to the parent, unless it is still busy with the
+ * previous one. There is no roundtrip: buffers come back through
+ * wl_buffer.release, frames are paced by the parent frame callback. */
 static void
-shared_output_update(struct shared_output *so)
+shared_output_commit(struct shared_output *so)
 {
-	struct ss_shm_buffer *sb;
+	struct ss_shm_buffer *sb = so->ready;
 	pixman_box32_t *r;
 	int i, nrects;
-	pixman_transform_t transform;
 
-	/* Only update if we need to */
-	if (!so->cache_dirty || so->parent.frame_cb)
+	if (!sb || so->parent.frame_cb)
 		return;
 
-	sb = shared_output_get_shm_buffer(so);
-	if (sb == NULL) {
-		shared_output_destroy(so);
-		return;
-	}
+	r = pixman_region32_rectangles(&so->pending_damage, &nrects);
+	for (i = 0; i < nrects; ++i)
+		wl_surface_damage(so->parent.surface, r[i].x1, r[i].y1,
+				  r[i].x2 - r[i].x1, r[i].y2 - r[i].y1);
+
+	wl_surface_attach(so->parent.surface, sb->buffer, 0, 0);
+
+	so->parent.frame_cb = wl_surface_frame(so->parent.surface);
+	wl_callback_add_listener(so->parent.frame_cb,
+				 &shared_output_frame_listener, so);
+
+	wl_surface_commit(so->parent.surface);
+	wl_display_flush(so->parent.display);
+
+	pixman_region32_clear(&so->pending_damage);
+	so->ready = NULL;
+	so->frame_count++;
+}
+
+static void
+shared_output_fill_from_cache(struct shared_output *so,
+			      struct ss_shm_buffer *sb)
+{
+	pixman_transform_t transform;
 
 	output_compute_transform(so->output, &transform);
 	pixman_image_set_transform(so->cache_image, &transform);
@@ -652,25 +680,65 @@ shared_output_update(struct shared_output *so)
 
 	pixman_image_set_transform(sb->pm_image, NULL);
 	pixman_image_set_clip_region32(sb->pm_image, NULL);
+}
+
+/* Read the damaged pixels back straight into the shared buffer. Only
+ * valid for untransformed outputs of scale 1, where output and
+ * framebuffer coordinates are the same. */
+static void
+shared_output_fill_direct(struct shared_output *so, struct ss_shm_buffer *sb,
+			  struct weston_capture_frame *frame)
+{
+	pixman_box32_t *r;
+	int i, nrects;
 
 	r = pixman_region32_rectangles(&sb->damage, &nrects);
 	for (i = 0; i < nrects; ++i)
-		wl_surface_damage(so->parent.surface, r[i].x1, r[i].y1,
-				  r[i].x2 - r[i].x1, r[i].y2 - r[i].y1);
+		weston_capture_frame_copy_rect(frame, sb->data, so->shm.width,
+					       r[i].x1, r[i].y1,
+					       r[i].x2 - r[i].x1,
+					       r[i].y2 - r[i].y1);
+}
 
-	wl_surface_attach(so->parent.surface, sb->buffer, 0, 0);
+static int
+shared_output_update_cache(struct shared_output *so, pixman_region32_t *damage,
+			   struct weston_capture_frame *frame)
+{
+	int32_t width, height, stride;
+	int i, nrects;
+	pixman_box32_t *r;
+	uint32_t *cache_data;
 
-	so->parent.frame_cb = wl_surface_frame(so->parent.surface);
-	wl_callback_add_listener(so->parent.frame_cb,
-				 &shared_output_frame_listener, so);
+	width = so->output->current_mode->width;
+	height = so->output->current_mode->height;
+	stride = width;
 
-	wl_surface_commit(so->parent.surface);
-	wl_callback_destroy(wl_display_sync(so->parent.display));
-	wl_display_flush(so->parent.display);
+	if (!so->cache_image ||
+	    pixman_image_get_width(so->cache_image) != width ||
+	    pixman_image_get_height(so->cache_image) != height) {
+		if (so->cache_image)
+			pixman_image_unref(so->cache_image);
 
-	/* Clear the buffer damage */
-	pixman_region32_fini(&sb->damage);
-	pixman_region32_init(&sb->damage);
+		so->cache_image =
+			pixman_image_create_bits(PIXMAN_a8r8g8b8,
+						 width, height, NULL,
+						 stride);
+		if (!so->cache_image)
+			return -1;
+
+		pixman_region32_fini(damage);
+		pixman_region32_init_rect(damage, 0, 0, width, height);
+	}
+
+	cache_data = pixman_image_get_data(so->cache_image);
+	r = pixman_region32_rectangles(damage, &nrects);
+	for (i = 0; i < nrects; ++i)
+		weston_capture_frame_copy_rect(frame, cache_data, stride,
+					       r[i].x1, r[i].y1,
+					       r[i].x2 - r[i].x1,
+					       r[i].y2 - r[i].y1);
+
+	return 0;
 }
 
 static void
@@ -785,17 +853,52 @@ struct zwp_fullscreen_shell_mode_feedback_v1_listener mode_feedback_listener = {
 	mode_feedback_ok,
 };
 
+static int
+shared_output_is_direct(struct shared_output *so)
+{
+	return so->output->transform == WL_OUTPUT_TRANSFORM_NORMAL &&
+	       so->output->current_scale == 1;
+}
+
+/* Besides the frame damage, ask for whatever the buffers we may fill
+ * this frame are missing, or for everything when the cache has to be
+ * (re)created. */
 static void
-shared_output_repainted(struct wl_listener *listener, void *data)
+shared_output_prepare_capture(struct weston_capture_sink *sink)
 {
 	struct shared_output *so =
-		container_of(listener, struct shared_output, frame_listener);
+		container_of(sink, struct shared_output, capture_sink);
+	struct ss_shm_buffer *sb;
+
+	pixman_region32_clear(&sink->region);
+
+	if (shared_output_is_direct(so)) {
+		wl_list_for_each(sb, &so->shm.buffers, link)
+			pixman_region32_union(&sink->region, &sink->region,
+					      &sb->damage);
+	} else if (!so->cache_image ||
+		   pixman_image_get_width(so->cache_image) !=
+		   so->output->current_mode->width ||
+		   pixman_image_get_height(so->cache_image) !=
+		   so->output->current_mode->height) {
+		pixman_region32_union_rect(&sink->region, &sink->region,
+					   0, 0,
+					   so->output->current_mode->width,
+					   so->output->current_mode->height);
+	}
+}
+
+static void
+shared_output_repainted(struct weston_capture_sink *sink,
+			struct weston_capture_frame *frame)
+{
+	struct shared_output *so =
+		container_of(sink, struct shared_output, capture_sink);
 	pixman_region32_t damage;
 	struct ss_shm_buffer *sb;
-	int32_t x, y, width, height, stride;
-	int i, nrects, do_yflip;
-	pixman_box32_t *r;
-	uint32_t *cache_data;
+	int direct;
+
+	direct = shared_output_is_direct(so);
 
 	/* Damage in output coordinates */
 	pixman_region32_init(&damage);
@@ -806,74 +909,48 @@ shared_output_repainted(struct wl_listener *listener, void *data)
 	/* Apply damage to all buffers */
 	wl_list_for_each(sb, &so->shm.buffers, link)
 		pixman_region32_union(&sb->damage, &sb->damage, &damage);
+	pixman_region32_union(&so->pending_damage, &so->pending_damage, &damage);
 
-	/* Transform to buffer coordinates */
-	weston_transformed_region(so->output->width, so->output->height,
-				  so->output->transform,
-				  so->output->current_scale,
-				  &damage, &damage);
-
-	width = so->output->current_mode->width;
-	height = so->output->current_mode->height;
-	stride = width;
-
-	if (!so->cache_image ||
-	    pixman_image_get_width(so->cache_image) != width ||
-	    pixman_image_get_height(so->cache_image) != height) {
-		if (so->cache_image)
-			pixman_image_unref(so->cache_image);
+	if (!direct) {
+		/* Same damage, in buffer coordinates */
+		pixman_region32_copy(&damage, frame->damage);
 
-		so->cache_image =
-			pixman_image_create_bits(PIXMAN_a8r8g8b8,
-						 width, height, NULL,
-						 stride);
-		if (!so->cache_image) {
+		if (shared_output_update_cache(so, &damage, frame) < 0) {
+			pixman_region32_fini(&damage);
 			shared_output_destroy(so);
 			return;
 		}
-
-		pixman_region32_fini(&damage);
-		pixman_region32_init_rect(&damage, 0, 0, width, height);
 	}
 
-	if (shared_output_ensure_tmp_data(so, &damage) < 0) {
+	pixman_region32_fini(&damage);
+
+	sb = shared_output_get_shm_buffer(so);
+	if (sb == NULL) {
+		/* All buffers are with the parent, this frame is skipped
+		 * and its damage stays accumulated in the buffers */
+		if (so->shm.exhausted)
+			return;
+
 		shared_output_destroy(so);
 		return;
 	}
 
-	do_yflip = !!(so->output->compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
-
-	cache_data = pixman_image_get_data(so->cache_image);
-	r = pixman_region32_rectangles(&damage, &nrects);
-	for (i = 0; i < nrects; ++i) {
-		x = r[i].x1;
-		y = r[i].y1;
-		width = r[i].x2 - r[i].x1;
-		height = r[i].y2 - r[i].y1;
-
-		if (do_yflip) {
-			so->output->compositor->renderer->read_pixels(
-				so->output, PIXMAN_a8r8g8b8, so->tmp_data,
-				x, so->output->current_mode->height - r[i].y2,
-				width, height);
-
-			pixman_blt(so->tmp_data, cache_data, -width, stride,
-				   32, 32, 0, 1 - height, x, y, width, height);
-		} else {
-			so->output->compositor->renderer->read_pixels(
-				so->output, PIXMAN_a8r8g8b8, so->tmp_data,
-				x, y, width, height);
-
-			pixman_blt(so->tmp_data, cache_data, width, stride,
-				   32, 32, 0, 0, x, y, width, height);
-		}
+	if (!pixman_region32_not_empty(&sb->damage) && sb != so->ready) {
+		/* Nothing new for the parent */
+		if (wl_list_empty(&sb->free_link))
+			wl_list_insert(&so->shm.free_buffers, &sb->free_link);
+		return;
 	}
 
-	pixman_region32_fini(&damage);
+	if (direct)
+		shared_output_fill_direct(so, sb, frame);
+	else
+		shared_output_fill_from_cache(so, sb);
 
-	so->cache_dirty = 1;
+	pixman_region32_clear(&sb->damage);
+	so->ready = sb;
 
-	shared_output_update(so);
+	shared_output_commit(so);
 }
 
 static struct shared_output *
@@ -956,13 +1033,19 @@ shared_output_create(struct weston_output *output, int parent_fd)
 	/* Ok, everything's created.  We should be good to go */
 	wl_list_init(&so->shm.buffers);
 	wl_list_init(&so->shm.free_buffers);
+	pixman_region32_init(&so->pending_damage);
+	weston_compositor_read_presentation_clock(output->compositor,
+						  &so->start_time);
 
 	so->output = output;
 	so->output_destroyed.notify = output_destroyed;
 	wl_signal_add(&so->output->destroy_signal, &so->output_destroyed);
 
-	so->frame_listener.notify = shared_output_repainted;
-	wl_signal_add(&output->frame_signal, &so->frame_listener);
+	weston_capture_sink_init(&so->capture_sink, PIXMAN_a8r8g8b8,
+				 WESTON_CAPTURE_SINK_DAMAGE);
+	so->capture_sink.prepare = shared_output_prepare_capture;
+	so->capture_sink.frame = shared_output_repainted;
+	weston_output_add_capture_sink(output, &so->capture_sink);
 	output->disable_planes++;
 	weston_output_damage(output);
 
@@ -983,6 +1066,16 @@ static void
 shared_output_destroy(struct shared_output *so)
 {
 	struct ss_shm_buffer *buffer, *bnext;
+	struct timespec now, elapsed;
+	int64_t msec;
+
+	weston_compositor_read_presentation_clock(so->output->compositor, &now);
+	timespec_sub(&elapsed, &now, &so->start_time);
+	msec = timespec_to_nsec(&elapsed) / 1000000;
+	if (msec > 0)
+		weston_log("Screen share: %u frames sent in %lld ms, %.1f fps\n",
+			   so->frame_count, (long long)msec,
+			   so->frame_count * 1000.0 / msec);
 
 	so->output->disable_planes--;
 
@@ -995,10 +1088,11 @@ shared_output_destroy(struct shared_output *so)
 	wl_event_source_remove(so->event_source);
 
 	wl_list_remove(&so->output_destroyed.link);
-	wl_list_remove(&so->frame_listener.link);
+	weston_capture_sink_remove(&so->capture_sink);
 
-	pixman_image_unref(so->cache_image);
-	free(so->tmp_data);
+	pixman_region32_fini(&so->pending_damage);
+	if (so->cache_image)
+		pixman_image_unref(so->cache_image);
 
 	free(so);
 }
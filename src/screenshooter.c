@@ -32,12 +32,20 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/uio.h>
+#include <pthread.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "compositor.h"
 #include "weston-screenshooter-server-protocol.h"
 #include "shared/helpers.h"
 
 #include "wcap/wcap-decode.h"
+#include "wcap/wcap-rle.h"
 
 struct screenshooter {
 	struct weston_compositor *ec;
@@ -48,153 +56,151 @@ struct screenshooter {
 };
 
 struct screenshooter_frame_listener {
-	struct wl_listener listener;
+	struct weston_capture_sink sink;
 	struct weston_buffer *buffer;
+	/* Requested area in framebuffer coordinates */
+	int32_t x, y, width, height;
 	weston_screenshooter_done_func_t done;
 	void *data;
 };
 
 static void
-copy_bgra_yflip(uint8_t *dst, uint8_t *src, int height, int stride)
+copy_row_swap_RB(uint32_t *dst, const uint32_t *src, int n)
 {
-	uint8_t *end;
-
-	end = dst + height * stride;
-	while (dst < end) {
-		memcpy(dst, src, stride);
-		dst += stride;
-		src -= stride;
+	int i = 0;
+
+#if defined(__SSE2__)
+	const __m128i ag = _mm_set1_epi32(0xff00ff00);
+	const __m128i r = _mm_set1_epi32(0x00ff0000);
+	const __m128i b = _mm_set1_epi32(0x000000ff);
+	__m128i v;
+
+	for (; i + 4 <= n; i += 4) {
+		v = _mm_loadu_si128((const __m128i *) (src + i));
+		v = _mm_or_si128(_mm_and_si128(v, ag),
+				 _mm_or_si128(
+					 _mm_and_si128(_mm_srli_epi32(v, 16), b),
+					 _mm_and_si128(_mm_slli_epi32(v, 16), r)));
+		_mm_storeu_si128((__m128i *) (dst + i), v);
 	}
-}
-
-static void
-copy_bgra(uint8_t *dst, uint8_t *src, int height, int stride)
-{
-	/* TODO: optimize this out */
-	memcpy(dst, src, height * stride);
-}
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+	uint8x16x4_t v;
 
-static void
-copy_row_swap_RB(void *vdst, void *vsrc, int bytes)
-{
-	uint32_t *dst = vdst;
-	uint32_t *src = vsrc;
-	uint32_t *end = dst + bytes / 4;
+	for (; i + 16 <= n; i += 16) {
+		v = vld4q_u8((const uint8_t *) (src + i));
+		v = (uint8x16x4_t) { { v.val[2], v.val[1], v.val[0], v.val[3] } };
+		vst4q_u8((uint8_t *) (dst + i), v);
+	}
+#endif
 
-	while (dst < end) {
-		uint32_t v = *src++;
+	for (; i < n; i++) {
+		uint32_t v = src[i];
 		/*                    A R G B */
 		uint32_t tmp = v & 0xff00ff00;
 		tmp |= (v >> 16) & 0x000000ff;
 		tmp |= (v << 16) & 0x00ff0000;
-		*dst++ = tmp;
+		dst[i] = tmp;
 	}
 }
 
+/* Copy the requested area straight from the captured boxes into the
+ * client buffer, undoing the y-flip and swizzling rows as we go. */
 static void
-copy_rgba_yflip(uint8_t *dst, uint8_t *src, int height, int stride)
-{
-	uint8_t *end;
-
-	end = dst + height * stride;
-	while (dst < end) {
-		copy_row_swap_RB(dst, src, stride);
-		dst += stride;
-		src -= stride;
-	}
-}
-
-static void
-copy_rgba(uint8_t *dst, uint8_t *src, int height, int stride)
-{
-	uint8_t *end;
-
-	end = dst + height * stride;
-	while (dst < end) {
-		copy_row_swap_RB(dst, src, stride);
-		dst += stride;
-		src += stride;
-	}
-}
-
-static void
-screenshooter_frame_notify(struct wl_listener *listener, void *data)
+screenshooter_frame_notify(struct weston_capture_sink *sink,
+			   struct weston_capture_frame *frame)
 {
 	struct screenshooter_frame_listener *l =
-		container_of(listener,
-			     struct screenshooter_frame_listener, listener);
-	struct weston_output *output = data;
-	struct weston_compositor *compositor = output->compositor;
-	int32_t stride;
-	uint8_t *pixels, *d, *s;
+		container_of(sink, struct screenshooter_frame_listener, sink);
+	struct weston_output *output = frame->output;
+	struct wl_shm_buffer *shm_buffer = l->buffer->shm_buffer;
+	int32_t fb_height = output->current_mode->height;
+	int32_t x1, y1, x2, y2, y, row, dst_stride, box_width, n;
+	const pixman_box32_t *b;
+	const uint32_t *src;
+	uint8_t *dst, *data;
+	int i, swap;
 
 	output->disable_planes--;
-	wl_list_remove(&listener->link);
-	stride = l->buffer->width * (PIXMAN_FORMAT_BPP(compositor->read_format) / 8);
-	pixels = malloc(stride * l->buffer->height);
+	weston_capture_sink_remove(sink);
 
-	if (pixels == NULL) {
-		l->done(l->data, WESTON_SCREENSHOOTER_NO_MEMORY);
+	/* nothing was read back, e.g. the mode changed meanwhile */
+	if (frame->nboxes == 0) {
+		l->done(l->data, WESTON_SCREENSHOOTER_FAILED);
 		free(l);
 		return;
 	}
 
-	compositor->renderer->read_pixels(output,
-			     compositor->read_format, pixels,
-			     0, 0, output->current_mode->width,
-			     output->current_mode->height);
-
-	stride = wl_shm_buffer_get_stride(l->buffer->shm_buffer);
-
-	d = wl_shm_buffer_get_data(l->buffer->shm_buffer);
-	s = pixels + stride * (l->buffer->height - 1);
-
-	wl_shm_buffer_begin_access(l->buffer->shm_buffer);
-
-	switch (compositor->read_format) {
-	case PIXMAN_a8r8g8b8:
-	case PIXMAN_x8r8g8b8:
-		if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP)
-			copy_bgra_yflip(d, s, output->current_mode->height, stride);
-		else
-			copy_bgra(d, pixels, output->current_mode->height, stride);
-		break;
+	switch (frame->format) {
 	case PIXMAN_x8b8g8r8:
 	case PIXMAN_a8b8g8r8:
-		if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP)
-			copy_rgba_yflip(d, s, output->current_mode->height, stride);
-		else
-			copy_rgba(d, pixels, output->current_mode->height, stride);
+		swap = 1;
 		break;
 	default:
+		swap = 0;
 		break;
 	}
 
-	wl_shm_buffer_end_access(l->buffer->shm_buffer);
+	dst_stride = wl_shm_buffer_get_stride(shm_buffer);
+	data = wl_shm_buffer_get_data(shm_buffer);
+
+	wl_shm_buffer_begin_access(shm_buffer);
+
+	for (i = 0; i < frame->nboxes; i++) {
+		b = &frame->boxes[i];
+		box_width = b->x2 - b->x1;
+
+		/* Box in top-down framebuffer coordinates */
+		x1 = MAX(b->x1, l->x);
+		x2 = MIN(b->x2, l->x + l->width);
+		if (frame->y_flip) {
+			y1 = MAX(fb_height - b->y2, l->y);
+			y2 = MIN(fb_height - b->y1, l->y + l->height);
+		} else {
+			y1 = MAX(b->y1, l->y);
+			y2 = MIN(b->y2, l->y + l->height);
+		}
+		/* Buffers in other formats get the raw 32 bit rows, cut
+		 * to their stride, as shoot always did. */
+		n = MIN(x2, l->x + dst_stride / 4) - x1;
+		if (n <= 0 || y1 >= y2)
+			continue;
+
+		for (y = y1; y < y2; y++) {
+			if (frame->y_flip)
+				row = fb_height - 1 - y - b->y1;
+			else
+				row = y - b->y1;
+
+			src = frame->pixels[i] + row * box_width + x1 - b->x1;
+			dst = data + (y - l->y) * dst_stride + (x1 - l->x) * 4;
+
+			if (swap)
+				copy_row_swap_RB((uint32_t *) dst, src, n);
+			else
+				memcpy(dst, src, n * 4);
+		}
+	}
+
+	wl_shm_buffer_end_access(shm_buffer);
 
 	l->done(l->data, WESTON_SCREENSHOOTER_SUCCESS);
-	free(pixels);
 	free(l);
 }
 
-WL_EXPORT int
-weston_screenshooter_shoot(struct weston_output *output,
-			   struct weston_buffer *buffer,
-			   weston_screenshooter_done_func_t done, void *data)
+static int
+screenshooter_shoot_area(struct weston_output *output,
+			 struct weston_buffer *buffer,
+			 int32_t x, int32_t y,
+			 int32_t width, int32_t height,
+			 weston_screenshooter_done_func_t done,
+			 void *data)
 {
 	struct screenshooter_frame_listener *l;
 
-	if (!wl_shm_buffer_get(buffer->resource)) {
-		done(data, WESTON_SCREENSHOOTER_BAD_BUFFER);
-		return -1;
-	}
-
-	buffer->shm_buffer = wl_shm_buffer_get(buffer->resource);
-	buffer->width = wl_shm_buffer_get_width(buffer->shm_buffer);
-	buffer->height = wl_shm_buffer_get_height(buffer->shm_buffer);
-
-	if (buffer->width < output->current_mode->width ||
-	    buffer->height < output->current_mode->height) {
+	if (width <= 0 || height <= 0 || x < 0 || y < 0 ||
+	    x + width > output->current_mode->width ||
+	    y + height > output->current_mode->height ||
+	    buffer->width < width || buffer->height < height) {
 		done(data, WESTON_SCREENSHOOTER_BAD_BUFFER);
 		return -1;
 	}
@@ -206,16 +212,81 @@ weston_screenshooter_shoot(struct weston_output *output,
 	}
 
 	l->buffer = buffer;
+	l->x = x;
+	l->y = y;
+	l->width = width;
+	l->height = height;
 	l->done = done;
 	l->data = data;
-	l->listener.notify = screenshooter_frame_notify;
-	wl_signal_add(&output->frame_signal, &l->listener);
+	weston_capture_sink_init(&l->sink, output->compositor->read_format, 0);
+	pixman_region32_union_rect(&l->sink.region, &l->sink.region,
+				   x, y, width, height);
+	l->sink.frame = screenshooter_frame_notify;
+	weston_output_add_capture_sink(output, &l->sink);
 	output->disable_planes++;
 	weston_output_schedule_repaint(output);
 
 	return 0;
 }
 
+/** Capture part of an output into an SHM buffer on its next repaint.
+ *
+ * The area is given in framebuffer coordinates and is written to the
+ * top left corner of the buffer, which must be in ARGB8888 or XRGB8888
+ * format.  Only that area is read back.
+ */
+WL_EXPORT int
+weston_screenshooter_shoot_region(struct weston_output *output,
+				  struct weston_buffer *buffer,
+				  int32_t x, int32_t y,
+				  int32_t width, int32_t height,
+				  weston_screenshooter_done_func_t done,
+				  void *data)
+{
+	uint32_t format;
+
+	if (!wl_shm_buffer_get(buffer->resource)) {
+		done(data, WESTON_SCREENSHOOTER_BAD_BUFFER);
+		return -1;
+	}
+
+	buffer->shm_buffer = wl_shm_buffer_get(buffer->resource);
+	buffer->width = wl_shm_buffer_get_width(buffer->shm_buffer);
+	buffer->height = wl_shm_buffer_get_height(buffer->shm_buffer);
+	format = wl_shm_buffer_get_format(buffer->shm_buffer);
+
+	if (format != WL_SHM_FORMAT_ARGB8888 &&
+	    format != WL_SHM_FORMAT_XRGB8888) {
+		done(data, WESTON_SCREENSHOOTER_BAD_BUFFER);
+		return -1;
+	}
+
+	return screenshooter_shoot_area(output, buffer, x, y, width, height,
+					done, data);
+}
+
+/* The buffer format is not checked: the pixels are stored in the
+ * compositor's read format, whatever the buffer claims to be. */
+WL_EXPORT int
+weston_screenshooter_shoot(struct weston_output *output,
+			   struct weston_buffer *buffer,
+			   weston_screenshooter_done_func_t done, void *data)
+{
+	if (!wl_shm_buffer_get(buffer->resource)) {
+		done(data, WESTON_SCREENSHOOTER_BAD_BUFFER);
+		return -1;
+	}
+
+	buffer->shm_buffer = wl_shm_buffer_get(buffer->resource);
+	buffer->width = wl_shm_buffer_get_width(buffer->shm_buffer);
+	buffer->height = wl_shm_buffer_get_height(buffer->shm_buffer);
+
+	return screenshooter_shoot_area(output, buffer, 0, 0,
+					output->current_mode->width,
+					output->current_mode->height,
+					done, data);
+}
+
 static void
 screenshooter_done(void *data, enum weston_screenshooter_outcome outcome)
 {
@@ -228,7 +299,16 @@ screenshooter_done(void *data, enum weston_screenshooter_outcome outcome)
 	case WESTON_SCREENSHOOTER_NO_MEMORY:
 		wl_resource_post_no_memory(resource);
 		break;
-	default:
+	case WESTON_SCREENSHOOTER_BAD_BUFFER:
+	case WESTON_SCREENSHOOTER_FAILED:
+		/* Version 1 has no failed event.  A capture which went
+		 * wrong is reported as done there, so that the client
+		 * does not wait forever; a bad buffer never was. */
+		if (wl_resource_get_version(resource) >=
+		    WESTON_SCREENSHOOTER_FAILED_SINCE_VERSION)
+			weston_screenshooter_send_failed(resource);
+		else if (outcome == WESTON_SCREENSHOOTER_FAILED)
+			weston_screenshooter_send_done(resource);
 		break;
 	}
 }
@@ -252,8 +332,31 @@ screenshooter_shoot(struct wl_client *client,
 	weston_screenshooter_shoot(output, buffer, screenshooter_done, resource);
 }
 
+static void
+screenshooter_shoot_region(struct wl_client *client,
+			   struct wl_resource *resource,
+			   struct wl_resource *output_resource,
+			   struct wl_resource *buffer_resource,
+			   int32_t x, int32_t y,
+			   int32_t width, int32_t height)
+{
+	struct weston_output *output =
+		wl_resource_get_user_data(output_resource);
+	struct weston_buffer *buffer =
+		weston_buffer_from_resource(buffer_resource);
+
+	if (buffer == NULL) {
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+
+	weston_screenshooter_shoot_region(output, buffer, x, y, width, height,
+					  screenshooter_done, resource);
+}
+
 struct weston_screenshooter_interface screenshooter_implementation = {
-	screenshooter_shoot
+	screenshooter_shoot,
+	screenshooter_shoot_region
 };
 
 static void
@@ -264,7 +367,8 @@ bind_shooter(struct wl_client *client,
 	struct wl_resource *resource;
 
 	resource = wl_resource_create(client,
-				      &weston_screenshooter_interface, 1, id);
+				      &weston_screenshooter_interface,
+				      MIN(version, 2), id);
 
 	if (client != shooter->client) {
 		wl_resource_post_error(resource, WL_DISPLAY_ERROR_INVALID_OBJECT,
@@ -308,157 +412,361 @@ screenshooter_binding(struct weston_keyboard *keyboard, uint32_t time,
 	free(screenshooter_exe);
 }
 
+/* Number of captured frames that may be waiting for the encoder thread
+ * before the recorder starts dropping frames. */
+#define RECORDER_QUEUE_LENGTH 4
+
+/* A full frame is recorded at least this often, so wcap_decoder_seek()
+ * never has to replay more than this much of the capture. */
+#define RECORDER_KEYFRAME_INTERVAL 10000
+
+struct weston_recorder_frame {
+	uint32_t msecs;
+	int key;
+	int nrects;
+	pixman_box32_t *rects;
+	int rects_size;
+
+	/* The shared readback, rects[i] being its box i */
+	struct weston_capture_buffer *buffer;
+};
+
 struct weston_recorder {
 	struct weston_output *output;
-	uint32_t *frame, *rect;
-	uint32_t *tmpbuf;
-	uint32_t total;
+	uint32_t *frame;
+	uint32_t *tmpbuf, *delta;
+	uint64_t total;
 	int fd;
-	struct wl_listener frame_listener;
-	int count, destroying;
+	int stride, height, do_yflip;
+	struct weston_capture_sink sink;
+	int count, dropped, destroying;
+	pixman_region32_t skipped_damage;
+	int need_key;
+	uint32_t key_msecs;
+
+	/* Frame index appended to the file on close, owned by the
+	 * worker thread while it runs. */
+	struct wcap_index_entry *index;
+	uint32_t index_count, index_size;
+	int index_failed;
+
+	/* Frames are read back on the main thread and handed to the
+	 * worker, which does the delta/RLE encoding and file I/O.
+	 * head and count are protected by mutex; a slot belongs to the
+	 * main thread until it is queued and to the worker until it
+	 * is retired. */
+	struct {
+		struct weston_recorder_frame frames[RECORDER_QUEUE_LENGTH];
+		int head, count, max_count;
+		int done;
+		pthread_t thread;
+		pthread_mutex_t mutex;
+		pthread_cond_t input_cond;
+	} queue;
 };
 
-static uint32_t *
-output_run(uint32_t *p, uint32_t delta, int run)
+/* Runs on the worker thread. */
+static void
+weston_recorder_index_frame(struct weston_recorder *recorder,
+			    struct weston_recorder_frame *frame)
 {
-	int i;
+	struct wcap_index_entry *index, *entry;
+	uint32_t size;
 
-	while (run > 0) {
-		if (run <= 0xe0) {
-			*p++ = delta | ((run - 1) << 24);
-			break;
-		}
+	if (recorder->index_failed)
+		return;
 
-		i = 24 - __builtin_clz(run);
-		*p++ = delta | ((i + 0xe0) << 24);
-		run -= 1 << (7 + i);
+	if (recorder->index_count == recorder->index_size) {
+		size = recorder->index_size ? recorder->index_size * 2 : 1024;
+		index = realloc(recorder->index, size * sizeof *index);
+		if (index == NULL) {
+			recorder->index_failed = 1;
+			return;
+		}
+		recorder->index = index;
+		recorder->index_size = size;
 	}
 
-	return p;
+	entry = &recorder->index[recorder->index_count++];
+	entry->offset = recorder->total;
+	entry->msecs = frame->msecs;
+	entry->flags = frame->key ? WCAP_FRAME_KEY : 0;
 }
 
-static uint32_t
-component_delta(uint32_t next, uint32_t prev)
+static void
+weston_recorder_write_index(struct weston_recorder *recorder)
 {
-	unsigned char dr, dg, db;
+	struct wcap_index_trailer trailer;
+	struct iovec v[2];
+	ssize_t len;
 
-	dr = (next >> 16) - (prev >> 16);
-	dg = (next >>  8) - (prev >>  8);
-	db = (next >>  0) - (prev >>  0);
+	if (recorder->index_failed) {
+		weston_log("recorder: out of memory for the frame index, "
+			   "the capture will not be seekable\n");
+		return;
+	}
 
-	return (dr << 16) | (dg << 8) | (db << 0);
+	trailer.offset = recorder->total;
+	trailer.count = recorder->index_count;
+	trailer.magic = WCAP_INDEX_MAGIC;
+
+	v[0].iov_base = recorder->index;
+	v[0].iov_len = recorder->index_count * sizeof *recorder->index;
+	v[1].iov_base = &trailer;
+	v[1].iov_len = sizeof trailer;
+	len = writev(recorder->fd, v, 2);
+	if (len > 0)
+		recorder->total += len;
 }
 
+/* Runs on the worker thread. */
 static void
-weston_recorder_destroy(struct weston_recorder *recorder);
-
-static void
-weston_recorder_frame_notify(struct wl_listener *listener, void *data)
+weston_recorder_encode_frame(struct weston_recorder *recorder,
+			     struct weston_recorder_frame *frame)
 {
-	struct weston_recorder *recorder =
-		container_of(listener, struct weston_recorder, frame_listener);
-	struct weston_output *output = data;
-	struct weston_compositor *compositor = output->compositor;
-	uint32_t msecs = output->frame_time;
-	pixman_box32_t *r;
-	pixman_region32_t damage, transformed_damage;
-	int i, j, k, n, width, height, run, stride;
-	uint32_t delta, prev, *d, *s, *p, next;
+	pixman_box32_t *r = frame->rects;
+	int i, j, width, height, run, y_orig;
+	uint32_t prev, *d, *p;
+	const uint32_t *s, *rect;
 	struct {
 		uint32_t msecs;
 		uint32_t nrects;
 	} header;
 	struct iovec v[2];
-	int do_yflip;
-	int y_orig;
-	uint32_t *outbuf;
 
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
-	if (do_yflip)
-		outbuf = recorder->rect;
-	else
-		outbuf = recorder->tmpbuf;
-
-	pixman_region32_init(&damage);
-	pixman_region32_init(&transformed_damage);
-	pixman_region32_intersect(&damage, &output->region,
-				  &output->previous_damage);
-	pixman_region32_translate(&damage, -output->x, -output->y);
-	weston_transformed_region(output->width, output->height,
-				 output->transform, output->current_scale,
-				 &damage, &transformed_damage);
-	pixman_region32_fini(&damage);
+	weston_recorder_index_frame(recorder, frame);
 
-	r = pixman_region32_rectangles(&transformed_damage, &n);
-	if (n == 0) {
-		pixman_region32_fini(&transformed_damage);
-		return;
-	}
+	/* Key frames are coded against black rather than the previous
+	 * frame so decoding can start there. */
+	if (frame->key)
+		memset(recorder->frame, 0,
+		       recorder->stride * 4 * recorder->height);
 
-	header.msecs = msecs;
-	header.nrects = n;
+	header.msecs = frame->msecs;
+	header.nrects = frame->nrects;
+	if (frame->key)
+		header.nrects |= WCAP_FRAME_KEY;
 	v[0].iov_base = &header;
 	v[0].iov_len = sizeof header;
 	v[1].iov_base = r;
-	v[1].iov_len = n * sizeof *r;
+	v[1].iov_len = frame->nrects * sizeof *r;
 	recorder->total += writev(recorder->fd, v, 2);
-	stride = output->current_mode->width;
 
-	for (i = 0; i < n; i++) {
+	for (i = 0; i < frame->nrects; i++) {
 		width = r[i].x2 - r[i].x1;
 		height = r[i].y2 - r[i].y1;
+		rect = frame->buffer->pixels[i];
 
-		if (do_yflip)
-			y_orig = output->current_mode->height - r[i].y2;
-		else
-			y_orig = r[i].y1;
-
-		compositor->renderer->read_pixels(output,
-				compositor->read_format, recorder->rect,
-				r[i].x1, y_orig, width, height);
-
-		p = outbuf;
-		run = prev = 0; /* quiet gcc */
+		p = recorder->tmpbuf;
+		run = prev = 0;
 		for (j = 0; j < height; j++) {
-			if (do_yflip)
-				s = recorder->rect + width * j;
+			if (recorder->do_yflip)
+				s = rect + width * j;
 			else
-				s = recorder->rect + width * (height - j - 1);
+				s = rect + width * (height - j - 1);
 			y_orig = r[i].y2 - j - 1;
-			d = recorder->frame + stride * y_orig + r[i].x1;
-
-			for (k = 0; k < width; k++) {
-				next = *s++;
-				delta = component_delta(next, *d);
-				*d++ = next;
-				if (run == 0 || delta == prev) {
-					run++;
-				} else {
-					p = output_run(p, prev, run);
-					run = 1;
-				}
-				prev = delta;
-			}
+			d = recorder->frame + recorder->stride * y_orig + r[i].x1;
+
+			wcap_rle_delta(recorder->delta, s, d, width);
+			p = wcap_rle_encode_span(p, recorder->delta, width,
+						 &prev, &run);
 		}
 
-		p = output_run(p, prev, run);
+		p = wcap_rle_output_run(p, prev, run);
 
-		recorder->total += write(recorder->fd,
-					 outbuf, (p - outbuf) * 4);
+		recorder->total += write(recorder->fd, recorder->tmpbuf,
+					 (p - recorder->tmpbuf) * 4);
 
 #if 0
 		fprintf(stderr,
 			"%dx%d at %d,%d rle from %d to %d bytes (%f) total %dM\n",
 			width, height, r[i].x1, r[i].y1,
-			width * height * 4, (int) (p - outbuf) * 4,
-			(float) (p - outbuf) / (width * height),
-			recorder->total / 1024 / 1024);
+			width * height * 4, (int) (p - recorder->tmpbuf) * 4,
+			(float) (p - recorder->tmpbuf) / (width * height),
+			(int) (recorder->total / 1024 / 1024));
 #endif
 	}
 
-	pixman_region32_fini(&transformed_damage);
+	weston_capture_buffer_unref(frame->buffer);
+	frame->buffer = NULL;
+}
+
+static void *
+weston_recorder_worker(void *data)
+{
+	struct weston_recorder *recorder = data;
+	struct weston_recorder_frame *frame;
+
+	pthread_mutex_lock(&recorder->queue.mutex);
+
+	for (;;) {
+		while (recorder->queue.count == 0 && !recorder->queue.done)
+			pthread_cond_wait(&recorder->queue.input_cond,
+					  &recorder->queue.mutex);
+
+		/* Drain whatever is still queued before exiting so the
+		 * file ends with the last captured frame. */
+		if (recorder->queue.count == 0)
+			break;
+
+		frame = &recorder->queue.frames[recorder->queue.head];
+		pthread_mutex_unlock(&recorder->queue.mutex);
+
+		weston_recorder_encode_frame(recorder, frame);
+
+		pthread_mutex_lock(&recorder->queue.mutex);
+		recorder->queue.head =
+			(recorder->queue.head + 1) % RECORDER_QUEUE_LENGTH;
+		recorder->queue.count--;
+	}
+
+	pthread_mutex_unlock(&recorder->queue.mutex);
+
+	return NULL;
+}
+
+static struct weston_recorder_frame *
+weston_recorder_get_frame(struct weston_recorder *recorder)
+{
+	struct weston_recorder_frame *frame = NULL;
+	int tail;
+
+	pthread_mutex_lock(&recorder->queue.mutex);
+	if (recorder->queue.count < RECORDER_QUEUE_LENGTH) {
+		tail = (recorder->queue.head + recorder->queue.count) %
+			RECORDER_QUEUE_LENGTH;
+		frame = &recorder->queue.frames[tail];
+	}
+	pthread_mutex_unlock(&recorder->queue.mutex);
+
+	return frame;
+}
+
+static void
+weston_recorder_queue_frame(struct weston_recorder *recorder)
+{
+	pthread_mutex_lock(&recorder->queue.mutex);
+	recorder->queue.count++;
+	if (recorder->queue.count > recorder->queue.max_count)
+		recorder->queue.max_count = recorder->queue.count;
+	pthread_cond_signal(&recorder->queue.input_cond);
+	pthread_mutex_unlock(&recorder->queue.mutex);
+}
+
+static int
+weston_recorder_frame_reserve(struct weston_recorder_frame *frame,
+			      int nrects)
+{
+	pixman_box32_t *rects;
+
+	if (frame->rects_size < nrects) {
+		rects = realloc(frame->rects, nrects * sizeof *rects);
+		if (rects == NULL)
+			return -1;
+		frame->rects = rects;
+		frame->rects_size = nrects;
+	}
+
+	return 0;
+}
+
+static void
+weston_recorder_destroy(struct weston_recorder *recorder);
+
+/* Ask for the whole output when a key frame is due, and for the damage
+ * of frames dropped while the encoder was behind. */
+static void
+weston_recorder_prepare(struct weston_capture_sink *sink)
+{
+	struct weston_recorder *recorder =
+		container_of(sink, struct weston_recorder, sink);
+	struct weston_output *output = sink->output;
+
+	if (output->frame_time - recorder->key_msecs >=
+	    RECORDER_KEYFRAME_INTERVAL)
+		recorder->need_key = 1;
+
+	if (recorder->need_key)
+		pixman_region32_union_rect(&recorder->skipped_damage,
+					   &recorder->skipped_damage, 0, 0,
+					   output->current_mode->width,
+					   output->current_mode->height);
+
+	pixman_region32_copy(&sink->region, &recorder->skipped_damage);
+}
+
+/* Queue the boxes the capture read back, which cover our damage, and a
+ * reference to their pixels; the worker encodes straight from those. */
+static void
+weston_recorder_frame_notify(struct weston_capture_sink *sink,
+			     struct weston_capture_frame *capture)
+{
+	struct weston_recorder *recorder =
+		container_of(sink, struct weston_recorder, sink);
+	struct weston_output *output = capture->output;
+	int32_t fb_height = output->current_mode->height;
+	struct weston_recorder_frame *frame;
+	pixman_region32_t damage;
+	pixman_box32_t *r;
+	int i;
+
+	/* Damage in framebuffer coordinates */
+	pixman_region32_init(&damage);
+	pixman_region32_union(&damage, capture->damage, &sink->region);
+	if (!pixman_region32_not_empty(&damage)) {
+		pixman_region32_fini(&damage);
+		goto out;
+	}
+
+	frame = weston_recorder_get_frame(recorder);
+	if (frame == NULL) {
+		/* The encoder is behind.  Skip this frame, but remember
+		 * its damage so the next captured frame brings the
+		 * encoder's copy of the output back in sync. */
+		if (recorder->dropped++ == 0)
+			weston_log("recorder: encoder falling behind, "
+				   "dropping frames\n");
+		pixman_region32_copy(&recorder->skipped_damage, &damage);
+		pixman_region32_fini(&damage);
+		goto out;
+	}
+
+	if (capture->buffer == NULL ||
+	    weston_recorder_frame_reserve(frame, capture->nboxes) < 0) {
+		/* Like a dropped frame, the next one re-encodes this
+		 * damage. */
+		weston_log("%s: out of memory\n", __func__);
+		pixman_region32_copy(&recorder->skipped_damage, &damage);
+		pixman_region32_fini(&damage);
+		goto out;
+	}
+	pixman_region32_fini(&damage);
+
+	frame->msecs = output->frame_time;
+	frame->key = recorder->need_key;
+	frame->nrects = capture->nboxes;
+	frame->buffer = weston_capture_buffer_ref(capture->buffer);
+
+	/* The file wants top-down framebuffer coordinates */
+	for (i = 0; i < capture->nboxes; i++) {
+		r = &frame->rects[i];
+		*r = capture->boxes[i];
+		if (capture->y_flip) {
+			r->y1 = fb_height - capture->boxes[i].y2;
+			r->y2 = fb_height - capture->boxes[i].y1;
+		}
+	}
+
+	pixman_region32_clear(&recorder->skipped_damage);
+	if (recorder->need_key) {
+		recorder->need_key = 0;
+		recorder->key_msecs = output->frame_time;
+	}
+
+	weston_recorder_queue_frame(recorder);
 	recorder->count++;
 
+out:
 	if (recorder->destroying)
 		weston_recorder_destroy(recorder);
 }
@@ -466,11 +774,22 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 static void
 weston_recorder_free(struct weston_recorder *recorder)
 {
+	int i;
+
 	if (recorder == NULL)
 		return;
 
+	for (i = 0; i < RECORDER_QUEUE_LENGTH; i++) {
+		free(recorder->queue.frames[i].rects);
+		if (recorder->queue.frames[i].buffer)
+			weston_capture_buffer_unref(
+				recorder->queue.frames[i].buffer);
+	}
+
+	pixman_region32_fini(&recorder->skipped_damage);
+	free(recorder->index);
+	free(recorder->delta);
 	free(recorder->tmpbuf);
-	free(recorder->rect);
 	free(recorder->frame);
 	free(recorder);
 }
@@ -482,9 +801,6 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 	struct weston_recorder *recorder;
 	int stride, size;
 	struct { uint32_t magic, format, width, height; } header;
-	int do_yflip;
-
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
 
 	recorder = zalloc(sizeof *recorder);
 	if (recorder == NULL) {
@@ -492,26 +808,33 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 		return;
 	}
 
+	pixman_region32_init(&recorder->skipped_damage);
+	weston_capture_sink_init(&recorder->sink, compositor->read_format,
+				 WESTON_CAPTURE_SINK_DAMAGE);
+	recorder->do_yflip =
+		!!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+
 	stride = output->current_mode->width;
 	size = stride * 4 * output->current_mode->height;
 	recorder->frame = zalloc(size);
-	recorder->rect = malloc(size);
+	recorder->delta = malloc(stride * 4);
+	recorder->stride = stride;
+	recorder->height = output->current_mode->height;
+	recorder->need_key = 1;
 	recorder->output = output;
 
-	if ((recorder->frame == NULL) || (recorder->rect == NULL)) {
+	if (recorder->frame == NULL || recorder->delta == NULL) {
 		weston_log("%s: out of memory\n", __func__);
 		goto err_recorder;
 	}
 
-	if (!do_yflip) {
-		recorder->tmpbuf = malloc(size);
-		if (recorder->tmpbuf == NULL) {
-			weston_log("%s: out of memory\n", __func__);
-			goto err_recorder;
-		}
+	recorder->tmpbuf = malloc(size);
+	if (recorder->tmpbuf == NULL) {
+		weston_log("%s: out of memory\n", __func__);
+		goto err_recorder;
 	}
 
-	header.magic = WCAP_HEADER_MAGIC;
+	header.magic = WCAP_HEADER_MAGIC_V2;
 
 	switch (compositor->read_format) {
 	case PIXMAN_x8r8g8b8:
@@ -538,8 +861,20 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 	header.height = output->current_mode->height;
 	recorder->total += write(recorder->fd, &header, sizeof header);
 
-	recorder->frame_listener.notify = weston_recorder_frame_notify;
-	wl_signal_add(&output->frame_signal, &recorder->frame_listener);
+	pthread_mutex_init(&recorder->queue.mutex, NULL);
+	pthread_cond_init(&recorder->queue.input_cond, NULL);
+	if (pthread_create(&recorder->queue.thread, NULL,
+			   weston_recorder_worker, recorder) != 0) {
+		weston_log("failed to start recorder thread\n");
+		pthread_mutex_destroy(&recorder->queue.mutex);
+		pthread_cond_destroy(&recorder->queue.input_cond);
+		close(recorder->fd);
+		goto err_recorder;
+	}
+
+	recorder->sink.prepare = weston_recorder_prepare;
+	recorder->sink.frame = weston_recorder_frame_notify;
+	weston_output_add_capture_sink(output, &recorder->sink);
 	output->disable_planes++;
 	weston_output_damage(output);
 
@@ -553,9 +888,27 @@ err_recorder:
 static void
 weston_recorder_destroy(struct weston_recorder *recorder)
 {
-	wl_list_remove(&recorder->frame_listener.link);
-	close(recorder->fd);
+	weston_capture_sink_remove(&recorder->sink);
 	recorder->output->disable_planes--;
+
+	pthread_mutex_lock(&recorder->queue.mutex);
+	recorder->queue.done = 1;
+	pthread_cond_signal(&recorder->queue.input_cond);
+	pthread_mutex_unlock(&recorder->queue.mutex);
+
+	pthread_join(recorder->queue.thread, NULL);
+	pthread_mutex_destroy(&recorder->queue.mutex);
+	pthread_cond_destroy(&recorder->queue.input_cond);
+
+	weston_recorder_write_index(recorder);
+
+	weston_log("recorder stopped, total file size %dM, "
+		   "%d frames queued, %d dropped, max queue depth %d/%d\n",
+		   (int) (recorder->total / (1024 * 1024)), recorder->count,
+		   recorder->dropped, recorder->queue.max_count,
+		   RECORDER_QUEUE_LENGTH);
+
+	close(recorder->fd);
 	weston_recorder_free(recorder);
 }
 
@@ -565,24 +918,22 @@ recorder_binding(struct weston_keyboard *keyboard, uint32_t time,
 {
 	struct weston_compositor *ec = keyboard->seat->compositor;
 	struct weston_output *output;
-	struct wl_listener *listener = NULL;
-	struct weston_recorder *recorder;
+	struct weston_capture_sink *sink;
+	struct weston_recorder *recorder = NULL;
 	static const char filename[] = "capture.wcap";
 
 	wl_list_for_each(output, &ec->output_list, link) {
-		listener = wl_signal_get(&output->frame_signal,
-					 weston_recorder_frame_notify);
-		if (listener)
-			break;
+		wl_list_for_each(sink, &output->capture.sink_list, link) {
+			if (sink->frame == weston_recorder_frame_notify)
+				recorder = container_of(sink,
+							struct weston_recorder,
+							sink);
+		}
 	}
 
-	if (listener) {
-		recorder = container_of(listener, struct weston_recorder,
-					frame_listener);
-
-		weston_log(
-			"stopping recorder, total file size %dM, %d frames\n",
-			recorder->total / (1024 * 1024), recorder->count);
+	if (recorder) {
+		weston_log("stopping recorder, %d frames captured\n",
+			   recorder->count);
 
 		recorder->destroying = 1;
 		weston_output_schedule_repaint(recorder->output);
@@ -622,7 +973,7 @@ screenshooter_create(struct weston_compositor *ec)
 	shooter->client = NULL;
 
 	shooter->global = wl_global_create(ec->wl_display,
-					   &weston_screenshooter_interface, 1,
+					   &weston_screenshooter_interface, 2,
 					   shooter, bind_shooter);
 	weston_compositor_add_key_binding(ec, KEY_S, MODIFIER_SUPER,
 					  screenshooter_binding, shooter);
@@ -0,0 +1,564 @@
+/*
+ * Copyright © 2016 The Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/input.h>
+
+#include "compositor.h"
+#include "timeline.h"
+#include "weston-statistics-server-protocol.h"
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+
+/*
+ * Repaint counters are updated unconditionally from the repaint path,
+ * so everything here has to stay cheap: a CPU clock read at the start
+ * and end of a repaint and a few additions.  Clients pull snapshots
+ * with weston_output_statistics.sample, nothing is sent per frame.
+ */
+
+/* Upper bound of histogram bucket 0, doubling for each following one */
+#define STATS_HISTOGRAM_BASE_NSEC 250000
+
+#define LATENCY_BUCKET_USEC 8000
+/* Input still waiting for presentation after this long is dropped */
+#define LATENCY_MAX_MSEC 10000
+
+struct weston_client_latency {
+	struct wl_list link;
+	struct wl_client *client;
+	struct wl_listener destroy_listener;
+	struct weston_latency_stats stats;
+};
+
+WL_EXPORT void
+weston_output_init_stats(struct weston_output *output)
+{
+	memset(&output->stats, 0, sizeof output->stats);
+	wl_list_init(&output->stats.resource_list);
+	wl_array_init(&output->stats.input_stamps);
+}
+
+WL_EXPORT void
+weston_output_release_stats(struct weston_output *output)
+{
+	struct wl_resource *resource, *tmp;
+
+	/* Leave the resources inert, sample becomes a no-op */
+	wl_resource_for_each_safe(resource, tmp,
+				  &output->stats.resource_list) {
+		wl_list_remove(wl_resource_get_link(resource));
+		wl_list_init(wl_resource_get_link(resource));
+		wl_resource_set_user_data(resource, NULL);
+	}
+
+	wl_array_release(&output->stats.input_stamps);
+}
+
+WL_EXPORT void
+weston_output_stats_repaint_begin(struct weston_output *output)
+{
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &output->stats.repaint_start);
+	output->stats.upload_start = output->compositor->upload_bytes;
+}
+
+WL_EXPORT void
+weston_output_stats_repaint_end(struct weston_output *output,
+				pixman_region32_t *damage, uint32_t views)
+{
+	struct weston_output_stats *stats = &output->stats;
+	struct timespec now, elapsed;
+	pixman_box32_t *boxes;
+	uint64_t nsec, area = 0;
+	int i, n;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	timespec_sub(&elapsed, &now, &stats->repaint_start);
+	nsec = timespec_to_nsec(&elapsed);
+
+	stats->repaints++;
+	stats->repaint_cpu_nsec += nsec;
+
+	for (i = 0; i < WESTON_STATS_HISTOGRAM_SIZE - 1; i++)
+		if (nsec < (uint64_t) STATS_HISTOGRAM_BASE_NSEC << i)
+			break;
+	stats->repaint_histogram[i]++;
+
+	boxes = pixman_region32_rectangles(damage, &n);
+	for (i = 0; i < n; i++)
+		area += (uint64_t) (boxes[i].x2 - boxes[i].x1) *
+			(boxes[i].y2 - boxes[i].y1);
+	stats->damage_pixels += area;
+
+	stats->views += views;
+	stats->upload_bytes +=
+		output->compositor->upload_bytes - stats->upload_start;
+}
+
+/** Restart missed vblank accounting
+ *
+ * Called when the repaint loop of the output (re)starts.  The time
+ * the output spent idle is not missed vblanks, so the next frame only
+ * sets the reference point.
+ */
+WL_EXPORT void
+weston_output_stats_restart(struct weston_output *output)
+{
+	output->stats.last_vblank.tv_sec = 0;
+	output->stats.last_vblank.tv_nsec = 0;
+}
+
+/** Account for a finished frame
+ *
+ * Called from weston_output_finish_frame().  Every refresh period
+ * between the previous vblank and this one that did not get a frame
+ * counts as a missed vblank.  A frame without a valid presentation
+ * timestamp is not a vblank and does not become the reference point.
+ */
+WL_EXPORT void
+weston_output_stats_frame(struct weston_output *output,
+			  const struct timespec *stamp, uint32_t flags)
+{
+	struct weston_output_stats *stats = &output->stats;
+	struct timespec interval;
+	int64_t refresh_nsec, nsec;
+
+	if (flags == WP_PRESENTATION_FEEDBACK_INVALID ||
+	    output->current_mode->refresh == 0)
+		return;
+
+	if (stats->last_vblank.tv_sec || stats->last_vblank.tv_nsec) {
+		refresh_nsec = millihz_to_nsec(output->current_mode->refresh);
+		timespec_sub(&interval, stamp, &stats->last_vblank);
+		nsec = timespec_to_nsec(&interval);
+		if (nsec > refresh_nsec + refresh_nsec / 2)
+			stats->missed_vblanks +=
+				(nsec + refresh_nsec / 2) / refresh_nsec - 1;
+	}
+
+	stats->last_vblank = *stamp;
+}
+
+/*
+ * Input to presentation latency.  Input code stamps the focus surface
+ * with the event time, the next commit of that surface takes the
+ * stamp over, the repaint showing the commit hands it to the output,
+ * and the presentation timestamp of that frame ends the measurement.
+ * Only the oldest event is kept at each step, so a burst of motion is
+ * measured from its first event.
+ */
+
+static void
+latency_stats_add(struct weston_latency_stats *stats, uint32_t usec)
+{
+	uint32_t bucket;
+
+	bucket = MIN(usec / LATENCY_BUCKET_USEC,
+		     WESTON_LATENCY_HISTOGRAM_SIZE - 1);
+	stats->histogram[bucket]++;
+	stats->samples++;
+	stats->total_usec += usec;
+	if (usec > stats->max_usec)
+		stats->max_usec = usec;
+}
+
+static void
+client_latency_destroy(struct wl_listener *listener, void *data)
+{
+	struct weston_client_latency *cl =
+		container_of(listener, struct weston_client_latency,
+			     destroy_listener);
+
+	wl_list_remove(&cl->link);
+	free(cl);
+}
+
+static struct weston_latency_stats *
+client_latency_get(struct weston_compositor *compositor,
+		   struct wl_client *client)
+{
+	struct weston_client_latency *cl;
+	struct wl_listener *listener;
+
+	listener = wl_client_get_destroy_listener(client,
+						  client_latency_destroy);
+	if (listener) {
+		cl = container_of(listener, struct weston_client_latency,
+				  destroy_listener);
+		return &cl->stats;
+	}
+
+	cl = zalloc(sizeof *cl);
+	if (!cl)
+		return NULL;
+
+	cl->client = client;
+	cl->destroy_listener.notify = client_latency_destroy;
+	wl_client_add_destroy_listener(client, &cl->destroy_listener);
+	wl_list_insert(&compositor->client_latency_list, &cl->link);
+
+	return &cl->stats;
+}
+
+WL_EXPORT void
+weston_surface_latency_commit(struct weston_surface *surface)
+{
+	if (surface->input_pending.seat && !surface->input_committed.seat)
+		surface->input_committed = surface->input_pending;
+	surface->input_pending.seat = NULL;
+}
+
+/** Forget a destroyed surface in frames waiting for presentation
+ *
+ * The input stamps are still accounted to their seat.
+ */
+WL_EXPORT void
+weston_surface_latency_release(struct weston_surface *surface)
+{
+	struct weston_output *output;
+	struct weston_input_stamp *stamp;
+
+	wl_list_for_each(output, &surface->compositor->output_list, link)
+		wl_array_for_each(stamp, &output->stats.input_stamps)
+			if (stamp->surface == surface)
+				stamp->surface = NULL;
+}
+
+/** Hand the committed input stamp of a surface to the frame being
+ * repainted on output */
+WL_EXPORT void
+weston_output_latency_take(struct weston_output *output,
+			   struct weston_surface *surface)
+{
+	struct weston_input_stamp *stamp;
+
+	if (!surface->input_committed.seat)
+		return;
+
+	stamp = wl_array_add(&output->stats.input_stamps, sizeof *stamp);
+	if (stamp) {
+		*stamp = surface->input_committed;
+		stamp->surface = surface;
+	}
+	surface->input_committed.seat = NULL;
+}
+
+static bool
+seat_is_alive(struct weston_compositor *compositor, struct weston_seat *seat)
+{
+	struct weston_seat *s;
+
+	wl_list_for_each(s, &compositor->seat_list, link)
+		if (s == seat)
+			return true;
+
+	return false;
+}
+
+/** Account the input stamps of a presented frame
+ *
+ * Called from weston_output_finish_frame() with the presentation
+ * timestamp.  Event times are on CLOCK_MONOTONIC, which is moved over
+ * to the presentation clock if that is a different one.
+ */
+WL_EXPORT void
+weston_output_latency_present(struct weston_output *output,
+			      const struct timespec *stamp, uint32_t flags)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct weston_input_stamp *input;
+	struct weston_latency_stats *client_stats;
+	struct timespec mono, now, offset, present;
+	uint32_t present_msec, msec, usec;
+
+	if (output->stats.input_stamps.size == 0)
+		return;
+
+	if (flags == WP_PRESENTATION_FEEDBACK_INVALID)
+		goto out;
+
+	present = *stamp;
+	if (compositor->presentation_clock != CLOCK_MONOTONIC) {
+		weston_compositor_read_presentation_clock(compositor, &now);
+		clock_gettime(CLOCK_MONOTONIC, &mono);
+		timespec_sub(&offset, &now, &mono);
+		timespec_sub(&present, &present, &offset);
+	}
+	/* Event times are 32 bit msec, wrapping along with them */
+	present_msec = (uint32_t) (timespec_to_nsec(&present) / 1000000);
+
+	wl_array_for_each(input, &output->stats.input_stamps) {
+		if (!seat_is_alive(compositor, input->seat))
+			continue;
+
+		msec = present_msec - input->msec;
+		if (msec > LATENCY_MAX_MSEC)
+			continue;
+		usec = msec * 1000 + present.tv_nsec / 1000 % 1000;
+
+		latency_stats_add(&input->seat->latency, usec);
+
+		if (!input->surface) {
+			TL_POINT("core_input_latency", TLP_OUTPUT(output),
+				 TLP_LATENCY(&usec), TLP_END);
+			continue;
+		}
+
+		TL_POINT("core_input_latency", TLP_OUTPUT(output),
+			 TLP_SURFACE(input->surface), TLP_LATENCY(&usec),
+			 TLP_END);
+
+		if (!input->surface->resource)
+			continue;
+		client_stats = client_latency_get(compositor,
+				wl_resource_get_client(input->surface->resource));
+		if (client_stats)
+			latency_stats_add(client_stats, usec);
+	}
+
+out:
+	output->stats.input_stamps.size = 0;
+}
+
+static void
+log_latency_stats(const char *what, const struct weston_latency_stats *stats)
+{
+	char histogram[WESTON_LATENCY_HISTOGRAM_SIZE * 11 + 1];
+	int i, len = 0;
+
+	if (stats->samples == 0)
+		return;
+
+	for (i = 0; i < WESTON_LATENCY_HISTOGRAM_SIZE; i++)
+		len += snprintf(histogram + len, sizeof histogram - len,
+				" %u", stats->histogram[i]);
+
+	weston_log_continue(STAMP_SPACE "%s: %" PRIu64 " samples, "
+			    "mean %.1f ms, max %.1f ms\n", what,
+			    stats->samples,
+			    stats->total_usec / 1000.0 / stats->samples,
+			    stats->max_usec / 1000.0);
+	weston_log_continue(STAMP_SPACE "  per %d ms:%s\n",
+			    LATENCY_BUCKET_USEC / 1000, histogram);
+}
+
+static void
+latency_debug_binding(struct weston_keyboard *keyboard, uint32_t time,
+		      uint32_t key, void *data)
+{
+	struct weston_compositor *compositor = data;
+	struct weston_client_latency *cl;
+	struct weston_seat *seat;
+	char what[128];
+	pid_t pid;
+
+	weston_log("Input to presentation latency\n");
+
+	wl_list_for_each(seat, &compositor->seat_list, link) {
+		snprintf(what, sizeof what, "seat %s", seat->seat_name);
+		log_latency_stats(what, &seat->latency);
+
+		if (seat->touch_state)
+			weston_log_continue(STAMP_SPACE "%s touch batching: "
+					    "%" PRIu64 " motion events, "
+					    "%" PRIu64 " frames collapsed\n",
+					    what,
+					    seat->touch_state->motion_collapsed,
+					    seat->touch_state->frames_collapsed);
+	}
+
+	wl_list_for_each(cl, &compositor->client_latency_list, link) {
+		wl_client_get_credentials(cl->client, &pid, NULL, NULL);
+		snprintf(what, sizeof what, "client %d", pid);
+		log_latency_stats(what, &cl->stats);
+	}
+}
+
+static void
+output_statistics_destroy(struct wl_client *client,
+			  struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static void
+output_statistics_sample(struct wl_client *client,
+			 struct wl_resource *resource)
+{
+	struct weston_output *output = wl_resource_get_user_data(resource);
+	struct weston_output_stats *stats;
+	struct wl_array histogram;
+	uint64_t cpu_usec;
+	uint32_t *buckets;
+
+	if (!output)
+		return;
+
+	stats = &output->stats;
+	cpu_usec = stats->repaint_cpu_nsec / 1000;
+
+	weston_output_statistics_send_counters(resource,
+		stats->repaints >> 32, stats->repaints & 0xffffffff,
+		stats->missed_vblanks >> 32, stats->missed_vblanks & 0xffffffff,
+		stats->damage_pixels >> 32, stats->damage_pixels & 0xffffffff,
+		stats->views >> 32, stats->views & 0xffffffff,
+		stats->upload_bytes >> 32, stats->upload_bytes & 0xffffffff,
+		cpu_usec >> 32, cpu_usec & 0xffffffff);
+
+	wl_array_init(&histogram);
+	buckets = wl_array_add(&histogram, sizeof stats->repaint_histogram);
+	if (!buckets) {
+		wl_array_release(&histogram);
+		wl_client_post_no_memory(client);
+		return;
+	}
+	memcpy(buckets, stats->repaint_histogram,
+	       sizeof stats->repaint_histogram);
+	weston_output_statistics_send_repaint_histogram(resource, &histogram);
+	wl_array_release(&histogram);
+
+	weston_output_statistics_send_done(resource);
+}
+
+static const struct weston_output_statistics_interface
+output_statistics_implementation = {
+	output_statistics_destroy,
+	output_statistics_sample
+};
+
+static void
+unlink_resource(struct wl_resource *resource)
+{
+	wl_list_remove(wl_resource_get_link(resource));
+}
+
+static void
+statistics_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+/* The output behind a wl_output, or NULL if it was destroyed.  The
+ * user data of a wl_output is left dangling when its output goes
+ * away, so only trust it while the resource is on a live output. */
+static struct weston_output *
+statistics_lookup_output(struct weston_compositor *compositor,
+			 struct wl_resource *output_resource)
+{
+	struct weston_output *output;
+	struct wl_resource *resource;
+
+	wl_list_for_each(output, &compositor->output_list, link)
+		wl_resource_for_each(resource, &output->resource_list)
+			if (resource == output_resource)
+				return output;
+
+	return NULL;
+}
+
+static void
+statistics_get_output_statistics(struct wl_client *client,
+				 struct wl_resource *resource, uint32_t id,
+				 struct wl_resource *output_resource)
+{
+	struct weston_compositor *compositor =
+		wl_resource_get_user_data(resource);
+	struct weston_output *output;
+	struct wl_resource *stats_resource;
+
+	output = statistics_lookup_output(compositor, output_resource);
+
+	stats_resource =
+		wl_resource_create(client, &weston_output_statistics_interface,
+				   wl_resource_get_version(resource), id);
+	if (!stats_resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(stats_resource,
+				       &output_statistics_implementation,
+				       output, unlink_resource);
+
+	if (output)
+		wl_list_insert(&output->stats.resource_list,
+			       wl_resource_get_link(stats_resource));
+	else
+		wl_list_init(wl_resource_get_link(stats_resource));
+}
+
+static const struct weston_statistics_interface statistics_implementation = {
+	statistics_destroy,
+	statistics_get_output_statistics
+};
+
+static void
+bind_statistics(struct wl_client *client,
+		void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource;
+	uid_t uid;
+
+	resource = wl_resource_create(client, &weston_statistics_interface,
+				      1, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_client_get_credentials(client, NULL, &uid, NULL);
+	if (uid != 0 && uid != getuid()) {
+		wl_resource_post_error(resource, WL_DISPLAY_ERROR_INVALID_OBJECT,
+				       "statistics: permission denied");
+		return;
+	}
+
+	wl_resource_set_implementation(resource, &statistics_implementation,
+				       data, NULL);
+}
+
+WL_EXPORT int
+weston_compositor_init_statistics(struct weston_compositor *compositor)
+{
+	wl_list_init(&compositor->client_latency_list);
+
+	if (!wl_global_create(compositor->wl_display,
+			      &weston_statistics_interface, 1,
+			      compositor, bind_statistics))
+		return -1;
+
+	weston_compositor_add_debug_binding(compositor, KEY_L,
+					    latency_debug_binding,
+					    compositor);
+
+	return 0;
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright © 2016 The Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_TIMELINE_BINARY_H
+#define WESTON_TIMELINE_BINARY_H
+
+#include <stdint.h>
+
+/*
+ * Binary timeline log, written when WESTON_TIMELINE=binary.
+ *
+ * The file is a header followed, at WESTON_TIMELINE_RECORDS_OFFSET, by
+ * a ring of capacity fixed-size records.  head counts every record ever
+ * written, so the oldest valid record is at head % capacity once the
+ * ring has wrapped.  Tracepoint names are interned in the header and
+ * referenced by index; object descriptions are records in the ring.
+ */
+
+#define WESTON_TIMELINE_BINARY_MAGIC	0x4c545757	/* "WWTL" */
+#define WESTON_TIMELINE_BINARY_VERSION	1
+
+#define WESTON_TIMELINE_MAX_POINTS	64
+#define WESTON_TIMELINE_POINT_NAME_SIZE	32
+#define WESTON_TIMELINE_RECORDS_OFFSET	4096
+
+enum weston_timeline_record_type {
+	WESTON_TIMELINE_RECORD_POINT = 1,
+	WESTON_TIMELINE_RECORD_OUTPUT,
+	WESTON_TIMELINE_RECORD_SURFACE,
+	/* Further bytes of the preceding object description */
+	WESTON_TIMELINE_RECORD_DESC,
+};
+
+/* Argument kinds in weston_timeline_record.u.point.args, these
+ * match enum timeline_type. */
+enum weston_timeline_arg {
+	WESTON_TIMELINE_ARG_END = 0,
+	WESTON_TIMELINE_ARG_OUTPUT,
+	WESTON_TIMELINE_ARG_SURFACE,
+	WESTON_TIMELINE_ARG_VBLANK,
+	WESTON_TIMELINE_ARG_LATENCY,
+};
+
+#define WESTON_TIMELINE_MAX_ARGS	4
+#define WESTON_TIMELINE_DESC_SIZE	36
+#define WESTON_TIMELINE_DESC_CONT_SIZE	40
+
+struct weston_timeline_binary_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t capacity;
+	uint64_t head;
+	uint32_t clock_id;
+	uint32_t n_points;
+	char points[WESTON_TIMELINE_MAX_POINTS][WESTON_TIMELINE_POINT_NAME_SIZE];
+};
+
+struct weston_timeline_record {
+	uint16_t type;
+	uint16_t reserved;
+	/* Tracepoint index for points, object id otherwise */
+	uint32_t id;
+	int64_t sec;
+	uint32_t nsec;
+	uint32_t reserved2;
+	union {
+		struct {
+			/* Argument kinds in call order, 0 terminated
+			 * unless all are used. */
+			uint8_t args[WESTON_TIMELINE_MAX_ARGS];
+			uint32_t output;
+			uint32_t surface;
+			uint32_t vblank_nsec;
+			int64_t vblank_sec;
+			/* Input to presentation, usec */
+			uint32_t latency;
+		} point;
+		struct {
+			/* Surfaces only, 0 if it is a main surface */
+			uint32_t main_surface;
+			/* Not 0 terminated if followed by DESC records */
+			char desc[WESTON_TIMELINE_DESC_SIZE];
+		} object;
+		char desc[WESTON_TIMELINE_DESC_CONT_SIZE];
+	} u;
+};
+
+#endif /* WESTON_TIMELINE_BINARY_H */
@@ -27,31 +27,116 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <time.h>
 #include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "timeline.h"
+#include "timeline-binary.h"
 #include "compositor.h"
 #include "file-util.h"
 
+/* 4 MiB of 64 byte records */
+#define TIMELINE_RING_RECORDS (1 << 16)
+
+struct timeline_ring {
+	struct weston_timeline_binary_header *header;
+	struct weston_timeline_record *records;
+	size_t size;
+	/* Tracepoint name pointers, in header->points order */
+	const char *points[WESTON_TIMELINE_MAX_POINTS];
+	unsigned dropped;
+};
+
 struct timeline_log {
 	clock_t clk_id;
 	FILE *file;
 	unsigned series;
 	struct wl_listener compositor_destroy_listener;
+	struct timeline_ring *ring;
 };
 
 WL_EXPORT int weston_timeline_enabled_;
 static struct timeline_log timeline_ = { CLOCK_MONOTONIC, NULL, 0 };
 
+static int
+timeline_binary_requested(void)
+{
+	const char *mode = getenv("WESTON_TIMELINE");
+
+	return mode && strcmp(mode, "binary") == 0;
+}
+
+static int
+timeline_ring_create(void)
+{
+	struct timeline_ring *ring;
+	size_t size;
+	void *map;
+
+	size = WESTON_TIMELINE_RECORDS_OFFSET +
+		TIMELINE_RING_RECORDS * sizeof(struct weston_timeline_record);
+
+	if (ftruncate(fileno(timeline_.file), size) < 0)
+		return -1;
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fileno(timeline_.file), 0);
+	if (map == MAP_FAILED)
+		return -1;
+
+	ring = zalloc(sizeof *ring);
+	if (!ring) {
+		munmap(map, size);
+		return -1;
+	}
+
+	ring->size = size;
+	ring->header = map;
+	ring->records = (void *) ((char *) map +
+				  WESTON_TIMELINE_RECORDS_OFFSET);
+
+	ring->header->magic = WESTON_TIMELINE_BINARY_MAGIC;
+	ring->header->version = WESTON_TIMELINE_BINARY_VERSION;
+	ring->header->record_size = sizeof(struct weston_timeline_record);
+	ring->header->capacity = TIMELINE_RING_RECORDS;
+	ring->header->clock_id = timeline_.clk_id;
+
+	timeline_.ring = ring;
+
+	return 0;
+}
+
+static void
+timeline_ring_destroy(void)
+{
+	struct timeline_ring *ring = timeline_.ring;
+	uint64_t head = ring->header->head;
+
+	weston_log("Timeline ring: %" PRIu64 " records, %" PRIu64
+		   " overwritten, %u dropped\n", head,
+		   head > TIMELINE_RING_RECORDS ?
+		   head - TIMELINE_RING_RECORDS : 0, ring->dropped);
+
+	munmap(ring->header, ring->size);
+	free(ring);
+	timeline_.ring = NULL;
+}
+
 static int
 weston_timeline_do_open(void)
 {
 	const char *prefix = "weston-timeline-";
-	const char *suffix = ".log";
+	const char *suffix;
 	char fname[1000];
+	int binary;
+
+	binary = timeline_binary_requested();
+	suffix = binary ? ".bin" : ".log";
 
 	timeline_.file = file_create_dated(prefix, suffix,
 					   fname, sizeof(fname));
@@ -71,6 +156,14 @@ weston_timeline_do_open(void)
 		return -1;
 	}
 
+	if (binary && timeline_ring_create() < 0) {
+		weston_log("Cannot map timeline file '%s': %s\n",
+			   fname, strerror(errno));
+		fclose(timeline_.file);
+		timeline_.file = NULL;
+		return -1;
+	}
+
 	weston_log("Opened timeline file '%s'\n", fname);
 
 	return 0;
@@ -111,6 +204,9 @@ weston_timeline_close(void)
 
 	wl_list_remove(&timeline_.compositor_destroy_listener.link);
 
+	if (timeline_.ring)
+		timeline_ring_destroy();
+
 	fclose(timeline_.file);
 	timeline_.file = NULL;
 	weston_log("Timeline log file closed.\n");
@@ -232,14 +328,210 @@ emit_vblank_timestamp(struct timeline_emit_context *ctx, void *obj)
 	return 1;
 }
 
+static int
+emit_latency(struct timeline_emit_context *ctx, void *obj)
+{
+	uint32_t *usec = obj;
+
+	fprintf(ctx->cur, "\"latency\":%u", *usec);
+
+	return 1;
+}
+
 typedef int (*type_func)(struct timeline_emit_context *ctx, void *obj);
 
 static const type_func type_dispatch[] = {
 	[TLT_OUTPUT] = emit_weston_output,
 	[TLT_SURFACE] = emit_weston_surface,
 	[TLT_VBLANK] = emit_vblank_timestamp,
+	[TLT_LATENCY] = emit_latency,
 };
 
+static int
+timeline_ring_point_id(struct timeline_ring *ring, const char *name)
+{
+	struct weston_timeline_binary_header *header = ring->header;
+	unsigned i;
+
+	/* Tracepoint names are string literals, so the pointer is
+	 * almost always enough. */
+	for (i = 0; i < header->n_points; i++)
+		if (ring->points[i] == name)
+			return i;
+
+	for (i = 0; i < header->n_points; i++)
+		if (strcmp(header->points[i], name) == 0)
+			return i;
+
+	if (i == WESTON_TIMELINE_MAX_POINTS)
+		return -1;
+
+	snprintf(header->points[i], sizeof header->points[i], "%s", name);
+	ring->points[i] = name;
+	header->n_points = i + 1;
+
+	return i;
+}
+
+static struct weston_timeline_record *
+timeline_ring_next(struct timeline_ring *ring)
+{
+	uint64_t head = ring->header->head;
+
+	return &ring->records[head % ring->header->capacity];
+}
+
+/* Publish the record returned by timeline_ring_next(). There is a
+ * single writer, the release store makes the record visible to a
+ * reader mapping the file while we run. */
+static void
+timeline_ring_commit(struct timeline_ring *ring)
+{
+	__atomic_store_n(&ring->header->head, ring->header->head + 1,
+			 __ATOMIC_RELEASE);
+}
+
+static void
+timeline_ring_emit_object(struct timeline_ring *ring, uint16_t type,
+			  uint32_t id, uint32_t main_surface,
+			  const char *desc, const struct timespec *ts)
+{
+	struct weston_timeline_record *rec;
+	size_t len, n, max;
+
+	/* The description goes out with its terminating 0, in the
+	 * object record followed by DESC records for the rest. */
+	len = strlen(desc) + 1;
+	max = WESTON_TIMELINE_DESC_SIZE + 3 * WESTON_TIMELINE_DESC_CONT_SIZE;
+	if (len > max)
+		len = max;
+
+	rec = timeline_ring_next(ring);
+	memset(rec, 0, sizeof *rec);
+	rec->type = type;
+	rec->id = id;
+	rec->sec = ts->tv_sec;
+	rec->nsec = ts->tv_nsec;
+	rec->u.object.main_surface = main_surface;
+	n = len < WESTON_TIMELINE_DESC_SIZE ? len : WESTON_TIMELINE_DESC_SIZE;
+	memcpy(rec->u.object.desc, desc, n);
+	desc += n;
+	len -= n;
+	timeline_ring_commit(ring);
+
+	while (len > 0) {
+		rec = timeline_ring_next(ring);
+		memset(rec, 0, sizeof *rec);
+		rec->type = WESTON_TIMELINE_RECORD_DESC;
+		rec->id = id;
+		n = len < WESTON_TIMELINE_DESC_CONT_SIZE ?
+			len : WESTON_TIMELINE_DESC_CONT_SIZE;
+		memcpy(rec->u.desc, desc, n);
+		desc += n;
+		len -= n;
+		if (len == 0)
+			rec->u.desc[n - 1] = '\0';
+		timeline_ring_commit(ring);
+	}
+}
+
+static void
+ring_check_weston_surface(struct timeline_emit_context *ctx,
+			  struct weston_surface *s, const struct timespec *ts)
+{
+	struct weston_surface *mains;
+	uint32_t main_id = 0;
+	char d[512];
+
+	if (!check_series(ctx, &s->timeline))
+		return;
+
+	mains = weston_surface_get_main_surface(s);
+	if (mains != s) {
+		ring_check_weston_surface(ctx, mains, ts);
+		main_id = mains->timeline.id;
+	}
+
+	if (!s->get_label || s->get_label(s, d, sizeof(d)) < 0)
+		d[0] = '\0';
+
+	timeline_ring_emit_object(timeline_.ring,
+				  WESTON_TIMELINE_RECORD_SURFACE,
+				  s->timeline.id, main_id, d, ts);
+}
+
+/* Binary counterpart of the JSON path in weston_timeline_point():
+ * no allocation or formatting unless an object is seen for the first
+ * time in this series. */
+static void
+timeline_ring_point(const char *name, const struct timespec *ts,
+		    va_list argp)
+{
+	struct timeline_ring *ring = timeline_.ring;
+	struct weston_timeline_record point, *rec;
+	struct timeline_emit_context ctx = { NULL, NULL, timeline_.series };
+	struct weston_output *o;
+	struct weston_surface *s;
+	struct timespec *vblank;
+	enum timeline_type otype;
+	void *obj;
+	int id, nargs = 0;
+
+	id = timeline_ring_point_id(ring, name);
+	if (id < 0) {
+		ring->dropped++;
+		return;
+	}
+
+	memset(&point, 0, sizeof point);
+	point.type = WESTON_TIMELINE_RECORD_POINT;
+	point.id = id;
+	point.sec = ts->tv_sec;
+	point.nsec = ts->tv_nsec;
+
+	while (1) {
+		otype = va_arg(argp, enum timeline_type);
+		if (otype == TLT_END)
+			break;
+
+		obj = va_arg(argp, void *);
+
+		switch (otype) {
+		case TLT_OUTPUT:
+			o = obj;
+			if (check_series(&ctx, &o->timeline))
+				timeline_ring_emit_object(ring,
+					WESTON_TIMELINE_RECORD_OUTPUT,
+					o->timeline.id, 0,
+					o->name ? o->name : "", ts);
+			point.u.point.output = o->timeline.id;
+			break;
+		case TLT_SURFACE:
+			s = obj;
+			ring_check_weston_surface(&ctx, s, ts);
+			point.u.point.surface = s->timeline.id;
+			break;
+		case TLT_VBLANK:
+			vblank = obj;
+			point.u.point.vblank_sec = vblank->tv_sec;
+			point.u.point.vblank_nsec = vblank->tv_nsec;
+			break;
+		case TLT_LATENCY:
+			point.u.point.latency = *(uint32_t *) obj;
+			break;
+		default:
+			continue;
+		}
+
+		if (nargs < WESTON_TIMELINE_MAX_ARGS)
+			point.u.point.args[nargs++] = otype;
+	}
+
+	rec = timeline_ring_next(ring);
+	*rec = point;
+	timeline_ring_commit(ring);
+}
+
 WL_EXPORT void
 weston_timeline_point(const char *name, ...)
 {
@@ -252,6 +544,13 @@ weston_timeline_point(const char *name, ...)
 
 	clock_gettime(timeline_.clk_id, &ts);
 
+	if (timeline_.ring) {
+		va_start(argp, name);
+		timeline_ring_point(name, &ts, argp);
+		va_end(argp);
+		return;
+	}
+
 	ctx.out = timeline_.file;
 	ctx.cur = fmemopen(buf, sizeof(buf), "w");
 	ctx.series = timeline_.series;
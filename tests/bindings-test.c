@@ -0,0 +1,249 @@
+/*
+ * Copyright © 2016 The Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include <linux/input.h>
+
+#include "src/compositor.h"
+
+#define FILLER_BINDINGS 5000
+#define PRESSES 20000
+#define ROUNDS 3
+
+struct bindings_test {
+	struct weston_compositor *compositor;
+	struct weston_seat seat;
+	int calls[4];
+	int order;
+};
+
+static struct timespec begin_time;
+
+static void
+reset_timer(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &begin_time);
+}
+
+static double
+read_timer(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double)(t.tv_sec - begin_time.tv_sec) +
+	       1e-9 * (t.tv_nsec - begin_time.tv_nsec);
+}
+
+static void
+first_handler(struct weston_keyboard *keyboard, uint32_t time,
+	      uint32_t key, void *data)
+{
+	struct bindings_test *test = data;
+
+	assert(test->order == 0);
+	test->order = 1;
+	test->calls[0]++;
+}
+
+static void
+second_handler(struct weston_keyboard *keyboard, uint32_t time,
+	       uint32_t key, void *data)
+{
+	struct bindings_test *test = data;
+
+	assert(test->order == 1);
+	test->order = 0;
+	test->calls[1]++;
+}
+
+static void
+ctrl_handler(struct weston_keyboard *keyboard, uint32_t time,
+	     uint32_t key, void *data)
+{
+	struct bindings_test *test = data;
+
+	test->calls[2]++;
+}
+
+static void
+filler_handler(struct weston_keyboard *keyboard, uint32_t time,
+	       uint32_t key, void *data)
+{
+	struct bindings_test *test = data;
+
+	test->calls[3]++;
+}
+
+static void
+press_key(struct bindings_test *test, uint32_t time, uint32_t key)
+{
+	notify_key(&test->seat, time, key, WL_KEYBOARD_KEY_STATE_PRESSED,
+		   STATE_UPDATE_AUTOMATIC);
+	notify_key(&test->seat, time, key, WL_KEYBOARD_KEY_STATE_RELEASED,
+		   STATE_UPDATE_AUTOMATIC);
+}
+
+/* Bindings the dispatch looked at for one press of key */
+static uint32_t
+count_probes(struct bindings_test *test, uint32_t key)
+{
+	struct weston_binding_table *table =
+		&test->compositor->key_binding_table;
+	uint32_t probes = table->probes;
+
+	press_key(test, 0, key);
+
+	return table->probes - probes;
+}
+
+/* Nanoseconds per press, the best of ROUNDS runs of PRESSES each */
+static double
+time_presses(struct bindings_test *test, uint32_t key)
+{
+	double nsec, best = 0;
+	uint32_t i, r;
+
+	for (r = 0; r < ROUNDS; r++) {
+		reset_timer();
+		for (i = 0; i < PRESSES; i++)
+			press_key(test, i, key);
+
+		nsec = read_timer() / PRESSES * 1e9;
+		if (r == 0 || nsec < best)
+			best = nsec;
+	}
+
+	return best;
+}
+
+static void
+bindings_test(void *data)
+{
+	struct bindings_test *test = data;
+	struct weston_compositor *compositor = test->compositor;
+	struct weston_binding *first, *second, *ctrl;
+	struct weston_binding **filler;
+	double base_nsec, filled_nsec;
+	uint32_t base_probes, filled_probes;
+	int i;
+
+	weston_seat_init(&test->seat, compositor, "bindings-seat");
+	assert(weston_seat_init_keyboard(&test->seat, NULL) == 0);
+
+	/* Handlers for one key run in the order they were added, and
+	 * only for the exact modifier state. */
+	first = weston_compositor_add_key_binding(compositor, KEY_F5, 0,
+						  first_handler, test);
+	second = weston_compositor_add_key_binding(compositor, KEY_F5, 0,
+						   second_handler, test);
+	ctrl = weston_compositor_add_key_binding(compositor, KEY_F5,
+						 MODIFIER_CTRL,
+						 ctrl_handler, test);
+	assert(first && second && ctrl);
+
+	base_nsec = time_presses(test, KEY_F5);
+	base_probes = count_probes(test, KEY_F5);
+	assert(test->calls[0] == ROUNDS * PRESSES + 1);
+	assert(test->calls[1] == ROUNDS * PRESSES + 1);
+	assert(test->calls[2] == 0);
+
+	/* Only the CTRL binding runs with CTRL held.  The modifier state
+	 * is recomputed after every key, so set it for each press. */
+	for (i = 0; i < 10; i++) {
+		test->seat.modifier_state = MODIFIER_CTRL;
+		press_key(test, i, KEY_F5);
+	}
+	assert(test->calls[0] == ROUNDS * PRESSES + 1);
+	assert(test->calls[1] == ROUNDS * PRESSES + 1);
+	assert(test->calls[2] == 10);
+
+	/* Key codes past KEY_MAX, never pressed here */
+	filler = calloc(FILLER_BINDINGS, sizeof *filler);
+	assert(filler);
+	for (i = 0; i < FILLER_BINDINGS; i++) {
+		filler[i] = weston_compositor_add_key_binding(compositor,
+					KEY_MAX + 1 + i / 4,
+					(i % 4) ? MODIFIER_CTRL << (i % 4 - 1) : 0,
+					filler_handler, test);
+		assert(filler[i]);
+	}
+
+	filled_nsec = time_presses(test, KEY_F5);
+	filled_probes = count_probes(test, KEY_F5);
+	assert(test->calls[0] == 2 * (ROUNDS * PRESSES + 1));
+	assert(test->calls[1] == 2 * (ROUNDS * PRESSES + 1));
+	assert(test->calls[2] == 10);
+	assert(test->calls[3] == 0);
+
+	fprintf(stderr, "key press with %d bindings: %.0f ns, %u probes, "
+		"with %d bindings: %.0f ns, %u probes\n",
+		3, base_nsec, base_probes,
+		FILLER_BINDINGS + 3, filled_nsec, filled_probes);
+
+	/* Dispatch only looks at the bucket of the key, not at every
+	 * binding.  The timings are for information only. */
+	assert(filled_probes <= base_probes + 8);
+
+	/* A destroyed binding does not run anymore */
+	weston_binding_destroy(first);
+	weston_binding_destroy(second);
+	press_key(test, 0, KEY_F5);
+	assert(test->calls[0] == 2 * (ROUNDS * PRESSES + 1));
+	assert(test->calls[1] == 2 * (ROUNDS * PRESSES + 1));
+
+	for (i = 0; i < FILLER_BINDINGS; i++)
+		weston_binding_destroy(filler[i]);
+	free(filler);
+	weston_binding_destroy(ctrl);
+
+	weston_seat_release(&test->seat);
+	free(test);
+
+	wl_display_terminate(compositor->wl_display);
+}
+
+WL_EXPORT int
+module_init(struct weston_compositor *compositor, int *argc, char *argv[])
+{
+	struct wl_event_loop *loop;
+	struct bindings_test *test;
+
+	test = zalloc(sizeof *test);
+	if (!test)
+		return -1;
+
+	test->compositor = compositor;
+
+	loop = wl_display_get_event_loop(compositor->wl_display);
+	wl_event_loop_add_idle(loop, bindings_test, test);
+
+	return 0;
+}
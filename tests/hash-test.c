@@ -0,0 +1,145 @@
+/*
+ * Copyright © 2016 The Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+
+#include "weston-test-runner.h"
+#include "xwayland/hash.h"
+
+/* X servers hand out XIDs from a per-client base. */
+#define XID_BASE	0x00e00000
+#define OTHER_XID_BASE	0x01000000
+
+#define CHURN_LIVE	1024
+#define CHURN_ROUNDS	(1 << 20)
+
+static void *
+element(uint32_t id)
+{
+	return (void *) (uintptr_t) (id * 2 + 1);
+}
+
+static void
+count_element(void *elem, void *data)
+{
+	int *count = data;
+
+	(*count)++;
+}
+
+static double
+elapsed_ns(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1e9 +
+		(now.tv_nsec - start->tv_nsec);
+}
+
+TEST(hash_insert_lookup_remove)
+{
+	struct hash_table *ht;
+	uint32_t i;
+	int count = 0;
+
+	ht = hash_table_create();
+	assert(ht);
+
+	for (i = 0; i < 10000; i++)
+		assert(hash_table_insert(ht, XID_BASE + i, element(i)) == 0);
+
+	for (i = 0; i < 10000; i++)
+		assert(hash_table_lookup(ht, XID_BASE + i) == element(i));
+	assert(hash_table_lookup(ht, XID_BASE + 10000) == NULL);
+
+	/* Removing every other entry must not lose the ones that
+	 * probed past it. */
+	for (i = 0; i < 10000; i += 2)
+		hash_table_remove(ht, XID_BASE + i);
+
+	for (i = 0; i < 10000; i++) {
+		if (i % 2)
+			assert(hash_table_lookup(ht, XID_BASE + i) ==
+			       element(i));
+		else
+			assert(hash_table_lookup(ht, XID_BASE + i) == NULL);
+	}
+
+	hash_table_for_each(ht, count_element, &count);
+	assert(count == 5000);
+
+	/* Inserting an existing key replaces its data. */
+	assert(hash_table_insert(ht, XID_BASE + 1, element(0)) == 0);
+	assert(hash_table_lookup(ht, XID_BASE + 1) == element(0));
+
+	hash_table_remove(ht, XID_BASE);
+	hash_table_destroy(ht);
+}
+
+/*
+ * Model a client popping up and tearing down menus and tooltips: a
+ * fixed number of live windows, with the oldest destroyed for every
+ * new one created, and a few lookups per window for its events,
+ * including one for a window we don't know about.
+ */
+TEST(hash_churn_benchmark)
+{
+	struct hash_table *ht;
+	struct timespec start;
+	uint32_t i, id;
+	double ns;
+
+	ht = hash_table_create();
+	assert(ht);
+
+	for (i = 0; i < CHURN_LIVE; i++)
+		assert(hash_table_insert(ht, XID_BASE + i, element(i)) == 0);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = CHURN_LIVE; i < CHURN_LIVE + CHURN_ROUNDS; i++) {
+		id = XID_BASE + i;
+		assert(hash_table_insert(ht, id, element(i)) == 0);
+		assert(hash_table_lookup(ht, id) == element(i));
+		assert(hash_table_lookup(ht, id - CHURN_LIVE / 2) ==
+		       element(i - CHURN_LIVE / 2));
+		assert(hash_table_lookup(ht, OTHER_XID_BASE + i) == NULL);
+		hash_table_remove(ht, id - CHURN_LIVE);
+	}
+
+	ns = elapsed_ns(&start);
+	fprintf(stderr, "%d rounds of insert, 3 lookups and remove with "
+		"%d live windows: %.1f ns per round\n",
+		CHURN_ROUNDS, CHURN_LIVE, ns / CHURN_ROUNDS);
+
+	hash_table_destroy(ht);
+}
@@ -0,0 +1,299 @@
+/*
+ * Copyright © 2016 The Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+#include "weston-test-runner.h"
+#include "wcap/wcap-rle.h"
+
+#define WIDTH 1920
+#define HEIGHT 1080
+#define FRAMES 16
+
+static struct timespec begin_time;
+
+static void
+reset_timer(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &begin_time);
+}
+
+static double
+read_timer(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double)(t.tv_sec - begin_time.tv_sec) +
+	       1e-9 * (t.tv_nsec - begin_time.tv_nsec);
+}
+
+/* The per-pixel encoder and decoder as they were before the kernels
+ * were split out; the vectorized paths must match them bit for bit. */
+
+static uint32_t *
+ref_output_run(uint32_t *p, uint32_t delta, int run)
+{
+	int i;
+
+	while (run > 0) {
+		if (run <= 0xe0) {
+			*p++ = delta | ((run - 1) << 24);
+			break;
+		}
+
+		i = 24 - __builtin_clz(run);
+		*p++ = delta | ((i + 0xe0) << 24);
+		run -= 1 << (7 + i);
+	}
+
+	return p;
+}
+
+static uint32_t
+ref_component_delta(uint32_t next, uint32_t prev)
+{
+	unsigned char dr, dg, db;
+
+	dr = (next >> 16) - (prev >> 16);
+	dg = (next >>  8) - (prev >>  8);
+	db = (next >>  0) - (prev >>  0);
+
+	return (dr << 16) | (dg << 8) | (db << 0);
+}
+
+static int
+ref_encode(uint32_t *out, const uint32_t *src, uint32_t *frame)
+{
+	uint32_t delta, prev, next, *p = out;
+	int i, run;
+
+	run = prev = 0;
+	for (i = 0; i < WIDTH * HEIGHT; i++) {
+		next = src[i];
+		delta = ref_component_delta(next, frame[i]);
+		frame[i] = next;
+		if (run == 0 || delta == prev) {
+			run++;
+		} else {
+			p = ref_output_run(p, prev, run);
+			run = 1;
+		}
+		prev = delta;
+	}
+
+	p = ref_output_run(p, prev, run);
+
+	return p - out;
+}
+
+static int
+encode(uint32_t *out, const uint32_t *src, uint32_t *frame, uint32_t *delta)
+{
+	uint32_t prev = 0, *p = out;
+	int j, run = 0;
+
+	for (j = 0; j < HEIGHT; j++) {
+		wcap_rle_delta(delta, src + j * WIDTH, frame + j * WIDTH, WIDTH);
+		p = wcap_rle_encode_span(p, delta, WIDTH, &prev, &run);
+	}
+
+	p = wcap_rle_output_run(p, prev, run);
+
+	return p - out;
+}
+
+static void
+decode(uint32_t *frame, const uint32_t *p, int n,
+       void (*apply)(uint32_t *d, uint32_t delta, int n))
+{
+	int i, l, j;
+
+	for (i = 0; i < n; i++) {
+		l = p[i] >> 24;
+		j = l < 0xe0 ? l + 1 : 1 << (l - 0xe0 + 7);
+		apply(frame, p[i], j);
+		frame += j;
+	}
+}
+
+static void
+fill_rect(uint32_t *frame, int x, int y, int w, int h, uint32_t color)
+{
+	int i, j;
+
+	for (j = y; j < y + h; j++)
+		for (i = x; i < x + w; i++)
+			frame[j * WIDTH + i] = color;
+}
+
+/* Flat panels with a few windows and some "text" that changes from
+ * frame to frame: long runs, mostly zero deltas. */
+static void
+generate_desktop(uint32_t *frames)
+{
+	uint32_t *f;
+	int i, j;
+
+	for (i = 0; i < FRAMES; i++) {
+		f = frames + i * WIDTH * HEIGHT;
+		fill_rect(f, 0, 0, WIDTH, HEIGHT, 0xff204060);
+		fill_rect(f, 0, 0, WIDTH, 32, 0xffc0c0c0);
+		fill_rect(f, 200, 150, 800, 600, 0xffffffff);
+		fill_rect(f, 900, 400, 700, 500, 0xffe0e0e0);
+		for (j = 0; j < 4000; j++)
+			f[(220 + (random() % 560)) * WIDTH +
+			  220 + (random() % 760)] = random() | 0xff000000;
+		fill_rect(f, 250 + i * 8, 300, 40, 20, 0xff3060c0);
+	}
+}
+
+/* Smooth gradients that move every frame: every pixel changes and
+ * runs are short. */
+static void
+generate_video(uint32_t *frames)
+{
+	uint32_t *f, r, g, b;
+	int i, x, y;
+
+	for (i = 0; i < FRAMES; i++) {
+		f = frames + i * WIDTH * HEIGHT;
+		for (y = 0; y < HEIGHT; y++) {
+			for (x = 0; x < WIDTH; x++) {
+				r = (x + i * 3) & 0xff;
+				g = (y + i * 5) & 0xff;
+				b = ((x ^ y) + (random() & 3)) & 0xff;
+				f[y * WIDTH + x] =
+					0xff000000 | r << 16 | g << 8 | b;
+			}
+		}
+	}
+}
+
+static int
+run_test(const char *name, const uint32_t *frames)
+{
+	size_t size = WIDTH * HEIGHT * 4;
+	uint32_t *ref_frame, *frame, *ref_out, *out, *delta, *decoded;
+	int i, n, ref_n, ret = 0;
+	double t_ref = 0, t = 0, t_dec_ref = 0, t_dec = 0, mb;
+
+	ref_frame = calloc(1, size);
+	frame = calloc(1, size);
+	ref_out = malloc(size);
+	out = malloc(size);
+	delta = malloc(WIDTH * 4);
+	decoded = calloc(1, size);
+
+	for (i = 0; i < FRAMES; i++) {
+		reset_timer();
+		ref_n = ref_encode(ref_out, frames + i * WIDTH * HEIGHT,
+				   ref_frame);
+		t_ref += read_timer();
+
+		reset_timer();
+		n = encode(out, frames + i * WIDTH * HEIGHT, frame, delta);
+		t += read_timer();
+
+		if (n != ref_n || memcmp(out, ref_out, n * 4) != 0) {
+			printf("%s: frame %d encodes differently\n", name, i);
+			ret = 1;
+			break;
+		}
+
+		memcpy(frame, decoded, size);
+		reset_timer();
+		decode(frame, out, n, wcap_rle_apply_scalar);
+		t_dec_ref += read_timer();
+
+		reset_timer();
+		decode(decoded, out, n, wcap_rle_apply);
+		t_dec += read_timer();
+
+		if (memcmp(frame, decoded, size) != 0) {
+			printf("%s: frame %d decodes differently\n", name, i);
+			ret = 1;
+			break;
+		}
+
+		if (memcmp(decoded, frames + i * WIDTH * HEIGHT, size) != 0) {
+			printf("%s: frame %d does not decode to its source\n",
+			       name, i);
+			ret = 1;
+			break;
+		}
+
+		/* Restore the encoder's reference frame. */
+		memcpy(frame, ref_frame, size);
+	}
+
+	mb = (double) FRAMES * size / (1024 * 1024);
+	printf("%s: %d frames %dx%d, last frame %d words\n"
+	       "  encode: scalar %.0f MB/s, vector %.0f MB/s\n"
+	       "  decode: scalar %.0f MB/s, vector %.0f MB/s\n",
+	       name, FRAMES, WIDTH, HEIGHT, ref_n,
+	       mb / t_ref, mb / t, mb / t_dec_ref, mb / t_dec);
+
+	free(ref_frame);
+	free(frame);
+	free(ref_out);
+	free(out);
+	free(delta);
+	free(decoded);
+
+	return ret;
+}
+
+static void
+run_generated(const char *name, void (*generate)(uint32_t *frames))
+{
+	uint32_t *frames;
+
+	frames = malloc(FRAMES * WIDTH * HEIGHT * 4);
+	assert(frames);
+
+	srandom(13);
+	generate(frames);
+	assert(run_test(name, frames) == 0);
+
+	free(frames);
+}
+
+TEST(wcap_rle_desktop)
+{
+	run_generated("desktop", generate_desktop);
+}
+
+TEST(wcap_rle_video)
+{
+	run_generated("video", generate_video);
+}
@@ -298,33 +298,12 @@ struct test_screenshot {
 };
 
 struct test_screenshot_frame_listener {
-	struct wl_listener listener;
+	struct weston_capture_sink sink;
 	struct weston_buffer *buffer;
 	weston_test_screenshot_done_func_t done;
 	void *data;
 };
 
-static void
-copy_bgra_yflip(uint8_t *dst, uint8_t *src, int height, int stride)
-{
-	uint8_t *end;
-
-	end = dst + height * stride;
-	while (dst < end) {
-		memcpy(dst, src, stride);
-		dst += stride;
-		src -= stride;
-	}
-}
-
-
-static void
-copy_bgra(uint8_t *dst, uint8_t *src, int height, int stride)
-{
-	/* TODO: optimize this out */
-	memcpy(dst, src, height * stride);
-}
-
 static void
 copy_row_swap_RB(void *vdst, void *vsrc, int bytes)
 {
@@ -343,86 +322,37 @@ copy_row_swap_RB(void *vdst, void *vsrc, int bytes)
 }
 
 static void
-copy_rgba_yflip(uint8_t *dst, uint8_t *src, int height, int stride)
-{
-	uint8_t *end;
-
-	end = dst + height * stride;
-	while (dst < end) {
-		copy_row_swap_RB(dst, src, stride);
-		dst += stride;
-		src -= stride;
-	}
-}
-
-static void
-copy_rgba(uint8_t *dst, uint8_t *src, int height, int stride)
-{
-	uint8_t *end;
-
-	end = dst + height * stride;
-	while (dst < end) {
-		copy_row_swap_RB(dst, src, stride);
-		dst += stride;
-		src += stride;
-	}
-}
-
-static void
-test_screenshot_frame_notify(struct wl_listener *listener, void *data)
+test_screenshot_frame_notify(struct weston_capture_sink *sink,
+			     struct weston_capture_frame *frame)
 {
 	struct test_screenshot_frame_listener *l =
-		container_of(listener,
-			     struct test_screenshot_frame_listener, listener);
-	struct weston_output *output = data;
+		container_of(sink, struct test_screenshot_frame_listener, sink);
+	struct weston_output *output = frame->output;
 	struct weston_compositor *compositor = output->compositor;
-	int32_t stride;
-	uint8_t *pixels, *d, *s;
+	int32_t stride, y;
+	uint8_t *d;
 
 	output->disable_planes--;
-	wl_list_remove(&listener->link);
-	stride = l->buffer->width * (PIXMAN_FORMAT_BPP(compositor->read_format) / 8);
-	pixels = malloc(stride * l->buffer->height);
-
-	if (pixels == NULL) {
-		l->done(l->data, WESTON_TEST_SCREENSHOT_NO_MEMORY);
-		free(l);
-		return;
-	}
-
-	/* FIXME: Needs to handle output transformations */
-
-	compositor->renderer->read_pixels(output,
-					  compositor->read_format,
-					  pixels,
-					  0, 0,
-					  output->current_mode->width,
-					  output->current_mode->height);
+	weston_capture_sink_remove(sink);
 
 	stride = wl_shm_buffer_get_stride(l->buffer->shm_buffer);
-
 	d = wl_shm_buffer_get_data(l->buffer->shm_buffer);
-	s = pixels + stride * (l->buffer->height - 1);
 
 	wl_shm_buffer_begin_access(l->buffer->shm_buffer);
 
-	/* XXX: It would be nice if we used Pixman to do all this rather
-	 *  than our own implementation
-	 */
+	/* FIXME: Needs to handle output transformations */
+
+	weston_capture_frame_copy_rect(frame, (uint32_t *) d, stride / 4,
+				       0, 0,
+				       output->current_mode->width,
+				       output->current_mode->height);
+
 	switch (compositor->read_format) {
-	case PIXMAN_a8r8g8b8:
-	case PIXMAN_x8r8g8b8:
-		if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP)
-			copy_bgra_yflip(d, s, output->current_mode->height, stride);
-		else
-			copy_bgra(d, pixels, output->current_mode->height, stride);
-		break;
 	case PIXMAN_x8b8g8r8:
 	case PIXMAN_a8b8g8r8:
-		if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP)
-			copy_rgba_yflip(d, s, output->current_mode->height, stride);
-		else
-			copy_rgba(d, pixels, output->current_mode->height, stride);
+		for (y = 0; y < output->current_mode->height; y++)
+			copy_row_swap_RB(d + y * stride, d + y * stride,
+					 stride);
 		break;
 	default:
 		break;
@@ -431,7 +361,6 @@ test_screenshot_frame_notify(struct wl_listener *listener, void *data)
 	wl_shm_buffer_end_access(l->buffer->shm_buffer);
 
 	l->done(l->data, WESTON_TEST_SCREENSHOT_SUCCESS);
-	free(pixels);
 	free(l);
 }
 
@@ -471,8 +400,12 @@ weston_test_screenshot_shoot(struct weston_output *output,
 	l->buffer = buffer;
 	l->done = done;
 	l->data = data;
-	l->listener.notify = test_screenshot_frame_notify;
-	wl_signal_add(&output->frame_signal, &l->listener);
+	weston_capture_sink_init(&l->sink, output->compositor->read_format, 0);
+	pixman_region32_union_rect(&l->sink.region, &l->sink.region, 0, 0,
+				   output->current_mode->width,
+				   output->current_mode->height);
+	l->sink.frame = test_screenshot_frame_notify;
+	weston_output_add_capture_sink(output, &l->sink);
 
 	/* Fire off a repaint */
 	output->disable_planes++;
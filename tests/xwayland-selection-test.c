@@ -0,0 +1,564 @@
+/*
+ * Copyright © 2016 The Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <unistd.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+
+#include "weston-test-client-helper.h"
+
+/*
+ * xwayland-selection-test: move a large clipboard selection through the
+ *			    Xwayland window manager in both directions,
+ *			    between a Wayland client and an X client, and
+ *			    report the throughput.
+ */
+
+#define TRANSFER_SIZE	(32 * 1024 * 1024)
+#define X11_CHUNK_SIZE	(256 * 1024)
+
+static const char mime_type[] = "text/plain;charset=utf-8";
+
+struct x11_client {
+	Display *display;
+	Window window;
+	Atom clipboard;
+	Atom targets;
+	Atom utf8_string;
+	Atom incr;
+	Atom property;
+
+	/* owner side */
+	Window requestor;
+	Atom requestor_property;
+	size_t sent;
+	int incr_done;
+
+	/* requestor side */
+	int incr_active;
+	size_t received;
+	int done;
+};
+
+struct selection_client {
+	struct client *client;
+	struct wl_data_device_manager *manager;
+	struct wl_data_device *device;
+	struct wl_data_source *source;
+	struct wl_data_offer *offer;
+	int fd;
+	size_t count;
+	int done;
+};
+
+static char
+pattern(size_t offset)
+{
+	return 'a' + offset % 26;
+}
+
+static void
+fill_pattern(char *buf, size_t offset, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = pattern(offset + i);
+}
+
+static void
+check_pattern(const char *buf, size_t offset, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		assert(buf[i] == pattern(offset + i));
+}
+
+static double
+time_since(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void
+report(const char *direction, const struct timespec *start)
+{
+	double secs = time_since(start);
+
+	fprintf(stderr, "%s: %d MiB in %.3f s, %.1f MiB/s\n", direction,
+		TRANSFER_SIZE / (1024 * 1024), secs,
+		TRANSFER_SIZE / (1024.0 * 1024.0) / secs);
+}
+
+static void
+data_offer_offer(void *data, struct wl_data_offer *offer, const char *type)
+{
+}
+
+static const struct wl_data_offer_listener data_offer_listener = {
+	data_offer_offer,
+};
+
+static void
+data_device_data_offer(void *data, struct wl_data_device *device,
+		       struct wl_data_offer *offer)
+{
+	wl_data_offer_add_listener(offer, &data_offer_listener, NULL);
+}
+
+static void
+data_device_enter(void *data, struct wl_data_device *device,
+		  uint32_t serial, struct wl_surface *surface,
+		  wl_fixed_t x, wl_fixed_t y, struct wl_data_offer *offer)
+{
+}
+
+static void
+data_device_leave(void *data, struct wl_data_device *device)
+{
+}
+
+static void
+data_device_motion(void *data, struct wl_data_device *device,
+		   uint32_t time, wl_fixed_t x, wl_fixed_t y)
+{
+}
+
+static void
+data_device_drop(void *data, struct wl_data_device *device)
+{
+}
+
+static void
+data_device_selection(void *data, struct wl_data_device *device,
+		      struct wl_data_offer *offer)
+{
+	struct selection_client *sel = data;
+
+	if (sel->offer)
+		wl_data_offer_destroy(sel->offer);
+	sel->offer = offer;
+}
+
+static const struct wl_data_device_listener data_device_listener = {
+	data_device_data_offer,
+	data_device_enter,
+	data_device_leave,
+	data_device_motion,
+	data_device_drop,
+	data_device_selection,
+};
+
+static void
+data_source_target(void *data, struct wl_data_source *source,
+		   const char *type)
+{
+}
+
+static void
+data_source_send(void *data, struct wl_data_source *source,
+		 const char *type, int32_t fd)
+{
+	struct selection_client *sel = data;
+
+	assert(strcmp(type, mime_type) == 0);
+	assert(sel->fd == -1);
+	fcntl(fd, F_SETFL, O_WRONLY | O_NONBLOCK);
+	sel->fd = fd;
+	sel->count = 0;
+}
+
+static void
+data_source_cancelled(void *data, struct wl_data_source *source)
+{
+	struct selection_client *sel = data;
+
+	wl_data_source_destroy(source);
+	sel->source = NULL;
+}
+
+static const struct wl_data_source_listener data_source_listener = {
+	data_source_target,
+	data_source_send,
+	data_source_cancelled,
+};
+
+static void
+selection_client_init(struct selection_client *sel)
+{
+	struct global *g;
+
+	memset(sel, 0, sizeof *sel);
+	sel->fd = -1;
+	sel->client = create_client_and_test_surface(100, 100, 100, 100);
+	assert(sel->client);
+
+	wl_list_for_each(g, &sel->client->global_list, link) {
+		if (strcmp(g->interface, "wl_data_device_manager") == 0) {
+			sel->manager =
+				wl_registry_bind(sel->client->wl_registry,
+						 g->name,
+						 &wl_data_device_manager_interface,
+						 1);
+			break;
+		}
+	}
+	assert(sel->manager);
+
+	sel->device =
+		wl_data_device_manager_get_data_device(sel->manager,
+						       sel->client->input->wl_seat);
+	wl_data_device_add_listener(sel->device, &data_device_listener, sel);
+
+	/* Selection offers only go to the client with keyboard focus. */
+	weston_test_activate_surface(sel->client->test->weston_test,
+				     sel->client->surface->wl_surface);
+	client_roundtrip(sel->client);
+}
+
+static void
+selection_client_write(struct selection_client *sel)
+{
+	char buf[64 * 1024];
+	size_t len;
+	ssize_t ret;
+
+	len = TRANSFER_SIZE - sel->count;
+	if (len > sizeof buf)
+		len = sizeof buf;
+	fill_pattern(buf, sel->count, len);
+
+	ret = write(sel->fd, buf, len);
+	if (ret == -1 && errno == EAGAIN)
+		return;
+	assert(ret > 0);
+
+	sel->count += ret;
+	if (sel->count == TRANSFER_SIZE) {
+		close(sel->fd);
+		sel->fd = -1;
+	}
+}
+
+static void
+selection_client_read(struct selection_client *sel)
+{
+	char buf[64 * 1024];
+	ssize_t ret;
+
+	ret = read(sel->fd, buf, sizeof buf);
+	if (ret == -1 && errno == EAGAIN)
+		return;
+	assert(ret >= 0);
+
+	if (ret == 0) {
+		assert(sel->count == TRANSFER_SIZE);
+		close(sel->fd);
+		sel->fd = -1;
+		sel->done = 1;
+		return;
+	}
+
+	check_pattern(buf, sel->count, ret);
+	sel->count += ret;
+	assert(sel->count <= TRANSFER_SIZE);
+}
+
+static void
+x11_client_init(struct x11_client *x11)
+{
+	Window root;
+
+	memset(x11, 0, sizeof *x11);
+	x11->display = XOpenDisplay(NULL);
+	assert(x11->display);
+
+	x11->clipboard = XInternAtom(x11->display, "CLIPBOARD", False);
+	x11->targets = XInternAtom(x11->display, "TARGETS", False);
+	x11->utf8_string = XInternAtom(x11->display, "UTF8_STRING", False);
+	x11->incr = XInternAtom(x11->display, "INCR", False);
+	x11->property = XInternAtom(x11->display, "THROUGHPUT_TEST", False);
+
+	root = DefaultRootWindow(x11->display);
+	x11->window = XCreateSimpleWindow(x11->display, root,
+					  0, 0, 10, 10, 0, 0, 0);
+	XSelectInput(x11->display, x11->window, PropertyChangeMask);
+	XFlush(x11->display);
+}
+
+static void
+x11_send_chunk(struct x11_client *x11)
+{
+	static char buf[X11_CHUNK_SIZE];
+	size_t len;
+
+	len = TRANSFER_SIZE - x11->sent;
+	if (len > sizeof buf)
+		len = sizeof buf;
+	fill_pattern(buf, x11->sent, len);
+
+	/* The final, empty property ends the transfer. */
+	XChangeProperty(x11->display, x11->requestor,
+			x11->requestor_property, x11->utf8_string, 8,
+			PropModeReplace, (unsigned char *) buf, len);
+	x11->sent += len;
+	if (len == 0)
+		x11->incr_done = 1;
+}
+
+static void
+x11_handle_selection_request(struct x11_client *x11,
+			     XSelectionRequestEvent *request)
+{
+	XSelectionEvent notify;
+	long size = TRANSFER_SIZE;
+
+	memset(&notify, 0, sizeof notify);
+	notify.type = SelectionNotify;
+	notify.requestor = request->requestor;
+	notify.selection = request->selection;
+	notify.target = request->target;
+	notify.property = request->property;
+	notify.time = request->time;
+
+	if (request->target == x11->targets) {
+		XChangeProperty(x11->display, request->requestor,
+				request->property, XA_ATOM, 32,
+				PropModeReplace,
+				(unsigned char *) &x11->utf8_string, 1);
+	} else if (request->target == x11->utf8_string) {
+		/* Always go through INCR, that's the path we want to
+		 * measure. */
+		x11->requestor = request->requestor;
+		x11->requestor_property = request->property;
+		x11->sent = 0;
+		x11->incr_done = 0;
+		XSelectInput(x11->display, request->requestor,
+			     PropertyChangeMask);
+		XChangeProperty(x11->display, request->requestor,
+				request->property, x11->incr, 32,
+				PropModeReplace, (unsigned char *) &size, 1);
+	} else {
+		notify.property = None;
+	}
+
+	XSendEvent(x11->display, request->requestor, False, 0,
+		   (XEvent *) &notify);
+}
+
+static void
+x11_get_property(struct x11_client *x11)
+{
+	unsigned long nitems, bytes_after;
+	unsigned char *value;
+	Atom type;
+	int format, status;
+
+	status = XGetWindowProperty(x11->display, x11->window,
+				    x11->property, 0, LONG_MAX / 4, True,
+				    AnyPropertyType, &type, &format,
+				    &nitems, &bytes_after, &value);
+	assert(status == Success);
+	assert(bytes_after == 0);
+
+	if (type == x11->incr) {
+		x11->incr_active = 1;
+	} else {
+		assert(type == x11->utf8_string);
+		assert(format == 8);
+		check_pattern((char *) value, x11->received, nitems);
+		x11->received += nitems;
+		assert(x11->received <= TRANSFER_SIZE);
+		if (!x11->incr_active || nitems == 0)
+			x11->done = 1;
+	}
+
+	XFree(value);
+}
+
+static void
+x11_dispatch(struct x11_client *x11)
+{
+	XEvent event;
+
+	while (XPending(x11->display)) {
+		XNextEvent(x11->display, &event);
+
+		switch (event.type) {
+		case SelectionRequest:
+			x11_handle_selection_request(x11,
+						     &event.xselectionrequest);
+			break;
+		case SelectionNotify:
+			assert(event.xselection.property != None);
+			x11_get_property(x11);
+			break;
+		case PropertyNotify:
+			if (event.xproperty.window == x11->requestor &&
+			    event.xproperty.atom == x11->requestor_property &&
+			    event.xproperty.state == PropertyDelete &&
+			    !x11->incr_done)
+				x11_send_chunk(x11);
+			else if (event.xproperty.window == x11->window &&
+				 event.xproperty.atom == x11->property &&
+				 event.xproperty.state == PropertyNewValue &&
+				 x11->incr_active)
+				x11_get_property(x11);
+			break;
+		}
+	}
+
+	XFlush(x11->display);
+}
+
+/* Wait for either client to have something to do, and do it. */
+static void
+dispatch(struct x11_client *x11, struct selection_client *sel,
+	 short fd_events, int timeout)
+{
+	struct wl_display *display = sel->client->wl_display;
+	struct pollfd fds[3];
+	int n = 2, ret;
+
+	fds[0].fd = ConnectionNumber(x11->display);
+	fds[0].events = POLLIN;
+	fds[1].fd = wl_display_get_fd(display);
+	fds[1].events = POLLIN;
+	if (sel->fd >= 0) {
+		fds[2].fd = sel->fd;
+		fds[2].events = fd_events;
+		n = 3;
+	}
+
+	x11_dispatch(x11);
+	assert(wl_display_flush(display) >= 0);
+	assert(wl_display_dispatch_pending(display) >= 0);
+
+	ret = poll(fds, n, timeout);
+	assert(ret >= 0 || errno == EINTR);
+
+	if (ret > 0 && fds[1].revents & POLLIN)
+		assert(wl_display_dispatch(display) >= 0);
+	x11_dispatch(x11);
+
+	if (ret > 0 && n == 3 && fds[2].revents) {
+		if (fd_events == POLLOUT)
+			selection_client_write(sel);
+		else
+			selection_client_read(sel);
+	}
+}
+
+static void
+wayland_to_x11(struct x11_client *x11, struct selection_client *sel)
+{
+	struct timespec start;
+
+	sel->source = wl_data_device_manager_create_data_source(sel->manager);
+	wl_data_source_add_listener(sel->source, &data_source_listener, sel);
+	wl_data_source_offer(sel->source, mime_type);
+	wl_data_device_set_selection(sel->device, sel->source, 0);
+	client_roundtrip(sel->client);
+
+	/* The window manager claims CLIPBOARD on our behalf, which
+	 * doesn't wake up either client, so poll for it. */
+	while (XGetSelectionOwner(x11->display, x11->clipboard) == None)
+		dispatch(x11, sel, POLLOUT, 10);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	XConvertSelection(x11->display, x11->clipboard, x11->utf8_string,
+			  x11->property, x11->window, CurrentTime);
+	while (!x11->done)
+		dispatch(x11, sel, POLLOUT, -1);
+
+	assert(x11->received == TRANSFER_SIZE);
+	report("wayland -> x11", &start);
+}
+
+static void
+x11_to_wayland(struct x11_client *x11, struct selection_client *sel)
+{
+	struct timespec start;
+	int p[2];
+
+	if (sel->offer)
+		wl_data_offer_destroy(sel->offer);
+	sel->offer = NULL;
+
+	XSetSelectionOwner(x11->display, x11->clipboard, x11->window,
+			   CurrentTime);
+	assert(XGetSelectionOwner(x11->display, x11->clipboard) ==
+	       x11->window);
+
+	/* Our own source is cancelled once the X selection replaces
+	 * it, and the window manager's offer follows. */
+	while (sel->source || !sel->offer)
+		dispatch(x11, sel, POLLIN, -1);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	assert(pipe2(p, O_CLOEXEC | O_NONBLOCK) == 0);
+	wl_data_offer_receive(sel->offer, mime_type, p[1]);
+	close(p[1]);
+	sel->fd = p[0];
+	sel->count = 0;
+
+	while (!sel->done)
+		dispatch(x11, sel, POLLIN, -1);
+
+	report("x11 -> wayland", &start);
+}
+
+TEST(xwayland_selection_throughput)
+{
+	struct x11_client x11;
+	struct selection_client sel;
+
+	x11_client_init(&x11);
+	selection_client_init(&sel);
+
+	alarm(60);
+
+	wayland_to_x11(&x11, &sel);
+	x11_to_wayland(&x11, &sel);
+
+	XCloseDisplay(x11.display);
+}
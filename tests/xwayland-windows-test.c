@@ -0,0 +1,153 @@
+/*
+ * Copyright © 2016 The Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <unistd.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/Xutil.h>
+
+#include "weston-test-runner.h"
+
+/*
+ * xwayland-windows-test: map a burst of X windows at once, as
+ *			  applications do when they start up, and check
+ *			  that the window manager picked up all of them.
+ */
+
+#define WINDOW_COUNT 64
+
+static double
+time_since(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1e3 +
+		(now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static Window
+create_window(Display *display, int i)
+{
+	Window window, root;
+	XClassHint class_hint;
+	char name[64];
+	Atom net_wm_name, utf8_string;
+
+	root = DefaultRootWindow(display);
+	window = XCreateSimpleWindow(display, root, 10 + i, 10 + i,
+				     100, 100, 0, 0, 0);
+	XSelectInput(display, window, StructureNotifyMask);
+
+	snprintf(name, sizeof name, "xwayland-windows-test %d", i);
+	XStoreName(display, window, name);
+
+	net_wm_name = XInternAtom(display, "_NET_WM_NAME", False);
+	utf8_string = XInternAtom(display, "UTF8_STRING", False);
+	XChangeProperty(display, window, net_wm_name, utf8_string, 8,
+			PropModeReplace, (unsigned char *) name, strlen(name));
+
+	class_hint.res_name = "xwayland-windows-test";
+	class_hint.res_class = "Weston-test";
+	XSetClassHint(display, window, &class_hint);
+
+	return window;
+}
+
+static long
+get_cardinal(Display *display, Window window, Atom property)
+{
+	unsigned long nitems, bytes_after;
+	unsigned char *value;
+	Atom type;
+	int format, status;
+	long result;
+
+	status = XGetWindowProperty(display, window, property, 0, 1, False,
+				    AnyPropertyType, &type, &format,
+				    &nitems, &bytes_after, &value);
+	assert(status == Success);
+	assert(format == 32);
+	assert(nitems == 1);
+
+	result = *(long *) value;
+	XFree(value);
+
+	return result;
+}
+
+TEST(xwayland_map_many_windows)
+{
+	Display *display;
+	Window windows[WINDOW_COUNT];
+	Atom wm_state, net_wm_desktop;
+	struct timespec start;
+	XEvent event;
+	int i, mapped = 0;
+
+	display = XOpenDisplay(NULL);
+	assert(display);
+
+	wm_state = XInternAtom(display, "WM_STATE", False);
+	net_wm_desktop = XInternAtom(display, "_NET_WM_DESKTOP", False);
+
+	for (i = 0; i < WINDOW_COUNT; i++)
+		windows[i] = create_window(display, i);
+
+	alarm(10);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < WINDOW_COUNT; i++)
+		XMapWindow(display, windows[i]);
+	XFlush(display);
+
+	/* The window manager only maps the window once it has read its
+	 * properties. */
+	while (mapped < WINDOW_COUNT) {
+		XNextEvent(display, &event);
+		if (event.type == MapNotify &&
+		    event.xmap.event == event.xmap.window)
+			mapped++;
+	}
+
+	fprintf(stderr, "mapped %d windows in %.2f ms\n",
+		WINDOW_COUNT, time_since(&start));
+
+	for (i = 0; i < WINDOW_COUNT; i++) {
+		assert(get_cardinal(display, windows[i], wm_state) ==
+		       NormalState);
+		assert(get_cardinal(display, windows[i], net_wm_desktop) == 0);
+	}
+
+	XCloseDisplay(display);
+}
@@ -0,0 +1,274 @@
+/*
+ * Copyright © 2016 The Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Convert a binary timeline log (WESTON_TIMELINE=binary) into the JSON
+ * lines format written by the default timeline mode.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "timeline-binary.h"
+
+#define MAX_DESC (WESTON_TIMELINE_DESC_SIZE + \
+		  3 * WESTON_TIMELINE_DESC_CONT_SIZE)
+
+struct converter {
+	const struct weston_timeline_binary_header *header;
+	const struct weston_timeline_record *records;
+	uint64_t first, last;
+	FILE *out;
+};
+
+static const struct weston_timeline_record *
+converter_record(struct converter *conv, uint64_t i)
+{
+	return &conv->records[i % conv->header->capacity];
+}
+
+static void
+print_quoted_string(FILE *fp, const char *str)
+{
+	if (!str[0]) {
+		fprintf(fp, "null");
+		return;
+	}
+
+	fprintf(fp, "\"%s\"", str);
+}
+
+/* Gather the description of the object record at i, returns the
+ * index of the last record belonging to it. */
+static uint64_t
+collect_desc(struct converter *conv, uint64_t i, char *desc)
+{
+	const struct weston_timeline_record *rec = converter_record(conv, i);
+	size_t len;
+
+	memcpy(desc, rec->u.object.desc, WESTON_TIMELINE_DESC_SIZE);
+	len = WESTON_TIMELINE_DESC_SIZE;
+
+	while (!memchr(desc, '\0', len) && i + 1 < conv->last) {
+		rec = converter_record(conv, i + 1);
+		if (rec->type != WESTON_TIMELINE_RECORD_DESC ||
+		    len + WESTON_TIMELINE_DESC_CONT_SIZE > MAX_DESC)
+			break;
+
+		memcpy(desc + len, rec->u.desc,
+		       WESTON_TIMELINE_DESC_CONT_SIZE);
+		len += WESTON_TIMELINE_DESC_CONT_SIZE;
+		i++;
+	}
+
+	desc[len] = '\0';
+
+	return i;
+}
+
+static void
+emit_point(struct converter *conv, const struct weston_timeline_record *rec)
+{
+	const char *name;
+	int i;
+
+	if (rec->id >= conv->header->n_points)
+		return;
+
+	name = conv->header->points[rec->id];
+
+	fprintf(conv->out, "{ \"T\":[%" PRId64 ", %u], \"N\":\"%.*s\"",
+		rec->sec, rec->nsec,
+		WESTON_TIMELINE_POINT_NAME_SIZE, name);
+
+	for (i = 0; i < WESTON_TIMELINE_MAX_ARGS; i++) {
+		switch (rec->u.point.args[i]) {
+		case WESTON_TIMELINE_ARG_OUTPUT:
+			fprintf(conv->out, ", \"wo\":%u",
+				rec->u.point.output);
+			break;
+		case WESTON_TIMELINE_ARG_SURFACE:
+			fprintf(conv->out, ", \"ws\":%u",
+				rec->u.point.surface);
+			break;
+		case WESTON_TIMELINE_ARG_VBLANK:
+			fprintf(conv->out, ", \"vblank\":[%" PRId64 ", %u]",
+				rec->u.point.vblank_sec,
+				rec->u.point.vblank_nsec);
+			break;
+		case WESTON_TIMELINE_ARG_LATENCY:
+			fprintf(conv->out, ", \"latency\":%u",
+				rec->u.point.latency);
+			break;
+		default:
+			i = WESTON_TIMELINE_MAX_ARGS;
+			break;
+		}
+	}
+
+	fprintf(conv->out, " }\n");
+}
+
+static void
+convert(struct converter *conv)
+{
+	const struct weston_timeline_record *rec;
+	char desc[MAX_DESC + 1];
+	uint64_t i;
+
+	for (i = conv->first; i < conv->last; i++) {
+		rec = converter_record(conv, i);
+
+		switch (rec->type) {
+		case WESTON_TIMELINE_RECORD_POINT:
+			emit_point(conv, rec);
+			break;
+		case WESTON_TIMELINE_RECORD_OUTPUT:
+			i = collect_desc(conv, i, desc);
+			fprintf(conv->out, "{ \"id\":%u, "
+				"\"type\":\"weston_output\", \"name\":",
+				rec->id);
+			print_quoted_string(conv->out, desc);
+			fprintf(conv->out, " }\n");
+			break;
+		case WESTON_TIMELINE_RECORD_SURFACE:
+			i = collect_desc(conv, i, desc);
+			fprintf(conv->out, "{ \"id\":%u, "
+				"\"type\":\"weston_surface\", \"desc\":",
+				rec->id);
+			print_quoted_string(conv->out, desc);
+			if (rec->u.object.main_surface)
+				fprintf(conv->out, ", \"main_surface\":%u",
+					rec->u.object.main_surface);
+			fprintf(conv->out, " }\n");
+			break;
+		default:
+			/* A description whose object record was
+			 * overwritten when the ring wrapped. */
+			break;
+		}
+	}
+}
+
+static void
+usage(const char *name, int exit_code)
+{
+	fprintf(stderr, "usage: %s <timeline.bin> [<output.log>]\n\n"
+		"Converts a binary weston timeline log, recorded with\n"
+		"WESTON_TIMELINE=binary, into the JSON timeline format.\n",
+		name);
+
+	exit(exit_code);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct converter conv;
+	struct stat buf;
+	uint64_t head, capacity;
+	void *map;
+	int fd;
+
+	if (argc < 2 || argc > 3)
+		usage(argv[0], EXIT_FAILURE);
+
+	fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+	if (fd == -1 || fstat(fd, &buf) == -1) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if ((size_t) buf.st_size < WESTON_TIMELINE_RECORDS_OFFSET) {
+		fprintf(stderr, "%s: not a binary timeline\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	map = mmap(NULL, buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap failed: %s\n",
+			argv[1], strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	conv.header = map;
+	conv.records = (const void *) ((const char *) map +
+				       WESTON_TIMELINE_RECORDS_OFFSET);
+
+	if (conv.header->magic != WESTON_TIMELINE_BINARY_MAGIC ||
+	    conv.header->version != WESTON_TIMELINE_BINARY_VERSION ||
+	    conv.header->record_size !=
+	    sizeof(struct weston_timeline_record) ||
+	    conv.header->capacity == 0 ||
+	    conv.header->n_points > WESTON_TIMELINE_MAX_POINTS) {
+		fprintf(stderr, "%s: not a binary timeline "
+			"or unsupported version\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	capacity = conv.header->capacity;
+	if ((uint64_t) buf.st_size < WESTON_TIMELINE_RECORDS_OFFSET +
+	    capacity * sizeof(struct weston_timeline_record)) {
+		fprintf(stderr, "%s: file truncated\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	head = __atomic_load_n(&conv.header->head, __ATOMIC_ACQUIRE);
+	conv.first = head > capacity ? head - capacity : 0;
+	conv.last = head;
+
+	if (argc == 3) {
+		conv.out = fopen(argv[2], "w");
+		if (!conv.out) {
+			fprintf(stderr, "%s: %s\n", argv[2], strerror(errno));
+			return EXIT_FAILURE;
+		}
+	} else {
+		conv.out = stdout;
+	}
+
+	if (conv.first > 0)
+		fprintf(stderr, "ring wrapped, %" PRIu64 " oldest records "
+			"were overwritten\n", conv.first);
+
+	convert(&conv);
+
+	if (conv.out != stdout)
+		fclose(conv.out);
+	munmap(map, buf.st_size);
+
+	return EXIT_SUCCESS;
+}
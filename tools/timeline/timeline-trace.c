@@ -0,0 +1,741 @@
+/*
+ * Copyright © 2016 The Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Read a weston timeline JSON log and
+ *  - write it as a Chrome trace-event file, loadable in chrome://tracing
+ *    and the Perfetto UI, with repaint slices per output and damage
+ *    events per surface,
+ *  - print a frame report: repaint duration percentiles, missed
+ *    vblanks, damage flushes per surface, commit to presentation
+ *    latency and input to presentation latency.
+ *
+ * Binary timelines must be converted first with weston-timeline-convert.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "config-parser.h"
+#include "helpers.h"
+#include "xalloc.h"
+#include "timeline-binary.h"
+
+#define PID_OUTPUTS	1
+#define PID_SURFACES	2
+
+struct sample_array {
+	double *data;
+	size_t count, alloc;
+};
+
+/* One parsed timeline line; fields not present are 0 / NULL. */
+struct entry {
+	int64_t ts;		/* "T", in nanoseconds */
+	char name[64];		/* "N" */
+	uint32_t id;
+	char type[32];
+	char desc[256];		/* "name" or "desc" */
+	int has_desc;
+	uint32_t main_surface;
+	uint32_t wo, ws;
+	int64_t vblank;
+	uint32_t latency;	/* usec */
+};
+
+struct pending_commit {
+	uint32_t surface;
+	int64_t commit;
+};
+
+struct output {
+	uint32_t id;
+	char *name;
+	int64_t req, begin, posted;
+	int64_t last_vblank;
+	int in_loop;
+	unsigned repaints, late_frames, missed_frames;
+	struct sample_array repaint;
+	struct sample_array interval;
+	int64_t min_interval; /* refresh estimate, 0 until known */
+	struct pending_commit *pending;
+	size_t pending_count, pending_alloc;
+};
+
+struct surface {
+	uint32_t id;
+	char *desc;
+	uint32_t main_surface;
+	int64_t commit;		/* oldest commit not yet flushed */
+	unsigned commits, flushes, presented;
+};
+
+struct timeline {
+	struct output **outputs;
+	struct surface **surfaces;
+	uint32_t outputs_size, surfaces_size;
+	struct sample_array latency;
+	struct sample_array input_latency;
+	FILE *trace;
+	int first_event;
+	uint64_t async_id;
+};
+
+static void
+sample_add(struct sample_array *a, double v)
+{
+	if (a->count == a->alloc) {
+		a->alloc = a->alloc ? a->alloc * 2 : 256;
+		a->data = xrealloc(a->data, a->alloc * sizeof a->data[0]);
+	}
+	a->data[a->count++] = v;
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile, the array must be sorted. */
+static double
+percentile(const struct sample_array *a, double p)
+{
+	size_t rank;
+
+	if (a->count == 0)
+		return 0.0;
+
+	rank = (size_t) ceil(p / 100.0 * a->count);
+	if (rank < 1)
+		rank = 1;
+
+	return a->data[rank - 1];
+}
+
+static void
+print_percentiles(const char *what, struct sample_array *a)
+{
+	qsort(a->data, a->count, sizeof a->data[0], compare_double);
+
+	printf("  %s (ms): n %zu", what, a->count);
+	if (a->count > 0)
+		printf(", p50 %.3f, p90 %.3f, p99 %.3f, max %.3f",
+		       percentile(a, 50), percentile(a, 90),
+		       percentile(a, 99), a->data[a->count - 1]);
+	printf("\n");
+}
+
+static struct output *
+get_output(struct timeline *tl, uint32_t id)
+{
+	struct output *o;
+	uint32_t size;
+
+	if (id == 0)
+		return NULL;
+
+	if (id >= tl->outputs_size) {
+		size = MAX(id + 1, tl->outputs_size * 2);
+		tl->outputs = xrealloc(tl->outputs, size * sizeof *tl->outputs);
+		memset(tl->outputs + tl->outputs_size, 0,
+		       (size - tl->outputs_size) * sizeof *tl->outputs);
+		tl->outputs_size = size;
+	}
+
+	if (!tl->outputs[id]) {
+		o = xzalloc(sizeof *o);
+		o->id = id;
+		tl->outputs[id] = o;
+	}
+
+	return tl->outputs[id];
+}
+
+static struct surface *
+get_surface(struct timeline *tl, uint32_t id)
+{
+	struct surface *s;
+	uint32_t size;
+
+	if (id == 0)
+		return NULL;
+
+	if (id >= tl->surfaces_size) {
+		size = MAX(id + 1, tl->surfaces_size * 2);
+		tl->surfaces = xrealloc(tl->surfaces,
+					size * sizeof *tl->surfaces);
+		memset(tl->surfaces + tl->surfaces_size, 0,
+		       (size - tl->surfaces_size) * sizeof *tl->surfaces);
+		tl->surfaces_size = size;
+	}
+
+	if (!tl->surfaces[id]) {
+		s = xzalloc(sizeof *s);
+		s->id = id;
+		tl->surfaces[id] = s;
+	}
+
+	return tl->surfaces[id];
+}
+
+/*
+ * A minimal parser for the flat objects timeline.c writes: string,
+ * integer, null and [sec, nsec] values only.
+ */
+
+static const char *
+skip_space(const char *p)
+{
+	while (*p == ' ' || *p == '\t' || *p == ',')
+		p++;
+
+	return p;
+}
+
+static const char *
+parse_string(const char *p, char *out, size_t size)
+{
+	size_t n = 0;
+
+	if (*p != '"')
+		return NULL;
+
+	for (p++; *p && *p != '"'; p++) {
+		if (*p == '\\' && p[1])
+			p++;
+		if (n + 1 < size)
+			out[n++] = *p;
+	}
+	out[n] = '\0';
+
+	return *p == '"' ? p + 1 : NULL;
+}
+
+static const char *
+parse_timespec(const char *p, int64_t *ns)
+{
+	long long sec, nsec;
+	int n;
+
+	if (sscanf(p, "[%lld ,%lld ]%n", &sec, &nsec, &n) != 2)
+		return NULL;
+
+	*ns = sec * 1000000000LL + nsec;
+
+	return p + n;
+}
+
+static int
+parse_entry(const char *line, struct entry *e)
+{
+	const char *p = skip_space(line);
+	char key[32], str[64];
+	unsigned long val;
+	char *end;
+
+	memset(e, 0, sizeof *e);
+
+	if (*p++ != '{')
+		return -1;
+
+	while (1) {
+		p = skip_space(p);
+		if (*p == '}')
+			return 0;
+
+		p = parse_string(p, key, sizeof key);
+		if (!p || *p++ != ':')
+			return -1;
+
+		if (*p == '"') {
+			if (strcmp(key, "N") == 0) {
+				p = parse_string(p, e->name, sizeof e->name);
+			} else if (strcmp(key, "type") == 0) {
+				p = parse_string(p, e->type, sizeof e->type);
+			} else if (strcmp(key, "name") == 0 ||
+				   strcmp(key, "desc") == 0) {
+				p = parse_string(p, e->desc, sizeof e->desc);
+				e->has_desc = 1;
+			} else {
+				p = parse_string(p, str, sizeof str);
+			}
+			if (!p)
+				return -1;
+		} else if (*p == '[') {
+			int64_t ts;
+
+			p = parse_timespec(p, &ts);
+			if (!p)
+				return -1;
+			if (strcmp(key, "T") == 0)
+				e->ts = ts;
+			else if (strcmp(key, "vblank") == 0)
+				e->vblank = ts;
+		} else if (strncmp(p, "null", 4) == 0) {
+			p += 4;
+		} else {
+			errno = 0;
+			val = strtoul(p, &end, 10);
+			if (errno != 0 || end == p || val > UINT32_MAX)
+				return -1;
+			p = end;
+			if (strcmp(key, "id") == 0)
+				e->id = val;
+			else if (strcmp(key, "wo") == 0)
+				e->wo = val;
+			else if (strcmp(key, "ws") == 0)
+				e->ws = val;
+			else if (strcmp(key, "main_surface") == 0)
+				e->main_surface = val;
+			else if (strcmp(key, "latency") == 0)
+				e->latency = val;
+		}
+	}
+}
+
+/*
+ * Chrome trace-event output
+ */
+
+static void
+trace_string(FILE *fp, const char *str)
+{
+	fputc('"', fp);
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			fprintf(fp, "\\%c", *str);
+		else if ((unsigned char) *str < 0x20)
+			fprintf(fp, "\\u%04x", *str);
+		else
+			fputc(*str, fp);
+	}
+	fputc('"', fp);
+}
+
+static void
+trace_begin_event(struct timeline *tl)
+{
+	fprintf(tl->trace, tl->first_event ? "\n" : ",\n");
+	tl->first_event = 0;
+}
+
+static void
+trace_thread_name(struct timeline *tl, int pid, uint32_t tid,
+		  const char *name)
+{
+	if (!tl->trace)
+		return;
+
+	trace_begin_event(tl);
+	fprintf(tl->trace, "{\"ph\":\"M\",\"name\":\"thread_name\","
+		"\"pid\":%d,\"tid\":%u,\"args\":{\"name\":", pid, tid);
+	trace_string(tl->trace, name);
+	fprintf(tl->trace, "}}");
+}
+
+static void
+trace_slice(struct timeline *tl, int pid, uint32_t tid, const char *name,
+	    int64_t begin, int64_t end)
+{
+	if (!tl->trace || end < begin)
+		return;
+
+	trace_begin_event(tl);
+	fprintf(tl->trace, "{\"ph\":\"X\",\"name\":\"%s\",\"pid\":%d,"
+		"\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+		name, pid, tid, begin / 1000.0, (end - begin) / 1000.0);
+}
+
+static void
+trace_instant(struct timeline *tl, int pid, uint32_t tid, const char *name,
+	      int64_t ts)
+{
+	if (!tl->trace)
+		return;
+
+	trace_begin_event(tl);
+	fprintf(tl->trace, "{\"ph\":\"i\",\"s\":\"t\",\"name\":\"%s\","
+		"\"pid\":%d,\"tid\":%u,\"ts\":%.3f}",
+		name, pid, tid, ts / 1000.0);
+}
+
+/* Async slices may overlap on a track, one per presented commit. */
+static void
+trace_async(struct timeline *tl, int pid, uint32_t tid, const char *name,
+	    int64_t begin, int64_t end)
+{
+	uint64_t id = ++tl->async_id;
+
+	if (!tl->trace || end < begin)
+		return;
+
+	trace_begin_event(tl);
+	fprintf(tl->trace, "{\"ph\":\"b\",\"cat\":\"latency\","
+		"\"name\":\"%s\",\"id\":%" PRIu64 ",\"pid\":%d,\"tid\":%u,"
+		"\"ts\":%.3f}", name, id, pid, tid, begin / 1000.0);
+	trace_begin_event(tl);
+	fprintf(tl->trace, "{\"ph\":\"e\",\"cat\":\"latency\","
+		"\"name\":\"%s\",\"id\":%" PRIu64 ",\"pid\":%d,\"tid\":%u,"
+		"\"ts\":%.3f}", name, id, pid, tid, end / 1000.0);
+}
+
+/*
+ * Event handling
+ */
+
+static void
+handle_object(struct timeline *tl, const struct entry *e)
+{
+	struct output *o;
+	struct surface *s;
+	char name[300];
+
+	if (strcmp(e->type, "weston_output") == 0) {
+		o = get_output(tl, e->id);
+		if (!o)
+			return;
+		free(o->name);
+		o->name = xstrdup(e->has_desc ? e->desc : "");
+		snprintf(name, sizeof name, "output %u %s", o->id, o->name);
+		trace_thread_name(tl, PID_OUTPUTS, o->id, name);
+	} else if (strcmp(e->type, "weston_surface") == 0) {
+		s = get_surface(tl, e->id);
+		if (!s)
+			return;
+		free(s->desc);
+		s->desc = xstrdup(e->has_desc ? e->desc : "");
+		s->main_surface = e->main_surface;
+		snprintf(name, sizeof name, "surface %u %s", s->id, s->desc);
+		trace_thread_name(tl, PID_SURFACES, s->id, name);
+	}
+}
+
+static void
+output_add_pending(struct output *o, struct surface *s)
+{
+	size_t i;
+
+	for (i = 0; i < o->pending_count; i++)
+		if (o->pending[i].surface == s->id)
+			return;
+
+	if (o->pending_count == o->pending_alloc) {
+		o->pending_alloc = o->pending_alloc ? o->pending_alloc * 2 : 16;
+		o->pending = xrealloc(o->pending,
+				      o->pending_alloc * sizeof *o->pending);
+	}
+
+	o->pending[o->pending_count].surface = s->id;
+	o->pending[o->pending_count].commit = s->commit;
+	o->pending_count++;
+}
+
+static void
+output_repaint_finished(struct timeline *tl, struct output *o,
+			const struct entry *e)
+{
+	struct surface *s;
+	int64_t present, interval, refresh;
+	size_t i;
+
+	/* The vblank timestamp is on the presentation clock, which is
+	 * normally the same monotonic clock as the timeline. */
+	present = e->vblank ? e->vblank : e->ts;
+
+	trace_slice(tl, PID_OUTPUTS, o->id, "wait for vblank",
+		    o->posted, e->ts);
+	trace_instant(tl, PID_OUTPUTS, o->id, "vblank", present);
+
+	if (o->last_vblank && present > o->last_vblank) {
+		interval = present - o->last_vblank;
+		sample_add(&o->interval, interval / 1e6);
+
+		/* Refresh estimated from the smallest interval seen so
+		 * far, good enough once a few frames went by. */
+		if (!o->min_interval || interval < o->min_interval)
+			o->min_interval = interval;
+		refresh = o->min_interval;
+		if (interval * 2 > refresh * 3) {
+			o->late_frames++;
+			o->missed_frames +=
+				(interval + refresh / 2) / refresh - 1;
+		}
+	}
+	o->last_vblank = present;
+
+	for (i = 0; i < o->pending_count; i++) {
+		s = get_surface(tl, o->pending[i].surface);
+		s->presented++;
+		sample_add(&tl->latency,
+			   (present - o->pending[i].commit) / 1e6);
+		trace_async(tl, PID_SURFACES, s->id, "commit to present",
+			    o->pending[i].commit, present);
+	}
+	o->pending_count = 0;
+}
+
+static void
+handle_point(struct timeline *tl, const struct entry *e)
+{
+	struct output *o = get_output(tl, e->wo);
+	struct surface *s = get_surface(tl, e->ws);
+
+	if (o && strcmp(e->name, "core_repaint_req") == 0) {
+		o->req = e->ts;
+		trace_instant(tl, PID_OUTPUTS, o->id, "repaint req", e->ts);
+	} else if (o && strcmp(e->name, "core_repaint_enter_loop") == 0) {
+		o->in_loop = 1;
+		o->last_vblank = 0;
+		trace_instant(tl, PID_OUTPUTS, o->id, "enter loop", e->ts);
+	} else if (o && strcmp(e->name, "core_repaint_exit_loop") == 0) {
+		o->in_loop = 0;
+		o->last_vblank = 0;
+		trace_instant(tl, PID_OUTPUTS, o->id, "exit loop", e->ts);
+	} else if (o && strcmp(e->name, "core_repaint_begin") == 0) {
+		o->begin = e->ts;
+		o->posted = 0;
+	} else if (o && strcmp(e->name, "core_repaint_posted") == 0) {
+		if (o->begin) {
+			o->repaints++;
+			sample_add(&o->repaint, (e->ts - o->begin) / 1e6);
+			trace_slice(tl, PID_OUTPUTS, o->id, "repaint",
+				    o->begin, e->ts);
+		}
+		o->posted = e->ts;
+		o->begin = 0;
+	} else if (o && strcmp(e->name, "core_repaint_finished") == 0) {
+		if (o->posted)
+			output_repaint_finished(tl, o, e);
+		o->posted = 0;
+	} else if (s && strcmp(e->name, "core_commit_damage") == 0) {
+		s->commits++;
+		if (!s->commit)
+			s->commit = e->ts;
+		trace_instant(tl, PID_SURFACES, s->id, "commit damage", e->ts);
+	} else if (s && strcmp(e->name, "core_flush_damage") == 0) {
+		s->flushes++;
+		if (o && s->commit)
+			output_add_pending(o, s);
+		s->commit = 0;
+		trace_instant(tl, PID_SURFACES, s->id, "flush damage", e->ts);
+	} else if (strcmp(e->name, "core_input_latency") == 0) {
+		sample_add(&tl->input_latency, e->latency / 1e3);
+		if (s)
+			trace_async(tl, PID_SURFACES, s->id,
+				    "input to present",
+				    e->ts - (int64_t) e->latency * 1000, e->ts);
+	} else if (o) {
+		trace_instant(tl, PID_OUTPUTS, o->id, e->name, e->ts);
+	} else if (s) {
+		trace_instant(tl, PID_SURFACES, s->id, e->name, e->ts);
+	}
+}
+
+static void
+print_report(struct timeline *tl)
+{
+	struct output *o;
+	struct surface *s;
+	uint32_t i;
+
+	printf("Outputs\n");
+	for (i = 0; i < tl->outputs_size; i++) {
+		o = tl->outputs[i];
+		if (!o)
+			continue;
+
+		printf("output %u \"%s\": %u repaints\n", o->id,
+		       o->name ? o->name : "", o->repaints);
+		print_percentiles("repaint duration", &o->repaint);
+		print_percentiles("vblank interval", &o->interval);
+		printf("  vblank misses: %u late frames, %u frames missed\n",
+		       o->late_frames, o->missed_frames);
+	}
+
+	printf("\nSurfaces\n");
+	printf("%8s %8s %8s %9s  %s\n",
+	       "id", "commits", "flushes", "presented", "description");
+	for (i = 0; i < tl->surfaces_size; i++) {
+		s = tl->surfaces[i];
+		if (!s)
+			continue;
+
+		printf("%8u %8u %8u %9u  %s", s->id, s->commits,
+		       s->flushes, s->presented, s->desc ? s->desc : "");
+		if (s->main_surface)
+			printf(" (sub-surface of %u)", s->main_surface);
+		printf("\n");
+	}
+
+	printf("\nCommit to presentation\n");
+	print_percentiles("latency", &tl->latency);
+
+	printf("\nInput to presentation\n");
+	print_percentiles("latency", &tl->input_latency);
+}
+
+static void
+timeline_release(struct timeline *tl)
+{
+	uint32_t i;
+
+	for (i = 0; i < tl->outputs_size; i++) {
+		if (!tl->outputs[i])
+			continue;
+		free(tl->outputs[i]->name);
+		free(tl->outputs[i]->repaint.data);
+		free(tl->outputs[i]->interval.data);
+		free(tl->outputs[i]->pending);
+		free(tl->outputs[i]);
+	}
+	free(tl->outputs);
+
+	for (i = 0; i < tl->surfaces_size; i++) {
+		if (!tl->surfaces[i])
+			continue;
+		free(tl->surfaces[i]->desc);
+		free(tl->surfaces[i]);
+	}
+	free(tl->surfaces);
+
+	free(tl->latency.data);
+	free(tl->input_latency.data);
+}
+
+static void
+usage(const char *name, int exit_code)
+{
+	fprintf(stderr, "usage: %s [options] <timeline.log>\n\n"
+		"Prints a frame report of a weston timeline log and\n"
+		"optionally converts it to the Chrome trace-event format.\n\n"
+		"  -o, --output=FILE\twrite a Chrome/Perfetto trace to FILE\n"
+		"  -q, --quiet\t\tdo not print the frame report\n"
+		"  -h, --help\t\tthis help text\n", name);
+
+	exit(exit_code);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct timeline tl;
+	struct entry e;
+	char *output = NULL;
+	int quiet = 0, help = 0;
+	unsigned lineno = 0, bad = 0;
+	char *line = NULL;
+	size_t len = 0;
+	uint32_t magic;
+	FILE *in;
+
+	const struct weston_option options[] = {
+		{ WESTON_OPTION_STRING, "output", 'o', &output },
+		{ WESTON_OPTION_BOOLEAN, "quiet", 'q', &quiet },
+		{ WESTON_OPTION_BOOLEAN, "help", 'h', &help },
+	};
+
+	parse_options(options, ARRAY_LENGTH(options), &argc, argv);
+	if (help)
+		usage(argv[0], EXIT_SUCCESS);
+
+	if (argc != 2)
+		usage(argv[0], EXIT_FAILURE);
+
+	in = fopen(argv[1], "r");
+	if (!in) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if (fread(&magic, sizeof magic, 1, in) == 1 &&
+	    magic == WESTON_TIMELINE_BINARY_MAGIC) {
+		fprintf(stderr, "%s: binary timeline, convert it with "
+			"weston-timeline-convert first\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+	rewind(in);
+
+	memset(&tl, 0, sizeof tl);
+	tl.first_event = 1;
+
+	if (output) {
+		tl.trace = fopen(output, "w");
+		if (!tl.trace) {
+			fprintf(stderr, "%s: %s\n", output, strerror(errno));
+			return EXIT_FAILURE;
+		}
+		fprintf(tl.trace, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+		fprintf(tl.trace, "\n{\"ph\":\"M\",\"name\":\"process_name\","
+			"\"pid\":%d,\"args\":{\"name\":\"outputs\"}},", PID_OUTPUTS);
+		fprintf(tl.trace, "\n{\"ph\":\"M\",\"name\":\"process_name\","
+			"\"pid\":%d,\"args\":{\"name\":\"surfaces\"}}", PID_SURFACES);
+		tl.first_event = 0;
+	}
+
+	while (getline(&line, &len, in) > 0) {
+		lineno++;
+
+		if (parse_entry(line, &e) < 0) {
+			if (bad++ < 10)
+				fprintf(stderr, "%s:%u: cannot parse line\n",
+					argv[1], lineno);
+			continue;
+		}
+
+		if (e.type[0])
+			handle_object(&tl, &e);
+		else if (e.name[0])
+			handle_point(&tl, &e);
+	}
+
+	free(line);
+	fclose(in);
+
+	if (tl.trace) {
+		fprintf(tl.trace, "\n]}\n");
+		fclose(tl.trace);
+	}
+
+	if (bad)
+		fprintf(stderr, "%u of %u lines could not be parsed\n",
+			bad, lineno);
+
+	if (!quiet)
+		print_report(&tl);
+
+	timeline_release(&tl);
+
+	return EXIT_SUCCESS;
+}
@@ -36,21 +36,25 @@
 #include <string.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <pthread.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <cairo.h>
 
 #include "wcap-decode.h"
 
 static void
-write_png(struct wcap_decoder *decoder, const char *filename)
+write_png(uint32_t *frame, int width, int height, const char *filename)
 {
 	cairo_surface_t *surface;
 
-	surface = cairo_image_surface_create_for_data((unsigned char *) decoder->frame,
+	surface = cairo_image_surface_create_for_data((unsigned char *) frame,
 						      CAIRO_FORMAT_ARGB32,
-						      decoder->width,
-						      decoder->height,
-						      decoder->width * 4);
+						      width, height,
+						      width * 4);
 	cairo_surface_write_to_png(surface, filename);
 	cairo_surface_destroy(surface);
 }
@@ -98,12 +102,75 @@ int clamp_uv(int u)
 		return clamp;
 }
 
+/* Convert a row of pixels to luma and the unscaled chroma terms that
+ * rgb_to_yuv() accumulates, with identical results. */
+static void
+convert_row(uint32_t format, const uint32_t *p, int n,
+	    unsigned char *y, int *u, int *v)
+{
+	int i = 0;
+
+#ifdef __SSE2__
+	/* All products are formed with _mm_madd_epi16() against a
+	 * coefficient in the low half of each lane; the coefficients
+	 * that do not fit in an int16 are split as x * 65536 - c. */
+	const __m128i mask = _mm_set1_epi32(0xff);
+	const __m128i cr = _mm_set1_epi32(19595);
+	const __m128i cg = _mm_set1_epi32((38469 - 65536) & 0xffff);
+	const __m128i cb = _mm_set1_epi32(7472);
+	const __m128i cu = _mm_set1_epi32((46727 - 65536) & 0xffff);
+	const __m128i cv = _mm_set1_epi32((36962 - 65536) & 0xffff);
+	int rshift = format == WCAP_FORMAT_XRGB8888 ? 16 : 0;
+	int bshift = 16 - rshift;
+	__m128i px, r, g, b, ly, d;
+
+	for (; i + 4 <= n; i += 4) {
+		px = _mm_loadu_si128((const __m128i *) (p + i));
+		r = _mm_and_si128(_mm_srl_epi32(px, _mm_cvtsi32_si128(rshift)),
+				  mask);
+		g = _mm_and_si128(_mm_srli_epi32(px, 8), mask);
+		b = _mm_and_si128(_mm_srl_epi32(px, _mm_cvtsi32_si128(bshift)),
+				  mask);
+
+		ly = _mm_add_epi32(_mm_madd_epi16(r, cr),
+				   _mm_madd_epi16(b, cb));
+		ly = _mm_add_epi32(ly, _mm_madd_epi16(g, cg));
+		ly = _mm_add_epi32(ly, _mm_slli_epi32(g, 16));
+		ly = _mm_srli_epi32(ly, 16);
+
+		d = _mm_sub_epi32(r, ly);
+		_mm_storeu_si128((__m128i *) (u + i),
+				 _mm_add_epi32(_mm_slli_epi32(d, 16),
+					       _mm_madd_epi16(d, cu)));
+		d = _mm_sub_epi32(b, ly);
+		_mm_storeu_si128((__m128i *) (v + i),
+				 _mm_add_epi32(_mm_slli_epi32(d, 16),
+					       _mm_madd_epi16(d, cv)));
+
+		ly = _mm_packs_epi32(ly, ly);
+		ly = _mm_packus_epi16(ly, ly);
+		*(uint32_t *) (y + i) = _mm_cvtsi128_si32(ly);
+	}
+#endif
+
+	for (; i < n; i++) {
+		u[i] = 0;
+		v[i] = 0;
+		y[i] = rgb_to_yuv(format, p[i], &u[i], &v[i]);
+	}
+}
+
+struct convert_scratch {
+	int *u1, *v1, *u2, *v2;
+};
+
 static void
-convert_to_yv12(struct wcap_decoder *decoder, unsigned char *out)
+convert_to_yv12(const struct wcap_decoder *decoder, const uint32_t *frame,
+		unsigned char *out, struct convert_scratch *scratch)
 {
 	unsigned char *y1, *y2, *u, *v;
-	uint32_t *p1, *p2, *end;
-	int i, u_accum, v_accum, stride0, stride1;
+	const uint32_t *p1, *p2;
+	int i, k, stride0, stride1;
 	uint32_t format = decoder->format;
 
 	stride0 = decoder->width;
@@ -113,38 +180,33 @@ convert_to_yv12(struct wcap_decoder *decoder, unsigned char *out)
 		y2 = y1 + stride0;
 		v = out + stride0 * decoder->height + stride1 * i / 2;
 		u = v + stride1 * decoder->height / 2;
-		p1 = decoder->frame + decoder->width * i;
+		p1 = frame + decoder->width * i;
 		p2 = p1 + decoder->width;
-		end = p1 + decoder->width;
-
-		while (p1 < end) {
-			u_accum = 0;
-			v_accum = 0;
-			y1[0] = rgb_to_yuv(format, p1[0], &u_accum, &v_accum);
-			y1[1] = rgb_to_yuv(format, p1[1], &u_accum, &v_accum);
-			y2[0] = rgb_to_yuv(format, p2[0], &u_accum, &v_accum);
-			y2[1] = rgb_to_yuv(format, p2[1], &u_accum, &v_accum);
-			u[0] = clamp_uv(u_accum);
-			v[0] = clamp_uv(v_accum);
-
-			y1 += 2;
-			p1 += 2;
-			y2 += 2;
-			p2 += 2;
-			u++;
-			v++;
+
+		convert_row(format, p1, decoder->width, y1,
+			    scratch->u1, scratch->v1);
+		convert_row(format, p2, decoder->width, y2,
+			    scratch->u2, scratch->v2);
+
+		for (k = 0; k < stride1; k++) {
+			u[k] = clamp_uv(scratch->u1[2 * k] +
+					scratch->u1[2 * k + 1] +
+					scratch->u2[2 * k] +
+					scratch->u2[2 * k + 1]);
+			v[k] = clamp_uv(scratch->v1[2 * k] +
+					scratch->v1[2 * k + 1] +
+					scratch->v2[2 * k] +
+					scratch->v2[2 * k + 1]);
 		}
 	}
 }
 
 static void
-convert_to_yuv444(struct wcap_decoder *decoder, unsigned char *out)
+convert_to_yuv444(const struct wcap_decoder *decoder, const uint32_t *frame,
+		  unsigned char *out, struct convert_scratch *scratch)
 {
-
 	unsigned char *yp, *up, *vp;
-	uint32_t *rp, *end;
-	int u, v;
-	int i, stride, psize;
+	int i, k, stride, psize;
 	uint32_t format = decoder->format;
 
 	stride = decoder->width;
@@ -153,44 +215,260 @@ convert_to_yuv444(struct wcap_decoder *decoder, unsigned char *out)
 		yp = out + stride * i;
 		up = yp + (psize * 2);
 		vp = yp + (psize * 1);
-		rp = decoder->frame + decoder->width * i;
-		end = rp + decoder->width;
-		while (rp < end) {
-			u = 0;
-			v = 0;
-			yp[0] = rgb_to_yuv(format, rp[0], &u, &v);
-			up[0] = clamp_uv(u/.3);
-			vp[0] = clamp_uv(v/.3);
-			up++;
-			vp++;
-			yp++;
-			rp++;
+
+		convert_row(format, frame + decoder->width * i,
+			    decoder->width, yp, scratch->u1, scratch->v1);
+
+		for (k = 0; k < stride; k++) {
+			up[k] = clamp_uv(scratch->u1[k]/.3);
+			vp[k] = clamp_uv(scratch->v1[k]/.3);
 		}
 	}
 }
 
+/* Delta decoding is inherently sequential and stays on the main
+ * thread.  Each output frame is copied into a job, converted or
+ * written as png by a pool of worker threads, and retired in order by
+ * the main thread, which owns stdout. */
+
+/* More threads than this rarely help, as the main thread decodes the
+ * frames serially. */
+#define PIPELINE_DEFAULT_MAX_THREADS 8
+
+/* Upper bound on the frame and output buffers of all jobs together. */
+#define PIPELINE_MEMORY_BUDGET (256 * 1024 * 1024)
+
+enum job_state {
+	JOB_FREE,
+	JOB_QUEUED,
+	JOB_DONE
+};
+
+struct job {
+	enum job_state state;
+	uint32_t *frame;
+	unsigned char *out;
+	int yuv;
+	char filename[200];
+};
+
+struct pipeline {
+	const struct wcap_decoder *decoder;
+	int depth, out_size;
+
+	pthread_t *threads;
+	int nthreads;
+	struct job *jobs;
+	int njobs;
+
+	/* Sequence numbers; next_retire <= next_work <= next_submit. */
+	int next_submit, next_work, next_retire;
+	int quit;
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond, done_cond;
+};
+
 static void
-output_yuv_frame(struct wcap_decoder *decoder, int depth)
+process_job(struct pipeline *pl, struct job *job,
+	    struct convert_scratch *scratch)
 {
-	static unsigned char *out;
-	int size;
+	const struct wcap_decoder *decoder = pl->decoder;
 
-	if (depth == 444) {
-		size = decoder->width * decoder->height * 3;
-	} else {
-		size = decoder->width * decoder->height * 3 / 2;
+	if (job->filename[0])
+		write_png(job->frame, decoder->width, decoder->height,
+			  job->filename);
+
+	if (!job->yuv)
+		return;
+
+	if (pl->depth == 444)
+		convert_to_yuv444(decoder, job->frame, job->out, scratch);
+	else
+		convert_to_yv12(decoder, job->frame, job->out, scratch);
+}
+
+static void *
+worker_thread_function(void *data)
+{
+	struct pipeline *pl = data;
+	struct convert_scratch scratch;
+	struct job *job;
+	int width = pl->decoder->width;
+
+	scratch.u1 = malloc(width * sizeof *scratch.u1);
+	scratch.v1 = malloc(width * sizeof *scratch.v1);
+	scratch.u2 = malloc(width * sizeof *scratch.u2);
+	scratch.v2 = malloc(width * sizeof *scratch.v2);
+	if (!scratch.u1 || !scratch.v1 || !scratch.u2 || !scratch.v2) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
 	}
-	if (out == NULL)
-		out = malloc(size);
 
-	if (depth == 444) {
-		convert_to_yuv444(decoder, out);
-	} else {
-		convert_to_yv12(decoder, out);
+	pthread_mutex_lock(&pl->mutex);
+	for (;;) {
+		while (!pl->quit && pl->next_work == pl->next_submit)
+			pthread_cond_wait(&pl->work_cond, &pl->mutex);
+		if (pl->next_work == pl->next_submit)
+			break;
+
+		job = &pl->jobs[pl->next_work++ % pl->njobs];
+		pthread_mutex_unlock(&pl->mutex);
+
+		process_job(pl, job, &scratch);
+
+		pthread_mutex_lock(&pl->mutex);
+		job->state = JOB_DONE;
+		pthread_cond_signal(&pl->done_cond);
+	}
+	pthread_mutex_unlock(&pl->mutex);
+
+	free(scratch.u1);
+	free(scratch.v1);
+	free(scratch.u2);
+	free(scratch.v2);
+
+	return NULL;
+}
+
+/* Retire finished jobs in submission order until fewer than
+ * max_pending are outstanding.  Called with the mutex held. */
+static void
+pipeline_retire(struct pipeline *pl, int max_pending)
+{
+	struct job *job;
+
+	while (pl->next_submit - pl->next_retire > max_pending) {
+		job = &pl->jobs[pl->next_retire % pl->njobs];
+		if (job->state != JOB_DONE) {
+			pthread_cond_wait(&pl->done_cond, &pl->mutex);
+			continue;
+		}
+
+		pthread_mutex_unlock(&pl->mutex);
+		if (job->filename[0])
+			fprintf(stderr, "wrote %s\n", job->filename);
+		if (job->yuv) {
+			printf("FRAME\n");
+			fwrite(job->out, 1, pl->out_size, stdout);
+		}
+		pthread_mutex_lock(&pl->mutex);
+
+		job->state = JOB_FREE;
+		pl->next_retire++;
+	}
+}
+
+static void
+pipeline_submit(struct pipeline *pl, const char *filename, int yuv)
+{
+	struct job *job;
+
+	pthread_mutex_lock(&pl->mutex);
+	pipeline_retire(pl, pl->njobs - 1);
+	pthread_mutex_unlock(&pl->mutex);
+
+	job = &pl->jobs[pl->next_submit % pl->njobs];
+	assert(job->state == JOB_FREE);
+	memcpy(job->frame, pl->decoder->frame,
+	       pl->decoder->width * pl->decoder->height * 4);
+	job->yuv = yuv;
+	if (filename)
+		snprintf(job->filename, sizeof job->filename, "%s", filename);
+	else
+		job->filename[0] = '\0';
+
+	pthread_mutex_lock(&pl->mutex);
+	job->state = JOB_QUEUED;
+	pl->next_submit++;
+	pthread_cond_signal(&pl->work_cond);
+	pthread_mutex_unlock(&pl->mutex);
+}
+
+static int
+pipeline_init(struct pipeline *pl, const struct wcap_decoder *decoder,
+	      int depth, int nthreads)
+{
+	size_t job_size;
+	int i, max_jobs;
+
+	memset(pl, 0, sizeof *pl);
+	pl->decoder = decoder;
+	pl->depth = depth;
+	if (depth == 444)
+		pl->out_size = decoder->width * decoder->height * 3;
+	else
+		pl->out_size = decoder->width * decoder->height * 3 / 2;
+
+	/* Enough jobs to keep every worker busy while the main thread
+	 * decodes ahead and waits for the oldest frame, as far as the
+	 * memory budget allows.  Workers beyond the number of jobs would
+	 * never get one. */
+	job_size = (size_t) decoder->width * decoder->height * 4;
+	if (depth)
+		job_size += pl->out_size;
+	max_jobs = PIPELINE_MEMORY_BUDGET / job_size;
+	if (max_jobs < 2)
+		max_jobs = 2;
+
+	pl->njobs = nthreads * 2;
+	if (pl->njobs > max_jobs)
+		pl->njobs = max_jobs;
+	if (nthreads > pl->njobs)
+		nthreads = pl->njobs;
+	pl->jobs = calloc(pl->njobs, sizeof *pl->jobs);
+	if (pl->jobs == NULL)
+		return -1;
+
+	for (i = 0; i < pl->njobs; i++) {
+		pl->jobs[i].frame =
+			malloc(decoder->width * decoder->height * 4);
+		pl->jobs[i].out = depth ? malloc(pl->out_size) : NULL;
+		if (pl->jobs[i].frame == NULL ||
+		    (depth && pl->jobs[i].out == NULL))
+			return -1;
 	}
 
-	printf("FRAME\n");
-	fwrite(out, 1, size, stdout);
+	pthread_mutex_init(&pl->mutex, NULL);
+	pthread_cond_init(&pl->work_cond, NULL);
+	pthread_cond_init(&pl->done_cond, NULL);
+
+	pl->threads = calloc(nthreads, sizeof *pl->threads);
+	if (pl->threads == NULL)
+		return -1;
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&pl->threads[i], NULL,
+				   worker_thread_function, pl) != 0)
+			break;
+		pl->nthreads++;
+	}
+
+	return pl->nthreads > 0 ? 0 : -1;
+}
+
+static void
+pipeline_finish(struct pipeline *pl)
+{
+	int i;
+
+	pthread_mutex_lock(&pl->mutex);
+	pipeline_retire(pl, 0);
+	pl->quit = 1;
+	pthread_cond_broadcast(&pl->work_cond);
+	pthread_mutex_unlock(&pl->mutex);
+
+	for (i = 0; i < pl->nthreads; i++)
+		pthread_join(pl->threads[i], NULL);
+
+	pthread_mutex_destroy(&pl->mutex);
+	pthread_cond_destroy(&pl->work_cond);
+	pthread_cond_destroy(&pl->done_cond);
+
+	for (i = 0; i < pl->njobs; i++) {
+		free(pl->jobs[i].frame);
+		free(pl->jobs[i].out);
+	}
+	free(pl->jobs);
+	free(pl->threads);
 }
 
 static void
@@ -198,14 +476,20 @@ usage(int exit_code)
 {
 	fprintf(stderr, "usage: wcap-decode "
 		"[--help] [--yuv4mpeg2] [--frame=<frame>] [--all] \n"
-		"\t[--rate=<num:denom>] <wcap file>\n\n"
+		"\t[--rate=<num:denom>] [--start=<secs>] [--end=<secs>]\n"
+		"\t[--threads=<n>]\n"
+		"\t<wcap file>\n\n"
 		"\t--help\t\t\tthis help text\n"
 		"\t--yuv4mpeg2\t\tdump wcap file to stdout in yuv4mpeg2 format\n"
 		"\t--yuv4mpeg2-444\t\tdump wcap file to stdout in yuv4mpeg2 444 format\n"
 		"\t--frame=<frame>\t\twrite out the given frame number as png\n"
 		"\t--all\t\t\twrite all frames as pngs\n"
 		"\t--rate=<num:denom>\treplay frame rate for yuv4mpeg2,\n"
-		"\t\t\t\tspecified as an integer fraction\n\n");
+		"\t\t\t\tspecified as an integer fraction\n"
+		"\t--threads=<n>\t\tnumber of conversion threads,\n"
+		"\t\t\t\tdefaults to the number of CPUs, at most 8\n"
+		"\t--start=<secs>\t\tstart decoding this far into the capture\n"
+		"\t--end=<secs>\t\tstop decoding this far into the capture\n\n");
 
 	exit(exit_code);
 }
@@ -213,11 +497,15 @@ usage(int exit_code)
 int main(int argc, char *argv[])
 {
 	struct wcap_decoder *decoder;
+	struct pipeline pipeline;
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
 	int i, j, output_frame = -1, yuv4mpeg2 = 0, all = 0, has_frame;
+	int threads_set = 0;
 	int num = 30, denom = 1;
+	double start = 0, end = -1;
 	char filename[200];
 	char *mode;
-	uint32_t msecs, frame_time;
+	uint32_t msecs, frame_time, end_msecs = 0;
 
 	for (i = 1, j = 1; i < argc; i++) {
 		if (strcmp(argv[i], "--yuv4mpeg2-444") == 0) {
@@ -234,6 +522,12 @@ int main(int argc, char *argv[])
 			;
 		} else if (sscanf(argv[i], "--rate=%d:%d", &num, &denom) == 2) {
 			;
+		} else if (sscanf(argv[i], "--start=%lf", &start) == 1) {
+			;
+		} else if (sscanf(argv[i], "--end=%lf", &end) == 1) {
+			;
+		} else if (sscanf(argv[i], "--threads=%d", &nthreads) == 1) {
+			threads_set = 1;
 		} else if (strcmp(argv[i], "--") == 0) {
 			break;
 		} else if (argv[i][0] == '-') {
@@ -252,6 +546,14 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "invalid rate, denom can not be 0\n");
 		exit(EXIT_FAILURE);
 	}
+	if (nthreads < 1)
+		nthreads = 1;
+	if (!threads_set && nthreads > PIPELINE_DEFAULT_MAX_THREADS)
+		nthreads = PIPELINE_DEFAULT_MAX_THREADS;
+	if (start < 0 || (end >= 0 && end < start)) {
+		fprintf(stderr, "invalid --start/--end range\n");
+		exit(EXIT_FAILURE);
+	}
 
 	decoder = wcap_decoder_create(argv[1]);
 	if (decoder == NULL) {
@@ -279,25 +581,40 @@ int main(int argc, char *argv[])
 		fflush(stdout);
 	}
 
+	if (pipeline_init(&pipeline, decoder, yuv4mpeg2, nthreads) < 0) {
+		fprintf(stderr, "Creating decode pipeline failed\n");
+		exit(EXIT_FAILURE);
+	}
+
 	i = 0;
-	has_frame = wcap_decoder_get_frame(decoder);
-	msecs = decoder->msecs;
+	if (start > 0) {
+		msecs = decoder->start_msecs + start * 1000;
+		has_frame = wcap_decoder_seek(decoder, msecs);
+	} else {
+		has_frame = wcap_decoder_get_frame(decoder);
+		msecs = decoder->msecs;
+	}
+	if (end >= 0)
+		end_msecs = decoder->start_msecs + end * 1000;
 	frame_time = 1000 * denom / num;
 	while (has_frame) {
+		if (end >= 0 && msecs > end_msecs)
+			break;
 		if (all || i == output_frame) {
 			snprintf(filename, sizeof filename,
 				 "wcap-frame-%d.png", i);
-			write_png(decoder, filename);
-			fprintf(stderr, "wrote %s\n", filename);
+			pipeline_submit(&pipeline, filename, yuv4mpeg2 != 0);
+		} else if (yuv4mpeg2) {
+			pipeline_submit(&pipeline, NULL, 1);
 		}
-		if (yuv4mpeg2)
-			output_yuv_frame(decoder, yuv4mpeg2);
 		i++;
 		msecs += frame_time;
 		while (decoder->msecs < msecs && has_frame)
 			has_frame = wcap_decoder_get_frame(decoder);
 	}
 
+	pipeline_finish(&pipeline);
+
 	fprintf(stderr, "wcap file: size %dx%d, %d frames\n",
 		decoder->width, decoder->height, i);
 
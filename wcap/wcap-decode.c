@@ -28,6 +28,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <sys/mman.h>
 #include <sys/mman.h>
 #include <sys/types.h>
@@ -39,20 +40,27 @@
 #include <cairo.h>
 
 #include "wcap-decode.h"
+#include "wcap-rle.h"
 
-static void
+static int
 wcap_decoder_decode_rectangle(struct wcap_decoder *decoder,
 			      struct wcap_rectangle *rect)
 {
-	uint32_t v, *p = decoder->p, *d;
+	uint32_t v, *p = decoder->p, *d, *end = decoder->end;
 	int width = rect->x2 - rect->x1, height = rect->y2 - rect->y1;
-	int x, i, j, k, l, count = width * height;
-	unsigned char r, g, b, dr, dg, db;
+	int x, i, j, l, n, count = width * height;
+
+	if (rect->x1 < 0 || rect->y1 < 0 || width <= 0 || height <= 0 ||
+	    rect->x2 > decoder->width || rect->y2 > decoder->height)
+		return -1;
 
 	d = decoder->frame + (rect->y2 - 1) * decoder->width;
 	x = rect->x1;
 	i = 0;
 	while (i < count) {
+		if (p == end)
+			return -1;
+
 		v = *p++;
 		l = v >> 24;
 		if (l < 0xe0) {
@@ -61,61 +69,185 @@ wcap_decoder_decode_rectangle(struct wcap_decoder *decoder,
 			j = 1 << (l - 0xe0 + 7);
 		}
 
-		dr = (v >> 16);
-		dg = (v >>  8);
-		db = (v >>  0);
-		for (k = 0; k < j; k++) {
-			r = (d[x] >> 16) + dr;
-			g = (d[x] >>  8) + dg;
-			b = (d[x] >>  0) + db;
-			d[x] = 0xff000000 | (r << 16) | (g << 8) | b;
-			x++;
+		if (j > count - i) {
+			printf("rle encoding longer than expected "
+			       "(%d expected %d)\n", i + j, count);
+			j = count - i;
+		}
+
+		/* A run may span several rows of the rectangle. */
+		i += j;
+		while (j > 0) {
+			n = rect->x2 - x;
+			if (n > j)
+				n = j;
+			wcap_rle_apply(d + x, v, n);
+			x += n;
+			j -= n;
 			if (x == rect->x2) {
 				x = rect->x1;
 				d -= decoder->width;
 			}
 		}
-		i += j;
 	}
 
-	if (i != count)
-		printf("rle encoding longer than expected (%d expected %d)\n",
-		       i, count);
-
 	decoder->p = p;
+
+	return 0;
 }
 
+/* Decode the next frame into decoder->frame.  Returns 0 at the end of
+ * the stream, which includes a frame cut short by a truncated file. */
 int
 wcap_decoder_get_frame(struct wcap_decoder *decoder)
 {
 	struct wcap_rectangle *rects;
 	struct wcap_frame_header *header;
-	uint32_t i;
+	uint32_t i, nrects;
 
-	if (decoder->p == decoder->end)
+	if ((char *) decoder->end - (char *) decoder->p < (int) sizeof *header)
 		return 0;
 
 	header = decoder->p;
+	nrects = header->nrects;
+	if (decoder->version == 2)
+		nrects &= ~WCAP_FRAME_KEY;
+
+	/* The recorder never writes empty frames, so in a v2 file
+	 * without a valid trailer this is the start of a partially
+	 * written index. */
+	if (decoder->version == 2 && nrects == 0)
+		return 0;
+
+	rects = (void *) (header + 1);
+	if ((char *) decoder->end - (char *) rects <
+	    (ptrdiff_t) (nrects * sizeof *rects))
+		goto truncated;
+
+	/* Key frames are coded against an all black frame, so decoding
+	 * can start at any of them. */
+	if (decoder->version == 2 && (header->nrects & WCAP_FRAME_KEY))
+		memset(decoder->frame, 0,
+		       decoder->width * decoder->height * 4);
+
+	decoder->p = (uint32_t *) (rects + nrects);
+	for (i = 0; i < nrects; i++)
+		if (wcap_decoder_decode_rectangle(decoder, &rects[i]) < 0)
+			goto truncated;
+
 	decoder->msecs = header->msecs;
 	decoder->count++;
 
-	rects = (void *) (header + 1);
-	decoder->p = (uint32_t *) (rects + header->nrects);
-	for (i = 0; i < header->nrects; i++)
-		wcap_decoder_decode_rectangle(decoder, &rects[i]);
+	return 1;
+
+truncated:
+	fprintf(stderr, "wcap: frame %d is truncated or corrupt\n",
+		decoder->count);
+	decoder->p = decoder->end;
+
+	return 0;
+}
+
+static void
+wcap_decoder_rewind(struct wcap_decoder *decoder)
+{
+	decoder->p = decoder->first_frame;
+	decoder->count = 0;
+	memset(decoder->frame, 0, decoder->width * decoder->height * 4);
+}
+
+/* Position the decoder at the last frame shown at or before msecs,
+ * leaving it in decoder->frame.  With an index this starts from the
+ * closest preceding key frame; otherwise, for v1 and truncated v2
+ * files, the stream is replayed from the first frame.  Returns 0 if
+ * there is no frame at or before msecs. */
+int
+wcap_decoder_seek(struct wcap_decoder *decoder, uint32_t msecs)
+{
+	struct wcap_frame_header *next;
+	uint32_t i, key = 0;
+
+	if (decoder->index != NULL) {
+		for (i = 0; i < decoder->index_count; i++) {
+			if (decoder->index[i].msecs > msecs)
+				break;
+			if (decoder->index[i].flags & WCAP_FRAME_KEY)
+				key = i;
+		}
+
+		if (i == 0)
+			return 0;
+
+		if (decoder->index[key].flags & WCAP_FRAME_KEY) {
+			decoder->p = (char *) decoder->map +
+				decoder->index[key].offset;
+			decoder->count = key;
+		} else {
+			wcap_decoder_rewind(decoder);
+		}
+	} else {
+		wcap_decoder_rewind(decoder);
+	}
+
+	if (!wcap_decoder_get_frame(decoder) || decoder->msecs > msecs)
+		return 0;
+
+	for (;;) {
+		next = decoder->p;
+		if ((char *) decoder->end - (char *) decoder->p <
+		    (int) sizeof *next || next->msecs > msecs)
+			break;
+		if (!wcap_decoder_get_frame(decoder))
+			break;
+	}
 
 	return 1;
 }
 
+static void
+wcap_decoder_load_index(struct wcap_decoder *decoder)
+{
+	struct wcap_index_trailer *trailer;
+	size_t frames_start, index_size;
+	uint32_t i;
+
+	frames_start = (char *) decoder->first_frame - (char *) decoder->map;
+	if (decoder->size < frames_start + sizeof *trailer)
+		return;
+
+	trailer = (void *) ((char *) decoder->map +
+			    decoder->size - sizeof *trailer);
+	if (trailer->magic != WCAP_INDEX_MAGIC)
+		return;
+
+	index_size = (size_t) trailer->count * sizeof *decoder->index;
+	if (trailer->offset < frames_start ||
+	    trailer->offset + index_size + sizeof *trailer != decoder->size)
+		return;
+
+	decoder->index = (void *) ((char *) decoder->map + trailer->offset);
+	for (i = 0; i < trailer->count; i++) {
+		if (decoder->index[i].offset < frames_start ||
+		    decoder->index[i].offset >= trailer->offset) {
+			decoder->index = NULL;
+			return;
+		}
+	}
+
+	decoder->index_count = trailer->count;
+	decoder->end = (char *) decoder->map + trailer->offset;
+}
+
 struct wcap_decoder *
 wcap_decoder_create(const char *filename)
 {
 	struct wcap_decoder *decoder;
 	struct wcap_header *header;
+	struct wcap_frame_header *first;
 	int frame_size;
 	struct stat buf;
 
-	decoder = malloc(sizeof *decoder);
+	decoder = calloc(1, sizeof *decoder);
 	if (decoder == NULL)
 		return NULL;
 
@@ -127,26 +259,57 @@ wcap_decoder_create(const char *filename)
 
 	fstat(decoder->fd, &buf);
 	decoder->size = buf.st_size;
+	if (decoder->size < sizeof *header) {
+		fprintf(stderr, "file too short\n");
+		close(decoder->fd);
+		free(decoder);
+		return NULL;
+	}
+
 	decoder->map = mmap(NULL, decoder->size,
 			    PROT_READ, MAP_PRIVATE, decoder->fd, 0);
 	if (decoder->map == MAP_FAILED) {
 		fprintf(stderr, "mmap failed\n");
+		close(decoder->fd);
 		free(decoder);
 		return NULL;
 	}
 
 	header = decoder->map;
+	switch (header->magic) {
+	case WCAP_HEADER_MAGIC:
+		decoder->version = 1;
+		break;
+	case WCAP_HEADER_MAGIC_V2:
+		decoder->version = 2;
+		break;
+	default:
+		fprintf(stderr, "not a wcap file\n");
+		wcap_decoder_destroy(decoder);
+		return NULL;
+	}
+
 	decoder->format = header->format;
 	decoder->count = 0;
 	decoder->width = header->width;
 	decoder->height = header->height;
-	decoder->p = header + 1;
+	decoder->first_frame = header + 1;
+	decoder->p = decoder->first_frame;
 	decoder->end = decoder->map + decoder->size;
 
+	if (decoder->version == 2)
+		wcap_decoder_load_index(decoder);
+
+	if ((char *) decoder->end - (char *) decoder->first_frame >=
+	    (int) sizeof *first) {
+		first = decoder->first_frame;
+		decoder->start_msecs = first->msecs;
+	}
+
 	frame_size = header->width * header->height * 4;
 	decoder->frame = malloc(frame_size);
 	if (decoder->frame == NULL) {
-		free(decoder);
+		wcap_decoder_destroy(decoder);
 		return NULL;
 	}
 	memset(decoder->frame, 0, frame_size);
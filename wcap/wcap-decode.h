@@ -27,6 +27,11 @@
 #define _WCAP_DECODE_
 
 #define WCAP_HEADER_MAGIC	0x57434150
+#define WCAP_HEADER_MAGIC_V2	0x57434132
+#define WCAP_INDEX_MAGIC	0x57434958
+
+/* Set in wcap_frame_header.nrects of a v2 key frame. */
+#define WCAP_FRAME_KEY		0x80000000
 
 #define WCAP_FORMAT_XRGB8888	0x34325258
 #define WCAP_FORMAT_XBGR8888	0x34324258
@@ -48,18 +53,37 @@ struct wcap_rectangle {
 	int32_t x1, y1, x2, y2;
 };
 
+struct wcap_index_entry {
+	uint64_t offset;
+	uint32_t msecs;
+	uint32_t flags;
+};
+
+struct wcap_index_trailer {
+	uint64_t offset;
+	uint32_t count;
+	uint32_t magic;
+};
+
 struct wcap_decoder {
 	int fd;
 	size_t size;
 	void *map, *p, *end;
+	void *first_frame;
 	uint32_t *frame;
 	uint32_t format;
 	uint32_t msecs;
 	uint32_t count;
+	uint32_t start_msecs;
 	int width, height;
+	int version;
+
+	struct wcap_index_entry *index;
+	uint32_t index_count;
 };
 
 int wcap_decoder_get_frame(struct wcap_decoder *decoder);
+int wcap_decoder_seek(struct wcap_decoder *decoder, uint32_t msecs);
 struct wcap_decoder *wcap_decoder_create(const char *filename);
 void wcap_decoder_destroy(struct wcap_decoder *decoder);
 
@@ -0,0 +1,290 @@
+/*
+ * Copyright © 2016 The Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "wcap-rle.h"
+
+/* Runs shorter than this are applied a pixel at a time; most runs of
+ * noisy content are one or two pixels, too short to pay for setting up
+ * the vector loop. */
+#define WCAP_RLE_SHORT_RUN 8
+
+/* One pixel of wcap_rle_apply_scalar(), with the red and blue bytes
+ * added in one go; the mask drops the carry out of each byte. */
+static inline uint32_t
+apply_pixel(uint32_t d, uint32_t delta)
+{
+	return 0xff000000 |
+		(((d & 0x00ff00ff) + (delta & 0x00ff00ff)) & 0x00ff00ff) |
+		(((d & 0x0000ff00) + (delta & 0x0000ff00)) & 0x0000ff00);
+}
+
+void
+wcap_rle_delta_scalar(uint32_t *delta, const uint32_t *next,
+		      uint32_t *prev, int n)
+{
+	unsigned char dr, dg, db;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		dr = (next[i] >> 16) - (prev[i] >> 16);
+		dg = (next[i] >>  8) - (prev[i] >>  8);
+		db = (next[i] >>  0) - (prev[i] >>  0);
+		delta[i] = (dr << 16) | (dg << 8) | (db << 0);
+		prev[i] = next[i];
+	}
+}
+
+int
+wcap_rle_run_length_scalar(const uint32_t *p, int n, uint32_t value)
+{
+	int i;
+
+	for (i = 0; i < n && p[i] == value; i++)
+		;
+
+	return i;
+}
+
+void
+wcap_rle_apply_scalar(uint32_t *d, uint32_t delta, int n)
+{
+	unsigned char r, g, b, dr, dg, db;
+	int i;
+
+	dr = (delta >> 16);
+	dg = (delta >>  8);
+	db = (delta >>  0);
+	for (i = 0; i < n; i++) {
+		r = (d[i] >> 16) + dr;
+		g = (d[i] >>  8) + dg;
+		b = (d[i] >>  0) + db;
+		d[i] = 0xff000000 | (r << 16) | (g << 8) | b;
+	}
+}
+
+#if defined(__SSE2__)
+
+/* The wcap components are bytes that wrap independently, so the
+ * delta is a bytewise subtraction with the alpha byte masked off and
+ * applying it is a bytewise addition with alpha forced to 0xff. */
+
+void
+wcap_rle_delta(uint32_t *delta, const uint32_t *next, uint32_t *prev, int n)
+{
+	const __m128i mask = _mm_set1_epi32(0x00ffffff);
+	__m128i a, b;
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		a = _mm_loadu_si128((const __m128i *) (next + i));
+		b = _mm_loadu_si128((const __m128i *) (prev + i));
+		_mm_storeu_si128((__m128i *) (delta + i),
+				 _mm_and_si128(_mm_sub_epi8(a, b), mask));
+		_mm_storeu_si128((__m128i *) (prev + i), a);
+	}
+
+	wcap_rle_delta_scalar(delta + i, next + i, prev + i, n - i);
+}
+
+int
+wcap_rle_run_length(const uint32_t *p, int n, uint32_t value)
+{
+	const __m128i v = _mm_set1_epi32(value);
+	int i, mask;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi32(
+			_mm_loadu_si128((const __m128i *) (p + i)), v));
+		if (mask != 0xffff)
+			return i + __builtin_ctz(~mask) / 4;
+	}
+
+	return i + wcap_rle_run_length_scalar(p + i, n - i, value);
+}
+
+void
+wcap_rle_apply(uint32_t *d, uint32_t delta, int n)
+{
+	__m128i v, alpha, a;
+	int i = 0;
+
+	if (n >= WCAP_RLE_SHORT_RUN) {
+		v = _mm_set1_epi32(delta & 0x00ffffff);
+		alpha = _mm_set1_epi32(0xff000000);
+		for (; i + 4 <= n; i += 4) {
+			a = _mm_loadu_si128((const __m128i *) (d + i));
+			a = _mm_or_si128(_mm_add_epi8(a, v), alpha);
+			_mm_storeu_si128((__m128i *) (d + i), a);
+		}
+	}
+
+	for (; i < n; i++)
+		d[i] = apply_pixel(d[i], delta);
+}
+
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+
+void
+wcap_rle_delta(uint32_t *delta, const uint32_t *next, uint32_t *prev, int n)
+{
+	const uint32x4_t mask = vdupq_n_u32(0x00ffffff);
+	uint8x16_t a, b;
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		a = vld1q_u8((const uint8_t *) (next + i));
+		b = vld1q_u8((const uint8_t *) (prev + i));
+		vst1q_u32(delta + i,
+			  vandq_u32(vreinterpretq_u32_u8(vsubq_u8(a, b)),
+				    mask));
+		vst1q_u8((uint8_t *) (prev + i), a);
+	}
+
+	wcap_rle_delta_scalar(delta + i, next + i, prev + i, n - i);
+}
+
+int
+wcap_rle_run_length(const uint32_t *p, int n, uint32_t value)
+{
+	const uint32x4_t v = vdupq_n_u32(value);
+	uint64x2_t eq;
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		eq = vreinterpretq_u64_u32(vceqq_u32(vld1q_u32(p + i), v));
+		if ((vgetq_lane_u64(eq, 0) & vgetq_lane_u64(eq, 1)) !=
+		    ~(uint64_t) 0)
+			break;
+	}
+
+	return i + wcap_rle_run_length_scalar(p + i, n - i, value);
+}
+
+void
+wcap_rle_apply(uint32_t *d, uint32_t delta, int n)
+{
+	uint8x16_t v, a;
+	uint32x4_t alpha;
+	int i = 0;
+
+	if (n >= WCAP_RLE_SHORT_RUN) {
+		v = vreinterpretq_u8_u32(vdupq_n_u32(delta & 0x00ffffff));
+		alpha = vdupq_n_u32(0xff000000);
+		for (; i + 4 <= n; i += 4) {
+			a = vaddq_u8(vld1q_u8((const uint8_t *) (d + i)), v);
+			vst1q_u32(d + i,
+				  vorrq_u32(vreinterpretq_u32_u8(a), alpha));
+		}
+	}
+
+	for (; i < n; i++)
+		d[i] = apply_pixel(d[i], delta);
+}
+
+#else
+
+void
+wcap_rle_delta(uint32_t *delta, const uint32_t *next, uint32_t *prev, int n)
+{
+	wcap_rle_delta_scalar(delta, next, prev, n);
+}
+
+int
+wcap_rle_run_length(const uint32_t *p, int n, uint32_t value)
+{
+	return wcap_rle_run_length_scalar(p, n, value);
+}
+
+void
+wcap_rle_apply(uint32_t *d, uint32_t delta, int n)
+{
+	wcap_rle_apply_scalar(d, delta, n);
+}
+
+#endif
+
+uint32_t *
+wcap_rle_output_run(uint32_t *p, uint32_t delta, int run)
+{
+	int i;
+
+	while (run > 0) {
+		if (run <= 0xe0) {
+			*p++ = delta | ((run - 1) << 24);
+			break;
+		}
+
+		i = 24 - __builtin_clz(run);
+		*p++ = delta | ((i + 0xe0) << 24);
+		run -= 1 << (7 + i);
+	}
+
+	return p;
+}
+
+uint32_t *
+wcap_rle_encode_span(uint32_t *p, const uint32_t *delta, int n,
+		     uint32_t *prev, int *run)
+{
+	int k = 0, l;
+
+	if (n > 0 && *run == 0) {
+		*prev = delta[0];
+		*run = 1;
+		k = 1;
+	}
+
+	while (k < n) {
+		/* Noisy content has mostly single pixel runs, so only
+		 * scan ahead once the next pixels extend the run. */
+		if (delta[k] == *prev) {
+			if (k + 1 < n && delta[k + 1] != *prev)
+				l = 1;
+			else
+				l = wcap_rle_run_length(delta + k, n - k,
+							*prev);
+			*run += l;
+			k += l;
+			if (k == n)
+				break;
+		}
+
+		p = wcap_rle_output_run(p, *prev, *run);
+		*prev = delta[k++];
+		*run = 1;
+	}
+
+	return p;
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright © 2016 The Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _WCAP_RLE_
+#define _WCAP_RLE_
+
+#include <stdint.h>
+
+/* Delta and run-length kernels shared by the wcap encoder in the
+ * compositor and by wcap-decode.  The wcap_rle_*() entry points use
+ * SSE2 or NEON when the compiler targets them and fall back to the
+ * _scalar variants otherwise; both produce identical output. */
+
+/* Store the per-component difference between next and prev in delta
+ * (alpha is always zero) and copy next over prev. */
+void
+wcap_rle_delta(uint32_t *delta, const uint32_t *next, uint32_t *prev, int n);
+void
+wcap_rle_delta_scalar(uint32_t *delta, const uint32_t *next,
+		      uint32_t *prev, int n);
+
+/* Return the number of leading elements of p equal to value. */
+int
+wcap_rle_run_length(const uint32_t *p, int n, uint32_t value);
+int
+wcap_rle_run_length_scalar(const uint32_t *p, int n, uint32_t value);
+
+/* Add the per-component delta to n pixels in place, forcing alpha to
+ * 0xff. */
+void
+wcap_rle_apply(uint32_t *d, uint32_t delta, int n);
+void
+wcap_rle_apply_scalar(uint32_t *d, uint32_t delta, int n);
+
+uint32_t *
+wcap_rle_output_run(uint32_t *p, uint32_t delta, int run);
+
+/* Run-length encode n deltas into p.  prev and run carry the open
+ * run across calls; start with run = 0 and close the stream with
+ * wcap_rle_output_run(p, prev, run). */
+uint32_t *
+wcap_rle_encode_span(uint32_t *p, const uint32_t *delta, int n,
+		     uint32_t *prev, int *run);
+
+#endif
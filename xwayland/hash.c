@@ -1,6 +1,7 @@
 /*
  * Copyright © 2009 Intel Corporation
  * Copyright © 1988-2004 Keith Packard and Bart Massey.
+ * Copyright © 2016 The Weston contributors
  *
  * Permission is hereby granted, free of charge, to any person obtaining a
  * copy of this software and associated documentation files (the "Software"),
@@ -39,83 +40,46 @@
 
 #include "hash.h"
 
+/*
+ * Open addressing with linear probing and Robin Hood insertion: an
+ * entry being inserted takes the slot of any entry that is closer to
+ * its home slot, which keeps probe sequences short and lets lookups
+ * stop early.  Removal shifts the following entries back by one
+ * instead of leaving a tombstone, so heavy insert/remove churn (X
+ * clients creating and destroying lots of menus and tooltips) never
+ * degrades the table or forces a rehash.
+ */
+
 struct hash_entry {
 	uint32_t hash;
-	void *data;
+	uint32_t distance;	/* from the home slot */
+	void *data;		/* NULL if the slot is free */
 };
 
 struct hash_table {
 	struct hash_entry *table;
-	uint32_t size;
-	uint32_t rehash;
-	uint32_t max_entries;
-	uint32_t size_index;
+	uint32_t size;		/* always a power of two */
+	uint32_t shift;		/* 32 - log2(size) */
 	uint32_t entries;
-	uint32_t deleted_entries;
 };
 
-#define ARRAY_SIZE(array) (sizeof(array) / sizeof(array[0]))
+#define HASH_TABLE_MIN_SIZE	16
+#define HASH_TABLE_MIN_SHIFT	28
+
+/* Grow when more than 7/8 full. */
+#define HASH_TABLE_MAX_LOAD(size)	((size) - (size) / 8)
 
 /*
- * From Knuth -- a good choice for hash/rehash values is p, p-2 where
- * p and p-2 are both prime.  These tables are sized to have an extra 10%
- * free to avoid exponential performance degradation as the hash table fills
+ * XIDs are handed out sequentially from a per-client base, so the low
+ * bits alone make a poor index.  Fibonacci hashing multiplies by
+ * 2^32 / phi and indexes with the top bits, which mixes in every bit
+ * of the XID and spreads runs of sequential XIDs evenly over the
+ * table.
  */
-
-static const uint32_t deleted_data;
-
-static const struct {
-   uint32_t max_entries, size, rehash;
-} hash_sizes[] = {
-    { 2,		5,		3	  },
-    { 4,		7,		5	  },
-    { 8,		13,		11	  },
-    { 16,		19,		17	  },
-    { 32,		43,		41        },
-    { 64,		73,		71        },
-    { 128,		151,		149       },
-    { 256,		283,		281       },
-    { 512,		571,		569       },
-    { 1024,		1153,		1151      },
-    { 2048,		2269,		2267      },
-    { 4096,		4519,		4517      },
-    { 8192,		9013,		9011      },
-    { 16384,		18043,		18041     },
-    { 32768,		36109,		36107     },
-    { 65536,		72091,		72089     },
-    { 131072,		144409,		144407    },
-    { 262144,		288361,		288359    },
-    { 524288,		576883,		576881    },
-    { 1048576,		1153459,	1153457   },
-    { 2097152,		2307163,	2307161   },
-    { 4194304,		4613893,	4613891   },
-    { 8388608,		9227641,	9227639   },
-    { 16777216,		18455029,	18455027  },
-    { 33554432,		36911011,	36911009  },
-    { 67108864,		73819861,	73819859  },
-    { 134217728,	147639589,	147639587 },
-    { 268435456,	295279081,	295279079 },
-    { 536870912,	590559793,	590559791 },
-    { 1073741824,	1181116273,	1181116271},
-    { 2147483648ul,	2362232233ul,	2362232231ul}
-};
-
-static int
-entry_is_free(struct hash_entry *entry)
-{
-	return entry->data == NULL;
-}
-
-static int
-entry_is_deleted(struct hash_entry *entry)
-{
-	return entry->data == &deleted_data;
-}
-
-static int
-entry_is_present(struct hash_entry *entry)
+static uint32_t
+hash_address(struct hash_table *ht, uint32_t hash)
 {
-	return entry->data != NULL && entry->data != &deleted_data;
+	return (hash * 0x9e3779b9u) >> ht->shift;
 }
 
 struct hash_table *
@@ -127,14 +91,10 @@ hash_table_create(void)
 	if (ht == NULL)
 		return NULL;
 
-	ht->size_index = 0;
-	ht->size = hash_sizes[ht->size_index].size;
-	ht->rehash = hash_sizes[ht->size_index].rehash;
-	ht->max_entries = hash_sizes[ht->size_index].max_entries;
-	ht->table = calloc(ht->size, sizeof(*ht->table));
+	ht->size = HASH_TABLE_MIN_SIZE;
+	ht->shift = HASH_TABLE_MIN_SHIFT;
 	ht->entries = 0;
-	ht->deleted_entries = 0;
-
+	ht->table = calloc(ht->size, sizeof(*ht->table));
 	if (ht->table == NULL) {
 		free(ht);
 		return NULL;
@@ -157,36 +117,39 @@ hash_table_destroy(struct hash_table *ht)
 }
 
 /**
- * Finds a hash table entry with the given key and hash of that key.
+ * Finds the hash table entry with the given hash.
  *
- * Returns NULL if no entry is found.  Note that the data pointer may be
- * modified by the user.
+ * Returns NULL if no entry is found.
  */
-static void *
+static struct hash_entry *
 hash_table_search(struct hash_table *ht, uint32_t hash)
 {
-	uint32_t hash_address;
-
-	hash_address = hash % ht->size;
-	do {
-		uint32_t double_hash;
+	uint32_t mask = ht->size - 1;
+	uint32_t address = hash_address(ht, hash);
+	uint32_t distance = 0;
+	struct hash_entry *entry;
 
-		struct hash_entry *entry = ht->table + hash_address;
+	for (;;) {
+		entry = ht->table + address;
 
-		if (entry_is_free(entry)) {
+		/* Anything we're looking for would have displaced an
+		 * entry closer to home than itself. */
+		if (entry->data == NULL || entry->distance < distance)
 			return NULL;
-		} else if (entry_is_present(entry) && entry->hash == hash) {
+		if (entry->hash == hash)
 			return entry;
-		}
-
-		double_hash = 1 + hash % ht->rehash;
-
-		hash_address = (hash_address + double_hash) % ht->size;
-	} while (hash_address != hash % ht->size);
 
-	return NULL;
+		address = (address + 1) & mask;
+		distance++;
+	}
 }
 
+/**
+ * Calls func for every element in the table.
+ *
+ * The table must not be modified from func: removal moves other
+ * entries around.
+ */
 void
 hash_table_for_each(struct hash_table *ht,
 		    hash_table_iterator_func_t func, void *data)
@@ -196,7 +159,7 @@ hash_table_for_each(struct hash_table *ht,
 
 	for (i = 0; i < ht->size; i++) {
 		entry = ht->table + i;
-		if (entry_is_present(entry))
+		if (entry->data != NULL)
 			func(entry->data, data);
 	}
 }
@@ -214,96 +177,125 @@ hash_table_lookup(struct hash_table *ht, uint32_t hash)
 }
 
 static void
-hash_table_rehash(struct hash_table *ht, unsigned int new_size_index)
+hash_table_place(struct hash_table *ht, uint32_t hash, void *data)
 {
-	struct hash_table old_ht;
-	struct hash_entry *table, *entry;
+	uint32_t mask = ht->size - 1;
+	uint32_t address = hash_address(ht, hash);
+	struct hash_entry carry, tmp, *entry;
 
-	if (new_size_index >= ARRAY_SIZE(hash_sizes))
-		return;
+	carry.hash = hash;
+	carry.distance = 0;
+	carry.data = data;
 
-	table = calloc(hash_sizes[new_size_index].size, sizeof(*ht->table));
-	if (table == NULL)
-		return;
+	for (;;) {
+		entry = ht->table + address;
 
-	old_ht = *ht;
+		if (entry->data == NULL) {
+			*entry = carry;
+			ht->entries++;
+			return;
+		}
+
+		if (entry->distance < carry.distance) {
+			tmp = *entry;
+			*entry = carry;
+			carry = tmp;
+		}
+
+		address = (address + 1) & mask;
+		carry.distance++;
+	}
+}
+
+static int
+hash_table_grow(struct hash_table *ht)
+{
+	struct hash_entry *old_table, *entry;
+	uint32_t old_size;
+
+	if (ht->shift == 1)
+		return -1;
+
+	old_table = ht->table;
+	old_size = ht->size;
+
+	ht->table = calloc(old_size * 2, sizeof(*ht->table));
+	if (ht->table == NULL) {
+		ht->table = old_table;
+		return -1;
+	}
 
-	ht->table = table;
-	ht->size_index = new_size_index;
-	ht->size = hash_sizes[ht->size_index].size;
-	ht->rehash = hash_sizes[ht->size_index].rehash;
-	ht->max_entries = hash_sizes[ht->size_index].max_entries;
+	ht->size = old_size * 2;
+	ht->shift--;
 	ht->entries = 0;
-	ht->deleted_entries = 0;
 
-	for (entry = old_ht.table;
-	     entry != old_ht.table + old_ht.size;
-	     entry++) {
-		if (entry_is_present(entry)) {
-			hash_table_insert(ht, entry->hash, entry->data);
-		}
+	for (entry = old_table; entry != old_table + old_size; entry++) {
+		if (entry->data != NULL)
+			hash_table_place(ht, entry->hash, entry->data);
 	}
 
-	free(old_ht.table);
+	free(old_table);
+
+	return 0;
 }
 
 /**
- * Inserts the data with the given hash into the table.
+ * Inserts the data with the given hash into the table, replacing the
+ * data of an existing entry with the same hash.
  *
- * Note that insertion may rearrange the table on a resize or rehash,
- * so previously found hash_entries are no longer valid after this function.
+ * Note that insertion may rearrange the table, so previously found
+ * hash_entries are no longer valid after this function.
  */
 int
 hash_table_insert(struct hash_table *ht, uint32_t hash, void *data)
 {
-	uint32_t hash_address;
+	struct hash_entry *entry;
 
-	if (ht->entries >= ht->max_entries) {
-		hash_table_rehash(ht, ht->size_index + 1);
-	} else if (ht->deleted_entries + ht->entries >= ht->max_entries) {
-		hash_table_rehash(ht, ht->size_index);
+	entry = hash_table_search(ht, hash);
+	if (entry != NULL) {
+		entry->data = data;
+		return 0;
 	}
 
-	hash_address = hash % ht->size;
-	do {
-		struct hash_entry *entry = ht->table + hash_address;
-		uint32_t double_hash;
-
-		if (!entry_is_present(entry)) {
-			if (entry_is_deleted(entry))
-				ht->deleted_entries--;
-			entry->hash = hash;
-			entry->data = data;
-			ht->entries++;
-			return 0;
-		}
+	if (ht->entries + 1 > HASH_TABLE_MAX_LOAD(ht->size) &&
+	    hash_table_grow(ht) < 0 &&
+	    ht->entries == ht->size)
+		return -1;
 
-		double_hash = 1 + hash % ht->rehash;
+	hash_table_place(ht, hash, data);
 
-		hash_address = (hash_address + double_hash) % ht->size;
-	} while (hash_address != hash % ht->size);
-
-	/* We could hit here if a required resize failed. An unchecked-malloc
-	 * application could ignore this result.
-	 */
-	return -1;
+	return 0;
 }
 
 /**
- * This function deletes the given hash table entry.
+ * Removes the entry with the given hash from the table.
  *
- * Note that deletion doesn't otherwise modify the table, so an iteration over
- * the table deleting entries is safe.
+ * The entries following it in its probe sequence are moved back by
+ * one slot, so no tombstone is left behind.
  */
 void
 hash_table_remove(struct hash_table *ht, uint32_t hash)
 {
-	struct hash_entry *entry;
+	uint32_t mask = ht->size - 1;
+	struct hash_entry *entry, *next;
+	uint32_t address;
 
 	entry = hash_table_search(ht, hash);
-	if (entry != NULL) {
-		entry->data = (void *) &deleted_data;
-		ht->entries--;
-		ht->deleted_entries++;
+	if (entry == NULL)
+		return;
+
+	address = entry - ht->table;
+	for (;;) {
+		address = (address + 1) & mask;
+		next = ht->table + address;
+		if (next->data == NULL || next->distance == 0)
+			break;
+
+		*entry = *next;
+		entry->distance--;
+		entry = next;
 	}
+
+	entry->data = NULL;
+	ht->entries--;
 }
@@ -33,6 +33,31 @@
 #include "xwayland.h"
 #include "shared/helpers.h"
 
+/* Bounds for the INCR chunk size, and the room left in each request
+ * for the (possibly BIG-REQUESTS extended) ChangeProperty header. */
+#define INCR_CHUNK_MIN		(64 * 1024)
+#define INCR_CHUNK_MAX		(4 * 1024 * 1024)
+#define INCR_CHUNK_SLACK	32
+
+static void
+weston_wm_fetch_property(struct weston_wm *wm)
+{
+	/* Delete the property as part of the fetch, so that an INCR
+	 * owner can start preparing the next chunk while we're still
+	 * writing this one to the client.  The reply is picked up
+	 * from weston_wm_handle_selection_reply() once it arrives. */
+	wm->property_chunk_ready = 0;
+	wm->property_cookie = xcb_get_property(wm->conn,
+					       1, /* delete */
+					       wm->selection_window,
+					       wm->atom.wl_selection,
+					       XCB_GET_PROPERTY_TYPE_ANY,
+					       0, /* offset */
+					       0x1fffffff /* length */);
+	wm->property_fetch_pending = 1;
+	xcb_flush(wm->conn);
+}
+
 static int
 writable_callback(int fd, uint32_t mask, void *data)
 {
@@ -56,10 +81,6 @@ writable_callback(int fd, uint32_t mask, void *data)
 		return 1;
 	}
 
-	weston_log("wrote %d (chunk size %d) of %d bytes\n",
-		wm->property_start + len,
-		len, xcb_get_property_value_length(wm->property_reply));
-
 	wm->property_start += len;
 	if (len == remainder) {
 		free(wm->property_reply);
@@ -69,9 +90,8 @@ writable_callback(int fd, uint32_t mask, void *data)
 		wm->property_source = NULL;
 
 		if (wm->incr) {
-			xcb_delete_property(wm->conn,
-					    wm->selection_window,
-					    wm->atom.wl_selection);
+			if (wm->property_chunk_ready)
+				weston_wm_fetch_property(wm);
 		} else {
 			weston_log("transfer complete\n");
 			close(fd);
@@ -99,31 +119,62 @@ weston_wm_write_property(struct weston_wm *wm, xcb_get_property_reply_t *reply)
 static void
 weston_wm_get_incr_chunk(struct weston_wm *wm)
 {
-	xcb_get_property_cookie_t cookie;
+	/* Only one chunk is in flight at a time: if we're still
+	 * waiting for the previous reply or writing it out, fetch the
+	 * new value once that's done. */
+	if (wm->property_fetch_pending || wm->property_reply)
+		wm->property_chunk_ready = 1;
+	else
+		weston_wm_fetch_property(wm);
+}
+
+void
+weston_wm_handle_selection_reply(struct weston_wm *wm)
+{
 	xcb_get_property_reply_t *reply;
+	xcb_generic_error_t *error = NULL;
+	void *r = NULL;
 
-	cookie = xcb_get_property(wm->conn,
-				  0, /* delete */
-				  wm->selection_window,
-				  wm->atom.wl_selection,
-				  XCB_GET_PROPERTY_TYPE_ANY,
-				  0, /* offset */
-				  0x1fffffff /* length */);
+	if (!wm->property_fetch_pending)
+		return;
 
-	reply = xcb_get_property_reply(wm->conn, cookie, NULL);
-	if (reply == NULL)
+	if (!xcb_poll_for_reply(wm->conn, wm->property_cookie.sequence,
+				&r, &error))
 		return;
 
-	dump_property(wm, wm->atom.wl_selection, reply);
+	wm->property_fetch_pending = 0;
+	reply = r;
+	free(error);
+	if (reply == NULL) {
+		/* The client would wait for the rest forever */
+		weston_log("failed to read the selection, "
+			   "closing the transfer\n");
+		close(wm->data_source_fd);
+		wm->data_source_fd = -1;
+		wm->incr = 0;
+		wm->property_chunk_ready = 0;
+		return;
+	}
 
-	if (xcb_get_property_value_length(reply) > 0) {
-		/* reply's ownership is transferred to wm, which is responsible
-		 * for freeing it */
-		weston_wm_write_property(wm, reply);
-	} else {
+	if (!wm->incr && reply->type == wm->atom.incr) {
+		dump_property(wm, wm->atom.wl_selection, reply);
+		wm->incr = 1;
+		free(reply);
+
+		/* The owner may have set the first chunk before we got
+		 * around to seeing the INCR reply. */
+		if (wm->property_chunk_ready)
+			weston_wm_fetch_property(wm);
+	} else if (wm->incr && xcb_get_property_value_length(reply) == 0) {
 		weston_log("transfer complete\n");
 		close(wm->data_source_fd);
 		free(reply);
+	} else {
+		if (!wm->incr)
+			wm->property_chunk_ready = 0;
+		/* reply's ownership is transferred to wm, which is responsible
+		 * for freeing it */
+		weston_wm_write_property(wm, reply);
 	}
 }
 
@@ -229,32 +280,8 @@ weston_wm_get_selection_targets(struct weston_wm *wm)
 static void
 weston_wm_get_selection_data(struct weston_wm *wm)
 {
-	xcb_get_property_cookie_t cookie;
-	xcb_get_property_reply_t *reply;
-
-	cookie = xcb_get_property(wm->conn,
-				  1, /* delete */
-				  wm->selection_window,
-				  wm->atom.wl_selection,
-				  XCB_GET_PROPERTY_TYPE_ANY,
-				  0, /* offset */
-				  0x1fffffff /* length */);
-
-	reply = xcb_get_property_reply(wm->conn, cookie, NULL);
-
-	dump_property(wm, wm->atom.wl_selection, reply);
-
-	if (reply == NULL) {
-		return;
-	} else if (reply->type == wm->atom.incr) {
-		wm->incr = 1;
-		free(reply);
-	} else {
-		wm->incr = 0;
-		/* reply's ownership is transferred to wm, which is responsible
-		 * for freeing it */
-		weston_wm_write_property(wm, reply);
-	}
+	wm->incr = 0;
+	weston_wm_fetch_property(wm);
 }
 
 static void
@@ -273,8 +300,6 @@ weston_wm_handle_selection_notify(struct weston_wm *wm,
 	}
 }
 
-static const size_t incr_chunk_size = 64 * 1024;
-
 static void
 weston_wm_send_selection_notify(struct weston_wm *wm, xcb_atom_t property)
 {
@@ -355,17 +380,19 @@ static int
 weston_wm_read_data_source(int fd, uint32_t mask, void *data)
 {
 	struct weston_wm *wm = data;
-	int len, current, available;
-	void *p;
-
-	current = wm->source_data.size;
-	if (wm->source_data.size < incr_chunk_size)
-		p = wl_array_add(&wm->source_data, incr_chunk_size);
-	else
-		p = (char *) wm->source_data.data + wm->source_data.size;
-	available = wm->source_data.alloc - current;
+	size_t current = wm->source_data.size;
+	uint32_t chunk_size = wm->incr_chunk_size;
+	int len = -1;
+
+	/* Never buffer more than we can put in a single ChangeProperty
+	 * request; the source is paused once the chunk is full. */
+	if (wm->source_data.alloc >= chunk_size ||
+	    wl_array_add(&wm->source_data, chunk_size - current)) {
+		wm->source_data.size = current;
+		len = read(fd, (char *) wm->source_data.data + current,
+			   chunk_size - current);
+	}
 
-	len = read(fd, p, available);
 	if (len == -1) {
 		weston_log("read error from data source: %m\n");
 		weston_wm_send_selection_notify(wm, XCB_ATOM_NONE);
@@ -373,13 +400,11 @@ weston_wm_read_data_source(int fd, uint32_t mask, void *data)
 		wm->property_source = NULL;
 		close(fd);
 		wl_array_release(&wm->source_data);
+		return 1;
 	}
 
-	weston_log("read %d (available %d, mask 0x%x) bytes: \"%.*s\"\n",
-		len, available, mask, len, (char *) p);
-
 	wm->source_data.size = current + len;
-	if (wm->source_data.size >= incr_chunk_size) {
+	if (wm->source_data.size >= chunk_size) {
 		if (!wm->incr) {
 			weston_log("got %zu bytes, starting incr\n",
 				wm->source_data.size);
@@ -390,25 +415,20 @@ weston_wm_read_data_source(int fd, uint32_t mask, void *data)
 					    wm->selection_request.property,
 					    wm->atom.incr,
 					    32, /* format */
-					    1, &incr_chunk_size);
+					    1, &chunk_size);
 			wm->selection_property_set = 1;
 			wm->flush_property_on_delete = 1;
 			wl_event_source_remove(wm->property_source);
 			wm->property_source = NULL;
 			weston_wm_send_selection_notify(wm, wm->selection_request.property);
 		} else if (wm->selection_property_set) {
-			weston_log("got %zu bytes, waiting for "
-				"property delete\n", wm->source_data.size);
-
 			wm->flush_property_on_delete = 1;
 			wl_event_source_remove(wm->property_source);
 			wm->property_source = NULL;
 		} else {
-			weston_log("got %zu bytes, "
-				"property deleted, seting new property\n",
-				wm->source_data.size);
 			weston_wm_flush_source_data(wm);
 		}
+		xcb_flush(wm->conn);
 	} else if (len == 0 && !wm->incr) {
 		weston_log("non-incr transfer complete\n");
 		/* Non-incr transfer all done. */
@@ -424,23 +444,14 @@ weston_wm_read_data_source(int fd, uint32_t mask, void *data)
 		weston_log("incr transfer complete\n");
 
 		wm->flush_property_on_delete = 1;
-		if (wm->selection_property_set) {
-			weston_log("got %zu bytes, waiting for "
-				"property delete\n", wm->source_data.size);
-		} else {
-			weston_log("got %zu bytes, "
-				"property deleted, seting new property\n",
-				wm->source_data.size);
+		if (!wm->selection_property_set)
 			weston_wm_flush_source_data(wm);
-		}
 		xcb_flush(wm->conn);
 		wl_event_source_remove(wm->property_source);
 		wm->property_source = NULL;
 		close(wm->data_source_fd);
 		wm->data_source_fd = -1;
 		close(fd);
-	} else {
-		weston_log("nothing happened, buffered the bytes\n");
 	}
 
 	return 1;
@@ -459,6 +470,12 @@ weston_wm_send_data(struct weston_wm *wm, xcb_atom_t target, const char *mime_ty
 		return;
 	}
 
+#ifdef F_SETPIPE_SZ
+	/* Let the source get a whole chunk ahead of us; this fails
+	 * harmlessly above /proc/sys/fs/pipe-max-size. */
+	fcntl(p[0], F_SETPIPE_SZ, wm->incr_chunk_size);
+#endif
+
 	wl_array_init(&wm->source_data);
 	wm->selection_target = target;
 	wm->data_source_fd = p[0];
@@ -478,12 +495,8 @@ weston_wm_send_incr_chunk(struct weston_wm *wm)
 {
 	int length;
 
-	weston_log("property deleted\n");
-
 	wm->selection_property_set = 0;
 	if (wm->flush_property_on_delete) {
-		weston_log("setting new property, %zu bytes\n",
-			wm->source_data.size);
 		wm->flush_property_on_delete = 0;
 		length = weston_wm_flush_source_data(wm);
 
@@ -517,7 +530,7 @@ weston_wm_handle_selection_property_notify(struct weston_wm *wm,
 	if (property_notify->window == wm->selection_window) {
 		if (property_notify->state == XCB_PROPERTY_NEW_VALUE &&
 		    property_notify->atom == wm->atom.wl_selection &&
-		    wm->incr)
+		    (wm->incr || wm->property_fetch_pending))
 			weston_wm_get_incr_chunk(wm);
 		return 1;
 	} else if (property_notify->window == wm->selection_request.requestor) {
@@ -672,16 +685,27 @@ weston_wm_set_selection(struct wl_listener *listener, void *data)
 				wm->selection_window,
 				wm->atom.clipboard,
 				XCB_TIME_CURRENT_TIME);
+	xcb_flush(wm->conn);
 }
 
 void
 weston_wm_selection_init(struct weston_wm *wm)
 {
 	struct weston_seat *seat;
-	uint32_t values[1], mask;
+	uint32_t values[1], mask, max_request;
 
 	wm->selection_request.requestor = XCB_NONE;
 
+	/* Send INCR chunks as large as the server lets a single
+	 * ChangeProperty request be, rather than a fixed 64 kB. */
+	max_request = xcb_get_maximum_request_length(wm->conn) * 4;
+	if (max_request > INCR_CHUNK_MAX + INCR_CHUNK_SLACK)
+		max_request = INCR_CHUNK_MAX + INCR_CHUNK_SLACK;
+	if (max_request < INCR_CHUNK_MIN + INCR_CHUNK_SLACK)
+		max_request = INCR_CHUNK_MIN + INCR_CHUNK_SLACK;
+	wm->incr_chunk_size = max_request - INCR_CHUNK_SLACK;
+	weston_log("xwm: using %u byte INCR chunks\n", wm->incr_chunk_size);
+
 	values[0] = XCB_EVENT_MASK_PROPERTY_CHANGE;
 	wm->selection_window = xcb_generate_id(wm->conn);
 	xcb_create_window(wm->conn,
@@ -123,6 +123,22 @@ struct motif_wm_hints {
 #define _NET_WM_MOVERESIZE_MOVE_KEYBOARD    10   /* move via keyboard */
 #define _NET_WM_MOVERESIZE_CANCEL           11   /* cancel operation */
 
+#define WM_WINDOW_PROPERTY_COUNT 11
+
+/* Rendered frame background pieces kept around for reuse, most
+ * recently used first.  Each one is a server side pixmap holding the
+ * corners of the background for one set of theme flags, with a one
+ * pixel row and column between them that is stretched along the
+ * edges.  Its size does not depend on the frame size. */
+#define WM_DECORATION_CACHE_SIZE 8
+
+struct weston_wm_decoration {
+	struct wl_list link;
+	uint32_t flags;
+	int left, right, top, bottom;
+	cairo_surface_t *surface;
+};
+
 struct weston_wm_window {
 	struct weston_wm *wm;
 	xcb_window_t id;
@@ -136,6 +152,15 @@ struct weston_wm_window {
 	struct wl_event_source *repaint_source;
 	struct wl_event_source *configure_source;
 	int properties_dirty;
+	uint32_t properties_pending;
+	xcb_get_property_cookie_t property_cookies[WM_WINDOW_PROPERTY_COUNT];
+	xcb_get_property_reply_t *property_replies[WM_WINDOW_PROPERTY_COUNT];
+	int geometry_pending;
+	xcb_get_geometry_cookie_t geometry_cookie;
+	struct wl_list fetch_link;
+	int decoration_drawn;
+	uint32_t drawn_flags;
+	int drawn_width, drawn_height;
 	int pid;
 	char *machine;
 	char *class;
@@ -168,6 +193,9 @@ weston_wm_set_net_active_window(struct weston_wm *wm, xcb_window_t window);
 static void
 weston_wm_window_schedule_repaint(struct weston_wm_window *window);
 
+static int
+weston_wm_handle_event(int fd, uint32_t mask, void *data);
+
 static void
 xserver_map_shell_surface(struct weston_wm_window *window,
 			  struct weston_surface *surface);
@@ -368,6 +396,7 @@ dump_property(struct weston_wm *wm,
 	}
 }
 
+#ifdef WM_DEBUG
 static void
 read_and_dump_property(struct weston_wm *wm,
 		       xcb_window_t window, xcb_atom_t property)
@@ -383,6 +412,7 @@ read_and_dump_property(struct weston_wm *wm,
 
 	free(reply);
 }
+#endif
 
 /* We reuse some predefined, but otherwise useles atoms */
 #define TYPE_WM_PROTOCOLS	XCB_ATOM_CUT_BUFFER0
@@ -390,19 +420,18 @@ read_and_dump_property(struct weston_wm *wm,
 #define TYPE_NET_WM_STATE	XCB_ATOM_CUT_BUFFER2
 #define TYPE_WM_NORMAL_HINTS	XCB_ATOM_CUT_BUFFER3
 
+struct wm_window_property {
+	xcb_atom_t atom;
+	xcb_atom_t type;
+	int offset;
+};
+
 static void
-weston_wm_window_read_properties(struct weston_wm_window *window)
+weston_wm_get_window_properties(struct weston_wm *wm,
+				struct wm_window_property *props)
 {
-	struct weston_wm *wm = window->wm;
-	struct weston_shell_interface *shell_interface =
-		&wm->server->compositor->shell_interface;
-
 #define F(field) offsetof(struct weston_wm_window, field)
-	const struct {
-		xcb_atom_t atom;
-		xcb_atom_t type;
-		int offset;
-	} props[] = {
+	const struct wm_window_property p[WM_WINDOW_PROPERTY_COUNT] = {
 		{ XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, F(class) },
 		{ XCB_ATOM_WM_NAME, XCB_ATOM_STRING, F(name) },
 		{ XCB_ATOM_WM_TRANSIENT_FOR, XCB_ATOM_WINDOW, F(transient_for) },
@@ -417,24 +446,61 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 	};
 #undef F
 
-	xcb_get_property_cookie_t cookie[ARRAY_LENGTH(props)];
+	memcpy(props, p, sizeof p);
+}
+
+/*
+ * Window properties are read in two halves so that the requests for
+ * every window that needs them go out together, and the replies are
+ * picked up from the event handler as they arrive, instead of taking
+ * a round trip per window on the main loop.
+ * weston_wm_window_fetch_properties() only sends the requests.
+ * weston_wm_window_read_properties() is for callers that need the
+ * properties right now, and only blocks on replies still in flight.
+ */
+static void
+weston_wm_window_fetch_properties(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+	struct wm_window_property props[WM_WINDOW_PROPERTY_COUNT];
+	uint32_t i;
+
+	if (!window->properties_dirty || window->properties_pending)
+		return;
+	window->properties_dirty = 0;
+
+	weston_wm_get_window_properties(wm, props);
+	for (i = 0; i < ARRAY_LENGTH(props); i++) {
+		window->property_cookies[i] =
+			xcb_get_property(wm->conn,
+					 0, /* delete */
+					 window->id,
+					 props[i].atom,
+					 XCB_ATOM_ANY, 0, 2048);
+		window->property_replies[i] = NULL;
+		window->properties_pending |= 1 << i;
+	}
+
+	if (wl_list_empty(&window->fetch_link))
+		wl_list_insert(wm->property_fetch_list.prev,
+			       &window->fetch_link);
+}
+
+static void
+weston_wm_window_apply_properties(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+	struct weston_shell_interface *shell_interface =
+		&wm->server->compositor->shell_interface;
+	struct wm_window_property props[WM_WINDOW_PROPERTY_COUNT];
 	xcb_get_property_reply_t *reply;
 	void *p;
 	uint32_t *xid;
 	xcb_atom_t *atom;
-	uint32_t i;
+	uint32_t i, j;
 	char name[1024];
 
-	if (!window->properties_dirty)
-		return;
-	window->properties_dirty = 0;
-
-	for (i = 0; i < ARRAY_LENGTH(props); i++)
-		cookie[i] = xcb_get_property(wm->conn,
-					     0, /* delete */
-					     window->id,
-					     props[i].atom,
-					     XCB_ATOM_ANY, 0, 2048);
+	weston_wm_get_window_properties(wm, props);
 
 	window->decorate = window->override_redirect ? 0 : MWM_DECOR_EVERYTHING;
 	window->size_hints.flags = 0;
@@ -442,7 +508,8 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 	window->delete_window = 0;
 
 	for (i = 0; i < ARRAY_LENGTH(props); i++)  {
-		reply = xcb_get_property_reply(wm->conn, cookie[i], NULL);
+		reply = window->property_replies[i];
+		window->property_replies[i] = NULL;
 		if (!reply)
 			/* Bad window, typically */
 			continue;
@@ -479,8 +546,8 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 			break;
 		case TYPE_WM_PROTOCOLS:
 			atom = xcb_get_property_value(reply);
-			for (i = 0; i < reply->value_len; i++)
-				if (atom[i] == wm->atom.wm_delete_window) {
+			for (j = 0; j < reply->value_len; j++)
+				if (atom[j] == wm->atom.wm_delete_window) {
 					window->delete_window = 1;
 					break;
 				}
@@ -493,12 +560,12 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 		case TYPE_NET_WM_STATE:
 			window->fullscreen = 0;
 			atom = xcb_get_property_value(reply);
-			for (i = 0; i < reply->value_len; i++) {
-				if (atom[i] == wm->atom.net_wm_state_fullscreen)
+			for (j = 0; j < reply->value_len; j++) {
+				if (atom[j] == wm->atom.net_wm_state_fullscreen)
 					window->fullscreen = 1;
-				if (atom[i] == wm->atom.net_wm_state_maximized_vert)
+				if (atom[j] == wm->atom.net_wm_state_maximized_vert)
 					window->maximized_vert = 1;
-				if (atom[i] == wm->atom.net_wm_state_maximized_horz)
+				if (atom[j] == wm->atom.net_wm_state_maximized_horz)
 					window->maximized_horz = 1;
 			}
 			break;
@@ -546,6 +613,144 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 		shell_interface->set_pid(window->shsurf, window->pid);
 }
 
+static void
+weston_wm_window_set_geometry_reply(struct weston_wm_window *window,
+				    xcb_get_geometry_reply_t *reply)
+{
+	window->geometry_pending = 0;
+
+	/* technically we should use XRender and check the visual format's
+	alpha_mask, but checking depth is simpler and works in all known cases */
+	if (reply != NULL)
+		window->has_alpha = reply->depth == 32;
+	free(reply);
+}
+
+/*
+ * Collects the outstanding replies for the window, waiting for them if
+ * block is set, and applies the properties once they're all in.
+ * Returns false if a reply hasn't arrived yet.
+ */
+static bool
+weston_wm_window_collect_replies(struct weston_wm_window *window, bool block)
+{
+	struct weston_wm *wm = window->wm;
+	xcb_generic_error_t *error;
+	void *reply;
+	uint32_t i;
+
+	if (window->geometry_pending) {
+		reply = NULL;
+		error = NULL;
+		if (block)
+			reply = xcb_get_geometry_reply(wm->conn,
+						       window->geometry_cookie,
+						       NULL);
+		else if (!xcb_poll_for_reply(wm->conn,
+					     window->geometry_cookie.sequence,
+					     &reply, &error))
+			return false;
+		free(error);
+		weston_wm_window_set_geometry_reply(window, reply);
+	}
+
+	for (i = 0; i < ARRAY_LENGTH(window->property_cookies); i++) {
+		if (!(window->properties_pending & (1 << i)))
+			continue;
+
+		reply = NULL;
+		error = NULL;
+		if (block)
+			reply = xcb_get_property_reply(wm->conn,
+						       window->property_cookies[i],
+						       NULL);
+		else if (!xcb_poll_for_reply(wm->conn,
+					     window->property_cookies[i].sequence,
+					     &reply, &error))
+			return false;
+		free(error);
+
+		window->property_replies[i] = reply;
+		window->properties_pending &= ~(1 << i);
+		if (window->properties_pending == 0)
+			weston_wm_window_apply_properties(window);
+	}
+
+	wl_list_remove(&window->fetch_link);
+	wl_list_init(&window->fetch_link);
+
+	return true;
+}
+
+static void
+weston_wm_window_discard_replies(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+	uint32_t i;
+
+	if (window->geometry_pending)
+		xcb_discard_reply(wm->conn, window->geometry_cookie.sequence);
+
+	for (i = 0; i < ARRAY_LENGTH(window->property_cookies); i++) {
+		if (window->properties_pending & (1 << i))
+			xcb_discard_reply(wm->conn,
+					  window->property_cookies[i].sequence);
+		free(window->property_replies[i]);
+	}
+
+	wl_list_remove(&window->fetch_link);
+}
+
+/*
+ * Picks up whatever property replies have arrived, for all windows,
+ * without blocking.  Called from the X event handler.
+ */
+static void
+weston_wm_handle_property_replies(struct weston_wm *wm)
+{
+	struct weston_wm_window *window, *next;
+
+	wl_list_for_each_safe(window, next, &wm->property_fetch_list,
+			      fetch_link) {
+		if (!weston_wm_window_collect_replies(window, false))
+			continue;
+
+		/* Changed again while we were reading it. */
+		weston_wm_window_fetch_properties(window);
+	}
+}
+
+static void
+weston_wm_check_selection_reply(void *data)
+{
+	struct weston_wm *wm = data;
+
+	wm->property_check_source = NULL;
+	weston_wm_handle_event(-1, 0, wm);
+}
+
+static void
+weston_wm_window_read_properties(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+
+	/* The second round only happens if the properties changed while
+	 * the first one was in flight. */
+	do {
+		weston_wm_window_fetch_properties(window);
+		weston_wm_window_collect_replies(window, true);
+	} while (window->properties_dirty);
+
+	/* Waiting for the replies may have read the pending selection
+	 * reply, and events, off the socket.  Nothing wakes us up for
+	 * those when we are not called from weston_wm_handle_event(). */
+	if (wm->property_fetch_pending && !wm->property_check_source)
+		wm->property_check_source =
+			wl_event_loop_add_idle(wm->server->loop,
+					       weston_wm_check_selection_reply,
+					       wm);
+}
+
 static void
 weston_wm_window_get_frame_size(struct weston_wm_window *window,
 				int *width, int *height)
@@ -972,6 +1177,9 @@ weston_wm_handle_map_request(struct weston_wm *wm, xcb_generic_event_t *event)
 
 	xcb_map_window(wm->conn, map_request->window);
 	xcb_map_window(wm->conn, window->frame_id);
+
+	/* The frame contents don't survive an unmap. */
+	window->decoration_drawn = 0;
 }
 
 static void
@@ -1032,6 +1240,174 @@ weston_wm_handle_unmap_notify(struct weston_wm *wm, xcb_generic_event_t *event)
 	xcb_unmap_window(wm->conn, window->frame_id);
 }
 
+static void
+weston_wm_decoration_destroy(struct weston_wm_decoration *decoration)
+{
+	wl_list_remove(&decoration->link);
+	cairo_surface_destroy(decoration->surface);
+	free(decoration);
+}
+
+static struct weston_wm_decoration *
+weston_wm_window_get_decoration(struct weston_wm_window *window,
+				uint32_t flags)
+{
+	struct weston_wm *wm = window->wm;
+	struct weston_wm_decoration *decoration;
+	cairo_t *cr;
+	int count = 0;
+
+	wl_list_for_each(decoration, &wm->decoration_cache, link) {
+		if (decoration->flags == flags) {
+			wl_list_remove(&decoration->link);
+			wl_list_insert(&wm->decoration_cache,
+				       &decoration->link);
+			return decoration;
+		}
+		count++;
+	}
+
+	if (count >= WM_DECORATION_CACHE_SIZE) {
+		decoration = container_of(wm->decoration_cache.prev,
+					  struct weston_wm_decoration, link);
+		weston_wm_decoration_destroy(decoration);
+	}
+
+	decoration = zalloc(sizeof *decoration);
+	if (!decoration)
+		return NULL;
+
+	decoration->flags = flags;
+	theme_frame_background_borders(wm->theme, flags,
+				       &decoration->left, &decoration->right,
+				       &decoration->top, &decoration->bottom);
+	decoration->surface =
+		cairo_surface_create_similar(window->cairo_surface,
+					     CAIRO_CONTENT_COLOR_ALPHA,
+					     decoration->left + 1 +
+					     decoration->right,
+					     decoration->top + 1 +
+					     decoration->bottom);
+
+	cr = cairo_create(decoration->surface);
+	theme_render_frame_background(wm->theme, cr,
+				      decoration->left + 1 + decoration->right,
+				      decoration->top + 1 + decoration->bottom,
+				      flags);
+	cairo_destroy(cr);
+
+	wl_list_insert(&wm->decoration_cache, &decoration->link);
+
+	return decoration;
+}
+
+/* Paints the background of a width x height frame from the pieces:
+ * the corners as they are, the row and column between them stretched
+ * over the edges and the middle. */
+static void
+weston_wm_decoration_paint(struct weston_wm_decoration *decoration,
+			   cairo_t *cr, int width, int height)
+{
+	cairo_pattern_t *pattern;
+	cairo_matrix_t matrix;
+	int sx[3], sw[3], dx[3], dw[3];
+	int sy[3], sh[3], dy[3], dh[3];
+	int i, x, y;
+
+	sx[0] = 0;
+	sx[1] = decoration->left;
+	sx[2] = decoration->left + 1;
+	sw[0] = decoration->left;
+	sw[1] = 1;
+	sw[2] = decoration->right;
+	dx[0] = 0;
+	dx[1] = decoration->left;
+	dx[2] = width - decoration->right;
+	dw[0] = decoration->left;
+	dw[1] = width - decoration->left - decoration->right;
+	dw[2] = decoration->right;
+
+	sy[0] = 0;
+	sy[1] = decoration->top;
+	sy[2] = decoration->top + 1;
+	sh[0] = decoration->top;
+	sh[1] = 1;
+	sh[2] = decoration->bottom;
+	dy[0] = 0;
+	dy[1] = decoration->top;
+	dy[2] = height - decoration->bottom;
+	dh[0] = decoration->top;
+	dh[1] = height - decoration->top - decoration->bottom;
+	dh[2] = decoration->bottom;
+
+	cairo_save(cr);
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	pattern = cairo_pattern_create_for_surface(decoration->surface);
+	cairo_pattern_set_filter(pattern, CAIRO_FILTER_NEAREST);
+	cairo_set_source(cr, pattern);
+	cairo_pattern_destroy(pattern);
+
+	for (i = 0; i < 9; i++) {
+		x = i % 3;
+		y = i / 3;
+
+		cairo_matrix_init_translate(&matrix, sx[x], sy[y]);
+		cairo_matrix_scale(&matrix,
+				   (double) sw[x] / dw[x],
+				   (double) sh[y] / dh[y]);
+		cairo_matrix_translate(&matrix, -dx[x], -dy[y]);
+		cairo_pattern_set_matrix(pattern, &matrix);
+		cairo_rectangle(cr, dx[x], dy[y], dw[x], dh[y]);
+		cairo_fill(cr);
+	}
+
+	cairo_restore(cr);
+}
+
+static void
+weston_wm_window_paint_frame(struct weston_wm_window *window, cairo_t *cr,
+			     int width, int height)
+{
+	struct weston_wm_decoration *decoration;
+	uint32_t flags;
+	int32_t x, y, w, h;
+
+	flags = frame_theme_flags(window->frame);
+
+	if (window->decoration_drawn &&
+	    window->drawn_flags == flags &&
+	    window->drawn_width == width &&
+	    window->drawn_height == height) {
+		/* Only the title or a button changed; everything
+		 * outside the title bar is already on screen. */
+		if (!(frame_status(window->frame) & FRAME_STATUS_REPAINT))
+			return;
+
+		frame_titlebar_rect(window->frame, &x, &y, &w, &h);
+		cairo_rectangle(cr, x, y, w, h);
+		cairo_clip(cr);
+	}
+
+	decoration = weston_wm_window_get_decoration(window, flags);
+
+	/* Frames smaller than the pieces are drawn the slow way */
+	if (!decoration ||
+	    width <= decoration->left + decoration->right ||
+	    height <= decoration->top + decoration->bottom) {
+		frame_repaint(window->frame, cr);
+		window->decoration_drawn = 0;
+		return;
+	}
+
+	weston_wm_decoration_paint(decoration, cr, width, height);
+	frame_repaint_foreground(window->frame, cr);
+
+	window->decoration_drawn = 1;
+	window->drawn_flags = flags;
+	window->drawn_width = width;
+	window->drawn_height = height;
+}
+
 static void
 weston_wm_window_draw_decoration(void *data)
 {
@@ -1043,7 +1419,6 @@ weston_wm_window_draw_decoration(void *data)
 	int32_t input_x, input_y, input_w, input_h;
 	struct weston_shell_interface *shell_interface =
 		&wm->server->compositor->shell_interface;
-	uint32_t flags = 0;
 	struct weston_view *view;
 
 	weston_wm_window_read_properties(window);
@@ -1058,12 +1433,11 @@ weston_wm_window_draw_decoration(void *data)
 
 	if (window->fullscreen) {
 		/* nothing */
+		window->decoration_drawn = 0;
 	} else if (window->decorate) {
-		if (wm->focus_window == window)
-			flags |= THEME_FRAME_ACTIVE;
-
-		frame_repaint(window->frame, cr);
+		weston_wm_window_paint_frame(window, cr, width, height);
 	} else {
+		window->decoration_drawn = 0;
 		cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
 		cairo_set_source_rgba(cr, 0, 0, 0, 0);
 		cairo_paint(cr);
@@ -1151,14 +1525,19 @@ weston_wm_handle_property_notify(struct weston_wm *wm, xcb_generic_event_t *even
 	if (!wm_lookup_window(wm, property_notify->window, &window))
 		return;
 
+	/* Coalesces with any read already in flight for the window;
+	 * the replies are picked up by weston_wm_handle_event(). */
 	window->properties_dirty = 1;
+	weston_wm_window_fetch_properties(window);
 
+#ifdef WM_DEBUG
 	wm_log("XCB_PROPERTY_NOTIFY: window %d, ", property_notify->window);
 	if (property_notify->state == XCB_PROPERTY_DELETE)
 		wm_log("deleted\n");
 	else
 		read_and_dump_property(wm, property_notify->window,
 				       property_notify->atom);
+#endif
 
 	if (property_notify->atom == wm->atom.net_wm_name ||
 	    property_notify->atom == XCB_ATOM_WM_NAME)
@@ -1171,8 +1550,6 @@ weston_wm_window_create(struct weston_wm *wm,
 {
 	struct weston_wm_window *window;
 	uint32_t values[1];
-	xcb_get_geometry_cookie_t geometry_cookie;
-	xcb_get_geometry_reply_t *geometry_reply;
 
 	window = zalloc(sizeof *window);
 	if (window == NULL) {
@@ -1180,8 +1557,6 @@ weston_wm_window_create(struct weston_wm *wm,
 		return;
 	}
 
-	geometry_cookie = xcb_get_geometry(wm->conn, id);
-
 	values[0] = XCB_EVENT_MASK_PROPERTY_CHANGE |
                     XCB_EVENT_MASK_FOCUS_CHANGE;
 	xcb_change_window_attributes(wm->conn, id, XCB_CW_EVENT_MASK, values);
@@ -1196,12 +1571,13 @@ weston_wm_window_create(struct weston_wm *wm,
 	window->y = y;
 	window->pos_dirty = false;
 
-	geometry_reply = xcb_get_geometry_reply(wm->conn, geometry_cookie, NULL);
-	/* technically we should use XRender and check the visual format's
-	alpha_mask, but checking depth is simpler and works in all known cases */
-	if (geometry_reply != NULL)
-		window->has_alpha = geometry_reply->depth == 32;
-	free(geometry_reply);
+	/* Don't wait for the geometry and properties here; the replies
+	 * are picked up by the event handler along with those for any
+	 * other windows created in the same batch of events. */
+	wl_list_init(&window->fetch_link);
+	window->geometry_cookie = xcb_get_geometry(wm->conn, id);
+	window->geometry_pending = 1;
+	weston_wm_window_fetch_properties(window);
 
 	hash_table_insert(wm->window_hash, id, window);
 }
@@ -1231,6 +1607,8 @@ weston_wm_window_destroy(struct weston_wm_window *window)
 	if (window->surface)
 		wl_list_remove(&window->surface_destroy_listener.link);
 
+	weston_wm_window_discard_replies(window);
+
 	hash_table_remove(window->wm->window_hash, window->id);
 	free(window);
 }
@@ -1890,6 +2268,68 @@ weston_wm_handle_focus_in(struct weston_wm *wm, xcb_generic_event_t *event)
 		weston_wm_send_focus_window(wm, wm->focus_window);
 }
 
+static void
+weston_wm_dispatch_event(struct weston_wm *wm, xcb_generic_event_t *event)
+{
+	if (weston_wm_handle_selection_event(wm, event))
+		return;
+
+	if (weston_wm_handle_dnd_event(wm, event))
+		return;
+
+	switch (EVENT_TYPE(event)) {
+	case XCB_BUTTON_PRESS:
+	case XCB_BUTTON_RELEASE:
+		weston_wm_handle_button(wm, event);
+		break;
+	case XCB_ENTER_NOTIFY:
+		weston_wm_handle_enter(wm, event);
+		break;
+	case XCB_LEAVE_NOTIFY:
+		weston_wm_handle_leave(wm, event);
+		break;
+	case XCB_MOTION_NOTIFY:
+		weston_wm_handle_motion(wm, event);
+		break;
+	case XCB_CREATE_NOTIFY:
+		weston_wm_handle_create_notify(wm, event);
+		break;
+	case XCB_MAP_REQUEST:
+		weston_wm_handle_map_request(wm, event);
+		break;
+	case XCB_MAP_NOTIFY:
+		weston_wm_handle_map_notify(wm, event);
+		break;
+	case XCB_UNMAP_NOTIFY:
+		weston_wm_handle_unmap_notify(wm, event);
+		break;
+	case XCB_REPARENT_NOTIFY:
+		weston_wm_handle_reparent_notify(wm, event);
+		break;
+	case XCB_CONFIGURE_REQUEST:
+		weston_wm_handle_configure_request(wm, event);
+		break;
+	case XCB_CONFIGURE_NOTIFY:
+		weston_wm_handle_configure_notify(wm, event);
+		break;
+	case XCB_DESTROY_NOTIFY:
+		weston_wm_handle_destroy_notify(wm, event);
+		break;
+	case XCB_MAPPING_NOTIFY:
+		wm_log("XCB_MAPPING_NOTIFY\n");
+		break;
+	case XCB_PROPERTY_NOTIFY:
+		weston_wm_handle_property_notify(wm, event);
+		break;
+	case XCB_CLIENT_MESSAGE:
+		weston_wm_handle_client_message(wm, event);
+		break;
+	case XCB_FOCUS_IN:
+		weston_wm_handle_focus_in(wm, event);
+		break;
+	}
+}
+
 static int
 weston_wm_handle_event(int fd, uint32_t mask, void *data)
 {
@@ -1897,76 +2337,29 @@ weston_wm_handle_event(int fd, uint32_t mask, void *data)
 	xcb_generic_event_t *event;
 	int count = 0;
 
-	while (event = xcb_poll_for_event(wm->conn), event != NULL) {
-		if (weston_wm_handle_selection_event(wm, event)) {
+	do {
+		while (event = xcb_poll_for_event(wm->conn), event != NULL) {
+			weston_wm_dispatch_event(wm, event);
 			free(event);
 			count++;
-			continue;
 		}
 
-		if (weston_wm_handle_dnd_event(wm, event)) {
+		weston_wm_handle_property_replies(wm);
+		weston_wm_handle_selection_reply(wm);
+
+		/* Polling for the replies may have read events off the
+		 * socket.  Nothing wakes us up for those, so handle them
+		 * now and look for the replies they bring along. */
+		event = xcb_poll_for_queued_event(wm->conn);
+		if (event) {
+			weston_wm_dispatch_event(wm, event);
 			free(event);
 			count++;
-			continue;
 		}
+	} while (event);
 
-		switch (EVENT_TYPE(event)) {
-		case XCB_BUTTON_PRESS:
-		case XCB_BUTTON_RELEASE:
-			weston_wm_handle_button(wm, event);
-			break;
-		case XCB_ENTER_NOTIFY:
-			weston_wm_handle_enter(wm, event);
-			break;
-		case XCB_LEAVE_NOTIFY:
-			weston_wm_handle_leave(wm, event);
-			break;
-		case XCB_MOTION_NOTIFY:
-			weston_wm_handle_motion(wm, event);
-			break;
-		case XCB_CREATE_NOTIFY:
-			weston_wm_handle_create_notify(wm, event);
-			break;
-		case XCB_MAP_REQUEST:
-			weston_wm_handle_map_request(wm, event);
-			break;
-		case XCB_MAP_NOTIFY:
-			weston_wm_handle_map_notify(wm, event);
-			break;
-		case XCB_UNMAP_NOTIFY:
-			weston_wm_handle_unmap_notify(wm, event);
-			break;
-		case XCB_REPARENT_NOTIFY:
-			weston_wm_handle_reparent_notify(wm, event);
-			break;
-		case XCB_CONFIGURE_REQUEST:
-			weston_wm_handle_configure_request(wm, event);
-			break;
-		case XCB_CONFIGURE_NOTIFY:
-			weston_wm_handle_configure_notify(wm, event);
-			break;
-		case XCB_DESTROY_NOTIFY:
-			weston_wm_handle_destroy_notify(wm, event);
-			break;
-		case XCB_MAPPING_NOTIFY:
-			wm_log("XCB_MAPPING_NOTIFY\n");
-			break;
-		case XCB_PROPERTY_NOTIFY:
-			weston_wm_handle_property_notify(wm, event);
-			break;
-		case XCB_CLIENT_MESSAGE:
-			weston_wm_handle_client_message(wm, event);
-			break;
-		case XCB_FOCUS_IN:
-			weston_wm_handle_focus_in(wm, event);
-			break;
-		}
-
-		free(event);
-		count++;
-	}
-
-	if (count != 0)
+	/* Send the property reads queued up by this batch of events. */
+	if (count != 0 || !wl_list_empty(&wm->property_fetch_list))
 		xcb_flush(wm->conn);
 
 	return count;
@@ -2096,6 +2489,7 @@ weston_wm_get_resources(struct weston_wm *wm)
 
 	xcb_prefetch_extension_data (wm->conn, &xcb_xfixes_id);
 	xcb_prefetch_extension_data (wm->conn, &xcb_composite_id);
+	xcb_prefetch_maximum_request_length(wm->conn);
 
 	formats_cookie = xcb_render_query_pict_formats(wm->conn);
 
@@ -2289,6 +2683,8 @@ weston_wm_create(struct weston_xserver *wxs, int fd)
 	wl_signal_add(&wxs->compositor->kill_signal,
 		      &wm->kill_listener);
 	wl_list_init(&wm->unpaired_window_list);
+	wl_list_init(&wm->property_fetch_list);
+	wl_list_init(&wm->decoration_cache);
 
 	weston_wm_create_cursors(wm);
 	weston_wm_window_set_cursor(wm, wm->screen->root, XWM_CURSOR_LEFT_PTR);
@@ -2305,11 +2701,18 @@ weston_wm_create(struct weston_xserver *wxs, int fd)
 void
 weston_wm_destroy(struct weston_wm *wm)
 {
+	struct weston_wm_decoration *decoration, *next;
+
+	wl_list_for_each_safe(decoration, next, &wm->decoration_cache, link)
+		weston_wm_decoration_destroy(decoration);
+
 	/* FIXME: Free windows in hash. */
 	hash_table_destroy(wm->window_hash);
 	weston_wm_destroy_cursors(wm);
 	xcb_disconnect(wm->conn);
 	wl_event_source_remove(wm->source);
+	if (wm->property_check_source)
+		wl_event_source_remove(wm->property_check_source);
 	wl_list_remove(&wm->selection_listener.link);
 	wl_list_remove(&wm->activate_listener.link);
 	wl_list_remove(&wm->kill_listener.link);
@@ -72,6 +72,8 @@ struct weston_wm {
 	struct wl_listener activate_listener;
 	struct wl_listener kill_listener;
 	struct wl_list unpaired_window_list;
+	struct wl_list property_fetch_list;
+	struct wl_list decoration_cache;
 
 	xcb_window_t selection_window;
 	xcb_window_t selection_owner;
@@ -80,6 +82,11 @@ struct weston_wm {
 	struct wl_event_source *property_source;
 	xcb_get_property_reply_t *property_reply;
 	int property_start;
+	xcb_get_property_cookie_t property_cookie;
+	int property_fetch_pending;
+	int property_chunk_ready;
+	struct wl_event_source *property_check_source;
+	uint32_t incr_chunk_size;
 	struct wl_array source_data;
 	xcb_selection_request_event_t selection_request;
 	xcb_atom_t selection_target;
@@ -169,6 +176,8 @@ weston_wm_selection_init(struct weston_wm *wm);
 int
 weston_wm_handle_selection_event(struct weston_wm *wm,
 				 xcb_generic_event_t *event);
+void
+weston_wm_handle_selection_reply(struct weston_wm *wm);
 
 struct weston_wm *
 weston_wm_create(struct weston_xserver *wxs, int fd);